@@ -65,6 +65,14 @@ enum config_mode {
 	MODE_SESSION = (1 << 4),
 	/** The current message is talking about log times for benchmark. */
 	MODE_LOGTIME = (1 << 5),
+	/** The current message is talking about BIB/session snapshots. */
+	MODE_SNAPSHOT = (1 << 9),
+	/** The current message is talking about session replication. */
+	MODE_REPLICATION = (1 << 10),
+	/** The current message is talking about the deterministic port mappings. */
+	MODE_DETERMINISTIC = (1 << 11),
+	/** The current message is talking about the fragment database. */
+	MODE_FRAGMENT = (1 << 12),
 };
 
 /**
@@ -76,13 +84,17 @@ enum config_mode {
 
 #define GLOBAL_OPS (OP_DISPLAY | OP_UPDATE)
 #define POOL6_OPS (DATABASE_OPS)
-#define POOL4_OPS (DATABASE_OPS)
+#define POOL4_OPS (DATABASE_OPS | OP_UPDATE)
 #define BLACKLIST_OPS (DATABASE_OPS)
 #define RFC6791_OPS (DATABASE_OPS)
 #define EAMT_OPS (DATABASE_OPS | OP_TEST)
 #define BIB_OPS (DATABASE_OPS & ~OP_FLUSH)
 #define SESSION_OPS (OP_DISPLAY | OP_COUNT)
 #define LOGTIME_OPS (OP_DISPLAY)
+#define SNAPSHOT_OPS (OP_DISPLAY | OP_ADD)
+#define REPLICATION_OPS (OP_COUNT | OP_ADD)
+#define DETERMINISTIC_OPS (OP_DISPLAY | OP_ADD | OP_REMOVE | OP_FLUSH | OP_TEST)
+#define FRAGMENT_OPS (OP_COUNT)
 /**
  * @}
  */
@@ -112,18 +124,22 @@ enum config_operation {
 #define POOL_MODES (MODE_POOL6 | MODE_POOL4 | MODE_BLACKLIST | MODE_RFC6791)
 #define TABLE_MODES (MODE_EAMT | MODE_BIB | MODE_SESSION)
 
-#define DISPLAY_MODES (MODE_GLOBAL | POOL_MODES | TABLE_MODES | MODE_LOGTIME)
-#define COUNT_MODES (POOL_MODES | TABLE_MODES)
-#define ADD_MODES (POOL_MODES | MODE_EAMT | MODE_BIB)
-#define REMOVE_MODES (POOL_MODES | MODE_EAMT | MODE_BIB)
-#define FLUSH_MODES (POOL_MODES | MODE_EAMT)
-#define UPDATE_MODES (MODE_GLOBAL)
-#define TEST_MODES (MODE_EAMT)
+#define DISPLAY_MODES (MODE_GLOBAL | POOL_MODES | TABLE_MODES | MODE_LOGTIME \
+		| MODE_SNAPSHOT | MODE_DETERMINISTIC)
+#define COUNT_MODES (POOL_MODES | TABLE_MODES | MODE_REPLICATION \
+		| MODE_FRAGMENT)
+#define ADD_MODES (POOL_MODES | MODE_EAMT | MODE_BIB | MODE_SNAPSHOT \
+		| MODE_REPLICATION | MODE_DETERMINISTIC)
+#define REMOVE_MODES (POOL_MODES | MODE_EAMT | MODE_BIB | MODE_DETERMINISTIC)
+#define FLUSH_MODES (POOL_MODES | MODE_EAMT | MODE_DETERMINISTIC)
+#define UPDATE_MODES (MODE_GLOBAL | MODE_POOL4)
+#define TEST_MODES (MODE_EAMT | MODE_DETERMINISTIC)
 
 #define SIIT_MODES (MODE_GLOBAL | MODE_POOL6 | MODE_BLACKLIST | MODE_RFC6791 \
 		| MODE_EAMT | MODE_LOGTIME)
 #define NAT64_MODES (MODE_GLOBAL | MODE_POOL6 | MODE_POOL4 | MODE_BIB \
-		| MODE_SESSION | MODE_LOGTIME)
+		| MODE_SESSION | MODE_LOGTIME | MODE_SNAPSHOT | MODE_REPLICATION \
+		| MODE_DETERMINISTIC | MODE_FRAGMENT)
 /**
  * @}
  */
@@ -217,6 +233,37 @@ union request_pool4 {
 		/* Whether the BIB and the sessions tables should also be cleared (false) or not (true). */
 		__u8 quick;
 	} flush;
+	/**
+	 * A chunk of a pool4 transaction. "struct pool4_batch_entry"s follow.
+	 *
+	 * The transaction is built privately and replaces pool4 in one go once
+	 * the last chunk (the one with @commit set) arrives. Like --quick, it
+	 * does not clear the BIB entries and sessions of the transport
+	 * addresses it removes.
+	 */
+	struct {
+		/** Is this the first request of the transaction? (boolean) */
+		__u8 begin;
+		/** Is this the last request of the transaction? (boolean) */
+		__u8 commit;
+		/**
+		 * Does the transaction describe the complete pool4 (true), or
+		 * changes to the current one (false)? Only read if @begin.
+		 */
+		__u8 replace;
+		/** Number of entries appended to this request. */
+		__u32 count;
+	} batch;
+};
+
+/** One of the operations of a pool4 transaction. (See request_pool4.batch.) */
+struct pool4_batch_entry {
+	__u32 mark;
+	__u8 proto;
+	/** Add (true) or remove (false)? */
+	__u8 add;
+	struct ipv4_prefix addrs;
+	struct port_range ports;
 };
 
 union request_pool {
@@ -372,6 +419,21 @@ enum global_type {
 	DROP_ICMP6_INFO,
 	DROP_EXTERNAL_TCP,
 
+	MAX_SESSIONS,
+	MAX_SESSIONS_PER_SUBSCRIBER,
+	MAX_BIBS,
+	MAX_BIBS_PER_SUBSCRIBER,
+	SUBSCRIBER_PREFIX_LEN,
+	EVICT_ON_LIMIT,
+	PORT_BLOCK_SIZE,
+	RSS_AFFINITY,
+	RSS_KEY,
+	RSS_INDIRECTION,
+	FRAG_HIGH_THRESH,
+	FRAG_LOW_THRESH,
+	MAX_PKTS_PER_SOURCE,
+	TCP_SYN_COOKIES,
+
 	/* SIIT */
 	COMPUTE_UDP_CSUM_ZERO,
 	EAM_HAIRPINNING_MODE,
@@ -408,6 +470,187 @@ struct response_pool4_count {
 	__u32 tables;
 	__u64 samples;
 	__u64 taddrs;
+	/** Transport addresses currently masking dynamic BIB entries. */
+	__u64 used;
+};
+
+struct response_session_count {
+	/** Number of sessions in the table. */
+	__u64 sessions;
+	/** Sessions that are due but the cleaner hasn't visited yet. */
+	__u64 expiry_backlog;
+	/** Number of expiration batches run so far. */
+	__u64 expiry_batches;
+	/** Maximum number of sessions visited per expiration batch. */
+	__u32 expiry_batch_size;
+
+	/*
+	 * The following are not specific to the table that was queried; they
+	 * add up the dynamic entries of all the protocols.
+	 */
+	/** Number of IPv6 subscribers that currently own state. */
+	__u64 subscribers;
+	/** Sessions charged to subscribers. */
+	__u64 subscriber_sessions;
+	/** BIB entries charged to subscribers. */
+	__u64 subscriber_bibs;
+	/** Entries that were not created because a limit had been reached. */
+	__u64 admission_drops;
+	/** Sessions removed early to make room for new ones. */
+	__u64 admission_evictions;
+};
+
+/** Kinds of records a snapshot is made of. */
+enum snapshot_section {
+	/** The records are "struct bib_entry_usr"s. */
+	SNAPSHOT_BIB = 0,
+	/** The records are "struct session_entry_usr"s. */
+	SNAPSHOT_SESSION = 1,
+};
+
+/**
+ * A chunk of a BIB/session snapshot the userspace app wants restored.
+ *
+ * (Snapshots are taken through the regular BIB and session display requests.)
+ *
+ * A restoration is a transaction per protocol: The BIB entries travel first,
+ * the sessions afterwards, in as many requests as needed. The tables are built
+ * in one go once the last request (the one with @commit set) arrives.
+ */
+struct request_snapshot {
+	/** Table the records belong to. See enum l4_protocol. */
+	__u8 l4_proto;
+	/** Is this the first request of the transaction? (boolean) */
+	__u8 begin;
+	/** Is this the last request of the transaction? (boolean) */
+	__u8 commit;
+	/** Kind of records appended to this request. See enum snapshot_section. */
+	__u8 section;
+	/** Number of records appended to this request. */
+	__u32 count;
+};
+
+/** The kernel's response to a committed "struct request_snapshot". */
+struct response_snapshot {
+	/** BIB entries that were restored. */
+	__u64 bibs;
+	/** Sessions that were restored. */
+	__u64 sessions;
+	/** BIB entries dropped because they collided or made no sense. */
+	__u64 bib_drops;
+	/** Sessions dropped because they collided or made no sense. */
+	__u64 session_drops;
+};
+
+enum replication_type {
+	/** The session was created. */
+	REPL_ADD = 0,
+	/** The session changed state or expirer, or was refreshed. */
+	REPL_UPDATE = 1,
+	/** The session died. */
+	REPL_RM = 2,
+};
+
+/**
+ * Something that happened to a session, from the eyes of a standby instance.
+ *
+ * The active instance sends these in batches (one array per Netlink message)
+ * to the socket that subscribed through a MODE_REPLICATION OP_DISPLAY request. The standby ingests the same arrays through MODE_REPLICATION
+ * OP_ADD requests. These are in host byte order; the userspace application
+ * converts them to its own wire format before they leave the machine.
+ */
+struct replication_event {
+	struct ipv6_transport_addr remote6;
+	struct ipv6_transport_addr local6;
+	struct ipv4_transport_addr local4;
+	struct ipv4_transport_addr remote4;
+	/** Milliseconds the session has left. Meaningless in REPL_RM. */
+	__u32 lifetime;
+	/** See enum replication_type. */
+	__u8 type;
+	__u8 l4_proto;
+	__u8 state;
+	/** Is the session being expired by the established sessions' timer? */
+	__u8 is_est;
+};
+
+/** Response to MODE_REPLICATION OP_COUNT requests. */
+struct response_replication {
+	/** Events published so far. */
+	__u64 events;
+	/** Events that could not be published (out of memory, backlog or socket). */
+	__u64 drops;
+	/** Netlink messages published so far. */
+	__u64 batches;
+	/** Events received from an active instance and applied. */
+	__u64 applied;
+	/** Events received from an active instance that could not be applied. */
+	__u64 rejected;
+};
+
+/** Response to MODE_FRAGMENT OP_COUNT requests. */
+struct response_fragment {
+	/** Incomplete packets currently being reassembled. */
+	__u64 buffers;
+	/** Bytes (skb truesize) currently held by those packets. */
+	__u64 mem;
+	/** Packets that were reassembled successfully. */
+	__u64 reassemblies;
+	/** Incomplete packets dropped because their fragments took too long. */
+	__u64 timeouts;
+	/** Incomplete packets dropped to keep memory below the low threshold. */
+	__u64 evictions;
+};
+
+/**
+ * A deterministic port mapping (RFC 7422).
+ *
+ * Every subscriber (ie. every /subscriber_len within prefix6) is assigned an
+ * equal, fixed slice of the transport addresses of pool4's "mark" tables, so
+ * the 6-to-4 mapping can be computed in both directions without logging it.
+ */
+struct deterministic_entry {
+	__u32 mark;
+	struct ipv6_prefix prefix6;
+	/** Length of the prefix each subscriber owns. */
+	__u8 subscriber_len;
+};
+
+/**
+ * Configuration for the "deterministic" module.
+ */
+union request_deterministic {
+	struct {
+		__u8 mark_set;
+		/** Mark of the last entry the app received in the last chunk. */
+		__u32 mark;
+	} display;
+	struct deterministic_entry add;
+	struct {
+		__u32 mark;
+	} rm;
+	struct {
+		/* Nothing needed here ATM. */
+	} flush;
+	struct {
+		__u32 mark;
+		__u8 proto;
+		__u8 addr_is_ipv6;
+		union {
+			struct in6_addr addr6;
+			struct ipv4_transport_addr addr4;
+		} addr;
+	} test;
+};
+
+/** The kernel's response to a MODE_DETERMINISTIC OP_TEST request. */
+struct response_deterministic {
+	/** The subscriber. */
+	struct ipv6_prefix prefix6;
+	/** First transport address of the subscriber's slice. */
+	struct ipv4_transport_addr first;
+	/** Length of the subscriber's slice (in transport addresses). */
+	__u32 count;
 };
 
 #ifdef BENCHMARK
@@ -438,6 +681,18 @@ struct bib_entry_usr {
 	__u8 is_static;
 };
 
+/**
+ * A pool4 sample, from the eyes of userspace.
+ */
+struct pool4_sample_usr {
+	struct pool4_sample sample;
+	/**
+	 * Number of transport addresses of @sample.addr currently masking
+	 * dynamic BIB entries of @sample.mark (regardless of port range).
+	 */
+	__u32 used;
+};
+
 /**
  * A session entry, from the eyes of userspace.
  *
@@ -453,6 +708,11 @@ struct session_entry_usr {
 	struct ipv4_transport_addr remote4;
 	__u64 dying_time;
 	__u8 state;
+	/**
+	 * Is the session being expired by the established sessions' timer?
+	 * (Otherwise, the transitory one.)
+	 */
+	__u8 is_est;
 };
 
 /**
@@ -465,6 +725,63 @@ struct eamt_entry {
 	struct ipv4_prefix prefix4;
 };
 
+/**
+ * Limits on the amount of state the NAT64 will keep.
+ *
+ * A "subscriber" is the set of IPv6 nodes whose addresses share the first
+ * @subscriber_prefix_len bits. Static BIB entries (and their sessions) are not
+ * charged to anyone.
+ *
+ * Zero means "unlimited" in all the max_* fields.
+ */
+struct admission_limits {
+	/** Maximum number of dynamic sessions (all protocols combined). */
+	__u64 max_sessions;
+	/** Maximum number of dynamic BIB entries (all protocols combined). */
+	__u64 max_bibs;
+	/** Maximum number of sessions a single subscriber can own. */
+	__u32 max_sessions_per_subscriber;
+	/** Maximum number of BIB entries a single subscriber can own. */
+	__u32 max_bibs_per_subscriber;
+	/** Length of the prefix that identifies a subscriber (usually 64). */
+	__u8 subscriber_prefix_len;
+	/**
+	 * What happens when a limit is reached.
+	 * true = remove the least recently used session(s) to make room.
+	 * false = drop the packet that wanted to create the new state.
+	 * (boolean)
+	 */
+	__u8 evict;
+};
+
+/** Length of the RSS (Toeplitz) hash key, in bytes. */
+#define RSS_KEY_LEN 40
+/** Maximum number of entries of the RSS indirection table. */
+#define RSS_INDIR_MAX 128
+
+/**
+ * How the NIC spreads incoming IPv4 traffic among its receive queues (Receive
+ * Side Scaling). It is what `ethtool --show-rxfh` prints.
+ *
+ * The queue of a packet is @indir[hash % @indir_len], where hash is the
+ * Toeplitz hash of its addresses and ports, computed with @key.
+ */
+struct rss_config {
+	/**
+	 * Choose IPv4 ports whose return traffic will be received by the same
+	 * queue as the IPv6 packet that created the BIB entry? (boolean)
+	 */
+	__u8 affinity;
+	__u8 key[RSS_KEY_LEN];
+	/**
+	 * Number of meaningful entries in @indir.
+	 * Zero means @indir is unknown, in which case the NIC is assumed to
+	 * have one queue per CPU, spread evenly over RSS_INDIR_MAX entries.
+	 */
+	__u16 indir_len;
+	__u16 indir[RSS_INDIR_MAX];
+};
+
 /**
  * A copy of the entire running configuration, excluding databases.
  */
@@ -569,9 +886,19 @@ struct global_config {
 		__u8 drop_icmp6_info;
 		/** Drop externally initiated TCP connections? (IPv4 initiated) (boolean) */
 		__u8 drop_external_tcp;
+		/**
+		 * Translate IPv4-initiated SYNs without creating their sessions
+		 * until the IPv6 side answers? (boolean)
+		 */
+		__u8 tcp_syn_cookies;
 
 		/** Maximum number of simultaneous TCP connections Jool wil tolerate. */
 		__u64 max_stored_pkts;
+		/**
+		 * Maximum number of those connections that can come from a
+		 * single IPv4 /24. Zero means only max_stored_pkts applies.
+		 */
+		__u32 max_stored_pkts_per_src;
 		/** True = issue #132 behaviour. False = RFC 6146 behaviour. (boolean) */
 		__u8 src_icmp6errs_better;
 
@@ -579,6 +906,26 @@ struct global_config {
 		__u8 bib_logging;
 		/** Log sessions as they are created and destroyed? */
 		__u8 session_logging;
+
+		/** Admission control. See struct admission_limits. */
+		struct admission_limits limits;
+		/**
+		 * Number of ports reserved for a subscriber at a time. (See
+		 * struct port_block.)
+		 * Zero means the ports are allocated one by one.
+		 */
+		__u32 port_block_size;
+		/** See struct rss_config. */
+		struct rss_config rss;
+
+		/**
+		 * Once the fragments waiting for reassembly add up to more than
+		 * this many bytes (skb truesize), the oldest incomplete packets
+		 * are dropped...
+		 */
+		__u32 frag_high_thresh;
+		/** ...until they add up to no more than this many bytes. */
+		__u32 frag_low_thresh;
 	} nat64;
 
 	struct {
@@ -67,11 +67,32 @@
 #define DEFAULT_ADDR_DEPENDENT_FILTERING false
 #define DEFAULT_FILTER_ICMPV6_INFO false
 #define DEFAULT_DROP_EXTERNAL_CONNECTIONS false
+#define DEFAULT_TCP_SYN_COOKIES false
 #define DEFAULT_MAX_STORED_PKTS 10
 #define DEFAULT_MAX_STORED_PKTS 10
+#define DEFAULT_MAX_STORED_PKTS_PER_SRC 3
 #define DEFAULT_SRC_ICMP6ERRS_BETTER false
 #define DEFAULT_BIB_LOGGING false
 #define DEFAULT_SESSION_LOGGING false
+#define DEFAULT_MAX_SESSIONS 0
+#define DEFAULT_MAX_BIBS 0
+#define DEFAULT_MAX_SESSIONS_PER_SUBSCRIBER 0
+#define DEFAULT_MAX_BIBS_PER_SUBSCRIBER 0
+#define DEFAULT_SUBSCRIBER_PREFIX_LEN 64
+#define DEFAULT_EVICT_ON_LIMIT false
+#define DEFAULT_PORT_BLOCK_SIZE 0
+#define DEFAULT_RSS_AFFINITY false
+/* Same as the kernel's ip6frag_high_thresh and ip6frag_low_thresh. */
+#define DEFAULT_FRAG_HIGH_THRESH (4 * 1024 * 1024)
+#define DEFAULT_FRAG_LOW_THRESH (3 * 1024 * 1024)
+/* The one most NICs ship with. (Microsoft's RSS verification suite.) */
+#define DEFAULT_RSS_KEY { \
+		0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, \
+		0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0, \
+		0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, \
+		0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c, \
+		0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa, \
+}
 
 #define DEFAULT_RESET_TRAFFIC_CLASS false
 #define DEFAULT_RESET_TOS false
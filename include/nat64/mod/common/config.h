@@ -16,13 +16,21 @@ unsigned long config_get_ttl_tcptrans(void);
 unsigned long config_get_ttl_icmp(void);
 
 unsigned int config_get_max_pkts(void);
+unsigned int config_get_max_pkts_per_src(void);
 bool config_get_src_icmp6errs_better(void);
 bool config_get_bib_logging(void);
 bool config_get_session_logging(void);
+void config_get_limits(struct admission_limits *limits);
+unsigned int config_get_port_block_size(void);
+bool config_get_rss_affinity(void);
+void config_get_rss(struct rss_config *rss);
+unsigned int config_get_frag_high_thresh(void);
+unsigned int config_get_frag_low_thresh(void);
 
 bool config_get_filter_icmpv6_info(void);
 bool config_get_addr_dependent_filtering(void);
 bool config_get_drop_external_connections(void);
+bool config_get_tcp_syn_cookies(void);
 
 bool config_amend_zero_csum(void);
 enum eam_hairpinning_mode config_eam_hairpin_mode(void);
@@ -20,4 +20,6 @@ int nlhandler_init(void);
  */
 void nlhandler_destroy(void);
 
+int nlhandler_unicast(struct sk_buff *skb, u32 portid);
+
 #endif /* _JOOL_MOD_NL_HANDLER_H */
@@ -303,6 +303,22 @@ static inline bool pkt_is_fragment(const struct packet *pkt)
 	return skb_shinfo(pkt->skb)->frag_list ? true : false;
 }
 
+/**
+ * Is "pkt" a fragment whose fragment offset is nonzero?
+ * (ie. its layer-4 header lives in some other fragment.)
+ */
+static inline bool pkt_is_subsequent_frag(const struct packet *pkt)
+{
+	switch (pkt_l3_proto(pkt)) {
+	case L3PROTO_IPV6:
+		return !is_first_frag6(pkt_frag_hdr(pkt));
+	case L3PROTO_IPV4:
+		return !is_first_frag4(pkt_ip4_hdr(pkt));
+	}
+
+	return false;
+}
+
 static inline int pkt_payload_offset(const struct packet *pkt)
 {
 	/*
@@ -108,4 +108,19 @@
  */
 void rbtree_clear(struct rb_root *root, void (*destructor)(struct rb_node *));
 
+void __rbtree_build(struct rb_root *root, void **entries, size_t count,
+		size_t hook_offset);
+
+/**
+ * Replaces "root"'s tree with one made out of the "count" entries from the
+ * "entries" array (of "type" pointers) in one go. The array must already be
+ * sorted and free of duplicates.
+ *
+ * This is O(n), as opposed to the O(n log n) of "count" rbtree_add()s.
+ * The old tree is dropped, not destroyed.
+ */
+#define rbtree_build(root, entries, count, type, hook_name) \
+	__rbtree_build(root, (void **)(entries), count, \
+			offsetof(type, hook_name))
+
 #endif /* _JOOL_MOD_RBTREE_H */
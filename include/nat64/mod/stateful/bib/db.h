@@ -22,7 +22,9 @@ int bibdb_get6(const struct ipv6_transport_addr *addr, const l4_protocol proto,
 		struct bib_entry **result);
 void bibdb_return(struct bib_entry *bib);
 
-int bibdb_add(struct bib_entry *entry);
+int bibdb_add(struct bib_entry *entry, struct bib_entry **old);
+int bibdb_restore(const l4_protocol proto, struct bib_entry **bibs,
+		size_t *count);
 int bibdb_count(const l4_protocol proto, __u64 *result);
 void bibdb_flush(void);
 
@@ -31,6 +33,8 @@ void bibdb_delete_taddr4s(const struct ipv4_prefix *prefix,
 
 bool bibdb_contains4(const struct ipv4_transport_addr *addr,
 		const l4_protocol proto);
+int bibdb_find_free4(const l4_protocol proto, const struct in_addr *addr,
+		const struct port_range *range, __u16 *result);
 int bibdb_foreach(const l4_protocol proto,
 		int (*func)(struct bib_entry *, void *), void *arg,
 		const struct ipv4_transport_addr *offset);
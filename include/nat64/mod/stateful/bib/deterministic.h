@@ -0,0 +1,42 @@
+#ifndef _JOOL_MOD_BIB_DETERMINISTIC_H
+#define _JOOL_MOD_BIB_DETERMINISTIC_H
+
+/**
+ * @file
+ * Deterministic port mappings (RFC 7422).
+ *
+ * A mapping splits the transport addresses of the pool4 tables of a mark into
+ * equal slices, one per subscriber of an IPv6 prefix. Subscriber number "s"
+ * (counting within the prefix) owns transport addresses [s * P, s * P + P),
+ * where P is the number of transport addresses of the table divided by the
+ * number of subscribers, and the transport addresses are counted in pool4's
+ * iteration order.
+ *
+ * This means the BIB entries of these subscribers do not need to be logged;
+ * the owner of any transport address can be computed later (see
+ * detmap_test4()), as long as pool4 doesn't change.
+ *
+ * Sources of the mark that are outside of the prefix are masked by the
+ * leftover transport addresses (the remainder of the division) only.
+ */
+
+#include "nat64/common/config.h"
+#include "nat64/mod/common/packet.h"
+
+int detmap_add(struct deterministic_entry *entry);
+int detmap_rm(__u32 mark);
+void detmap_flush(void);
+void detmap_destroy(void);
+
+int detmap_foreach(int (*func)(struct deterministic_entry *, void *), void *arg,
+		__u32 *offset);
+
+int detmap_allocate(struct packet *in, struct tuple *tuple6,
+		struct ipv4_transport_addr *result, bool *deterministic);
+int detmap_test6(__u32 mark, l4_protocol proto, struct in6_addr *addr,
+		struct response_deterministic *result);
+int detmap_test4(__u32 mark, l4_protocol proto,
+		struct ipv4_transport_addr *addr,
+		struct response_deterministic *result);
+
+#endif /* _JOOL_MOD_BIB_DETERMINISTIC_H */
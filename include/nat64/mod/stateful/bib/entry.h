@@ -3,6 +3,9 @@
 
 #include "nat64/mod/common/types.h"
 
+struct port_block;
+struct subscriber;
+
 /**
  * A row, intended to be part of one of the BIB tables.
  * A binding between a transport address from the IPv4 network to one from the
@@ -42,16 +45,50 @@ struct bib_entry {
 	 */
 	struct kref refcounter;
 
-	/** Appends this entry to the database's IPv6 index. */
-	struct rb_node tree6_hook;
-	/** Appends this entry to the database's IPv4 index. */
+	/** Appends this entry to the database's IPv6 hash index. */
+	struct hlist_node hash6_hook;
+	/** Appends this entry to the database's IPv4 hash index. */
+	struct hlist_node hash4_hook;
+	/** Appends this entry to the database's IPv4 tree. (For foreachs.) */
 	struct rb_node tree4_hook;
+	/**
+	 * Lookups don't lock, so entries can only be freed after a grace
+	 * period.
+	 */
+	struct rcu_head rcu;
 
 	/**
 	 * A reference for the IPv4 borrowed from pool4, this is hold it just
 	 * for keeping the host6_node alive in the database.
 	 */
 	struct host_addr4 *host4_addr;
+
+	/**
+	 * The IPv6 subscriber this entry (and its sessions) is charged to.
+	 * NULL if the entry is not charged to anyone (ie. it's static).
+	 */
+	struct subscriber *subscriber;
+	/**
+	 * The port block (owned by @subscriber) @ipv4's port was taken from.
+	 * NULL if the port was allocated on its own.
+	 */
+	struct port_block *block;
+	/**
+	 * Was @ipv4 computed out of a deterministic mapping?
+	 * (See bib/deterministic.h.) These don't need to be logged.
+	 */
+	bool is_deterministic;
+	/**
+	 * The mark of the pool4 table @ipv4 was taken from. Only meaningful if
+	 * @mark_set. The BIB charges the entry to that table's usage counters
+	 * (see pool4/usage.h).
+	 */
+	__u32 mark;
+	/**
+	 * Is @mark known? Static entries, and the ones that arrived from a
+	 * snapshot or a replica, don't know which table they belong to.
+	 */
+	bool mark_set;
 };
 
 int bibentry_init(void);
@@ -62,6 +99,7 @@ struct bib_entry *bibentry_create(const struct ipv4_transport_addr *addr4,
 		const bool is_static, const l4_protocol proto);
 void bibentry_kfree(struct bib_entry *bib);
 void bibentry_get(struct bib_entry *bib);
+bool bibentry_get_unless_zero(struct bib_entry *bib);
 int bibentry_return(struct bib_entry *bib);
 
 void bibentry_log(const struct bib_entry *bib, const char *action);
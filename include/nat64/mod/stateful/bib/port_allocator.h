@@ -1,13 +1,49 @@
 #ifndef _JOOL_MOD_BIB_PORT_ALLOCATOR_H
 #define _JOOL_MOD_BIB_PORT_ALLOCATOR_H
 
+#include <linux/list.h>
 #include "nat64/mod/common/packet.h"
 #include "nat64/mod/common/types.h"
 
+struct subscriber;
+
+/**
+ * A group of contiguous ports of a pool4 address, reserved for a single IPv6
+ * subscriber. (See --port-block-size.)
+ *
+ * While the block lives, the subscriber's BIB entries take their ports from
+ * it and nobody else's do.
+ */
+struct port_block {
+	struct in_addr addr;
+	struct port_range range;
+	l4_protocol proto;
+	/** The mark of the pool4 table the block was reserved from. */
+	__u32 mark;
+
+	/**
+	 * The subscriber the block belongs to.
+	 * The block doesn't hold a reference; its BIB entries do.
+	 */
+	struct subscriber *owner;
+	/**
+	 * Number of BIB entries that took their ports from this block.
+	 * Protected by the owner's lock.
+	 */
+	unsigned int refs;
+	/** Chains the block to its owner's list. Protected by the owner's lock. */
+	struct list_head hook;
+};
+
 int palloc_init(void);
 void palloc_destroy(void);
 
 int palloc_allocate(struct packet *in_pkt, const struct tuple *tuple6,
 		struct in_addr *daddr, struct ipv4_transport_addr *result);
+int palloc_allocate_block(struct packet *in_pkt, const struct tuple *tuple6,
+		struct in_addr *daddr, struct subscriber *sub,
+		unsigned int block_size, struct ipv4_transport_addr *result,
+		struct port_block **block);
+void palloc_release_block(struct port_block *block);
 
 #endif /* _JOOL_MOD_BIB_PORT_ALLOCATOR_H */
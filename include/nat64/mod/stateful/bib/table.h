@@ -1,33 +1,94 @@
 #ifndef _JOOL_MOD_BIB_TABLE_H
 #define _JOOL_MOD_BIB_TABLE_H
 
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 #include "nat64/mod/stateful/bib/entry.h"
 
+/** Number of buckets in the port usage index. (See struct port_usage.) */
+#define BIB_USAGE_BITS 6
+#define BIB_USAGE_SLOTS (1 << BIB_USAGE_BITS)
+
+/** An array of hash buckets, along with its size. */
+struct bib_buckets {
+	/** log2 of the length of @heads. */
+	unsigned int bits;
+	struct hlist_head heads[0];
+};
+
+/**
+ * A hash index of BIB entries that can be queried without locking.
+ *
+ * Readers need rcu_read_lock_bh(). Writers need the table's spinlock.
+ */
+struct bib_hash {
+	struct bib_buckets __rcu *buckets;
+	/**
+	 * While @buckets is being grown, the previous array. Entries are
+	 * migrated from it to @buckets a few buckets at a time, so lookups
+	 * need to query both. NULL when no resize is in progress.
+	 */
+	struct bib_buckets __rcu *old;
+	/**
+	 * Bumped while entries are being moved between buckets.
+	 * Lookups that fail while this is happening need to be retried.
+	 */
+	seqcount_t seq;
+};
+
 /**
  * BIB table definition.
- * Holds two red-black trees, one for each indexing need (IPv4 and IPv6).
+ * Holds two hash indexes (one for each lookup direction) and a red-black
+ * tree, which is only there to give the foreachs a stable order.
  */
 struct bib_table {
 	/** Indexes the entries using their IPv6 identifiers. */
-	struct rb_root tree6;
+	struct bib_hash hash6;
 	/** Indexes the entries using their IPv4 identifiers. */
+	struct bib_hash hash4;
+	/**
+	 * Sorts the entries by their IPv4 identifiers.
+	 * This one is only for the foreachs (and their offsets); use @hash4
+	 * for lookups.
+	 */
 	struct rb_root tree4;
 	/* Number of entries in this table. */
 	u64 count;
 	/**
-	 * Lock to sync access.
-	 * Note, this protects the structure of the trees, not the entries.
+	 * Indexes the ports taken by the entries, by IPv4 address.
+	 * Links struct port_usages. (These are private to table.c.)
+	 * This is how the port allocator finds free ports without probing
+	 * tree4 once per candidate.
+	 */
+	struct hlist_head usage[BIB_USAGE_SLOTS];
+	/**
+	 * Lock to sync writers.
+	 * Note, this protects the structure of the indexes, not the entries.
 	 * The entries are immutable, and when they're part of the database,
 	 * they can only be killed by bib_release(), which spinlockly deletes
-	 * them from the trees first.
+	 * them from the indexes first.
 	 */
 	spinlock_t lock;
+
+	/** Random salt for the hash indexes. */
+	u32 hash_seed;
+	/** Grows the hash indexes when they get too crowded. */
+	struct work_struct resizer;
+	/**
+	 * Serializes the writers of the hash indexes' bucket arrays (the
+	 * resizer and bibtable_restore()).
+	 */
+	struct mutex resize_lock;
 };
 
-void bibtable_init(struct bib_table *table);
+int bibtable_init(struct bib_table *table);
 void bibtable_destroy(struct bib_table *table);
 
-int bibtable_add(struct bib_table *table, struct bib_entry *entry);
+int bibtable_add(struct bib_table *table, struct bib_entry *entry,
+		struct bib_entry **old);
+int bibtable_restore(struct bib_table *table, struct bib_entry **bibs,
+		size_t *count);
 void bibtable_rm(struct bib_table *table, struct bib_entry *entry);
 void bibtable_flush(struct bib_table *table);
 void bibtable_delete_taddr4s(struct bib_table *table,
@@ -41,6 +102,8 @@ int bibtable_get4(struct bib_table *table,
 		struct bib_entry **result);
 bool bibtable_contains4(struct bib_table *table,
 		const struct ipv4_transport_addr *addr);
+int bibtable_find_free4(struct bib_table *table, const struct in_addr *addr,
+		const struct port_range *range, __u16 *result);
 
 int bibtable_count(struct bib_table *table, __u64 *result);
 int bibtable_foreach(struct bib_table *table,
@@ -12,11 +12,16 @@
  */
 
 #include "nat64/mod/common/packet.h"
+#include "nat64/mod/stateful/session/entry.h"
 
 /**
  * Computes the addresses of "in"'s opposite layer-3 protocol.
  * "out" is filled with these addresses.
+ *
+ * "session" is the session filtering found for the packet. If it's NULL (eg.
+ * because filtering skips ICMP errors), it is looked up here.
  */
-verdict compute_out_tuple(struct tuple *in, struct tuple *out, struct packet *pkt_in);
+verdict compute_out_tuple(struct tuple *in, struct session_entry *session,
+		struct tuple *out, struct packet *pkt_in);
 
 #endif /* _JOOL_MOD_OUTGOING_H */
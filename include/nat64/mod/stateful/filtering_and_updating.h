@@ -12,10 +12,12 @@
  */
 
 #include "nat64/mod/common/packet.h"
+#include "nat64/mod/stateful/session/entry.h"
 
-int filtering_init(void);
+int filtering_init(unsigned int syn_cookie_slots);
 void filtering_destroy(void);
 
-verdict filtering_and_updating(struct packet *pkt, struct tuple *in_tuple);
+verdict filtering_and_updating(struct packet *pkt, struct tuple *in_tuple,
+		struct session_entry **session_out);
 
 #endif /* _JOOL_MOD_FILTERING_H */
@@ -0,0 +1,53 @@
+#ifndef _JOOL_MOD_FRAGMENT_CACHE_H
+#define _JOOL_MOD_FRAGMENT_CACHE_H
+
+/**
+ * @file
+ * Virtual reassembly.
+ *
+ * If the module is inserted with virtual_reassembly, Jool does not ask the
+ * kernel to defragment, and translates every fragment as soon as it arrives
+ * instead.
+ *
+ * Only the first fragment carries the layer-4 header, so this module remembers
+ * the outgoing tuple the first fragment was translated with, indexed by
+ * (source, destination, fragment identification, protocol). The remaining
+ * fragments are translated using that tuple. (Or, if the first fragment was
+ * not translated, they share its fate.) Subsequent fragments that arrive
+ * before their first fragment are held in a small queue until it shows up (or
+ * until the fragment timeout, whatever happens first).
+ *
+ * The cache is sharded, and its memory is bounded by --fragment-high-thresh
+ * and --fragment-low-thresh; when it grows too large, the oldest packets are
+ * forgotten.
+ *
+ * Some fragments cannot be translated on their own (ICMP, zero-checksum UDP,
+ * hairpins). Those, and the rest of their packets, are handed to the kernel's
+ * reassembler instead, and the whole packet is translated once it completes.
+ */
+
+#include "nat64/mod/common/packet.h"
+
+enum fragcache_type {
+	/* Not a fragment, or virtual reassembly is disabled. */
+	FRAGCACHE_NONE,
+	/* Fragment offset is zero; it has the layer-4 header. */
+	FRAGCACHE_FIRST,
+	/* Fragment offset is nonzero. */
+	FRAGCACHE_SUBSEQUENT,
+	/* A fragment virtual reassembly cannot translate. */
+	FRAGCACHE_UNSUPPORTED,
+};
+
+int fragcache_init(bool enabled);
+void fragcache_destroy(void);
+
+bool fragcache_is_enabled(void);
+enum fragcache_type fragcache_type(struct packet *pkt);
+
+verdict fragcache_get(struct packet *pkt, struct tuple *tuple_out);
+struct sk_buff *fragcache_add(struct packet *pkt, struct tuple *tuple_out);
+void fragcache_reject(struct packet *pkt, verdict result);
+verdict fragcache_reassemble(struct packet *pkt);
+
+#endif /* _JOOL_MOD_FRAGMENT_CACHE_H */
@@ -11,8 +11,17 @@
  *
  * This module queues these fragments in skb_shinfo(skb)->frag_list so the rest of Jool doesn't
  * have to worry about handling fragments differently depending on kernel version.
+ *
+ * The packets being reassembled are spread over several independently locked shards, so
+ * fragments of unrelated packets can be handled in parallel. Each shard's hash table grows as it
+ * fills up, and shrinks back once it empties.
+ *
+ * The bytes held by the incomplete packets are accounted (by skb truesize). Once they surpass the
+ * global frag_high_thresh, the oldest incomplete packets are dropped until they fall back to
+ * frag_low_thresh.
  */
 
+#include "nat64/common/config.h"
 #include "nat64/mod/common/packet.h"
 
 
@@ -22,5 +31,7 @@ verdict fragdb_handle(struct packet *pkt);
 
 void fragdb_destroy(void);
 
+void fragdb_stats(struct response_fragment *stats);
+
 
 #endif /* _JOOL_MOD_FRAGMENT_DB_H */
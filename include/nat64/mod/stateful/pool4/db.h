@@ -26,6 +26,14 @@ int pool4db_rm(const __u32 mark, enum l4_protocol proto,
 		struct ipv4_prefix *prefix, struct port_range *ports);
 int pool4db_flush(void);
 
+int pool4db_batch_begin(__u32 owner, bool replace);
+int pool4db_batch_add(__u32 owner, const __u32 mark, enum l4_protocol proto,
+		struct ipv4_prefix *prefix, struct port_range *ports);
+int pool4db_batch_rm(__u32 owner, const __u32 mark, enum l4_protocol proto,
+		struct ipv4_prefix *prefix, struct port_range *ports);
+int pool4db_batch_commit(__u32 owner);
+void pool4db_batch_abort(__u32 owner);
+
 /*
  * Read functions (Legal to use anywhere)
  */
@@ -36,9 +44,12 @@ void pool4db_count(__u32 *tables, __u64 *samples, __u64 *taddrs);
 
 int pool4db_foreach_sample(int (*cb)(struct pool4_sample *, void *), void *arg,
 		struct pool4_sample *offset);
-int pool4db_foreach_taddr4(struct packet *in, enum l4_protocol l4_proto,
+int pool4db_foreach_range(struct packet *in, enum l4_protocol l4_proto,
 		struct in_addr *daddr,
-		int (*func)(struct ipv4_transport_addr *, void *), void *arg,
+		int (*func)(struct pool4_sample *, void *), void *arg,
 		unsigned int offset);
+int pool4db_foreach_mark_slice(__u32 mark, enum l4_protocol l4_proto,
+		int (*get_offset)(__u64, void *, __u64 *), void *offset_arg,
+		int (*func)(struct pool4_sample *, void *), void *arg);
 
 #endif /* _JOOL_MOD_POOL4_DB_H */
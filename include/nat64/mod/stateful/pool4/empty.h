@@ -5,8 +5,8 @@
 #include "nat64/mod/common/types.h"
 
 bool pool4empty_contains(const struct ipv4_transport_addr *addr);
-int pool4empty_foreach_taddr4(struct packet *in, struct in_addr *daddr,
-		int (*func)(struct ipv4_transport_addr *, void *), void *arg,
+int pool4empty_foreach_range(struct packet *in, struct in_addr *daddr,
+		int (*func)(struct pool4_sample *, void *), void *arg,
 		unsigned int offset);
 
 #endif /* _JOOL_MOD_POOL4_EMPTY_H */
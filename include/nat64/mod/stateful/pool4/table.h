@@ -1,12 +1,54 @@
 #ifndef _JOOL_MOD_POOL4_TABLE_H
 #define _JOOL_MOD_POOL4_TABLE_H
 
+#include <linux/workqueue.h>
 #include "nat64/mod/stateful/pool4/entry.h"
 
+/** A port range of some address, in a struct pool4_snapshot. */
+struct pool4_flat_range {
+	struct in_addr addr;
+	struct port_range range;
+	/** Number of transport addresses in the ranges that precede this one. */
+	unsigned int offset;
+};
+
+/**
+ * An immutable, flattened copy of a table's rows.
+ *
+ * The ranges are laid out in the same order the lists would be iterated,
+ * and each of them knows how many transport addresses precede it, so
+ * offset-based iteration can binary search its starting point instead of
+ * chasing pointers over every preceding range.
+ */
+struct pool4_snapshot {
+	/** Queues the release of the snapshot once it's been replaced. */
+	struct rcu_head rcu;
+	/** vfree() cannot run in RCU callbacks, so it's deferred to this. */
+	struct work_struct work;
+	/** Number of addresses. */
+	unsigned int addrs;
+	/** Number of transport addresses. */
+	unsigned int taddrs;
+	/** Length of @ranges. */
+	unsigned int count;
+	struct pool4_flat_range ranges[0];
+};
+
 struct pool4_table {
 	__u32 mark;
 	enum l4_protocol proto;
 	struct list_head rows;
+	/**
+	 * Rebuilt after every change to @rows. NULL if it could not be
+	 * allocated, in which case the readers walk @rows instead.
+	 */
+	struct pool4_snapshot __rcu *snapshot;
+	/**
+	 * Is this table part of a pool4 transaction that hasn't been committed
+	 * yet? Nobody else can see staged tables, so editing them doesn't need
+	 * to wait for grace periods nor rebuild @snapshot.
+	 */
+	bool is_staged;
 
 	struct hlist_node hlist_hook;
 };
@@ -17,6 +59,8 @@ struct pool4_table {
 
 struct pool4_table *pool4table_create(__u32 mark, enum l4_protocol proto);
 void pool4table_destroy(struct pool4_table *table);
+struct pool4_table *pool4table_clone(struct pool4_table *table);
+void pool4table_publish(struct pool4_table *table);
 
 int pool4table_add(struct pool4_table *table, struct ipv4_prefix *prefix,
 		struct port_range *ports);
@@ -35,8 +79,11 @@ void pool4table_count(struct pool4_table *table, __u64 *samples, __u64 *taddrs);
 int pool4table_foreach_sample(struct pool4_table *table,
 		int (*func)(struct pool4_sample *, void *), void * args,
 		struct pool4_sample *offset);
-int pool4table_foreach_taddr4(struct pool4_table *table,
-		int (*func)(struct ipv4_transport_addr *, void *), void *args,
+int pool4table_foreach_range(struct pool4_table *table,
+		int (*func)(struct pool4_sample *, void *), void *args,
 		unsigned int offset);
+int pool4table_foreach_slice(struct pool4_table *table,
+		int (*get_offset)(__u64, void *, __u64 *), void *offset_arg,
+		int (*func)(struct pool4_sample *, void *), void *arg);
 
 #endif /* _JOOL_MOD_POOL4_TABLE_H */
@@ -0,0 +1,37 @@
+#ifndef _JOOL_MOD_POOL4_USAGE_H
+#define _JOOL_MOD_POOL4_USAGE_H
+
+/**
+ * @file
+ * Live counters of the pool4 transport addresses the BIB is using, per mark,
+ * protocol and address.
+ *
+ * The BIB charges its dynamic entries here as it adds them, and refunds them
+ * as it removes them.
+ *
+ * The port allocator also remembers here which tables it found full, so it can
+ * turn down the next connections right away instead of visiting every
+ * transport address of the table again. A table stops being "full" as soon as
+ * any of its transport addresses might have been freed, or pool4 changes.
+ */
+
+#include "nat64/mod/common/types.h"
+
+int pool4usage_charge(__u32 mark, l4_protocol proto,
+		const struct in_addr *addr);
+void pool4usage_refund(__u32 mark, l4_protocol proto,
+		const struct in_addr *addr);
+void pool4usage_forget(l4_protocol proto);
+void pool4usage_forget_all(void);
+void pool4usage_flush(void);
+
+unsigned long pool4usage_epoch(l4_protocol proto);
+void pool4usage_set_exhausted(__u32 mark, l4_protocol proto,
+		unsigned long epoch);
+bool pool4usage_is_exhausted(__u32 mark, l4_protocol proto);
+
+__u32 pool4usage_get(__u32 mark, l4_protocol proto,
+		const struct in_addr *addr);
+__u64 pool4usage_count(void);
+
+#endif /* _JOOL_MOD_POOL4_USAGE_H */
@@ -0,0 +1,32 @@
+#ifndef _JOOL_MOD_REPLICATION_H
+#define _JOOL_MOD_REPLICATION_H
+
+/**
+ * @file
+ * Session replication for active/standby pairs.
+ *
+ * The active instance publishes what happens to its sessions (see struct
+ * replication_event) to a single Netlink socket, which an administrator
+ * subscribed. (Not a multicast group; anyone can join those in the
+ * NETLINK_USERSOCK family.) The userspace app carries the events to the
+ * standby instance, which applies them to its own tables.
+ *
+ * Publishing never waits for anyone; the events are batched in per-CPU
+ * buffers and sent from a work item. If the listeners can't keep up, events
+ * are dropped, and the standby catches up on the next update of each session.
+ * Nothing is done at all if nobody is listening.
+ */
+
+#include "nat64/common/config.h"
+#include "nat64/mod/stateful/session/entry.h"
+
+int replication_init(void);
+void replication_destroy(void);
+
+void replication_listen(u32 portid);
+void replication_session(struct session_entry *session,
+		enum replication_type type);
+int replication_apply(struct replication_event *events, size_t count);
+void replication_stats(struct response_replication *stats);
+
+#endif /* _JOOL_MOD_REPLICATION_H */
@@ -18,19 +18,28 @@ void sessiondb_destroy(void);
 
 int sessiondb_get(struct tuple *tuple, fate_cb cb, struct packet *pkt,
 		struct session_entry **result);
-int sessiondb_add(struct session_entry *session, bool is_established);
+int sessiondb_add(struct session_entry *session, bool is_established,
+		struct session_entry **old);
+int sessiondb_restore(l4_protocol proto, struct session_restore *restores,
+		size_t count, size_t *added);
 
 int sessiondb_foreach(l4_protocol proto,
 		int (*func)(struct session_entry *, void *), void *arg,
 		struct ipv4_transport_addr *offset_remote,
 		struct ipv4_transport_addr *offset_local);
 int sessiondb_count(l4_protocol proto, __u64 *result);
+int sessiondb_expiry_stats(l4_protocol proto, __u64 *backlog, __u64 *batches);
+unsigned long sessiondb_get_timeout(struct session_entry *session);
 
 int sessiondb_delete_by_bib(struct bib_entry *bib);
 void sessiondb_delete_taddr4s(struct ipv4_prefix *prefix,
 		struct port_range *ports);
 void sessiondb_delete_taddr6s(struct ipv6_prefix *prefix);
 void sessiondb_flush(void);
+int sessiondb_rm(struct session_entry *session);
+int sessiondb_update(struct session_entry *session, __u8 state,
+		bool established, unsigned long lifetime);
+struct session_entry *sessiondb_lru(l4_protocol proto);
 
 bool sessiondb_allow(struct tuple *tuple4);
 void sessiondb_update_timers(void);
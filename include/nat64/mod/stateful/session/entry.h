@@ -2,7 +2,9 @@
 #define _JOOL_MOD_SESSION_ENTRY_H
 
 #include <linux/kref.h>
+#include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 #include "nat64/common/types.h"
 #include "nat64/mod/stateful/bib/db.h"
 
@@ -13,9 +15,19 @@
  * Please note that modifications to this structure may need to cascade to
  * "struct session_entry_usr".
  *
- * TODO (performance) this structure is somewhat big (probably 128+ bytes) and there will be lots
- * of sessions in memory. Maybe turn l4_proto into a single-byte integer and remove some of the
- * transport addresses (since they can be extracted from bib).
+ * There will be lots of these in memory, so the fields are ordered by heat:
+ * the first cache line contains everything a packet needs to find the session
+ * and refresh it. The indexing and bookkeeping fields go afterwards.
+ *
+ * The local4 and remote6 addresses cannot be extracted from bib because
+ * sessions can exist before their BIB entry does (see the TCP simultaneous
+ * open quirk in pkt_queue), and because the lookups would have to dereference
+ * bib on every chain node.
+ *
+ * The expirer is not a pointer because it can be inferred from the home shard
+ * and @established. @subscriber_hook stays; a side table would need a list
+ * hook and a back-pointer per subscribed session, which is more than the hook
+ * itself, and most dynamic sessions are subscribed.
  */
 struct session_entry {
 	/**
@@ -47,42 +59,71 @@ struct session_entry {
 	/** Jiffy (from the epoch) this session was last updated/used. */
 	unsigned long update_time;
 
-	/**
-	 * Owner bib of this session. Used for quick access during removal.
-	 * (when the session dies, the BIB might have to die too.)
-	 */
-	struct bib_entry *const bib;
+	/* -- End of the first cache line (on 64-bit machines). -- */
 
 	/**
 	 * Number of active references to this entry, including the ones from the table it belongs to.
 	 * When this reaches zero, the entry is released from memory.
 	 */
 	struct kref refcounter;
+	/*
+	 * The following fields are packed into the word the refcount leaves
+	 * free. @l4_proto never changes; the rest are protected by the home
+	 * shard's lock.
+	 */
 	/**
-	 * When the session is in the database, this chains it to its
-	 * corresponding expiration queue.
-	 * Otherwise, the code can use it for other purposes. The expirer
-	 * module, for example, uses it to chain sessions that need
-	 * post-processing after a spinlock release.
+	 * Transport protocol of the table this entry is in.
+	 * Used to know which table the session should be removed from when expired.
+	 * (This is a l4_protocol.)
 	 */
-	struct list_head list_hook;
+	const unsigned int l4_proto:2;
+	/** Current TCP state. Only relevant if l4_proto == L4PROTO_TCP. */
+	unsigned int state:3;
+	/** Is this session queued in one of its home shard's expirers? */
+	unsigned int queued:1;
 	/**
-	 * Expiration timer who is supposed to delete this session when its death time is reached.
+	 * If @queued, is the expirer the established one? (Otherwise it's the
+	 * transitory one.)
 	 */
-	struct expire_timer *expirer;
+	unsigned int established:1;
+	/** If @queued, slot of the expirer's wheel this session is in. */
+	unsigned int expirer_slot:7;
+
+	/** Appends this entry to the database's IPv6 hash index. */
+	struct hlist_node hash6_hook;
+	/** Appends this entry to the database's IPv4 hash index. */
+	struct hlist_node hash4_hook;
+
 	/**
-	 * Transport protocol of the table this entry is in.
-	 * Used to know which table the session should be removed from when expired.
+	 * Owner bib of this session. Used for quick access during removal.
+	 * (when the session dies, the BIB might have to die too.)
 	 */
-	const l4_protocol l4_proto;
+	struct bib_entry *const bib;
 
-	/** Current TCP state. Only relevant if l4_proto == L4PROTO_TCP. */
-	u_int8_t state;
+	union {
+		/**
+		 * When the session is in the database, this chains it to its
+		 * corresponding expiration queue.
+		 * Otherwise, the code can use it for other purposes. The
+		 * expirer module, for example, uses it to chain sessions that
+		 * need post-processing after a spinlock release.
+		 */
+		struct list_head list_hook;
+		/**
+		 * Lookups do not lock, so the entry is freed only after an RCU
+		 * grace period. (By then, nobody needs @list_hook anymore.)
+		 */
+		struct rcu_head rcu;
+	};
 
-	/** Appends this entry to the database's IPv6 index. */
-	struct rb_node tree6_hook;
-	/** Appends this entry to the database's IPv4 index. */
+	/** Appends this entry to the database's (sorted) IPv4 index. */
 	struct rb_node tree4_hook;
+
+	/**
+	 * Chains this entry to the list of sessions its BIB's subscriber owns,
+	 * while the session is in the database. (Unused if bib is static.)
+	 */
+	struct list_head subscriber_hook;
 };
 
 int session_init(void);
@@ -96,6 +137,7 @@ struct session_entry *session_create(const struct ipv6_transport_addr *remote6,
 struct session_entry *session_clone(struct session_entry *session);
 
 void session_get(struct session_entry *session);
+bool session_get_unless_zero(struct session_entry *session);
 int session_return(struct session_entry *session);
 
 void session_log(const struct session_entry *session, const char *action);
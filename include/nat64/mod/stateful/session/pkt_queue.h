@@ -34,6 +34,12 @@
  * handshake), otherwise a ICMP error containing the original IPv4 packet is generated (because
  * there's no Simultaneous Open going on).
  *
+ * Because any IPv4 node can fill this database with SYNs, packets are charged
+ * to the /24 network they came from, and each network can only store
+ * max_stored_pkts_per_src of them (on top of the global max_stored_pkts). A
+ * network's packets always live in the same shard of the database, so the
+ * shards can enforce these quotas (and expire their packets) independently.
+ *
  * @author Angel Cazares
  * @author Daniel Hernandez
  * @author Alberto Leiva
@@ -0,0 +1,41 @@
+#ifndef _JOOL_MOD_SYN_COOKIE_H
+#define _JOOL_MOD_SYN_COOKIE_H
+
+/**
+ * @file
+ * Stateless handling of IPv4-initiated TCP connections (--tcp-syn-cookies).
+ *
+ * Normally, an IPv4 SYN that finds no session gets one (in the V4_INIT state)
+ * or is stored in the packet queue for a few seconds. Under a SYN flood, this
+ * is the bulk of Jool's memory.
+ *
+ * If --tcp-syn-cookies is enabled, the SYN's destination has a BIB entry and
+ * Address-Dependent Filtering is disabled, the SYN is translated through a
+ * session that never reaches the database. All that is kept is a slot in a
+ * fixed-size table, which records the SYN's IPv4 addresses and sequence
+ * number. If the IPv6 node answers with a SYN-ACK that acknowledges that
+ * sequence number, the session is created directly in the ESTABLISHED state.
+ *
+ * The table's capacity is the syn_cookie_slots module argument (by default, it
+ * scales with the machine's RAM). Each SYN hashes to a bucket of a few slots
+ * and can only claim one that is empty or expired; live records are never
+ * overwritten. A SYN that finds its bucket full is handled as if the feature
+ * were disabled (V4_INIT session, subject to --max-sessions). So a flood that
+ * outpaces the table (more than roughly slots / TCP_INCOMING_SYN SYNs per
+ * second) degrades to the stateful behavior, and is never worse than it.
+ *
+ * A SYN-ACK that matches no record is dropped; the IPv4 node will retransmit
+ * its SYN.
+ */
+
+#include "nat64/mod/common/types.h"
+
+int syncookie_init(unsigned int slots);
+void syncookie_destroy(void);
+
+int syncookie_store(const struct ipv4_transport_addr *local4,
+		const struct ipv4_transport_addr *remote4, __u32 seq);
+bool syncookie_validate(const struct ipv4_transport_addr *local4,
+		const struct ipv4_transport_addr *remote4, __u32 ack);
+
+#endif /* _JOOL_MOD_SYN_COOKIE_H */
@@ -1,7 +1,9 @@
 #ifndef _JOOL_MOD_SESSION_TABLE_H
 #define _JOOL_MOD_SESSION_TABLE_H
 
-#include <linux/timer.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 #include "nat64/mod/common/packet.h"
 #include "nat64/mod/stateful/session/entry.h"
 
@@ -35,48 +37,185 @@ enum session_fate {
 typedef enum session_fate (*fate_cb)(struct session_entry *, void *);
 typedef unsigned long (*timeout_cb)(void);
 
+/**
+ * Number of shards each session table is split into, in bits.
+ */
+#define SESSIONTABLE_SHARD_BITS 4
+#define SESSIONTABLE_SHARDS (1 << SESSIONTABLE_SHARD_BITS)
+
+/**
+ * Number of slots in each level of the expiration wheels. Must be a power of
+ * two.
+ */
+#define EXPIRER_SLOTS 64
+/** Time span covered by each slot of the wheels' fine level, in jiffies. */
+#define EXPIRER_TICK HZ
+/**
+ * Maximum number of sessions the cleaner visits before releasing the lock.
+ * If the batch is not enough, the rest is handled by an immediate requeue.
+ */
+#define EXPIRER_BATCH 1024
+/** Number of sessions sessiontable_lru() compares to pick a victim. */
+#define SESSIONTABLE_LRU_SAMPLES 8
+
 struct session_table;
+struct session_shard;
+/**
+ * A timing wheel that kills sessions once they have been idle for
+ * get_timeout() jiffies.
+ *
+ * Sessions are bucketed by expiration time. The wheel has two levels: the fine
+ * one has EXPIRER_SLOTS slots of EXPIRER_TICK each, and the coarse one has
+ * EXPIRER_SLOTS slots of one fine lap each. Sessions that expire beyond the
+ * fine level's horizon wait in the coarse level, and are cascaded down to the
+ * fine level once their coarse slot comes. (Sessions that expire beyond the
+ * coarse level's horizon, about 68 minutes, just get cascaded more than once.)
+ *
+ * Packets only refresh the session's update_time; the session is moved to its
+ * new slot lazily, when the wheel reaches the old one.
+ *
+ * The cleaning happens in a work item, EXPIRER_BATCH sessions at a time.
+ */
 struct expire_timer {
-	struct timer_list timer;
-	struct list_head sessions;
+	struct delayed_work work;
+	/**
+	 * The first EXPIRER_SLOTS slots are the fine level, the rest are the
+	 * coarse level.
+	 */
+	struct list_head slots[2 * EXPIRER_SLOTS];
+	/** Number of sessions queued in each slot. */
+	u32 slot_counts[2 * EXPIRER_SLOTS];
+	/** Next slot the wheel has to process, in EXPIRER_TICK units. */
+	unsigned long clock;
+	/**
+	 * Sessions from the slot pointed by @clock the cleaner still has to
+	 * visit. Zero if it hasn't started the slot yet.
+	 */
+	u32 todo;
+	/** Number of sessions queued in the wheel. */
+	u64 count;
+	/** Number of cleaner batches run so far. (Stat only.) */
+	u64 batches;
 	timeout_cb get_timeout;
 	fate_cb decide_fate_cb;
 	struct session_table *table;
+	struct session_shard *shard;
+};
+
+/** An array of hash buckets, along with its size. */
+struct session_buckets {
+	/** log2 of the length of @heads. */
+	unsigned int bits;
+	struct hlist_head heads[0];
 };
 
 /**
- * Session table definition.
- * Holds red-black trees, one for each indexing need (IPv4 and IPv6).
+ * A hash index of sessions that can be queried without locking.
+ *
+ * Readers need rcu_read_lock_bh(). Writers need the lock of the structure the
+ * index belongs to.
  */
-struct session_table {
+struct session_hash {
+	struct session_buckets __rcu *buckets;
 	/**
-	 * Indexes the entries using their IPv6 identifiers.
-	 * (sorted by local6, then remote6. The taddr6 foreach needs this.)
+	 * While @buckets is being grown, the previous array. Sessions are
+	 * migrated from it to @buckets a few buckets at a time, so lookups
+	 * need to query both. NULL when no resize is in progress.
 	 */
-	struct rb_root tree6;
+	struct session_buckets __rcu *old;
 	/**
-	 * Indexes the entries using their IPv4 identifiers.
-	 * (sorted by local4, then remote4. sessiontable_allow() and the BIB and
-	 * taddr4 foreachs need this.)
+	 * Bumped while sessions are being moved between buckets.
+	 * Lookups that fail while this is happening need to be retried.
+	 */
+	seqcount_t seq;
+};
+
+/**
+ * A slice of a session table; the "home" of the sessions whose IPv4 side
+ * hashes into it.
+ *
+ * The home shard holds the IPv4 indexes, the expiration queues and the count of
+ * its sessions. Its lock also protects the mutable portion of these sessions
+ * (state, update_time, the expirer fields and list_hook).
+ */
+struct session_shard {
+	/**
+	 * Indexes the entries using their IPv4 identifiers, keyed by local4
+	 * and the remote4 address. (The remote port is not part of the key
+	 * because sessiontable_allow() doesn't know it.)
+	 */
+	struct session_hash hash4;
+	/**
+	 * Also indexes the entries using their IPv4 identifiers, but sorted.
+	 * (by local4, then remote4.)
+	 * This one is only for the foreachs; use @hash4 for lookups.
 	 */
 	struct rb_root tree4;
-	/** Number of session entries in this table. */
+	/** Number of session entries in this shard. */
 	u64 count;
 
-	/** Expires this table's established sessions. */
+	/** Expires this shard's established sessions. */
 	struct expire_timer est_timer;
-	/** Expires this table's transitory sessions. */
+	/** Expires this shard's transitory sessions. */
 	struct expire_timer trans_timer;
 
 	/**
-	 * Lock to sync access. This protects both the trees and the entries,
-	 * but if you only need to read the const portion of the entries,
-	 * you can get away with maintaining your reference count thingy.
+	 * Lock to sync writers. This protects the indexes, the expiration
+	 * queues and the mutable fields of the entries.
+	 * If you only need to read the const portion of the entries, you can
+	 * get away with maintaining your reference count thingy.
 	 */
 	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+/**
+ * A slice of a session table's IPv6 index.
+ *
+ * Sessions are placed here depending on their IPv6 side, so they usually don't
+ * land on the index shard that matches their home shard. Only the index is
+ * protected by @lock; go to the home shard to touch the sessions themselves.
+ */
+struct session_index6 {
+	/** Indexes the entries using their IPv6 identifiers. */
+	struct session_hash hash6;
+	/** Number of session entries in @hash6. */
+	u64 count;
+	/**
+	 * Lock to sync writers of @hash6.
+	 * If you need both, always take the home shard's lock first.
+	 */
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+/**
+ * Session table definition.
+ * Split into SESSIONTABLE_SHARDS independently locked shards so packets from
+ * unrelated connections don't fight over a single spinlock.
+ */
+struct session_table {
+	struct session_shard shards[SESSIONTABLE_SHARDS];
+	struct session_index6 index6[SESSIONTABLE_SHARDS];
+	/** Randomizes shard selection so remote nodes can't aim at one. */
+	u32 hash_seed;
+	/** Grows the hash indexes when they get too crowded. */
+	struct work_struct resizer;
+	/**
+	 * Serializes the writers of the hash indexes' bucket arrays (the
+	 * resizer and sessiontable_restore()).
+	 */
+	struct mutex resize_lock;
+};
+
+/** A session sessiontable_restore() has to add to the table. */
+struct session_restore {
+	struct session_entry *session;
+	/** Time the session has left before it expires, in jiffies. */
+	unsigned long lifetime;
+	/** Queue the session in the established timer? (Otherwise transitory.) */
+	bool established;
 };
 
-void sessiontable_init(struct session_table *table,
+int sessiontable_init(struct session_table *table,
 		timeout_cb est_timeout, fate_cb est_callback,
 		timeout_cb trans_timeout, fate_cb trans_callback);
 void sessiontable_destroy(struct session_table *table);
@@ -84,7 +223,9 @@ void sessiontable_destroy(struct session_table *table);
 int sessiontable_get(struct session_table *table, struct tuple *tuple,
 		fate_cb cb, struct packet *pkt, struct session_entry **result);
 int sessiontable_add(struct session_table *table, struct session_entry *session,
-		bool is_established);
+		bool is_established, struct session_entry **old);
+int sessiontable_restore(struct session_table *table,
+		struct session_restore *restores, size_t count, size_t *added);
 
 int sessiontable_foreach(struct session_table *table,
 		int (*func)(struct session_entry *, void *), void *arg,
@@ -99,8 +240,17 @@ void sessiontable_delete_taddr4s(struct session_table *table,
 void sessiontable_delete_taddr6s(struct session_table *table,
 		struct ipv6_prefix *prefix);
 void sessiontable_flush(struct session_table *table);
+int sessiontable_rm(struct session_table *table, struct session_entry *session);
+int sessiontable_update(struct session_table *table,
+		struct session_entry *session, __u8 state, bool established,
+		unsigned long lifetime);
+struct session_entry *sessiontable_lru(struct session_table *table);
 
 bool sessiontable_allow(struct session_table *table, struct tuple *tuple4);
 void sessiontable_update_timers(struct session_table *table);
+unsigned long sessiontable_get_timeout(struct session_table *table,
+		const struct session_entry *session);
+void sessiontable_expiry_stats(struct session_table *table, __u64 *backlog,
+		__u64 *batches);
 
 #endif /* _JOOL_MOD_SESSION_TABLE_H */
@@ -0,0 +1,21 @@
+#ifndef _JOOL_MOD_SNAPSHOT_H
+#define _JOOL_MOD_SNAPSHOT_H
+
+/**
+ * @file
+ * Restoration of BIB/session snapshots, so the state can survive module
+ * reloads. (Snapshots are taken by the userspace app, through the regular BIB
+ * and session display requests.)
+ *
+ * The records are staged as they arrive, and the tables are built out of them
+ * in bulk once the userspace app commits. See struct request_snapshot.
+ */
+
+#include "nat64/common/config.h"
+
+int snapshot_restore(__u32 owner, struct request_snapshot *request,
+		void *records, size_t records_len,
+		struct response_snapshot *response);
+void snapshot_destroy(void);
+
+#endif /* _JOOL_MOD_SNAPSHOT_H */
@@ -0,0 +1,75 @@
+#ifndef _JOOL_MOD_SUBSCRIBER_H
+#define _JOOL_MOD_SUBSCRIBER_H
+
+/**
+ * @file
+ * Bookkeeping of the BIB entries and sessions each IPv6 subscriber owns, so
+ * admission control doesn't have to walk the tables. (See struct
+ * admission_limits.)
+ *
+ * A subscriber stays alive while it has at least one BIB entry. Its sessions
+ * do not need to pin it because they always pin their BIB entry.
+ */
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include "nat64/common/config.h"
+#include "nat64/common/types.h"
+
+struct port_block;
+struct session_entry;
+
+struct subscriber {
+	/** The subscriber's IPv6 addresses. */
+	struct ipv6_prefix prefix;
+	/** Chains this subscriber to its hash table bucket. */
+	struct hlist_node hook;
+	/** One per BIB entry, plus the temporary ones from subscriber_get(). */
+	atomic_t refcount;
+
+	/** Protects the fields below. */
+	spinlock_t lock;
+	/** Number of sessions this subscriber currently has in the DB. */
+	unsigned int sessions;
+	/** Number of (dynamic) BIB entries this subscriber currently has. */
+	unsigned int bibs;
+	/**
+	 * The subscriber's sessions, roughly from least to most recently used.
+	 * (Chained through session_entry.subscriber_hook.)
+	 */
+	struct list_head lru;
+	/** The port blocks reserved for this subscriber. (struct port_block) */
+	struct list_head blocks;
+};
+
+int subscriber_init(void);
+void subscriber_destroy(void);
+
+struct subscriber *subscriber_get(const struct in6_addr *addr, __u8 len);
+void subscriber_put(struct subscriber *sub);
+
+void subscriber_add_bib(struct subscriber *sub);
+void subscriber_rm_bib(struct subscriber *sub, struct port_block *block);
+void subscriber_add_session(struct subscriber *sub,
+		struct session_entry *session);
+void subscriber_rm_session(struct subscriber *sub,
+		struct session_entry *session);
+
+int subscriber_check_bibs(struct subscriber *sub,
+		struct admission_limits *limits);
+int subscriber_check_sessions(struct subscriber *sub,
+		struct admission_limits *limits);
+struct session_entry *subscriber_lru(struct subscriber *sub);
+
+int subscriber_take_port(struct subscriber *sub, l4_protocol proto,
+		__u32 mark, struct ipv4_transport_addr *result,
+		struct port_block **block, struct in_addr *hint);
+void subscriber_return_port(struct subscriber *sub, struct port_block *block);
+void subscriber_add_block(struct subscriber *sub, struct port_block *block);
+
+void subscriber_count_drop(void);
+void subscriber_count_eviction(void);
+void subscriber_stats(__u64 *subscribers, __u64 *sessions, __u64 *bibs,
+		__u64 *drops, __u64 *evictions);
+
+#endif /* _JOOL_MOD_SUBSCRIBER_H */
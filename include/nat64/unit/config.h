@@ -0,0 +1,8 @@
+#ifndef _JOOL_UNIT_CONFIG_H
+#define _JOOL_UNIT_CONFIG_H
+
+#include "nat64/mod/common/config.h"
+
+struct global_config *config_clone_for_update(void);
+
+#endif /* _JOOL_UNIT_CONFIG_H */
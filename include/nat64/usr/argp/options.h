@@ -19,6 +19,10 @@ enum argp_flags {
 	ARGP_BLACKLIST = 7000,
 	ARGP_RFC6791 = 6791,
 	ARGP_LOGTIME = 'l',
+	ARGP_SNAPSHOT = 7001,
+	ARGP_REPLICATION = 7002,
+	ARGP_DETERMINISTIC = 7003,
+	ARGP_FRAGMENT = 7004,
 	ARGP_GLOBAL = 'g',
 
 	/* Operations */
@@ -36,6 +40,7 @@ enum argp_flags {
 	ARGP_QUICK = 'q',
 	ARGP_MARK = 'm',
 	ARGP_FORCE = 1002,
+	ARGP_REPLACE = 1003,
 
 	/* BIB, session */
 	ARGP_TCP = 't',
@@ -45,6 +50,16 @@ enum argp_flags {
 	ARGP_CSV = 2022,
 	ARGP_BIB_IPV6 = 2020,
 	ARGP_BIB_IPV4 = 2021,
+	ARGP_FILE = 2023,
+
+	/* Replication */
+	ARGP_SEND = 2024,
+	ARGP_RECEIVE = 2025,
+	ARGP_PEER = 2027,
+	ARGP_KEY = 2028,
+
+	/* Deterministic mappings */
+	ARGP_DET_SUBSCRIBER_LEN = 2026,
 
 	/* General */
 	ARGP_DROP_ADDR = 3000,
@@ -58,6 +73,20 @@ enum argp_flags {
 	ARGP_SRC_ICMP6ERRS_BETTER = 3015,
 	ARGP_BIB_LOGGING,
 	ARGP_SESSION_LOGGING,
+	ARGP_MAX_SESSIONS = 3020,
+	ARGP_MAX_SESSIONS_SUB = 3021,
+	ARGP_MAX_BIBS = 3022,
+	ARGP_MAX_BIBS_SUB = 3023,
+	ARGP_SUBSCRIBER_LEN = 3024,
+	ARGP_EVICT_ON_LIMIT = 3025,
+	ARGP_PORT_BLOCK_SIZE = 3026,
+	ARGP_RSS_AFFINITY = 3027,
+	ARGP_RSS_KEY = 3028,
+	ARGP_RSS_INDIR = 3029,
+	ARGP_FRAG_HIGH_THRESH = 3030,
+	ARGP_FRAG_LOW_THRESH = 3031,
+	ARGP_STORED_PKTS_SRC = 3032,
+	ARGP_SYN_COOKIES = 3033,
 	ARGP_RESET_TCLASS = 4002,
 	ARGP_RESET_TOS = 4003,
 	ARGP_NEW_TOS = 4004,
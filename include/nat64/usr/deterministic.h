@@ -0,0 +1,15 @@
+#ifndef _JOOL_USR_DETERMINISTIC_H
+#define _JOOL_USR_DETERMINISTIC_H
+
+#include "nat64/common/types.h"
+
+int deterministic_display(bool csv_format);
+int deterministic_test(__u32 mark, bool tcp, bool udp, bool icmp,
+		bool addr6_set, struct in6_addr *addr6,
+		bool addr4_set, struct ipv4_transport_addr *addr4);
+int deterministic_add(__u32 mark, struct ipv6_prefix *prefix6,
+		__u8 subscriber_len);
+int deterministic_remove(__u32 mark);
+int deterministic_flush(void);
+
+#endif /* _JOOL_USR_DETERMINISTIC_H */
@@ -0,0 +1,8 @@
+#ifndef _JOOL_USR_FRAGMENT_H
+#define _JOOL_USR_FRAGMENT_H
+
+
+int fragment_count(void);
+
+
+#endif /* _JOOL_USR_FRAGMENT_H */
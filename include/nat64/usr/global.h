@@ -27,15 +27,29 @@
 #define OPTNAME_DROP_BY_ADDR		"address-dependent-filtering"
 #define OPTNAME_DROP_ICMP6_INFO		"drop-icmpv6-info"
 #define OPTNAME_DROP_EXTERNAL_TCP	"drop-externally-initiated-tcp"
+#define OPTNAME_SYN_COOKIES		"tcp-syn-cookies"
 #define OPTNAME_UDP_TIMEOUT		"udp-timeout"
 #define OPTNAME_ICMP_TIMEOUT		"icmp-timeout"
 #define OPTNAME_TCPEST_TIMEOUT		"tcp-est-timeout"
 #define OPTNAME_TCPTRANS_TIMEOUT	"tcp-trans-timeout"
 #define OPTNAME_FRAG_TIMEOUT		"fragment-arrival-timeout"
 #define OPTNAME_MAX_SO			"maximum-simultaneous-opens"
+#define OPTNAME_MAX_SO_SRC		"maximum-simultaneous-opens-per-source"
 #define OPTNAME_SRC_ICMP6E_BETTER	"source-icmpv6-errors-better"
 #define OPTNAME_BIB_LOGGING		"logging-bib"
 #define OPTNAME_SESSION_LOGGING		"logging-session"
+#define OPTNAME_MAX_SESSIONS		"max-sessions"
+#define OPTNAME_MAX_SESSIONS_SUB	"max-sessions-per-subscriber"
+#define OPTNAME_MAX_BIBS		"max-bibs"
+#define OPTNAME_MAX_BIBS_SUB		"max-bibs-per-subscriber"
+#define OPTNAME_SUBSCRIBER_LEN		"subscriber-prefix-length"
+#define OPTNAME_EVICT_ON_LIMIT		"evict-on-limit"
+#define OPTNAME_PORT_BLOCK_SIZE		"port-block-size"
+#define OPTNAME_RSS_AFFINITY		"rss-affinity"
+#define OPTNAME_RSS_KEY			"rss-key"
+#define OPTNAME_RSS_INDIR		"rss-indirection"
+#define OPTNAME_FRAG_HIGH_THRESH	"fragment-high-thresh"
+#define OPTNAME_FRAG_LOW_THRESH		"fragment-low-thresh"
 
 
 int global_display(bool csv);
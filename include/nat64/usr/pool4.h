@@ -13,6 +13,7 @@ int pool4_rm(__u32 mark, bool tcp, bool udp, bool icmp,
 		struct ipv4_prefix *addrs, struct port_range *ports,
 		bool quick);
 int pool4_flush(bool quick);
+int pool4_batch(char *file_name, bool replace);
 
 
 #endif /* _JOOL_USR_POOL4_H */
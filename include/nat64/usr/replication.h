@@ -0,0 +1,13 @@
+#ifndef _JOOL_USR_REPLICATION_H
+#define _JOOL_USR_REPLICATION_H
+
+#include "nat64/common/types.h"
+
+
+int replication_count(void);
+int replication_send(struct ipv4_transport_addr *peer, char *key_file);
+int replication_receive(struct ipv4_transport_addr *local,
+		struct in_addr *peer, char *key_file);
+
+
+#endif /* _JOOL_USR_REPLICATION_H */
@@ -0,0 +1,11 @@
+#ifndef _JOOL_USR_SNAPSHOT_H
+#define _JOOL_USR_SNAPSHOT_H
+
+#include <stdbool.h>
+
+
+int snapshot_dump(char *file_name, bool use_tcp, bool use_udp, bool use_icmp);
+int snapshot_restore(char *file_name, bool use_tcp, bool use_udp, bool use_icmp);
+
+
+#endif /* _JOOL_USR_SNAPSHOT_H */
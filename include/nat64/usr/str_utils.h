@@ -44,6 +44,11 @@ int str_to_port_range(char *str, struct port_range *range);
  * It sets "out_len" as "out"'s length in elements (not bytes).
  */
 int str_to_u16_array(const char *str, __u16 **out, size_t *out_len);
+/**
+ * Parses "str" as exactly "len" colon-separated hexadecimal bytes (such as
+ * "6d:5a:56"), which it then copies to "out".
+ */
+int str_to_hex_array(const char *str, __u8 *out, size_t len);
 
 /**
  * @{
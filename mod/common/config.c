@@ -14,6 +14,7 @@ int config_init(bool is_disable)
 {
 	struct global_config *cfg;
 	__u16 plateaus[] = DEFAULT_MTU_PLATEAUS;
+	__u8 rss_key[] = DEFAULT_RSS_KEY;
 
 	cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
 	if (!cfg)
@@ -36,12 +37,29 @@ int config_init(bool is_disable)
 	cfg->nat64.ttl.tcp_trans = msecs_to_jiffies(1000 * TCP_TRANS);
 	cfg->nat64.ttl.frag = msecs_to_jiffies(1000 * FRAGMENT_MIN);
 	cfg->nat64.max_stored_pkts = DEFAULT_MAX_STORED_PKTS;
+	cfg->nat64.max_stored_pkts_per_src = DEFAULT_MAX_STORED_PKTS_PER_SRC;
 	cfg->nat64.src_icmp6errs_better = DEFAULT_SRC_ICMP6ERRS_BETTER;
 	cfg->nat64.drop_by_addr = DEFAULT_ADDR_DEPENDENT_FILTERING;
 	cfg->nat64.drop_external_tcp = DEFAULT_DROP_EXTERNAL_CONNECTIONS;
+	cfg->nat64.tcp_syn_cookies = DEFAULT_TCP_SYN_COOKIES;
 	cfg->nat64.drop_icmp6_info = DEFAULT_FILTER_ICMPV6_INFO;
 	cfg->nat64.bib_logging = DEFAULT_BIB_LOGGING;
 	cfg->nat64.session_logging = DEFAULT_SESSION_LOGGING;
+	cfg->nat64.limits.max_sessions = DEFAULT_MAX_SESSIONS;
+	cfg->nat64.limits.max_bibs = DEFAULT_MAX_BIBS;
+	cfg->nat64.limits.max_sessions_per_subscriber =
+			DEFAULT_MAX_SESSIONS_PER_SUBSCRIBER;
+	cfg->nat64.limits.max_bibs_per_subscriber =
+			DEFAULT_MAX_BIBS_PER_SUBSCRIBER;
+	cfg->nat64.limits.subscriber_prefix_len = DEFAULT_SUBSCRIBER_PREFIX_LEN;
+	cfg->nat64.limits.evict = DEFAULT_EVICT_ON_LIMIT;
+	cfg->nat64.port_block_size = DEFAULT_PORT_BLOCK_SIZE;
+	cfg->nat64.rss.affinity = DEFAULT_RSS_AFFINITY;
+	memcpy(cfg->nat64.rss.key, rss_key, sizeof(cfg->nat64.rss.key));
+	cfg->nat64.rss.indir_len = 0;
+	memset(cfg->nat64.rss.indir, 0, sizeof(cfg->nat64.rss.indir));
+	cfg->nat64.frag_high_thresh = DEFAULT_FRAG_HIGH_THRESH;
+	cfg->nat64.frag_low_thresh = DEFAULT_FRAG_LOW_THRESH;
 
 	cfg->siit.compute_udp_csum_zero = DEFAULT_COMPUTE_UDP_CSUM0;
 	cfg->siit.eam_hairpin_mode = DEFAULT_EAM_HAIRPIN_MODE;
@@ -148,6 +166,11 @@ unsigned int config_get_max_pkts(void)
 	return RCU_THINGY(unsigned int, nat64.max_stored_pkts);
 }
 
+unsigned int config_get_max_pkts_per_src(void)
+{
+	return RCU_THINGY(unsigned int, nat64.max_stored_pkts_per_src);
+}
+
 bool config_get_src_icmp6errs_better(void)
 {
 	return RCU_THINGY(bool, nat64.src_icmp6errs_better);
@@ -163,6 +186,40 @@ bool config_get_session_logging(void)
 	return RCU_THINGY(bool, nat64.session_logging);
 }
 
+void config_get_limits(struct admission_limits *limits)
+{
+	rcu_read_lock_bh();
+	*limits = rcu_dereference_bh(config)->nat64.limits;
+	rcu_read_unlock_bh();
+}
+
+unsigned int config_get_port_block_size(void)
+{
+	return RCU_THINGY(unsigned int, nat64.port_block_size);
+}
+
+bool config_get_rss_affinity(void)
+{
+	return RCU_THINGY(bool, nat64.rss.affinity);
+}
+
+void config_get_rss(struct rss_config *rss)
+{
+	rcu_read_lock_bh();
+	*rss = rcu_dereference_bh(config)->nat64.rss;
+	rcu_read_unlock_bh();
+}
+
+unsigned int config_get_frag_high_thresh(void)
+{
+	return RCU_THINGY(unsigned int, nat64.frag_high_thresh);
+}
+
+unsigned int config_get_frag_low_thresh(void)
+{
+	return RCU_THINGY(unsigned int, nat64.frag_low_thresh);
+}
+
 bool config_get_filter_icmpv6_info(void)
 {
 	return RCU_THINGY(bool, nat64.drop_icmp6_info);
@@ -178,6 +235,11 @@ bool config_get_drop_external_connections(void)
 	return RCU_THINGY(bool, nat64.drop_external_tcp);
 }
 
+bool config_get_tcp_syn_cookies(void)
+{
+	return RCU_THINGY(bool, nat64.tcp_syn_cookies);
+}
+
 bool config_amend_zero_csum(void)
 {
 	return RCU_THINGY(bool, siit.compute_udp_csum_zero);
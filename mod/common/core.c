@@ -7,40 +7,133 @@
 #include "nat64/mod/stateful/compute_outgoing_tuple.h"
 #include "nat64/mod/stateful/determine_incoming_tuple.h"
 #include "nat64/mod/stateful/filtering_and_updating.h"
+#include "nat64/mod/stateful/fragment_cache.h"
 #include "nat64/mod/stateful/fragment_db.h"
 #include "nat64/mod/common/send_packet.h"
 
 
-static unsigned int core_common(struct packet *in)
+static verdict translate(struct tuple *tuple_out, struct packet *in)
 {
 	struct packet out;
-	struct tuple tuple_in;
-	struct tuple tuple_out;
 	verdict result;
 
-	if (xlat_is_nat64()) {
-		result = determine_in_tuple(in, &tuple_in);
-		if (result != VERDICT_CONTINUE)
-			goto end;
-		result = filtering_and_updating(in, &tuple_in);
-		if (result != VERDICT_CONTINUE)
-			goto end;
-		result = compute_out_tuple(&tuple_in, &tuple_out, in);
-		if (result != VERDICT_CONTINUE)
-			goto end;
-	}
-	result = translating_the_packet(&tuple_out, in, &out);
+	result = translating_the_packet(tuple_out, in, &out);
 	if (result != VERDICT_CONTINUE)
-		goto end;
+		return result;
 
-	if (is_hairpin(&out, &tuple_out)) {
-		result = handling_hairpinning(&out, &tuple_out);
+	if (is_hairpin(&out, tuple_out)) {
+		result = handling_hairpinning(&out, tuple_out);
 		kfree_skb(out.skb);
 	} else {
 		result = sendpkt_send(in, &out);
 		/* sendpkt_send() releases out's skb regardless of verdict. */
 	}
 
+	return result;
+}
+
+/**
+ * Translates the fragments the fragment cache held until their first fragment
+ * ("first") showed up. They are chained through skb->next.
+ */
+static void translate_pending(struct tuple *tuple_out, struct packet *first,
+		struct sk_buff *skb)
+{
+	struct packet pkt;
+	struct sk_buff *next;
+	int error;
+
+	for (; skb; skb = next) {
+		next = skb->next;
+		skb->next = NULL;
+
+		error = (pkt_l3_proto(first) == L3PROTO_IPV6)
+				? pkt_init_ipv6(&pkt, skb)
+				: pkt_init_ipv4(&pkt, skb);
+		if (!error)
+			translate(tuple_out, &pkt);
+		/* They were stolen, so they are ours regardless of verdict. */
+		kfree_skb(skb);
+	}
+}
+
+static verdict nat64_steps(struct packet *in, struct tuple *tuple_out,
+		struct session_entry **session)
+{
+	struct tuple tuple_in;
+	verdict result;
+
+	result = determine_in_tuple(in, &tuple_in);
+	if (result != VERDICT_CONTINUE)
+		return result;
+	/* The session is looked up once, here, and reused below. */
+	result = filtering_and_updating(in, &tuple_in, session);
+	if (result != VERDICT_CONTINUE)
+		return result;
+	return compute_out_tuple(&tuple_in, *session, tuple_out, in);
+}
+
+static unsigned int core_common(struct packet *in)
+{
+	struct sk_buff *original = in->skb;
+	struct tuple tuple_out;
+	struct session_entry *session = NULL;
+	enum fragcache_type frag = FRAGCACHE_NONE;
+	struct sk_buff *pending = NULL;
+	verdict result;
+
+	if (xlat_is_nat64()) {
+		frag = fragcache_type(in);
+		switch (frag) {
+		case FRAGCACHE_SUBSEQUENT:
+			/* Steps 1 through 3 already happened to the first one. */
+			result = fragcache_get(in, &tuple_out);
+			if (result != VERDICT_CONTINUE)
+				goto end;
+			if (pkt_is_fragment(in))
+				break;
+			/* It completed a packet that needed full reassembly. */
+			frag = FRAGCACHE_NONE;
+			result = nat64_steps(in, &tuple_out, &session);
+			break;
+		case FRAGCACHE_UNSUPPORTED:
+			result = fragcache_reassemble(in);
+			if (result != VERDICT_CONTINUE)
+				goto end;
+			frag = FRAGCACHE_NONE;
+			/* Fall through. */
+		default:
+			result = nat64_steps(in, &tuple_out, &session);
+			break;
+		}
+
+		if (frag == FRAGCACHE_FIRST && result == VERDICT_CONTINUE
+				&& is_hairpin(in, &tuple_out)) {
+			/*
+			 * The second pass would need its own fragment cache,
+			 * so the packet has to be reassembled first. The whole
+			 * packet shares the fragment's tuple and session.
+			 */
+			result = fragcache_reassemble(in);
+			if (result != VERDICT_CONTINUE)
+				goto end;
+			frag = FRAGCACHE_NONE;
+		}
+
+		if (frag == FRAGCACHE_FIRST) {
+			if (result == VERDICT_CONTINUE)
+				pending = fragcache_add(in, &tuple_out);
+			else
+				fragcache_reject(in, result);
+		}
+		if (result != VERDICT_CONTINUE)
+			goto end;
+	}
+
+	result = translate(&tuple_out, in);
+	if (pending)
+		translate_pending(&tuple_out, in, pending);
+
 	if (result != VERDICT_CONTINUE)
 		goto end;
 
@@ -58,6 +151,17 @@ static unsigned int core_common(struct packet *in)
 	/* Fall through. */
 
 end:
+	if (session)
+		session_return(session);
+	if (in->skb != original && result != VERDICT_STOLEN) {
+		/*
+		 * @in was reassembled into a new skb, and the kernel already
+		 * released the fragments (including @original). Whatever
+		 * happened, the kernel must not touch them again.
+		 */
+		kfree_skb(in->skb);
+		result = VERDICT_STOLEN;
+	}
 	if (result == VERDICT_ACCEPT)
 		log_debug("Returning the packet to the kernel.");
 
@@ -115,7 +219,7 @@ unsigned int core_6to4(struct sk_buff *skb, const struct net_device *dev)
 	if (pkt_init_ipv6(&pkt, skb) != 0)
 		return NF_DROP;
 
-	if (xlat_is_nat64()) {
+	if (xlat_is_nat64() && !fragcache_is_enabled()) {
 		verdict result = fragdb_handle(&pkt);
 		if (result != VERDICT_CONTINUE)
 			return (unsigned int) result;
@@ -15,9 +15,15 @@
 #include "nat64/mod/stateless/blacklist4.h"
 #include "nat64/mod/stateless/rfc6791.h"
 #include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/pool4/usage.h"
 #include "nat64/mod/stateful/bib/db.h"
+#include "nat64/mod/stateful/bib/deterministic.h"
 #include "nat64/mod/stateful/bib/static_routes.h"
 #include "nat64/mod/stateful/session/db.h"
+#include "nat64/mod/stateful/fragment_db.h"
+#include "nat64/mod/stateful/replication.h"
+#include "nat64/mod/stateful/snapshot.h"
+#include "nat64/mod/stateful/subscriber.h"
 
 /**
  * Socket the userspace application will speak to.
@@ -267,7 +273,13 @@ static int handle_pool6_config(struct nlmsghdr *nl_hdr, struct request_hdr *jool
 
 static int pool4_to_usr(struct pool4_sample *sample, void *arg)
 {
-	return nlbuffer_write(arg, sample, sizeof(*sample));
+	struct pool4_sample_usr sample_usr;
+
+	sample_usr.sample = *sample;
+	sample_usr.used = pool4usage_get(sample->mark, sample->proto,
+			&sample->addr);
+
+	return nlbuffer_write(arg, &sample_usr, sizeof(sample_usr));
 }
 
 static int handle_pool4_display(struct nlmsghdr *nl_hdr, union request_pool4 *request)
@@ -347,6 +359,85 @@ static int handle_pool4_flush(struct nlmsghdr *nl_hdr, union request_pool4 *requ
 	return respond_error(nl_hdr, error);
 }
 
+static int apply_pool4_batch(__u32 owner, struct pool4_batch_entry *entries,
+		unsigned int count)
+{
+	struct pool4_batch_entry *entry;
+	unsigned int i;
+	int error;
+
+	for (i = 0; i < count; i++) {
+		entry = &entries[i];
+		if (entry->proto >= L4_PROTO_COUNT) {
+			log_err("Entry %u of the pool4 batch has an unknown protocol (%u).",
+					i, entry->proto);
+			return -EINVAL;
+		}
+
+		error = entry->add
+				? pool4db_batch_add(owner, entry->mark,
+						entry->proto, &entry->addrs,
+						&entry->ports)
+				: pool4db_batch_rm(owner, entry->mark,
+						entry->proto, &entry->addrs,
+						&entry->ports);
+		if (error) {
+			log_err("Entry %u of the pool4 batch could not be applied (error code %d).",
+					i, error);
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+static int handle_pool4_batch(struct nlmsghdr *nl_hdr,
+		struct request_hdr *jool_hdr, union request_pool4 *request)
+{
+	size_t entries_len;
+	int error;
+
+	if (verify_superpriv())
+		return respond_error(nl_hdr, -EPERM);
+
+	if (jool_hdr->length < sizeof(*jool_hdr) + sizeof(*request)
+			|| jool_hdr->length > nlmsg_len(nl_hdr)) {
+		log_err("The pool4 batch request's length is inconsistent.");
+		return respond_error(nl_hdr, -EINVAL);
+	}
+	entries_len = jool_hdr->length - sizeof(*jool_hdr) - sizeof(*request);
+	/* Don't multiply the count; it could overflow on 32-bit machines. */
+	if (entries_len % sizeof(struct pool4_batch_entry)
+			|| request->batch.count != entries_len
+					/ sizeof(struct pool4_batch_entry)) {
+		log_err("The pool4 batch request claims %u entries, but carries %zu bytes.",
+				request->batch.count, entries_len);
+		return respond_error(nl_hdr, -EINVAL);
+	}
+
+	log_debug("Applying a pool4 batch chunk.");
+
+	if (request->batch.begin) {
+		error = pool4db_batch_begin(nl_hdr->nlmsg_pid,
+				request->batch.replace);
+		if (error)
+			return respond_error(nl_hdr, error);
+	}
+
+	error = apply_pool4_batch(nl_hdr->nlmsg_pid,
+			(struct pool4_batch_entry *)(request + 1),
+			request->batch.count);
+	if (error) {
+		pool4db_batch_abort(nl_hdr->nlmsg_pid);
+		return respond_error(nl_hdr, error);
+	}
+
+	if (request->batch.commit)
+		error = pool4db_batch_commit(nl_hdr->nlmsg_pid);
+
+	return respond_error(nl_hdr, error);
+}
+
 static int handle_pool4_config(struct nlmsghdr *nl_hdr, struct request_hdr *jool_hdr,
 		union request_pool4 *request)
 {
@@ -365,6 +456,7 @@ static int handle_pool4_config(struct nlmsghdr *nl_hdr, struct request_hdr *jool
 		log_debug("Returning IPv4 pool counters.");
 		pool4db_count(&counters.tables, &counters.samples,
 				&counters.taddrs);
+		counters.used = pool4usage_count();
 		return respond_setcfg(nl_hdr, &counters, sizeof(counters));
 
 	case OP_ADD:
@@ -376,6 +468,9 @@ static int handle_pool4_config(struct nlmsghdr *nl_hdr, struct request_hdr *jool
 	case OP_FLUSH:
 		return handle_pool4_flush(nl_hdr, request);
 
+	case OP_UPDATE:
+		return handle_pool4_batch(nl_hdr, jool_hdr, request);
+
 	default:
 		log_err("Unknown operation: %d", jool_hdr->operation);
 		return respond_error(nl_hdr, -EINVAL);
@@ -460,9 +555,11 @@ static int session_entry_to_userspace(struct session_entry *entry, void *arg)
 {
 	struct nl_buffer *buffer = (struct nl_buffer *) arg;
 	struct session_entry_usr entry_usr;
+	unsigned long timeout;
 	unsigned long dying_time;
 
-	if (!entry->expirer || !entry->expirer->get_timeout)
+	timeout = sessiondb_get_timeout(entry);
+	if (!timeout)
 		return -EINVAL;
 
 	entry_usr.remote6 = entry->remote6;
@@ -470,8 +567,9 @@ static int session_entry_to_userspace(struct session_entry *entry, void *arg)
 	entry_usr.local4 = entry->local4;
 	entry_usr.remote4 = entry->remote4;
 	entry_usr.state = entry->state;
+	entry_usr.is_est = entry->established;
 
-	dying_time = entry->update_time + entry->expirer->get_timeout();
+	dying_time = entry->update_time + timeout;
 	entry_usr.dying_time = (dying_time > jiffies) ? jiffies_to_msecs(dying_time - jiffies) : 0;
 
 	return nlbuffer_write(buffer, &entry_usr, sizeof(entry_usr));
@@ -502,12 +600,32 @@ static int handle_session_display(struct nlmsghdr *nl_hdr, struct request_sessio
 	return error;
 }
 
-static int handle_session_config(struct nlmsghdr *nl_hdr, struct request_hdr *jool_hdr,
+static int handle_session_count(struct nlmsghdr *nl_hdr,
 		struct request_session *request)
 {
-	__u64 count;
+	struct response_session_count counters;
 	int error;
 
+	log_debug("Returning session count.");
+
+	error = sessiondb_count(request->l4_proto, &counters.sessions);
+	if (error)
+		return respond_error(nl_hdr, error);
+	error = sessiondb_expiry_stats(request->l4_proto,
+			&counters.expiry_backlog, &counters.expiry_batches);
+	if (error)
+		return respond_error(nl_hdr, error);
+	counters.expiry_batch_size = EXPIRER_BATCH;
+	subscriber_stats(&counters.subscribers, &counters.subscriber_sessions,
+			&counters.subscriber_bibs, &counters.admission_drops,
+			&counters.admission_evictions);
+
+	return respond_setcfg(nl_hdr, &counters, sizeof(counters));
+}
+
+static int handle_session_config(struct nlmsghdr *nl_hdr, struct request_hdr *jool_hdr,
+		struct request_session *request)
+{
 	if (xlat_is_siit()) {
 		log_err("SIIT doesn't have session tables.");
 		return -EINVAL;
@@ -518,11 +636,202 @@ static int handle_session_config(struct nlmsghdr *nl_hdr, struct request_hdr *jo
 		return handle_session_display(nl_hdr, request);
 
 	case OP_COUNT:
-		log_debug("Returning session count.");
-		error = sessiondb_count(request->l4_proto, &count);
-		if (error)
+		return handle_session_count(nl_hdr, request);
+
+	default:
+		log_err("Unknown operation: %d", jool_hdr->operation);
+		return respond_error(nl_hdr, -EINVAL);
+	}
+}
+
+static int handle_snapshot_config(struct nlmsghdr *nl_hdr,
+		struct request_hdr *jool_hdr, struct request_snapshot *request)
+{
+	struct response_snapshot response;
+	size_t records_len;
+	int error;
+
+	if (xlat_is_siit()) {
+		log_err("SIIT doesn't have BIBs or sessions.");
+		return -EINVAL;
+	}
+
+	switch (jool_hdr->operation) {
+	case OP_ADD:
+		if (verify_superpriv())
+			return respond_error(nl_hdr, -EPERM);
+
+		if (jool_hdr->length < sizeof(*jool_hdr) + sizeof(*request)
+				|| jool_hdr->length > nlmsg_len(nl_hdr)) {
+			log_err("The snapshot request's length is inconsistent.");
+			return respond_error(nl_hdr, -EINVAL);
+		}
+		records_len = jool_hdr->length - sizeof(*jool_hdr)
+				- sizeof(*request);
+
+		log_debug("Restoring a snapshot chunk.");
+		error = snapshot_restore(nl_hdr->nlmsg_pid, request,
+				request + 1, records_len, &response);
+		if (error || !request->commit)
 			return respond_error(nl_hdr, error);
-		return respond_setcfg(nl_hdr, &count, sizeof(count));
+		return respond_setcfg(nl_hdr, &response, sizeof(response));
+
+	default:
+		log_err("Unknown operation: %d", jool_hdr->operation);
+		return respond_error(nl_hdr, -EINVAL);
+	}
+}
+
+static int handle_replication_config(struct nlmsghdr *nl_hdr,
+		struct request_hdr *jool_hdr, struct replication_event *events)
+{
+	struct response_replication stats;
+	size_t len;
+
+	if (xlat_is_siit()) {
+		log_err("SIIT doesn't have sessions.");
+		return -EINVAL;
+	}
+
+	switch (jool_hdr->operation) {
+	case OP_COUNT:
+		log_debug("Returning replication stats.");
+		replication_stats(&stats);
+		return respond_setcfg(nl_hdr, &stats, sizeof(stats));
+
+	case OP_DISPLAY:
+		/* The events reveal every session. */
+		if (verify_superpriv())
+			return respond_error(nl_hdr, -EPERM);
+
+		log_debug("Publishing the session events to %u.",
+				nl_hdr->nlmsg_pid);
+		replication_listen(nl_hdr->nlmsg_pid);
+		return respond_error(nl_hdr, 0);
+
+	case OP_ADD:
+		if (verify_superpriv())
+			return respond_error(nl_hdr, -EPERM);
+
+		if (jool_hdr->length < sizeof(*jool_hdr)
+				|| jool_hdr->length > nlmsg_len(nl_hdr)) {
+			log_err("The replication request's length is inconsistent.");
+			return respond_error(nl_hdr, -EINVAL);
+		}
+		len = jool_hdr->length - sizeof(*jool_hdr);
+
+		return respond_error(nl_hdr, replication_apply(events,
+				len / sizeof(*events)));
+
+	default:
+		log_err("Unknown operation: %d", jool_hdr->operation);
+		return respond_error(nl_hdr, -EINVAL);
+	}
+}
+
+static int handle_fragment_config(struct nlmsghdr *nl_hdr,
+		struct request_hdr *jool_hdr)
+{
+	struct response_fragment stats;
+
+	if (xlat_is_siit()) {
+		log_err("SIIT doesn't have a fragment database.");
+		return -EINVAL;
+	}
+
+	switch (jool_hdr->operation) {
+	case OP_COUNT:
+		log_debug("Returning fragment database stats.");
+		fragdb_stats(&stats);
+		return respond_setcfg(nl_hdr, &stats, sizeof(stats));
+
+	default:
+		log_err("Unknown operation: %d", jool_hdr->operation);
+		return respond_error(nl_hdr, -EINVAL);
+	}
+}
+
+static int detmap_entry_to_userspace(struct deterministic_entry *entry,
+		void *arg)
+{
+	return nlbuffer_write(arg, entry, sizeof(*entry));
+}
+
+static int handle_deterministic_display(struct nlmsghdr *nl_hdr,
+		union request_deterministic *request)
+{
+	struct nl_buffer *buffer;
+	__u32 *offset;
+	int error;
+
+	log_debug("Sending the deterministic mappings to userspace.");
+
+	buffer = nlbuffer_create(nl_socket, nl_hdr);
+	if (!buffer)
+		return respond_error(nl_hdr, -ENOMEM);
+
+	offset = request->display.mark_set ? &request->display.mark : NULL;
+	error = detmap_foreach(detmap_entry_to_userspace, buffer, offset);
+	error = (error >= 0) ? nlbuffer_close(buffer, error) : respond_error(nl_hdr, error);
+
+	kfree(buffer);
+	return error;
+}
+
+static int handle_deterministic_test(struct nlmsghdr *nl_hdr,
+		union request_deterministic *request)
+{
+	struct response_deterministic response;
+	int error;
+
+	log_debug("Computing deterministic mapping for the user.");
+	error = request->test.addr_is_ipv6
+			? detmap_test6(request->test.mark, request->test.proto,
+					&request->test.addr.addr6, &response)
+			: detmap_test4(request->test.mark, request->test.proto,
+					&request->test.addr.addr4, &response);
+	if (error)
+		return respond_error(nl_hdr, error);
+
+	return respond_setcfg(nl_hdr, &response, sizeof(response));
+}
+
+static int handle_deterministic_config(struct nlmsghdr *nl_hdr,
+		struct request_hdr *jool_hdr,
+		union request_deterministic *request)
+{
+	if (xlat_is_siit()) {
+		log_err("SIIT doesn't have BIBs.");
+		return -EINVAL;
+	}
+
+	switch (jool_hdr->operation) {
+	case OP_DISPLAY:
+		return handle_deterministic_display(nl_hdr, request);
+
+	case OP_TEST:
+		return handle_deterministic_test(nl_hdr, request);
+
+	case OP_ADD:
+		if (verify_superpriv())
+			return respond_error(nl_hdr, -EPERM);
+
+		log_debug("Adding deterministic mapping.");
+		return respond_error(nl_hdr, detmap_add(&request->add));
+
+	case OP_REMOVE:
+		if (verify_superpriv())
+			return respond_error(nl_hdr, -EPERM);
+
+		log_debug("Removing deterministic mapping.");
+		return respond_error(nl_hdr, detmap_rm(request->rm.mark));
+
+	case OP_FLUSH:
+		if (verify_superpriv())
+			return respond_error(nl_hdr, -EPERM);
+
+		detmap_flush();
+		return respond_error(nl_hdr, 0);
 
 	default:
 		log_err("Unknown operation: %d", jool_hdr->operation);
@@ -849,6 +1158,19 @@ static bool assign_timeout(void *value, unsigned int min, __u64 *field)
 	return true;
 }
 
+static bool assign_u32(void *value, __u32 *field)
+{
+	__u64 value64 = *((__u64 *) value);
+
+	if (value64 > 0xFFFFFFFFU) {
+		log_err("Expected a number less than %u.", 0xFFFFFFFFU);
+		return false;
+	}
+
+	*field = value64;
+	return true;
+}
+
 static int be16_compare(const void *a, const void *b)
 {
 	return *(__u16 *)b - *(__u16 *)a;
@@ -909,6 +1231,28 @@ static int update_plateaus(struct global_config *config, size_t size, void *valu
 	return 0;
 }
 
+static int update_rss_indir(struct global_config *config, size_t size,
+		void *value)
+{
+	struct rss_config *rss = &config->nat64.rss;
+	unsigned int count = size / sizeof(*rss->indir);
+
+	if (size % sizeof(*rss->indir)) {
+		log_err("Expected an array of 16-bit integers; got an uneven number of bytes.");
+		return -EINVAL;
+	}
+	if (count == 0 || count > RSS_INDIR_MAX) {
+		log_err("The RSS indirection table needs 1 to %u entries.",
+				RSS_INDIR_MAX);
+		return -EINVAL;
+	}
+
+	memset(rss->indir, 0, sizeof(rss->indir));
+	memcpy(rss->indir, value, size);
+	rss->indir_len = count;
+	return 0;
+}
+
 static int handle_global_update(enum global_type type, size_t size, unsigned char *value)
 {
 	struct global_config *config;
@@ -930,6 +1274,12 @@ static int handle_global_update(enum global_type type, size_t size, unsigned cha
 			goto einval;
 		config->nat64.max_stored_pkts = *((__u64 *) value);
 		break;
+	case MAX_PKTS_PER_SOURCE:
+		if (!ensure_bytes(size, 8))
+			goto einval;
+		if (!assign_u32(value, &config->nat64.max_stored_pkts_per_src))
+			goto einval;
+		break;
 	case SRC_ICMP6ERRS_BETTER:
 		if (!ensure_bytes(size, 1))
 			goto einval;
@@ -995,6 +1345,99 @@ static int handle_global_update(enum global_type type, size_t size, unsigned cha
 			goto einval;
 		config->nat64.drop_external_tcp = *((__u8 *) value);
 		break;
+	case TCP_SYN_COOKIES:
+		if (!ensure_bytes(size, 1))
+			goto einval;
+		config->nat64.tcp_syn_cookies = *((__u8 *) value);
+		break;
+
+	case MAX_SESSIONS:
+		if (!ensure_bytes(size, 8))
+			goto einval;
+		config->nat64.limits.max_sessions = *((__u64 *) value);
+		break;
+	case MAX_SESSIONS_PER_SUBSCRIBER:
+		if (!ensure_bytes(size, 8))
+			goto einval;
+		if (!assign_u32(value,
+				&config->nat64.limits.max_sessions_per_subscriber))
+			goto einval;
+		break;
+	case MAX_BIBS:
+		if (!ensure_bytes(size, 8))
+			goto einval;
+		config->nat64.limits.max_bibs = *((__u64 *) value);
+		break;
+	case MAX_BIBS_PER_SUBSCRIBER:
+		if (!ensure_bytes(size, 8))
+			goto einval;
+		if (!assign_u32(value,
+				&config->nat64.limits.max_bibs_per_subscriber))
+			goto einval;
+		break;
+	case SUBSCRIBER_PREFIX_LEN:
+		if (!ensure_bytes(size, 1))
+			goto einval;
+		if (*((__u8 *) value) > 128) {
+			log_err("Prefix length %u is too high for an IPv6 address.",
+					*((__u8 *) value));
+			goto einval;
+		}
+		config->nat64.limits.subscriber_prefix_len = *((__u8 *) value);
+		break;
+	case EVICT_ON_LIMIT:
+		if (!ensure_bytes(size, 1))
+			goto einval;
+		config->nat64.limits.evict = *((__u8 *) value);
+		break;
+	case PORT_BLOCK_SIZE:
+		if (!ensure_bytes(size, 8))
+			goto einval;
+		if (*((__u64 *) value) > 65536) {
+			log_err("A port block cannot be bigger than 65536 ports.");
+			goto einval;
+		}
+		config->nat64.port_block_size = *((__u64 *) value);
+		break;
+	case RSS_AFFINITY:
+		if (!ensure_bytes(size, 1))
+			goto einval;
+		config->nat64.rss.affinity = *((__u8 *) value);
+		break;
+	case RSS_KEY:
+		if (size != RSS_KEY_LEN) {
+			log_err("The RSS key has to be %u bytes long, not %zu.",
+					RSS_KEY_LEN, size);
+			goto einval;
+		}
+		memcpy(config->nat64.rss.key, value, RSS_KEY_LEN);
+		break;
+	case RSS_INDIRECTION:
+		if (is_error(update_rss_indir(config, size, value)))
+			goto einval;
+		break;
+	case FRAG_HIGH_THRESH:
+		if (!ensure_bytes(size, 8))
+			goto einval;
+		if (!assign_u32(value, &config->nat64.frag_high_thresh))
+			goto einval;
+		if (config->nat64.frag_high_thresh < config->nat64.frag_low_thresh) {
+			log_err("The high threshold cannot be lower than the low threshold (%u).",
+					config->nat64.frag_low_thresh);
+			goto einval;
+		}
+		break;
+	case FRAG_LOW_THRESH:
+		if (!ensure_bytes(size, 8))
+			goto einval;
+		if (!assign_u32(value, &config->nat64.frag_low_thresh))
+			goto einval;
+		if (config->nat64.frag_low_thresh > config->nat64.frag_high_thresh) {
+			log_err("The low threshold cannot be higher than the high threshold (%u).",
+					config->nat64.frag_high_thresh);
+			goto einval;
+		}
+		break;
 
 	case COMPUTE_UDP_CSUM_ZERO:
 		if (!ensure_bytes(size, 1))
@@ -1174,6 +1617,18 @@ static int handle_netlink_message(struct sk_buff *skb_in, struct nlmsghdr *nl_hd
 	case MODE_SESSION:
 		return handle_session_config(nl_hdr, jool_hdr, request);
 		break;
+	case MODE_SNAPSHOT:
+		return handle_snapshot_config(nl_hdr, jool_hdr, request);
+		break;
+	case MODE_REPLICATION:
+		return handle_replication_config(nl_hdr, jool_hdr, request);
+		break;
+	case MODE_DETERMINISTIC:
+		return handle_deterministic_config(nl_hdr, jool_hdr, request);
+		break;
+	case MODE_FRAGMENT:
+		return handle_fragment_config(nl_hdr, jool_hdr);
+		break;
 	case MODE_EAMT:
 		return handle_eamt_config(nl_hdr, jool_hdr, request);
 		break;
@@ -1254,3 +1709,19 @@ void nlhandler_destroy(void)
 	if (nl_socket)
 		netlink_kernel_release(nl_socket);
 }
+
+/**
+ * Sends "skb" (a single Netlink message) to the userspace socket "portid".
+ * If the socket can't keep up, it loses the message; this never waits for it.
+ *
+ * Consumes "skb", regardless of the result.
+ */
+int nlhandler_unicast(struct sk_buff *skb, u32 portid)
+{
+	if (!nl_socket) {
+		kfree_skb(skb);
+		return -EINVAL;
+	}
+
+	return nlmsg_unicast(nl_socket, skb, portid);
+}
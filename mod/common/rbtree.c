@@ -1,5 +1,11 @@
 #include "nat64/mod/common/rbtree.h"
 
+#include <linux/log2.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+#include <linux/rbtree_augmented.h>
+#endif
+
 void rbtree_clear(struct rb_root *root, void (*destructor)(struct rb_node *))
 {
 	/* ... using a postorder traversal. */
@@ -29,3 +35,56 @@ void rbtree_clear(struct rb_root *root, void (*destructor)(struct rb_node *))
 
 	(root)->rb_node = NULL;
 }
+
+static void set_parent(struct rb_node *node, struct rb_node *parent,
+		bool is_black)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+	rb_set_parent_color(node, parent, is_black ? RB_BLACK : RB_RED);
+#else
+	rb_set_parent(node, parent);
+	rb_set_color(node, is_black ? RB_BLACK : RB_RED);
+#endif
+}
+
+/**
+ * Links entries[min, max) as a subtree whose root sits at depth "depth", and
+ * returns the subtree's root.
+ *
+ * Splitting by the middle yields a tree whose leaves all sit at two adjacent
+ * depths at most, so painting the nodes of the deepest level red (if it's not
+ * full) and everything else black satisfies the red-black invariants.
+ * "red_depth" is the depth of that level.
+ */
+static struct rb_node *build_subtree(void **entries, size_t min, size_t max,
+		size_t hook_offset, struct rb_node *parent, unsigned int depth,
+		unsigned int red_depth)
+{
+	struct rb_node *node;
+	size_t middle;
+
+	if (min >= max)
+		return NULL;
+
+	middle = min + (max - min) / 2;
+	node = entries[middle] + hook_offset;
+	set_parent(node, parent, depth != red_depth);
+	node->rb_left = build_subtree(entries, min, middle, hook_offset,
+			node, depth + 1, red_depth);
+	node->rb_right = build_subtree(entries, middle + 1, max, hook_offset,
+			node, depth + 1, red_depth);
+
+	return node;
+}
+
+void __rbtree_build(struct rb_root *root, void **entries, size_t count,
+		size_t hook_offset)
+{
+	/*
+	 * The recursion is only log2(count) deep. The deepest level is full
+	 * (and therefore black) when count + 1 is a power of two; in that case
+	 * red_depth is one level beyond the leaves and nothing is painted red.
+	 */
+	root->rb_node = build_subtree(entries, 0, count, hook_offset, NULL, 0,
+			ilog2(count + 1));
+}
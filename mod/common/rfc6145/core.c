@@ -14,7 +14,11 @@ static verdict translate_first(struct tuple *tuple, struct packet *in, struct pa
 	result = steps->l3_hdr_fn(tuple, in, out);
 	if (result != VERDICT_CONTINUE)
 		goto revert;
-	result = steps->l3_payload_fn(tuple, in, out);
+	/* Subsequent fragments don't have a layer-4 header to translate. */
+	if (pkt_is_subsequent_frag(in))
+		result = copy_payload(in, out) ? VERDICT_DROP : VERDICT_CONTINUE;
+	else
+		result = steps->l3_payload_fn(tuple, in, out);
 	if (result != VERDICT_CONTINUE)
 		goto revert;
 
@@ -136,7 +136,7 @@ struct dst_entry *route6(struct packet *pkt)
 	flow.saddr = hdr_ip->saddr;
 	flow.daddr = hdr_ip->daddr;
 	flow.flowlabel = get_flow_label(hdr_ip);
-	{
+	if (!pkt_is_subsequent_frag(pkt)) {
 		union {
 			struct tcphdr *tcp;
 			struct udphdr *udp;
@@ -42,11 +42,25 @@ int bibdb_init(void)
 	if (error)
 		return error;
 
-	bibtable_init(&bib_tcp);
-	bibtable_init(&bib_udp);
-	bibtable_init(&bib_icmp);
+	error = bibtable_init(&bib_tcp);
+	if (error)
+		goto tcp_fail;
+	error = bibtable_init(&bib_udp);
+	if (error)
+		goto udp_fail;
+	error = bibtable_init(&bib_icmp);
+	if (error)
+		goto icmp_fail;
 
 	return 0;
+
+icmp_fail:
+	bibtable_destroy(&bib_udp);
+udp_fail:
+	bibtable_destroy(&bib_tcp);
+tcp_fail:
+	bibentry_destroy();
+	return error;
 }
 
 /**
@@ -121,6 +135,19 @@ bool bibdb_contains4(const struct ipv4_transport_addr *addr,
 	return table ? bibtable_contains4(table, addr) : false;
 }
 
+/**
+ * Places in "result" the first port from "range" that's not being used by any
+ * "proto" BIB entry on address "addr".
+ *
+ * Returns -ESRCH if all of them are taken.
+ */
+int bibdb_find_free4(const l4_protocol proto, const struct in_addr *addr,
+		const struct port_range *range, __u16 *result)
+{
+	struct bib_table *table = get_table(proto);
+	return table ? bibtable_find_free4(table, addr, range, result) : -EINVAL;
+}
+
 /**
  * Makes "result" point to the BIB entry from the "l4_proto" table whose IPv6
  * side (address and port) is "addr".
@@ -168,13 +195,34 @@ void bibdb_return(struct bib_entry *bib)
  * do not assume you're transferring it.
  *
  * @param entry row to be added to the table.
- * @param l4_proto identifier of the table to add "entry" to.
+ * @param old if not NULL, and the table already holds an entry for "entry"'s
+ *	IPv6 transport address, that entry will be returned here (with an extra
+ *	reference; see bibtable_add()).
  * @return whether the entry could be inserted or not.
  */
-int bibdb_add(struct bib_entry *entry)
+int bibdb_add(struct bib_entry *entry, struct bib_entry **old)
 {
 	struct bib_table *table = get_table(entry->l4_proto);
-	return table ? bibtable_add(table, entry) : -EINVAL;
+
+	if (!table) {
+		if (old)
+			*old = NULL;
+		return -EINVAL;
+	}
+
+	return bibtable_add(table, entry, old);
+}
+
+/**
+ * Adds the "*count" entries from "bibs" (which belong to the "proto" table) to
+ * the database in one go. Meant for snapshot restoration; see
+ * bibtable_restore() for the details.
+ */
+int bibdb_restore(const l4_protocol proto, struct bib_entry **bibs,
+		size_t *count)
+{
+	struct bib_table *table = get_table(proto);
+	return table ? bibtable_restore(table, bibs, count) : -EINVAL;
 }
 
 /**
@@ -0,0 +1,532 @@
+#include "nat64/mod/stateful/bib/deterministic.h"
+
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include "nat64/common/str_utils.h"
+#include "nat64/mod/common/address.h"
+#include "nat64/mod/common/types.h"
+#include "nat64/mod/stateful/bib/db.h"
+#include "nat64/mod/stateful/pool4/db.h"
+
+struct detmap_node {
+	struct deterministic_entry entry;
+	/** Chains the node to @mappings. */
+	struct list_head hook;
+};
+
+/**
+ * The mappings, sorted by mark.
+ * The packet path only reads it (in RCU-bh read-side critical sections);
+ * writers are serialized by @lock.
+ */
+static LIST_HEAD(mappings);
+static DEFINE_MUTEX(lock);
+
+/**
+ * Either the RCU read lock or @lock must be held.
+ */
+static struct detmap_node *find_node(__u32 mark)
+{
+	struct detmap_node *node;
+
+	list_for_each_entry_rcu(node, &mappings, hook) {
+		if (node->entry.mark == mark)
+			return node;
+		if (node->entry.mark > mark)
+			break;
+	}
+
+	return NULL;
+}
+
+static int validate_entry(struct deterministic_entry *entry)
+{
+	int error;
+
+	error = prefix6_validate(&entry->prefix6);
+	if (error)
+		return error;
+
+	if (entry->subscriber_len < entry->prefix6.len
+			|| entry->subscriber_len > 128) {
+		log_err("The subscriber length (%u) has to be between the prefix length (%u) and 128.",
+				entry->subscriber_len, entry->prefix6.len);
+		return -EINVAL;
+	}
+
+	if (entry->subscriber_len - entry->prefix6.len > 32) {
+		log_err("Deterministic mappings cannot have more than 2^32 subscribers. (%pI6c/%u, subscriber length %u)",
+				&entry->prefix6.address, entry->prefix6.len,
+				entry->subscriber_len);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int detmap_add(struct deterministic_entry *entry)
+{
+	struct detmap_node *new;
+	struct detmap_node *node;
+	struct list_head *prev;
+	int error;
+
+	error = validate_entry(entry);
+	if (error)
+		return error;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+	new->entry = *entry;
+
+	mutex_lock(&lock);
+
+	prev = &mappings;
+	list_for_each_entry(node, &mappings, hook) {
+		if (node->entry.mark == entry->mark) {
+			log_err("Mark %u already has a deterministic mapping.",
+					entry->mark);
+			mutex_unlock(&lock);
+			kfree(new);
+			return -EEXIST;
+		}
+		if (node->entry.mark > entry->mark)
+			break;
+		prev = &node->hook;
+	}
+	list_add_rcu(&new->hook, prev);
+
+	mutex_unlock(&lock);
+	return 0;
+}
+
+int detmap_rm(__u32 mark)
+{
+	struct detmap_node *node;
+
+	mutex_lock(&lock);
+	node = find_node(mark);
+	if (!node) {
+		mutex_unlock(&lock);
+		log_err("Mark %u doesn't have a deterministic mapping.", mark);
+		return -ESRCH;
+	}
+	list_del_rcu(&node->hook);
+	mutex_unlock(&lock);
+
+	synchronize_rcu_bh();
+	kfree(node);
+	return 0;
+}
+
+void detmap_flush(void)
+{
+	struct detmap_node *node;
+	struct detmap_node *tmp;
+	LIST_HEAD(garbage);
+
+	mutex_lock(&lock);
+	list_for_each_entry_safe(node, tmp, &mappings, hook) {
+		list_del_rcu(&node->hook);
+		list_add(&node->hook, &garbage);
+	}
+	mutex_unlock(&lock);
+
+	if (list_empty(&garbage))
+		return;
+
+	synchronize_rcu_bh();
+	list_for_each_entry_safe(node, tmp, &garbage, hook)
+		kfree(node);
+}
+
+/**
+ * Has to be called after the packet path is disconnected.
+ */
+void detmap_destroy(void)
+{
+	detmap_flush();
+}
+
+/**
+ * Runs @func on every mapping whose mark is greater than @offset (all of them
+ * if @offset is NULL), in mark order. Stops early if @func returns nonzero.
+ */
+int detmap_foreach(int (*func)(struct deterministic_entry *, void *), void *arg,
+		__u32 *offset)
+{
+	struct detmap_node *node;
+	int error = 0;
+
+	rcu_read_lock_bh();
+	list_for_each_entry_rcu(node, &mappings, hook) {
+		if (offset && node->entry.mark <= *offset)
+			continue;
+		error = func(&node->entry, arg);
+		if (error)
+			break;
+	}
+	rcu_read_unlock_bh();
+
+	return error;
+}
+
+static int get_entry(__u32 mark, struct deterministic_entry *result)
+{
+	struct detmap_node *node;
+	int error = -ENOENT;
+
+	rcu_read_lock_bh();
+	node = find_node(mark);
+	if (node) {
+		*result = node->entry;
+		error = 0;
+	}
+	rcu_read_unlock_bh();
+
+	return error;
+}
+
+/**
+ * Returns the number of the subscriber @addr belongs to, within @entry.
+ */
+static __u32 get_index(struct deterministic_entry *entry, struct in6_addr *addr)
+{
+	unsigned int i;
+	__u32 index = 0;
+
+	for (i = entry->prefix6.len; i < entry->subscriber_len; i++)
+		index = (index << 1) | !!addr6_get_bit(addr, i);
+
+	return index;
+}
+
+/**
+ * Returns the prefix of subscriber number @index, within @entry.
+ */
+static void get_subscriber(struct deterministic_entry *entry, __u32 index,
+		struct ipv6_prefix *result)
+{
+	unsigned int i;
+
+	*result = entry->prefix6;
+	for (i = entry->subscriber_len; i > entry->prefix6.len; i--) {
+		addr6_set_bit(&result->address, i - 1, index & 1);
+		index >>= 1;
+	}
+	result->len = entry->subscriber_len;
+}
+
+/** A subscriber's portion of its mark's pool4 table. */
+struct slice {
+	struct deterministic_entry *entry;
+	l4_protocol proto;
+	/** Number of the subscriber. */
+	__u64 index;
+	/**
+	 * Is this the remainder past the last subscriber's slice instead?
+	 * (@index is ignored in this case.)
+	 */
+	bool leftover;
+	/** Number of subscribers. (Output.) */
+	__u64 subscribers;
+	/** Transport addresses each subscriber owns. (Output.) */
+	__u64 size;
+};
+
+/**
+ * Computes the size of @slice_void's slice out of the @taddrs transport
+ * addresses of its pool4 table, and returns in @offset the position of its
+ * first one. (A pool4db_foreach_mark_slice() get_offset callback.)
+ */
+static int compute_slice(__u64 taddrs, void *slice_void, __u64 *offset)
+{
+	struct slice *slice = slice_void;
+	struct deterministic_entry *entry = slice->entry;
+
+	slice->subscribers = 1ULL
+			<< (entry->subscriber_len - entry->prefix6.len);
+	slice->size = div64_u64(taddrs, slice->subscribers);
+	if (slice->size == 0) {
+		log_warn_once("pool4's %s table for mark %u has less transport addresses than its deterministic mapping has subscribers.",
+				l4proto_to_string(slice->proto), entry->mark);
+		return -ESRCH;
+	}
+
+	if (!slice->leftover) {
+		*offset = slice->index * slice->size;
+		return 0;
+	}
+
+	*offset = slice->subscribers * slice->size;
+	if (*offset >= taddrs)
+		return -ESRCH; /* Nothing's left over. */
+	slice->size = taddrs - *offset;
+	return 0;
+}
+
+/**
+ * Walks the pool4 table of @slice, starting from the slice's first transport
+ * address. The slice's size is computed in the same pass, so it matches the
+ * pool4 the walk sees.
+ */
+static int foreach_slice(struct slice *slice,
+		int (*func)(struct pool4_sample *, void *), void *arg)
+{
+	int error;
+
+	slice->size = 0;
+	error = pool4db_foreach_mark_slice(slice->entry->mark, slice->proto,
+			compute_slice, slice, func, arg);
+	if (error == -ESRCH && !slice->size) {
+		log_debug("pool4 has no usable %s table for mark %u.",
+				l4proto_to_string(slice->proto),
+				slice->entry->mark);
+	}
+
+	return error;
+}
+
+struct slice_args {
+	struct slice slice;
+	/** Transport addresses of the slice that have been visited already. */
+	__u64 visited;
+	struct ipv4_transport_addr *result;
+};
+
+static int find_free(struct pool4_sample *sample, void *void_args)
+{
+	struct slice_args *args = void_args;
+	struct port_range range = sample->range;
+	__u64 remaining = args->slice.size - args->visited;
+	unsigned int count;
+	__u16 port;
+
+	count = port_range_count(&range);
+	if (count > remaining) {
+		count = remaining;
+		range.max = range.min + count - 1;
+	}
+	args->visited += count;
+
+	if (!bibdb_find_free4(args->slice.proto, &sample->addr, &range,
+			&port)) {
+		args->result->l3 = sample->addr;
+		args->result->l4 = port;
+		return 1;
+	}
+
+	/* Stop before leaking into the next subscriber's slice. */
+	return (args->visited < args->slice.size) ? 0 : -ESRCH;
+}
+
+/**
+ * Allocates a transport address for @tuple6 out of its subscriber's slice.
+ *
+ * Returns -ENOENT if @in's mark doesn't have a deterministic mapping, in which
+ * case the caller should fall back to the regular allocators.
+ *
+ * If the mark has a mapping but @tuple6's source is outside of it, the
+ * transport address is taken from the leftovers instead, so it doesn't eat
+ * into anyone's slice. (Otherwise detmap_test4() would name the wrong
+ * subscriber.) @deterministic tells the two cases apart.
+ */
+int detmap_allocate(struct packet *in, struct tuple *tuple6,
+		struct ipv4_transport_addr *result, bool *deterministic)
+{
+	struct deterministic_entry entry;
+	struct slice_args args;
+	int error;
+
+	if (list_empty(&mappings))
+		return -ENOENT;
+
+	error = get_entry(in->skb->mark, &entry);
+	if (error)
+		return error;
+
+	*deterministic = prefix6_contains(&entry.prefix6,
+			&tuple6->src.addr6.l3);
+
+	args.slice.entry = &entry;
+	args.slice.proto = tuple6->l4_proto;
+	args.slice.index = *deterministic
+			? get_index(&entry, &tuple6->src.addr6.l3)
+			: 0;
+	args.slice.leftover = !*deterministic;
+	args.visited = 0;
+	args.result = result;
+
+	error = foreach_slice(&args.slice, find_free, &args);
+	switch (error) {
+	case 1:
+		return 0;
+	case 0:
+	case -ESRCH:
+		if (*deterministic)
+			log_debug("%pI6c's deterministic slice is exhausted.",
+					&tuple6->src.addr6.l3);
+		else
+			log_debug("%pI6c is outside mark %u's deterministic mapping, and its leftovers are exhausted.",
+					&tuple6->src.addr6.l3, entry.mark);
+		return -ESRCH;
+	}
+
+	return error;
+}
+
+static int get_first(struct pool4_sample *sample, void *arg)
+{
+	struct ipv4_transport_addr *result = arg;
+
+	result->l3 = sample->addr;
+	result->l4 = sample->range.min;
+	return 1;
+}
+
+/**
+ * Fills the rest of @result, which describes @slice and starts at @first.
+ */
+static void describe(struct slice *slice, struct ipv4_transport_addr *first,
+		struct response_deterministic *result)
+{
+	get_subscriber(slice->entry, slice->index, &result->prefix6);
+	result->first = *first;
+	result->count = slice->size;
+}
+
+/**
+ * Computes the slice @addr (and the rest of its subscriber) is masked with.
+ */
+int detmap_test6(__u32 mark, l4_protocol proto, struct in6_addr *addr,
+		struct response_deterministic *result)
+{
+	struct deterministic_entry entry;
+	struct slice slice;
+	struct ipv4_transport_addr first;
+	int error;
+
+	error = get_entry(mark, &entry);
+	if (error) {
+		log_err("Mark %u doesn't have a deterministic mapping.", mark);
+		return -ESRCH;
+	}
+	if (!prefix6_contains(&entry.prefix6, addr)) {
+		log_err("%pI6c is not part of mark %u's deterministic mapping.",
+				addr, mark);
+		return -ESRCH;
+	}
+
+	slice.entry = &entry;
+	slice.proto = proto;
+	slice.index = get_index(&entry, addr);
+	slice.leftover = false;
+	error = foreach_slice(&slice, get_first, &first);
+	if (error != 1)
+		return (error < 0) ? error : -ESRCH;
+
+	describe(&slice, &first, result);
+	return 0;
+}
+
+struct position_args {
+	/** The slice is unknown; this is only used to compute its size. */
+	struct slice slice;
+	const struct ipv4_transport_addr *addr;
+	/** Transport addresses that precede the current sample. */
+	__u64 position;
+	/**
+	 * First transport address of the last slice that starts at or before
+	 * the current one.
+	 */
+	struct ipv4_transport_addr first;
+};
+
+/**
+ * Returns the position of the first transport address of the slice that
+ * contains the @position'th transport address.
+ */
+static __u64 slice_start(struct slice *slice, __u64 position)
+{
+	return div64_u64(position, slice->size) * slice->size;
+}
+
+static int find_position(struct pool4_sample *sample, void *void_args)
+{
+	struct position_args *args = void_args;
+	bool found;
+	__u64 last;
+	__u64 start;
+
+	found = args->addr->l3.s_addr == sample->addr.s_addr
+			&& port_range_contains(&sample->range, args->addr->l4);
+	/* Position of the last transport address we care about. */
+	last = found
+			? (args->position + args->addr->l4 - sample->range.min)
+			: (args->position + port_range_count(&sample->range)
+					- 1);
+
+	/* Remember the slice's beginning, in case it's in this sample. */
+	start = slice_start(&args->slice, last);
+	if (start >= args->position) {
+		args->first.l3 = sample->addr;
+		args->first.l4 = sample->range.min + (start - args->position);
+	}
+
+	if (found) {
+		args->position = last;
+		return 1;
+	}
+
+	args->position = last + 1;
+	return 0;
+}
+
+/**
+ * Computes the subscriber @addr belongs to. This is the reason why
+ * deterministic BIB entries don't need to be logged.
+ */
+int detmap_test4(__u32 mark, l4_protocol proto,
+		struct ipv4_transport_addr *addr,
+		struct response_deterministic *result)
+{
+	struct deterministic_entry entry;
+	struct position_args args;
+	int error;
+
+	error = get_entry(mark, &entry);
+	if (error) {
+		log_err("Mark %u doesn't have a deterministic mapping.", mark);
+		return -ESRCH;
+	}
+
+	/*
+	 * Find @addr and its slice's first transport address in one pass, so
+	 * they are computed out of the same pool4.
+	 */
+	args.slice.entry = &entry;
+	args.slice.proto = proto;
+	args.slice.index = 0;
+	args.slice.leftover = false;
+	args.addr = addr;
+	args.position = 0;
+	error = foreach_slice(&args.slice, find_position, &args);
+	if (error != 1) {
+		log_err("%pI4#%u is not part of pool4's mark %u.",
+				&addr->l3, addr->l4, mark);
+		return (error < 0) ? error : -ESRCH;
+	}
+
+	args.slice.index = div64_u64(args.position, args.slice.size);
+	if (args.slice.index >= args.slice.subscribers) {
+		log_err("%pI4#%u is a leftover; nobody owns it.",
+				&addr->l3, addr->l4);
+		return -ESRCH;
+	}
+
+	describe(&args.slice, &args.first, result);
+	return 0;
+}
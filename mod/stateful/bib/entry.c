@@ -1,6 +1,7 @@
 #include "nat64/mod/stateful/bib/entry.h"
 #include "nat64/mod/common/config.h"
 #include "nat64/common/str_utils.h"
+#include "nat64/mod/stateful/subscriber.h"
 
 /** Cache for struct bib_entrys, for efficient allocation. */
 static struct kmem_cache *entry_cache;
@@ -18,6 +19,8 @@ int bibentry_init(void)
 }
 void bibentry_destroy(void)
 {
+	/* Wait for the pending bibentry_free()s. */
+	rcu_barrier_bh();
 	kmem_cache_destroy(entry_cache);
 }
 
@@ -42,13 +45,26 @@ struct bib_entry *bibentry_create(const struct ipv4_transport_addr *addr4,
 
 	memcpy(result, &tmp, sizeof(tmp));
 	kref_init(&result->refcounter);
-	RB_CLEAR_NODE(&result->tree6_hook);
+	INIT_HLIST_NODE(&result->hash6_hook);
+	INIT_HLIST_NODE(&result->hash4_hook);
 	RB_CLEAR_NODE(&result->tree4_hook);
 	result->host4_addr = NULL;
+	result->subscriber = NULL;
+	result->block = NULL;
+	result->is_deterministic = false;
+	result->mark = 0;
+	result->mark_set = false;
 
 	return result;
 }
 
+static void bibentry_free(struct rcu_head *rcu)
+{
+	struct bib_entry *bib;
+	bib = container_of(rcu, struct bib_entry, rcu);
+	kmem_cache_free(entry_cache, bib);
+}
+
 /**
  * Roughly reverts the work of bib_create() by freeing "bib" from memory. What breaks the symmetry
  * is the return of "bib"'s IPv4 address to the IPv4 pool (the borrow doesn't happen in
@@ -57,10 +73,15 @@ struct bib_entry *bibentry_create(const struct ipv4_transport_addr *addr4,
  * This is intended to be used when you are the only user of "bib" (i.e. you just created it
  * and you haven't inserted it to any tables). If that might not be the case, use bib_return()
  * instead.
+ *
+ * The memory itself is released after a RCU-bh grace period, because lockless lookups might still
+ * be looking at "bib" if it was just removed from its table.
  */
 void bibentry_kfree(struct bib_entry *bib)
 {
-	kmem_cache_free(entry_cache, bib);
+	if (bib->subscriber)
+		subscriber_rm_bib(bib->subscriber, bib->block);
+	call_rcu_bh(&bib->rcu, bibentry_free);
 }
 
 /**
@@ -78,6 +99,17 @@ void bibentry_get(struct bib_entry *bib)
 	kref_get(&bib->refcounter);
 }
 
+/**
+ * Like bibentry_get(), except it fails if "bib" is already dying.
+ *
+ * Meant for lockless lookups, which might stumble upon entries whose last
+ * reference has already been dropped.
+ */
+bool bibentry_get_unless_zero(struct bib_entry *bib)
+{
+	return kref_get_unless_zero(&bib->refcounter);
+}
+
 /**
  * kref_put's function parameter cannot be NULL, so eh.
  */
@@ -111,6 +143,12 @@ void bibentry_log(const struct bib_entry *bib, const char *action)
 
 	if (!config_get_bib_logging())
 		return;
+	/* These are logged once per block. (See palloc_allocate_block().) */
+	if (bib->block)
+		return;
+	/* These can be computed later. (See detmap_test4().) */
+	if (bib->is_deterministic)
+		return;
 
 	do_gettimeofday(&tval);
 	time_to_tm(tval.tv_sec, 0, &t);
@@ -1,122 +1,377 @@
 #include "nat64/mod/stateful/bib/port_allocator.h"
 
-#include <crypto/md5.h>
-#include <linux/crypto.h>
+#include <linux/bitmap.h>
+#include <linux/cpumask.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/time.h>
+#include <linux/workqueue.h>
 #include "nat64/common/str_utils.h"
+#include "nat64/mod/common/address.h"
+#include "nat64/mod/common/config.h"
 #include "nat64/mod/stateful/bib/db.h"
 #include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/pool4/usage.h"
+#include "nat64/mod/stateful/subscriber.h"
 
-/* TODO (issue175) RFC 6056 wants us to change this from time to time. */
-static unsigned char *secret_key;
-static size_t secret_key_len;
+/**
+ * RFC 6056 wants the secret key of f() to be changed from time to time.
+ * A new key only changes the ports future connections start testing from;
+ * existing BIB entries are not affected.
+ */
+#define PALLOC_KEY_LIFETIME (60 * 60 * HZ)
+
+/** SipHash-2-4 key. */
+struct palloc_key {
+	__u64 k0;
+	__u64 k1;
+};
+
+/**
+ * Current key of f(). Readers only need RCU; the key is never modified, only
+ * replaced by @rotator.
+ */
+static struct palloc_key __rcu *secret_key;
+static struct delayed_work rotator;
 static atomic_t next_ephemeral;
 
-static struct crypto_hash *tfm;
-static DEFINE_SPINLOCK(tfm_lock);
+/** The reservation table has 2^RESERVATION_HASH_BITS buckets. */
+#define RESERVATION_HASH_BITS 8
+
+/**
+ * The ports of an IPv4 address that belong to port blocks (of one protocol).
+ * Exists while the address has at least one block.
+ */
+struct reservation {
+	struct in_addr addr;
+	l4_protocol proto;
+	/** Number of blocks reserved on the address. */
+	unsigned int blocks;
+	/** Chains the reservation to its bucket. */
+	struct hlist_node hook;
+	DECLARE_BITMAP(ports, 1 << 16);
+};
+
+static struct hlist_head reservations[1 << RESERVATION_HASH_BITS];
+static DEFINE_SPINLOCK(reservations_lock);
+
+static struct palloc_key *create_key(void)
+{
+	struct palloc_key *key;
+
+	key = kmalloc(sizeof(*key), GFP_KERNEL);
+	if (key)
+		get_random_bytes(key, sizeof(*key));
+	return key;
+}
+
+static void rotate_key(struct work_struct *work)
+{
+	struct palloc_key *new;
+	struct palloc_key *old;
+
+	new = create_key();
+	if (new) {
+		/* The rotator is the only writer once palloc_init() is done. */
+		old = rcu_dereference_protected(secret_key, true);
+		rcu_assign_pointer(secret_key, new);
+		/* Only this work item waits; packets keep using the old key. */
+		synchronize_rcu_bh();
+		kfree(old);
+	} else {
+		log_debug("Could not allocate a new port allocator key. "
+				"Will keep the old one for now.");
+	}
+
+	schedule_delayed_work(&rotator, PALLOC_KEY_LIFETIME);
+}
 
 int palloc_init(void)
 {
+	struct palloc_key *key;
 	unsigned int tmp;
-	int error;
-
-	/* Secret key stuff */
-	secret_key_len = PAGE_SIZE;
-	if (secret_key_len > 128)
-		secret_key_len = 128;
 
-	secret_key = kmalloc(secret_key_len, GFP_KERNEL);
-	if (!secret_key)
+	key = create_key();
+	if (!key)
 		return -ENOMEM;
-	get_random_bytes(secret_key, secret_key_len);
+	RCU_INIT_POINTER(secret_key, key);
 
-	/* Next ephemeral stuff */
 	get_random_bytes(&tmp, sizeof(tmp));
 	atomic_set(&next_ephemeral, tmp);
 
-	/* TFC stuff */
-	tfm = crypto_alloc_hash("md5", 0, CRYPTO_ALG_ASYNC);
-	if (IS_ERR(tfm)) {
-		error = PTR_ERR(tfm);
-		log_warn_once("Failed to load transform for MD5; errcode %d",
-				error);
-		kfree(secret_key);
-		return error;
-	}
-
+	INIT_DELAYED_WORK(&rotator, rotate_key);
+	schedule_delayed_work(&rotator, PALLOC_KEY_LIFETIME);
 	return 0;
 }
 
 void palloc_destroy(void)
 {
-	crypto_free_hash(tfm);
-	kfree(secret_key);
+	cancel_delayed_work_sync(&rotator);
+	kfree(rcu_dereference_protected(secret_key, true));
+}
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+		v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+		v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+	} while (0)
+
+/**
+ * SipHash-2-4 (Aumasson and Bernstein) of the "len" bytes "data" points to.
+ * It only touches the stack, so any number of CPUs can run it at the same time.
+ */
+static __u64 siphash24(const __u8 *data, size_t len,
+		const struct palloc_key *key)
+{
+	__u64 v0 = key->k0 ^ 0x736f6d6570736575ULL;
+	__u64 v1 = key->k1 ^ 0x646f72616e646f6dULL;
+	__u64 v2 = key->k0 ^ 0x6c7967656e657261ULL;
+	__u64 v3 = key->k1 ^ 0x7465646279746573ULL;
+	__u64 b = ((__u64)len) << 56;
+	__u64 m;
+	__le64 word;
+	size_t i;
+
+	for (; len >= 8; len -= 8, data += 8) {
+		memcpy(&word, data, sizeof(word));
+		m = le64_to_cpu(word);
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	for (i = 0; i < len; i++)
+		b |= ((__u64)data[i]) << (8 * i);
+
+	v3 ^= b;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
 }
 
-static int f(const struct in6_addr *local_ip, const struct in6_addr *remote_ip,
+static void f(const struct in6_addr *local_ip, const struct in6_addr *remote_ip,
 		__u16 remote_port, unsigned int *result)
 {
-	/*
-	 * See http://stackoverflow.com/questions/3869028.
-	 * user502515, nanoship and noaccount are the good ones.
-	 */
+	struct {
+		struct in6_addr local_ip;
+		struct in6_addr remote_ip;
+		__u16 remote_port;
+	} __packed input;
 
-	union {
-		__be32 as32[4];
-		__u8 as8[16];
-	} md5_result;
-	struct scatterlist sg[4];
-	unsigned int len;
-	struct hash_desc desc;
-	int error;
+	input.local_ip = *local_ip;
+	input.remote_ip = *remote_ip;
+	input.remote_port = remote_port;
 
-	sg_init_table(sg, ARRAY_SIZE(sg));
-	sg_set_buf(&sg[0], local_ip, sizeof(*local_ip));
-	sg_set_buf(&sg[1], remote_ip, sizeof(*remote_ip));
-	sg_set_buf(&sg[2], &remote_port, sizeof(remote_port));
-	sg_set_buf(&sg[3], secret_key, secret_key_len);
-	len = sizeof(*local_ip) + sizeof(*remote_ip) + sizeof(remote_port) +
-			secret_key_len;
-	desc.tfm = tfm;
-	desc.flags = 0;
+	rcu_read_lock_bh();
+	*result = siphash24((__u8 *)&input, sizeof(input),
+			rcu_dereference_bh(secret_key));
+	rcu_read_unlock_bh();
+}
 
-	spin_lock_bh(&tfm_lock);
+/**
+ * Number of free ports palloc_allocate() is willing to test before it gives up
+ * on RSS affinity.
+ */
+#define RSS_MAX_CANDIDATES 256
 
-	error = crypto_hash_init(&desc);
-	if (error) {
-		log_debug("crypto_hash_init() failed. Errcode: %d", error);
-		goto unlock;
-	}
-	error = crypto_hash_digest(&desc, sg, len, md5_result.as8);
-	if (error) {
-		log_debug("crypto_hash_digest() failed. Errcode: %d", error);
-		goto unlock;
-	}
+/**
+ * Returns the 32 bits of @key that start at bit number @bit.
+ */
+static __u32 toeplitz_window(const __u8 *key, unsigned int bit)
+{
+	const __u8 *k = &key[bit / 8];
+	__u64 bits;
 
-	*result = md5_result.as32[3];
-	/* Fall through. */
+	bits = ((__u64)k[0] << 32) | ((__u64)k[1] << 24) | ((__u64)k[2] << 16)
+			| ((__u64)k[3] << 8) | (__u64)k[4];
+	return bits >> (8 - (bit % 8));
+}
 
-unlock:
-	spin_unlock_bh(&tfm_lock);
-	return error;
+/**
+ * Toeplitz hash of @len bytes of input, which start @offset bytes into the
+ * hashed tuple.
+ *
+ * The hash is linear (with XOR), so the hash of the tuple is the XOR of the
+ * hashes of its fields. This lets the port allocator reuse the fields that do
+ * not change between candidates.
+ */
+static __u32 toeplitz(const __u8 *key, const void *data, unsigned int len,
+		unsigned int offset)
+{
+	const __u8 *bytes = data;
+	__u32 result = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < len; i++)
+		for (j = 0; j < 8; j++)
+			if (bytes[i] & (0x80 >> j))
+				result ^= toeplitz_window(key,
+						8 * (offset + i) + j);
+
+	return result;
+}
+
+/**
+ * State of an RSS-affine allocation.
+ * The IPv4 tuple the NIC hashes is (source address, destination address,
+ * source port, destination port). In the return traffic of the connection, the
+ * source is the remote node and the destination is our pool4 candidate.
+ */
+struct rss_args {
+	struct rss_config cfg;
+	/** Queue the IPv6 packet was received from. */
+	unsigned int target;
+	/** Queues the NIC is assumed to have, if @cfg has no indirection. */
+	unsigned int queues;
+	/** Hash of the remote transport address. */
+	__u32 remote_hash;
+	/** Free ports tested so far. */
+	unsigned int candidates;
+	/** First free transport address found, in case none of them fit. */
+	struct ipv4_transport_addr fallback;
+	bool fallback_set;
+};
+
+static unsigned int rss_queue(struct rss_args *rss, __u32 hash)
+{
+	if (rss->cfg.indir_len)
+		return rss->cfg.indir[hash % rss->cfg.indir_len];
+	return (hash % RSS_INDIR_MAX) % rss->queues;
+}
+
+static void rss_init(struct rss_args *rss, struct packet *in_pkt,
+		const struct tuple *tuple6, struct in_addr *daddr)
+{
+	struct sk_buff *skb = in_pkt->skb;
+	__be16 remote_port = cpu_to_be16(tuple6->dst.addr6.l4);
+
+	config_get_rss(&rss->cfg);
+	/* Queues and CPUs usually map one to one; assume so if unrecorded. */
+	rss->target = skb_rx_queue_recorded(skb)
+			? skb_get_rx_queue(skb)
+			: raw_smp_processor_id();
+	rss->queues = num_online_cpus();
+	rss->remote_hash = toeplitz(rss->cfg.key, daddr, 4, 0)
+			^ toeplitz(rss->cfg.key, &remote_port, 2, 8);
+	rss->candidates = 0;
+	rss->fallback_set = false;
+}
+
+/**
+ * Looks for a free port in @sample whose return traffic would land on
+ * @rss->target. Returns 0 on success, -ESRCH if there's none and -EAGAIN if
+ * the allocator should stop looking.
+ */
+static int choose_rss_port(struct rss_args *rss, l4_protocol proto,
+		struct pool4_sample *sample, __u16 *result)
+{
+	struct port_range range = sample->range;
+	__u32 addr_hash;
+	__u32 hash;
+	__be16 port;
+
+	addr_hash = rss->remote_hash
+			^ toeplitz(rss->cfg.key, &sample->addr, 4, 4);
+
+	while (!bibdb_find_free4(proto, &sample->addr, &range, result)) {
+		if (!rss->fallback_set) {
+			rss->fallback.l3 = sample->addr;
+			rss->fallback.l4 = *result;
+			rss->fallback_set = true;
+		}
+
+		port = cpu_to_be16(*result);
+		hash = addr_hash ^ toeplitz(rss->cfg.key, &port, 2, 10);
+		if (rss_queue(rss, hash) == rss->target)
+			return 0;
+
+		if (++rss->candidates >= RSS_MAX_CANDIDATES)
+			return -EAGAIN;
+		if (*result == range.max)
+			break;
+		range.min = *result + 1;
+	}
+
+	return -ESRCH;
 }
 
 struct iteration_args {
 	l4_protocol proto;
 	struct ipv4_transport_addr *result;
+	/** Number of transport addresses visited so far. */
+	unsigned int visited;
+	/** NULL if the allocation is not RSS-affine. */
+	struct rss_args *rss;
 };
 
-static int choose_port(struct ipv4_transport_addr *addr, void *void_args)
+static int choose_port(struct pool4_sample *sample, void *void_args)
 {
 	struct iteration_args *args = void_args;
+	__u16 port;
+	int error;
 
-	atomic_inc(&next_ephemeral);
+	if (args->rss) {
+		error = choose_rss_port(args->rss, args->proto, sample, &port);
+		if (error == -EAGAIN)
+			return error;
+	} else {
+		/*
+		 * The BIB knows which ports are taken; no need to test them one
+		 * by one.
+		 */
+		error = bibdb_find_free4(args->proto, &sample->addr,
+				&sample->range, &port);
+	}
 
-	if (!bibdb_contains4(addr, args->proto)) {
-		*(args->result) = *addr;
-		return 1; /* positive = break iteration, no error. */
+	if (error) {
+		args->visited += port_range_count(&sample->range);
+		return 0; /* Keep looking */
 	}
 
-	return 0; /* Keep looking */
+	args->visited += port - sample->range.min + 1U;
+	args->result->l3 = sample->addr;
+	args->result->l4 = port;
+	return 1; /* positive = break iteration, no error. */
+}
+
+/**
+ * Converts the result of a failed pool4 iteration into palloc_allocate()'s
+ * error code.
+ */
+static int handle_failure(struct packet *in_pkt, const struct tuple *tuple6,
+		int error)
+{
+	if (error == -ESRCH) {
+		/*
+		 * Assume the user doesn't need this mark/protocol.
+		 * From our point of view, this is completely normal.
+		 */
+		log_debug("There are no pool4 entries for %s packets with mark "
+				"%u.", l4proto_to_string(tuple6->l4_proto),
+				in_pkt->skb->mark);
+		return -ESRCH;
+	}
+	if (error == 0) {
+		log_warn_once("pool4 is exhausted! There are no transport "
+				"addresses left for %s packets with mark %u.",
+				l4proto_to_string(tuple6->l4_proto),
+				in_pkt->skb->mark);
+		return -ESRCH;
+	}
+
+	return error;
 }
 
 /**
@@ -126,40 +381,258 @@ int palloc_allocate(struct packet *in_pkt, const struct tuple *tuple6,
 		struct in_addr *daddr, struct ipv4_transport_addr *result)
 {
 	struct iteration_args args;
+	struct rss_args rss;
 	unsigned int offset;
+	__u32 mark = in_pkt->skb->mark;
+	unsigned long epoch = 0;
+	bool fail_fast;
 	int error;
 
-	error = f(&tuple6->src.addr6.l3, &tuple6->dst.addr6.l3,
-			tuple6->dst.addr6.l4, &offset);
-	if (error)
-		return error;
+	/*
+	 * The empty pool4 depends on the packet's destination, so its
+	 * exhaustion cannot be remembered.
+	 */
+	fail_fast = !pool4db_is_empty();
+	if (fail_fast) {
+		if (pool4usage_is_exhausted(mark, tuple6->l4_proto))
+			return handle_failure(in_pkt, tuple6, 0);
+		epoch = pool4usage_epoch(tuple6->l4_proto);
+	}
+
+	f(&tuple6->src.addr6.l3, &tuple6->dst.addr6.l3, tuple6->dst.addr6.l4,
+			&offset);
 
 	args.proto = tuple6->l4_proto;
 	args.result = result;
+	args.visited = 0;
+	args.rss = NULL;
+	/* NICs only hash the ports of TCP and UDP. */
+	if (tuple6->l4_proto != L4PROTO_ICMP && config_get_rss_affinity()) {
+		rss_init(&rss, in_pkt, tuple6, daddr);
+		args.rss = &rss;
+	}
 
-	error = pool4db_foreach_taddr4(in_pkt, tuple6->l4_proto, daddr,
+	error = pool4db_foreach_range(in_pkt, tuple6->l4_proto, daddr,
 			choose_port, &args,
 			offset + atomic_read(&next_ephemeral));
+	/* Same as incrementing next_ephemeral once per candidate tested. */
+	atomic_add(args.visited, &next_ephemeral);
 
 	if (error == 1)
 		return 0;
-	if (error == -ESRCH) {
-		/*
-		 * Assume the user doesn't need this mark/protocol.
-		 * From our point of view, this is completely normal.
-		 */
-		log_debug("There are no pool4 entries for %s packets with mark "
-				"%u.", l4proto_to_string(tuple6->l4_proto),
-				in_pkt->skb->mark);
-		return -ESRCH;
+	/* No port fits the queue; settle for any free one. */
+	if ((error == 0 || error == -EAGAIN) && args.rss
+			&& rss.fallback_set) {
+		*result = rss.fallback;
+		return 0;
 	}
-	if (error == 0) {
-		log_warn_once("pool4 is exhausted! There are no transport "
-				"addresses left for %s packets with mark %u.",
-				l4proto_to_string(tuple6->l4_proto),
-				in_pkt->skb->mark);
-		return -ESRCH;
+	/* Visited everything and found nothing; skip the scan next time. */
+	if (error == 0 && fail_fast)
+		pool4usage_set_exhausted(mark, tuple6->l4_proto, epoch);
+	return handle_failure(in_pkt, tuple6, error);
+}
+
+/**
+ * Spinlock must be held.
+ */
+static struct reservation *find_reservation(const struct in_addr *addr,
+		l4_protocol proto)
+{
+	struct reservation *reservation;
+	struct hlist_node *node;
+	struct hlist_head *bucket;
+
+	bucket = &reservations[hash_32((__force __u32)addr->s_addr ^ proto,
+			RESERVATION_HASH_BITS)];
+	hlist_for_each(node, bucket) {
+		reservation = hlist_entry(node, struct reservation, hook);
+		if (reservation->proto == proto
+				&& addr4_equals(&reservation->addr, addr))
+			return reservation;
+	}
+
+	return NULL;
+}
+
+/**
+ * Spinlock must be held.
+ */
+static int reserve(struct reservation *reservation, const struct in_addr *addr,
+		l4_protocol proto, const struct port_range *range)
+{
+	if (!reservation) {
+		reservation = kzalloc(sizeof(*reservation), GFP_ATOMIC);
+		if (!reservation)
+			return -ENOMEM;
+		reservation->addr = *addr;
+		reservation->proto = proto;
+		hlist_add_head(&reservation->hook, &reservations[hash_32(
+				(__force __u32)addr->s_addr ^ proto,
+				RESERVATION_HASH_BITS)]);
+	}
+
+	bitmap_set(reservation->ports, range->min, port_range_count(range));
+	reservation->blocks++;
+	return 0;
+}
+
+struct block_args {
+	l4_protocol proto;
+	unsigned int size;
+	/** Only reserve on this address. NULL means anywhere. */
+	const struct in_addr *addr;
+	/** The reserved block will be described here. */
+	struct port_block *block;
+	/** A free port from @block. */
+	__u16 port;
+};
+
+static int choose_block(struct pool4_sample *sample, void *void_args)
+{
+	struct block_args *args = void_args;
+	struct reservation *reservation;
+	struct port_range range;
+	unsigned int start;
+	int error = 0;
+
+	if (args->addr && !addr4_equals(args->addr, &sample->addr))
+		return 0; /* Keep looking */
+
+	spin_lock_bh(&reservations_lock);
+	reservation = find_reservation(&sample->addr, args->proto);
+
+	for (start = sample->range.min - (sample->range.min % args->size);
+			start <= sample->range.max;
+			start += args->size) {
+		range.min = max_t(unsigned int, start, sample->range.min);
+		range.max = min_t(unsigned int, start + args->size - 1,
+				sample->range.max);
+
+		/* Some other subscriber's? */
+		if (reservation && find_next_bit(reservation->ports,
+				range.max + 1, range.min) <= range.max)
+			continue;
+		/* Taken by static or pre-block entries? */
+		if (bibdb_find_free4(args->proto, &sample->addr, &range,
+				&args->port))
+			continue;
+
+		error = reserve(reservation, &sample->addr, args->proto,
+				&range);
+		if (!error) {
+			args->block->addr = sample->addr;
+			args->block->range = range;
+			error = 1; /* positive = break iteration, no error. */
+		}
+		break;
 	}
 
+	spin_unlock_bh(&reservations_lock);
 	return error;
 }
+
+static void log_block(struct port_block *block, const char *action)
+{
+	struct timeval tval;
+	struct tm t;
+
+	if (!config_get_bib_logging())
+		return;
+
+	do_gettimeofday(&tval);
+	time_to_tm(tval.tv_sec, 0, &t);
+	log_info("%ld/%d/%d %d:%d:%d (GMT) - %s %pI4#%u-%u (%s) for %pI6c/%u",
+			1900 + t.tm_year, t.tm_mon + 1, t.tm_mday,
+			t.tm_hour, t.tm_min, t.tm_sec, action,
+			&block->addr, block->range.min, block->range.max,
+			l4proto_to_string(block->proto),
+			&block->owner->prefix.address, block->owner->prefix.len);
+}
+
+/**
+ * Port-block version of palloc_allocate(). Takes the port out of one of "sub"'s
+ * blocks, and reserves a new block of "block_size" ports (on the same address,
+ * if possible) when they are full.
+ *
+ * "block" will point to the block the port was taken from. The port is charged
+ * to it; hand it back through subscriber_rm_bib() (bibentry_kfree() does it for
+ * you once you've assigned the block to the BIB entry).
+ */
+int palloc_allocate_block(struct packet *in_pkt, const struct tuple *tuple6,
+		struct in_addr *daddr, struct subscriber *sub,
+		unsigned int block_size, struct ipv4_transport_addr *result,
+		struct port_block **block)
+{
+	struct block_args args;
+	struct port_block *new;
+	struct in_addr hint;
+	__u32 mark = in_pkt->skb->mark;
+	int error;
+
+	error = subscriber_take_port(sub, tuple6->l4_proto, mark, result, block,
+			&hint);
+	if (error != -ESRCH)
+		return error;
+
+	new = kmalloc(sizeof(*new), GFP_ATOMIC);
+	if (!new)
+		return -ENOMEM;
+
+	args.proto = tuple6->l4_proto;
+	args.size = block_size;
+	args.addr = hint.s_addr ? &hint : NULL;
+	args.block = new;
+
+	/* Not worth randomizing; blocks are reserved rarely and first-fit. */
+	error = pool4db_foreach_range(in_pkt, args.proto, daddr, choose_block,
+			&args, 0);
+	if (error == 0 && args.addr) {
+		/* The subscriber's address is full; settle for another one. */
+		args.addr = NULL;
+		error = pool4db_foreach_range(in_pkt, args.proto, daddr,
+				choose_block, &args, 0);
+	}
+	if (error != 1) {
+		kfree(new);
+		return handle_failure(in_pkt, tuple6, error);
+	}
+
+	new->proto = args.proto;
+	new->mark = mark;
+	new->owner = sub;
+	new->refs = 1;
+	subscriber_add_block(sub, new);
+	log_block(new, "Reserved");
+
+	result->l3 = new->addr;
+	result->l4 = args.port;
+	*block = new;
+	return 0;
+}
+
+/**
+ * Returns "block"'s ports to pool4, and frees it. "block" must not be part of
+ * its subscriber anymore.
+ */
+void palloc_release_block(struct port_block *block)
+{
+	struct reservation *reservation;
+
+	spin_lock_bh(&reservations_lock);
+
+	reservation = find_reservation(&block->addr, block->proto);
+	if (!WARN(!reservation, "Port block %pI4#%u-%u has no reservation.",
+			&block->addr, block->range.min, block->range.max)) {
+		bitmap_clear(reservation->ports, block->range.min,
+				port_range_count(&block->range));
+		if (--reservation->blocks == 0) {
+			hlist_del(&reservation->hook);
+			kfree(reservation);
+		}
+	}
+
+	spin_unlock_bh(&reservations_lock);
+
+	log_block(block, "Released");
+	kfree(block);
+}
@@ -62,7 +62,7 @@ int add_static_route(struct request_bib *request)
 		return -ENOMEM;
 	}
 
-	error = bibdb_add(bib);
+	error = bibdb_add(bib, NULL);
 	if (error) {
 		log_err("The BIB entry could not be added to the database, "
 				"despite validations. This can happen if a "
@@ -1,29 +1,564 @@
 #include "nat64/mod/stateful/bib/table.h"
+#include <linux/bitops.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 #include <net/ipv6.h>
+#include "nat64/mod/common/address.h"
 #include "nat64/mod/common/rbtree.h"
+#include "nat64/mod/common/rcu.h"
 #include "nat64/mod/stateful/bib/port_allocator.h"
+#include "nat64/mod/stateful/pool4/usage.h"
 
+#define PORTS_PER_ADDR (1 << 16)
+/**
+ * Port usage bitmaps are allocated in pieces of this many ports (128 bytes),
+ * so they never need high-order atomic allocations.
+ */
+#define PORTS_PER_CHUNK 1024
+#define CHUNKS_PER_ADDR (PORTS_PER_ADDR / PORTS_PER_CHUNK)
+/** Initial size of the hash indexes, in bits. */
+#define HASH_MIN_BITS 6
+/** Hash indexes will not grow beyond this size (in bits). */
+#define HASH_MAX_BITS 20
+/** Number of buckets a resize migrates before releasing the lock. */
+#define HASH_MIGRATE_BATCH 64
+
+/** A piece of a port_usage's bitmap. */
+struct port_chunk {
+	/** Number of bits set in @ports. */
+	unsigned int used;
+	DECLARE_BITMAP(ports, PORTS_PER_CHUNK);
+};
+
+/**
+ * The ports of an IPv4 address that are taken by some BIB entry.
+ *
+ * The BIB keeps these in sync with tree4 (they are updated under the same
+ * spinlock), so the port allocator can find the free ports of a pool4 range
+ * by scanning a bitmap instead of querying the tree once per port.
+ *
+ * The bitmap is split in PORTS_PER_CHUNK-sized chunks, and only the chunks that
+ * contain taken ports are allocated. Neither the usage nor its chunks exist
+ * while they have no entries.
+ */
+struct port_usage {
+	struct in_addr addr;
+	/** Number of bits set in @chunks. */
+	unsigned int used;
+	/** Links this to its bucket in bib_table.usage. */
+	struct hlist_node hook;
+	/** Chunk n holds ports [n * PORTS_PER_CHUNK, (n + 1) * PORTS_PER_CHUNK). */
+	struct port_chunk *chunks[CHUNKS_PER_ADDR];
+};
+
+static u32 hash6(struct bib_table *table,
+		const struct ipv6_transport_addr *addr)
+{
+	return jhash_1word(addr->l4, jhash2(addr->l3.s6_addr32, 4,
+			table->hash_seed));
+}
+
+static u32 hash4(struct bib_table *table,
+		const struct ipv4_transport_addr *addr)
+{
+	return jhash_2words((__force u32)addr->l3.s_addr, addr->l4,
+			table->hash_seed);
+}
+
+static struct hlist_head *get_bucket(struct bib_buckets *buckets, u32 hash)
+{
+	return &buckets->heads[hash & ((1 << buckets->bits) - 1)];
+}
+
+static struct bib_buckets *alloc_buckets(unsigned int bits)
+{
+	struct bib_buckets *result;
+	size_t size;
+	unsigned int i;
+
+	size = sizeof(*result) + (sizeof(result->heads[0]) << bits);
+	if (size <= PAGE_SIZE)
+		result = kmalloc(size, GFP_KERNEL);
+	else
+		result = vmalloc(size);
+	if (!result)
+		return NULL;
+
+	result->bits = bits;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&result->heads[i]);
+
+	return result;
+}
+
+static void free_buckets(struct bib_buckets *buckets)
+{
+	if (is_vmalloc_addr(buckets))
+		vfree(buckets);
+	else
+		kfree(buckets);
+}
+
+static int hash_init(struct bib_hash *hash)
+{
+	struct bib_buckets *buckets;
+
+	buckets = alloc_buckets(HASH_MIN_BITS);
+	if (!buckets)
+		return -ENOMEM;
+
+	RCU_INIT_POINTER(hash->buckets, buckets);
+	RCU_INIT_POINTER(hash->old, NULL);
+	seqcount_init(&hash->seq);
+	return 0;
+}
+
+/**
+ * Doesn't care about RCU; nobody else can be reading @hash anymore.
+ */
+static void hash_destroy(struct bib_hash *hash)
+{
+	struct bib_buckets *buckets;
+
+	buckets = rcu_dereference_raw(hash->buckets);
+	if (buckets)
+		free_buckets(buckets);
+	RCU_INIT_POINTER(hash->buckets, NULL);
+	/* Resizes finish before the table is destroyed; this is paranoia. */
+	buckets = rcu_dereference_raw(hash->old);
+	if (buckets)
+		free_buckets(buckets);
+	RCU_INIT_POINTER(hash->old, NULL);
+}
+
+/**
+ * Spinlock must be held.
+ */
+static struct bib_buckets *get_buckets(struct bib_table *table,
+		struct bib_hash *hash)
+{
+	return rcu_dereference_protected(hash->buckets,
+			lockdep_is_held(&table->lock));
+}
+
+/**
+ * Returns the size (in bits) a hash index needs to hold @count entries
+ * without getting crowded.
+ */
+static unsigned int fit_bits(u64 count)
+{
+	unsigned int bits = HASH_MIN_BITS;
+
+	while (bits < HASH_MAX_BITS && count > (2ULL << bits))
+		bits++;
+
+	return bits;
+}
+
+/**
+ * Moves the entries from @old's buckets [@first, @last) to @new.
+ *
+ * Spinlock must be held.
+ */
+static void migrate_buckets(struct bib_table *table, struct bib_buckets *old,
+		struct bib_buckets *new, bool is6, unsigned int first,
+		unsigned int last)
+{
+	struct bib_entry *bib;
+	struct hlist_node *node, *tmp;
+	unsigned int i;
+
+	for (i = first; i < last; i++) {
+		hlist_for_each_safe(node, tmp, &old->heads[i]) {
+			hlist_del_rcu(node);
+			if (is6) {
+				bib = hlist_entry(node, struct bib_entry,
+						hash6_hook);
+				hlist_add_head_rcu(node, get_bucket(new,
+						hash6(table, &bib->ipv6)));
+			} else {
+				bib = hlist_entry(node, struct bib_entry,
+						hash4_hook);
+				hlist_add_head_rcu(node, get_bucket(new,
+						hash4(table, &bib->ipv4)));
+			}
+		}
+	}
+}
+
+/**
+ * Moves @hash's entries to a bucket array of 2^@bits buckets.
+ *
+ * The new array is published right away, (so new entries go there) and the
+ * old entries are migrated HASH_MIGRATE_BATCH buckets at a time, releasing
+ * the spinlock in between. Lookups query both arrays meanwhile.
+ *
+ * Lookups that happen while a batch is being moved might get lost as their
+ * entries change buckets; that's what @hash->seq is for.
+ *
+ * @table->resize_lock must be held.
+ */
+static int grow_hash(struct bib_table *table, struct bib_hash *hash, bool is6,
+		unsigned int bits)
+{
+	struct bib_buckets *old, *new;
+	unsigned int i;
+
+	new = alloc_buckets(bits);
+	if (!new) {
+		log_debug("Could not allocate a bigger BIB hash index.");
+		return -ENOMEM;
+	}
+
+	spin_lock_bh(&table->lock);
+	old = get_buckets(table, hash);
+	write_seqcount_begin(&hash->seq);
+	rcu_assign_pointer(hash->old, old);
+	rcu_assign_pointer(hash->buckets, new);
+	write_seqcount_end(&hash->seq);
+	spin_unlock_bh(&table->lock);
+
+	for (i = 0; i < (1 << old->bits); i += HASH_MIGRATE_BATCH) {
+		spin_lock_bh(&table->lock);
+		write_seqcount_begin(&hash->seq);
+		migrate_buckets(table, old, new, is6, i,
+				min(i + HASH_MIGRATE_BATCH, 1U << old->bits));
+		write_seqcount_end(&hash->seq);
+		spin_unlock_bh(&table->lock);
+		cond_resched();
+	}
+
+	spin_lock_bh(&table->lock);
+	write_seqcount_begin(&hash->seq);
+	RCU_INIT_POINTER(hash->old, NULL);
+	write_seqcount_end(&hash->seq);
+	spin_unlock_bh(&table->lock);
+
+	synchronize_rcu_bh();
+	free_buckets(old);
+	return 0;
+}
+
+/**
+ * Grows both hash indexes (if needed) so they can hold @extra more entries
+ * than @table currently has without getting crowded.
+ *
+ * @table->resize_lock must be held.
+ */
+static int reserve_hashes(struct bib_table *table, u64 extra)
+{
+	unsigned int bits6, bits4, new_bits;
+	int error;
+
+	spin_lock_bh(&table->lock);
+	bits6 = get_buckets(table, &table->hash6)->bits;
+	bits4 = get_buckets(table, &table->hash4)->bits;
+	new_bits = fit_bits(table->count + extra);
+	spin_unlock_bh(&table->lock);
+
+	if (new_bits > bits6) {
+		error = grow_hash(table, &table->hash6, true, new_bits);
+		if (error)
+			return error;
+	}
+	if (new_bits > bits4)
+		return grow_hash(table, &table->hash4, false, new_bits);
+
+	return 0;
+}
+
+static void resize_hashes(struct work_struct *work)
+{
+	struct bib_table *table;
+
+	table = container_of(work, struct bib_table, resizer);
+
+	mutex_lock(&table->resize_lock);
+	reserve_hashes(table, 0);
+	mutex_unlock(&table->resize_lock);
+}
 
-void bibtable_init(struct bib_table *table)
+static bool is_crowded(struct bib_buckets *buckets, u64 count)
 {
-	table->tree6 = RB_ROOT;
+	return buckets->bits < HASH_MAX_BITS && count > (2ULL << buckets->bits);
+}
+
+/**
+ * Requests a resize if the hash indexes have too many entries.
+ *
+ * Spinlock must be held.
+ */
+static void maybe_resize(struct bib_table *table)
+{
+	if (is_crowded(get_buckets(table, &table->hash6), table->count)
+			|| is_crowded(get_buckets(table, &table->hash4),
+					table->count))
+		schedule_work(&table->resizer);
+}
+
+/**
+ * Adds @bib to the hash indexes.
+ *
+ * Spinlock must be held.
+ */
+static void hash_add(struct bib_table *table, struct bib_entry *bib)
+{
+	hlist_add_head_rcu(&bib->hash6_hook,
+			get_bucket(get_buckets(table, &table->hash6),
+					hash6(table, &bib->ipv6)));
+	hlist_add_head_rcu(&bib->hash4_hook,
+			get_bucket(get_buckets(table, &table->hash4),
+					hash4(table, &bib->ipv4)));
+}
+
+static void usage_kfree(struct port_usage *usage)
+{
+	unsigned int i;
+
+	for (i = 0; i < CHUNKS_PER_ADDR; i++)
+		kfree(usage->chunks[i]);
+	kfree(usage);
+}
+
+int bibtable_init(struct bib_table *table)
+{
+	unsigned int i;
+
+	memset(table, 0, sizeof(*table));
+
+	if (hash_init(&table->hash6) || hash_init(&table->hash4)) {
+		hash_destroy(&table->hash6);
+		hash_destroy(&table->hash4);
+		log_err("Could not allocate the BIB hash indexes.");
+		return -ENOMEM;
+	}
+
 	table->tree4 = RB_ROOT;
 	table->count = 0;
+	for (i = 0; i < BIB_USAGE_SLOTS; i++)
+		INIT_HLIST_HEAD(&table->usage[i]);
 	spin_lock_init(&table->lock);
+	get_random_bytes(&table->hash_seed, sizeof(table->hash_seed));
+	INIT_WORK(&table->resizer, resize_hashes);
+	mutex_init(&table->resize_lock);
+	return 0;
 }
 
 static void destroy_aux(struct rb_node *node)
 {
-	bibentry_kfree(rb_entry(node, struct bib_entry, tree6_hook));
+	bibentry_kfree(rb_entry(node, struct bib_entry, tree4_hook));
 }
 
 void bibtable_destroy(struct bib_table *table)
 {
+	struct hlist_node *node, *tmp;
+	unsigned int i;
+
+	cancel_work_sync(&table->resizer);
+
 	/*
-	 * The values need to be released only in one of the trees
-	 * because both trees point to the same values.
+	 * Every entry is in the tree, so it's the only index that needs to be
+	 * walked. The hashes point to the same values.
 	 */
-	rbtree_clear(&table->tree6, destroy_aux);
+	rbtree_clear(&table->tree4, destroy_aux);
+	hash_destroy(&table->hash6);
+	hash_destroy(&table->hash4);
+
+	for (i = 0; i < BIB_USAGE_SLOTS; i++) {
+		hlist_for_each_safe(node, tmp, &table->usage[i]) {
+			hlist_del(node);
+			usage_kfree(hlist_entry(node, struct port_usage, hook));
+		}
+	}
+}
+
+static struct hlist_head *usage_slot(struct bib_table *table,
+		const struct in_addr *addr)
+{
+	return &table->usage[hash_32((__force __u32)addr->s_addr,
+			BIB_USAGE_BITS)];
+}
+
+/**
+ * Spinlock must be held.
+ */
+static struct port_usage *find_usage(struct bib_table *table,
+		const struct in_addr *addr)
+{
+	struct port_usage *usage;
+	struct hlist_node *node;
+
+	hlist_for_each(node, usage_slot(table, addr)) {
+		usage = hlist_entry(node, struct port_usage, hook);
+		if (addr4_equals(&usage->addr, addr))
+			return usage;
+	}
+
+	return NULL;
+}
+
+/**
+ * Records that @bib's IPv4 transport address is taken.
+ * Also charges it to its pool4 table, if it knows which one it is.
+ *
+ * Spinlock must be held.
+ */
+static int mark_used(struct bib_table *table, struct bib_entry *bib)
+{
+	struct port_usage *usage;
+	struct port_chunk **chunk;
+	bool new_usage = false;
+	int error;
+
+	if (bib->mark_set) {
+		error = pool4usage_charge(bib->mark, bib->l4_proto,
+				&bib->ipv4.l3);
+		if (error)
+			return error;
+	}
+
+	usage = find_usage(table, &bib->ipv4.l3);
+	if (!usage) {
+		usage = kzalloc(sizeof(*usage), GFP_ATOMIC);
+		if (!usage)
+			goto enomem;
+		usage->addr = bib->ipv4.l3;
+		new_usage = true;
+	}
+
+	chunk = &usage->chunks[bib->ipv4.l4 / PORTS_PER_CHUNK];
+	if (!*chunk) {
+		*chunk = kzalloc(sizeof(**chunk), GFP_ATOMIC);
+		if (!*chunk) {
+			if (new_usage)
+				kfree(usage);
+			goto enomem;
+		}
+	}
+
+	if (new_usage)
+		hlist_add_head(&usage->hook, usage_slot(table, &usage->addr));
+
+	if (!WARN(test_and_set_bit(bib->ipv4.l4 % PORTS_PER_CHUNK,
+			(*chunk)->ports), "Port usage is out of sync.")) {
+		(*chunk)->used++;
+		usage->used++;
+	}
+	return 0;
+
+enomem:
+	if (bib->mark_set)
+		pool4usage_refund(bib->mark, bib->l4_proto, &bib->ipv4.l3);
+	return -ENOMEM;
+}
+
+/**
+ * Reverts mark_used().
+ *
+ * Spinlock must be held.
+ */
+static void mark_free(struct bib_table *table, struct bib_entry *bib)
+{
+	struct port_usage *usage;
+	struct port_chunk **chunk;
+
+	if (bib->mark_set)
+		pool4usage_refund(bib->mark, bib->l4_proto, &bib->ipv4.l3);
+	else
+		pool4usage_forget(bib->l4_proto);
+
+	usage = find_usage(table, &bib->ipv4.l3);
+	if (WARN(!usage, "Port usage is out of sync."))
+		return;
+	chunk = &usage->chunks[bib->ipv4.l4 / PORTS_PER_CHUNK];
+	if (WARN(!*chunk, "Port usage is out of sync."))
+		return;
+
+	if (test_and_clear_bit(bib->ipv4.l4 % PORTS_PER_CHUNK,
+			(*chunk)->ports)) {
+		(*chunk)->used--;
+		usage->used--;
+	}
+	if (!(*chunk)->used) {
+		kfree(*chunk);
+		*chunk = NULL;
+	}
+	if (!usage->used) {
+		hlist_del(&usage->hook);
+		usage_kfree(usage);
+	}
+}
+
+/**
+ * Returns the first port from [@from, @to] that's not set in @usage, or
+ * PORTS_PER_ADDR if there is none.
+ *
+ * Spinlock must be held.
+ */
+static unsigned int find_zero_port(struct port_usage *usage,
+		unsigned int from, unsigned int to)
+{
+	struct port_chunk *chunk;
+	unsigned int base;
+	unsigned int last;
+	unsigned long bit;
+
+	while (from <= to) {
+		base = from - (from % PORTS_PER_CHUNK);
+		chunk = usage->chunks[base / PORTS_PER_CHUNK];
+		if (!chunk)
+			return from;
+
+		last = min(to, base + PORTS_PER_CHUNK - 1) - base;
+		bit = find_next_zero_bit(chunk->ports, last + 1UL, from - base);
+		if (bit <= last)
+			return base + bit;
+
+		from = base + PORTS_PER_CHUNK;
+	}
+
+	return PORTS_PER_ADDR;
+}
+
+/**
+ * Finds the first port from @range that's not taken by any of @table's
+ * entries on address @addr, and places it in @result.
+ *
+ * Returns -ESRCH if the range is exhausted.
+ */
+int bibtable_find_free4(struct bib_table *table, const struct in_addr *addr,
+		const struct port_range *range, __u16 *result)
+{
+	struct port_usage *usage;
+	unsigned int port;
+	int error = 0;
+
+	spin_lock_bh(&table->lock);
+
+	usage = find_usage(table, addr);
+	if (!usage) {
+		*result = range->min;
+		goto end;
+	}
+	if (usage->used == PORTS_PER_ADDR) {
+		error = -ESRCH;
+		goto end;
+	}
+
+	port = find_zero_port(usage, range->min, range->max);
+	if (port > range->max)
+		error = -ESRCH;
+	else
+		*result = port;
+	/* Fall through. */
+
+end:
+	spin_unlock_bh(&table->lock);
+	return error;
 }
 
 /**
@@ -84,90 +619,239 @@ static int compare_full4(const struct bib_entry *bib,
 	return gap;
 }
 
-static struct bib_entry *find_by_addr6(const struct bib_table *table,
+static struct bib_entry *find6_in(struct bib_buckets *buckets, u32 hash,
+		const struct ipv6_transport_addr *addr)
+{
+	struct bib_entry *bib;
+	struct hlist_node *node;
+
+	hlist_for_each_rcu_bh(node, get_bucket(buckets, hash)) {
+		bib = hlist_entry(node, struct bib_entry, hash6_hook);
+		if (!compare_full6(bib, addr))
+			return bib;
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the entry whose IPv6 transport address is @addr.
+ *
+ * Requires rcu_read_lock_bh() or the spinlock. The result is not
+ * reference-counted.
+ */
+static struct bib_entry *find6(struct bib_table *table,
 		const struct ipv6_transport_addr *addr)
 {
-	return rbtree_find(addr, &table->tree6, compare_full6, struct bib_entry,
-			tree6_hook);
+	struct bib_buckets *old;
+	struct bib_entry *bib;
+	unsigned int seq;
+	u32 hash;
+
+	hash = hash6(table, addr);
+
+	do {
+		seq = read_seqcount_begin(&table->hash6.seq);
+		bib = find6_in(rcu_dereference_bh(table->hash6.buckets), hash,
+				addr);
+		if (bib)
+			return bib;
+		/* If a resize is in progress, try the old array as well. */
+		old = rcu_dereference_bh(table->hash6.old);
+		if (old) {
+			bib = find6_in(old, hash, addr);
+			if (bib)
+				return bib;
+		}
+	} while (read_seqcount_retry(&table->hash6.seq, seq));
+
+	return NULL;
+}
+
+static struct bib_entry *find4_in(struct bib_buckets *buckets, u32 hash,
+		const struct ipv4_transport_addr *addr)
+{
+	struct bib_entry *bib;
+	struct hlist_node *node;
+
+	hlist_for_each_rcu_bh(node, get_bucket(buckets, hash)) {
+		bib = hlist_entry(node, struct bib_entry, hash4_hook);
+		if (!compare_full4(bib, addr))
+			return bib;
+	}
+
+	return NULL;
 }
 
-static struct bib_entry *find_by_addr4(const struct bib_table *table,
+/**
+ * Returns the entry whose IPv4 transport address is @addr.
+ *
+ * Requires rcu_read_lock_bh() or the spinlock. The result is not
+ * reference-counted.
+ */
+static struct bib_entry *find4(struct bib_table *table,
 		const struct ipv4_transport_addr *addr)
 {
-	return rbtree_find(addr, &table->tree4, compare_full4, struct bib_entry,
-			tree4_hook);
+	struct bib_buckets *old;
+	struct bib_entry *bib;
+	unsigned int seq;
+	u32 hash;
+
+	hash = hash4(table, addr);
+
+	do {
+		seq = read_seqcount_begin(&table->hash4.seq);
+		bib = find4_in(rcu_dereference_bh(table->hash4.buckets), hash,
+				addr);
+		if (bib)
+			return bib;
+		/* If a resize is in progress, try the old array as well. */
+		old = rcu_dereference_bh(table->hash4.old);
+		if (old) {
+			bib = find4_in(old, hash, addr);
+			if (bib)
+				return bib;
+		}
+	} while (read_seqcount_retry(&table->hash4.seq, seq));
+
+	return NULL;
 }
 
+/**
+ * Lockless. Entries that are already dying are treated as missing.
+ */
 int bibtable_get6(struct bib_table *table,
 		const struct ipv6_transport_addr *addr,
 		struct bib_entry **result)
 {
-	spin_lock_bh(&table->lock);
-	*result = find_by_addr6(table, addr);
-	if (*result)
-		bibentry_get(*result);
-	spin_unlock_bh(&table->lock);
+	rcu_read_lock_bh();
+	*result = find6(table, addr);
+	if (*result && !bibentry_get_unless_zero(*result))
+		*result = NULL;
+	rcu_read_unlock_bh();
 
 	return (*result) ? 0 : -ESRCH;
 }
 
+/**
+ * Lockless. Entries that are already dying are treated as missing.
+ */
 int bibtable_get4(struct bib_table *table,
 		const struct ipv4_transport_addr *addr,
 		struct bib_entry **result)
 {
-	spin_lock_bh(&table->lock);
-	*result = find_by_addr4(table, addr);
-	if (*result)
-		bibentry_get(*result);
-	spin_unlock_bh(&table->lock);
+	rcu_read_lock_bh();
+	*result = find4(table, addr);
+	if (*result && !bibentry_get_unless_zero(*result))
+		*result = NULL;
+	rcu_read_unlock_bh();
 
 	return (*result) ? 0 : -ESRCH;
 }
 
+/**
+ * Lockless. Dying entries still count; their ports are not free yet.
+ */
 bool bibtable_contains4(struct bib_table *table,
 		const struct ipv4_transport_addr *addr)
 {
 	bool result;
 
-	spin_lock_bh(&table->lock);
-	result = find_by_addr4(table, addr) ? true : false;
-	spin_unlock_bh(&table->lock);
+	rcu_read_lock_bh();
+	result = find4(table, addr) ? true : false;
+	rcu_read_unlock_bh();
 
 	return result;
 }
 
-static int add6(struct bib_table *table, struct bib_entry *bib)
-{
-	return rbtree_add(bib, &bib->ipv6, &table->tree6, compare_full6,
-			struct bib_entry, tree6_hook);
-}
-
 static int add4(struct bib_table *table, struct bib_entry *bib)
 {
 	return rbtree_add(bib, &bib->ipv4, &table->tree4, compare_full4,
 			struct bib_entry, tree4_hook);
 }
 
-int bibtable_add(struct bib_table *table, struct bib_entry *bib)
+/**
+ * Spinlock must be held.
+ */
+static void rm(struct bib_table *table, struct bib_entry *bib)
+{
+	if (!WARN(hlist_unhashed(&bib->hash6_hook), "Faulty IPv6 index"))
+		hlist_del_init_rcu(&bib->hash6_hook);
+	if (!WARN(hlist_unhashed(&bib->hash4_hook), "Faulty IPv4 index"))
+		hlist_del_init_rcu(&bib->hash4_hook);
+	if (!WARN(RB_EMPTY_NODE(&bib->tree4_hook), "Faulty IPv4 tree")) {
+		rb_erase(&bib->tree4_hook, &table->tree4);
+		RB_CLEAR_NODE(&bib->tree4_hook);
+	}
+	mark_free(table, bib);
+	table->count--;
+
+	bibentry_log(bib, "Forgot");
+}
+
+/**
+ * Adds "bib" to "table".
+ *
+ * If "table" already has an entry for "bib"'s IPv6 transport address, fails
+ * with -EEXIST and, unless "old" is NULL, returns that entry (with an extra
+ * reference) in "old". The lookup and the insertion happen in the same
+ * critical section, so the caller can use "old" instead of "bib" even if
+ * another CPU won the race to create the mapping.
+ *
+ * "old" is set to NULL in any other case.
+ *
+ * If the colliding entry is already dying (ie. its last reference is gone, but
+ * its killer hasn't removed it yet), it is evicted on the spot and "bib" takes
+ * its place. Lockless lookups ignore dying entries, so the caller is probably
+ * here precisely because of it.
+ */
+int bibtable_add(struct bib_table *table, struct bib_entry *bib,
+		struct bib_entry **old)
 {
+	struct bib_entry *collision;
 	int error;
 
+	if (old)
+		*old = NULL;
+
 	spin_lock_bh(&table->lock);
 
-	error = add6(table, bib);
-	if (error) {
-		log_debug("IPv6 index failed.");
+	collision = find6(table, &bib->ipv6);
+	if (collision && !bibentry_get_unless_zero(collision)) {
+		/* bibtable_rm() will notice it's already gone. */
+		rm(table, collision);
+		collision = NULL;
+	}
+	if (collision) {
+		if (old) {
+			*old = collision;
+		} else if (bibentry_return(collision)) {
+			/* Everyone else let go while we were looking. */
+			rm(table, collision);
+			bibentry_kfree(collision);
+		}
+		error = -EEXIST;
 		goto fail;
 	}
 
+	/* The tree also checks the IPv4 side for duplicates. */
 	error = add4(table, bib);
 	if (error) {
-		rb_erase(&bib->tree6_hook, &table->tree6);
 		log_debug("IPv4 index failed.");
 		goto fail;
 	}
 
+	error = mark_used(table, bib);
+	if (error) {
+		rb_erase(&bib->tree4_hook, &table->tree4);
+		RB_CLEAR_NODE(&bib->tree4_hook);
+		log_debug("Port usage index failed.");
+		goto fail;
+	}
+
+	hash_add(table, bib);
 	table->count++;
+	maybe_resize(table);
 
 	spin_unlock_bh(&table->lock);
 	bibentry_log(bib, "Mapped");
@@ -178,24 +862,194 @@ fail:
 	return error;
 }
 
+static int sort_compare6(const void *bib1, const void *bib2)
+{
+	const struct bib_entry *b1 = *(struct bib_entry **)bib1;
+	const struct bib_entry *b2 = *(struct bib_entry **)bib2;
+	return compare_full6(b1, &b2->ipv6);
+}
+
+static int sort_compare4(const void *bib1, const void *bib2)
+{
+	const struct bib_entry *b1 = *(struct bib_entry **)bib1;
+	const struct bib_entry *b2 = *(struct bib_entry **)bib2;
+	return compare_full4(b1, &b2->ipv4);
+}
+
+/**
+ * Removes the NULLs from "bibs". Returns the new length.
+ */
+static size_t compact(struct bib_entry **bibs, size_t count)
+{
+	size_t i, j;
+
+	for (i = 0, j = 0; i < count; i++)
+		if (bibs[i])
+			bibs[j++] = bibs[i];
+
+	return j;
+}
+
+/**
+ * Frees the entries from "bibs" (sorted by "compare_fn") that collide with
+ * their predecessors, and NULLs their slots.
+ *
+ * Returns the number of entries that were dropped.
+ */
+static size_t drop_duplicates(struct bib_entry **bibs, size_t count,
+		int (*compare_fn)(const void *, const void *))
+{
+	size_t i, last;
+	size_t dropped = 0;
+
+	for (i = 1, last = 0; i < count; i++) {
+		if (compare_fn(&bibs[last], &bibs[i])) {
+			last = i;
+			continue;
+		}
+
+		log_debug("Dropping duplicate BIB entry %pI6c#%u - %pI4#%u.",
+				&bibs[i]->ipv6.l3, bibs[i]->ipv6.l4,
+				&bibs[i]->ipv4.l3, bibs[i]->ipv4.l4);
+		bibentry_kfree(bibs[i]);
+		bibs[i] = NULL;
+		dropped++;
+	}
+
+	return dropped;
+}
+
 /**
+ * mark_used()s every entry from "bibs". On failure, nothing is marked.
+ *
  * Spinlock must be held.
  */
-static void rm(struct bib_table *table, struct bib_entry *bib)
+static int mark_all_used(struct bib_table *table, struct bib_entry **bibs,
+		size_t count)
 {
-	if (!WARN(RB_EMPTY_NODE(&bib->tree6_hook), "Faulty IPv6 index"))
-		rb_erase(&bib->tree6_hook, &table->tree6);
-	if (!WARN(RB_EMPTY_NODE(&bib->tree4_hook), "Faulty IPv4 index"))
-		rb_erase(&bib->tree4_hook, &table->tree4);
-	table->count--;
+	size_t i;
+	int error;
 
-	bibentry_log(bib, "Forgot");
+	for (i = 0; i < count; i++) {
+		error = mark_used(table, bibs[i]);
+		if (error) {
+			while (i > 0)
+				mark_free(table, bibs[--i]);
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Inserts the "*count" entries from "bibs" into "table", in one go.
+ *
+ * The hash indexes are grown up front, so the resizer doesn't have to rehash
+ * the entries over and over again as they come in. If the table is empty, the
+ * tree is built straight out of the sorted entries, which is much faster than
+ * adding them one by one. Otherwise (ie.
+ * some traffic beat the restoration), they are added one by one, and the
+ * entries that collide with existing ones lose.
+ *
+ * The entries that didn't make it (duplicates and collisions) are freed, and
+ * removed from "bibs". On return, "bibs" contains the entries that were
+ * inserted, sorted by IPv4 transport address, and "*count" is its new length.
+ *
+ * The creator references are not touched, so the caller still has to return
+ * them when it's done.
+ */
+int bibtable_restore(struct bib_table *table, struct bib_entry **bibs,
+		size_t *count)
+{
+	struct bib_entry **bibs6;
+	size_t n = *count;
+	size_t i;
+	bool collided = false;
+	int error;
+
+	if (!n)
+		return 0;
+
+	bibs6 = vmalloc(n * sizeof(*bibs6));
+	if (!bibs6)
+		return -ENOMEM;
+
+	sort(bibs, n, sizeof(*bibs), sort_compare4, NULL);
+	if (drop_duplicates(bibs, n, sort_compare4))
+		n = compact(bibs, n);
+
+	memcpy(bibs6, bibs, n * sizeof(*bibs6));
+	sort(bibs6, n, sizeof(*bibs6), sort_compare6, NULL);
+	if (drop_duplicates(bibs6, n, sort_compare6)) {
+		/* Rare; just start the IPv4 version over. */
+		n = compact(bibs6, n);
+		memcpy(bibs, bibs6, n * sizeof(*bibs));
+		sort(bibs, n, sizeof(*bibs), sort_compare4, NULL);
+	}
+
+	mutex_lock(&table->resize_lock);
+	error = reserve_hashes(table, n);
+	mutex_unlock(&table->resize_lock);
+	if (error) {
+		vfree(bibs6);
+		return error;
+	}
+
+	spin_lock_bh(&table->lock);
+
+	if (!table->count && !mark_all_used(table, bibs, n)) {
+		rbtree_build(&table->tree4, bibs, n, struct bib_entry,
+				tree4_hook);
+		for (i = 0; i < n; i++)
+			hash_add(table, bibs[i]);
+		table->count = n;
+	} else {
+		for (i = 0; i < n; i++) {
+			if (find6(table, &bibs[i]->ipv6)
+					|| add4(table, bibs[i])) {
+				bibs[i] = NULL;
+				collided = true;
+				continue;
+			}
+			if (mark_used(table, bibs[i])) {
+				rb_erase(&bibs[i]->tree4_hook, &table->tree4);
+				RB_CLEAR_NODE(&bibs[i]->tree4_hook);
+				bibs[i] = NULL;
+				collided = true;
+				continue;
+			}
+			hash_add(table, bibs[i]);
+			table->count++;
+		}
+	}
+
+	spin_unlock_bh(&table->lock);
+
+	/*
+	 * bibs6 still holds every entry that made it past the deduplication,
+	 * so it's the one that knows what needs to be freed.
+	 */
+	if (collided) {
+		for (i = 0; i < n; i++) {
+			if (RB_EMPTY_NODE(&bibs6[i]->tree4_hook))
+				bibentry_kfree(bibs6[i]);
+		}
+		n = compact(bibs, n);
+	}
+
+	vfree(bibs6);
+	log_debug("Restored %zu BIB entries (%zu dropped).", n, *count - n);
+	*count = n;
+	return 0;
 }
 
 void bibtable_rm(struct bib_table *table, struct bib_entry *bib)
 {
 	spin_lock_bh(&table->lock);
-	rm(table, bib);
+	/* bibtable_add() might have evicted it already. */
+	if (!hlist_unhashed(&bib->hash6_hook))
+		rm(table, bib);
 	spin_unlock_bh(&table->lock);
 }
 
@@ -1,21 +1,25 @@
 #include "nat64/mod/stateful/compute_outgoing_tuple.h"
 #include "nat64/mod/stateful/session/db.h"
 
-verdict compute_out_tuple(struct tuple *in, struct tuple *out, struct packet *pkt_in)
+verdict compute_out_tuple(struct tuple *in, struct session_entry *session,
+		struct tuple *out, struct packet *pkt_in)
 {
-	struct session_entry *session;
+	struct session_entry *found = NULL;
 	int error;
 
 	log_debug("Step 3: Computing the Outgoing Tuple");
 
-	error = sessiondb_get(in, NULL, NULL, &session);
-	if (error) {
-		/*
-		 * Bogus ICMP errors might cause this because Filtering never cares for them,
-		 * so it's not critical.
-		 */
-		log_debug("Error code %d while trying to find the packet's session entry.", error);
-		return VERDICT_ACCEPT;
+	if (!session) {
+		error = sessiondb_get(in, NULL, NULL, &found);
+		if (error) {
+			/*
+			 * Bogus ICMP errors might cause this because Filtering never cares for them,
+			 * so it's not critical.
+			 */
+			log_debug("Error code %d while trying to find the packet's session entry.", error);
+			return VERDICT_ACCEPT;
+		}
+		session = found;
 	}
 
 	/*
@@ -57,7 +61,8 @@ verdict compute_out_tuple(struct tuple *in, struct tuple *out, struct packet *pk
 		break;
 	}
 
-	session_return(session);
+	if (found)
+		session_return(found);
 	log_tuple(out);
 
 	log_debug("Done step 3.");
@@ -8,10 +8,13 @@
 #include "nat64/mod/common/rfc6052.h"
 #include "nat64/mod/common/stats.h"
 #include "nat64/mod/stateful/bib/db.h"
+#include "nat64/mod/stateful/bib/deterministic.h"
 #include "nat64/mod/stateful/bib/port_allocator.h"
 #include "nat64/mod/stateful/pool4/db.h"
 #include "nat64/mod/stateful/session/db.h"
 #include "nat64/mod/stateful/session/pkt_queue.h"
+#include "nat64/mod/stateful/session/syn_cookie.h"
+#include "nat64/mod/stateful/subscriber.h"
 
 #include <linux/skbuff.h>
 #include <linux/ip.h>
@@ -48,34 +51,50 @@ static enum session_fate expired_cb(struct session_entry *session, void *arg)
 	return FATE_RM;
 }
 
-int filtering_init(void)
+int filtering_init(unsigned int syn_cookie_slots)
 {
 	int error;
 
-	error = bibdb_init();
+	error = subscriber_init();
 	if (error)
 		return error;
 
+	error = bibdb_init();
+	if (error)
+		goto subscriber_fail;
+
 	error = palloc_init();
-	if (error) {
-		bibdb_destroy();
-		return error;
-	}
+	if (error)
+		goto bib_fail;
 
 	error = sessiondb_init(expired_cb, expired_cb);
-	if (error) {
-		palloc_destroy();
-		bibdb_destroy();
-	}
+	if (error)
+		goto palloc_fail;
 
+	error = syncookie_init(syn_cookie_slots);
+	if (error)
+		goto sessiondb_fail;
+
+	return 0;
+
+sessiondb_fail:
+	sessiondb_destroy();
+palloc_fail:
+	palloc_destroy();
+bib_fail:
+	bibdb_destroy();
+subscriber_fail:
+	subscriber_destroy();
 	return error;
 }
 
 void filtering_destroy(void)
 {
+	syncookie_destroy();
 	sessiondb_destroy();
 	palloc_destroy();
 	bibdb_destroy();
+	subscriber_destroy();
 }
 
 /**
@@ -113,23 +132,122 @@ static void log_session(struct session_entry *session)
 		log_debug("Session entry: None");
 }
 
+/**
+ * Hands "session" over to the caller through "session_out", or releases it if
+ * the caller doesn't want it.
+ */
+static void hand_over(struct session_entry *session,
+		struct session_entry **session_out)
+{
+	if (session_out)
+		*session_out = session;
+	else
+		session_return(session);
+}
+
 static int xlat_addr64(struct tuple *tuple6, struct in_addr *addr)
 {
 	return rfc6052_6to4(&tuple6->dst.addr6.l3, addr);
 }
 
+/**
+ * Decides whether "sub" can have one more BIB entry ("new_bib" = true) or
+ * session ("new_bib" = false). If the limits are reached, it tries to make
+ * room by evicting the least recently used session (or, for BIB entries, every
+ * session of its BIB entry), if the configuration allows it.
+ *
+ * If the subscriber is the one who ran out of quota, the victim is one of its
+ * own. If the global limit was reached, the victim is taken from the "proto"
+ * table.
+ */
+static int admit(struct subscriber *sub, struct admission_limits *limits,
+		l4_protocol proto, bool new_bib)
+{
+	struct session_entry *victim;
+	int error;
+
+	error = new_bib
+			? subscriber_check_bibs(sub, limits)
+			: subscriber_check_sessions(sub, limits);
+	if (!error)
+		return 0;
+	if (!limits->evict)
+		goto drop;
+
+	victim = (error == -EDQUOT) ? subscriber_lru(sub) : sessiondb_lru(proto);
+	if (!victim)
+		goto drop;
+
+	if (!new_bib) {
+		sessiondb_rm(victim);
+	} else if (victim->bib && victim->bib->subscriber) {
+		/* The BIB entry dies when its last session does. */
+		sessiondb_delete_by_bib(victim->bib);
+	} else {
+		/* Static BIB entry; cannot make room by evicting it. */
+		session_return(victim);
+		goto drop;
+	}
+	session_return(victim);
+	subscriber_count_eviction();
+
+	error = new_bib
+			? subscriber_check_bibs(sub, limits)
+			: subscriber_check_sessions(sub, limits);
+	if (!error)
+		return 0;
+	/* Fall through. */
+
+drop:
+	log_debug("%s limit reached; dropping.", new_bib ? "BIB" : "Session");
+	subscriber_count_drop();
+	return error;
+}
+
+/**
+ * admit()s a new session for "bib".
+ */
+static int admit_session(struct bib_entry *bib, l4_protocol proto)
+{
+	struct admission_limits limits;
+
+	if (!bib || !bib->subscriber)
+		return 0; /* Static BIB entries are not charged to anyone. */
+
+	config_get_limits(&limits);
+	return admit(bib->subscriber, &limits, proto, false);
+}
+
+/**
+ * Creates the BIB entry "tuple6" needs, and charges it to "sub" (whose
+ * reference the entry inherits).
+ */
 static int create_bib6(struct packet *in_pkt, struct tuple *tuple6,
-		struct bib_entry **result)
+		struct subscriber *sub, struct bib_entry **result)
 {
 	struct ipv4_transport_addr saddr;
 	struct in_addr daddr;
+	struct port_block *block = NULL;
+	unsigned int block_size;
+	bool deterministic;
 	struct bib_entry *bib;
 	int error;
 
 	error = xlat_addr64(tuple6, &daddr);
 	if (error)
 		return error;
-	error = palloc_allocate(in_pkt, tuple6, &daddr, &saddr);
+
+	error = detmap_allocate(in_pkt, tuple6, &saddr, &deterministic);
+	if (error == -ENOENT) {
+		/* Not subject to a deterministic mapping. */
+		deterministic = false;
+		block_size = config_get_port_block_size();
+		error = block_size
+				? palloc_allocate_block(in_pkt, tuple6, &daddr,
+						sub, block_size, &saddr, &block)
+				: palloc_allocate(in_pkt, tuple6, &daddr,
+						&saddr);
+	}
 	if (error)
 		return error;
 
@@ -137,9 +255,18 @@ static int create_bib6(struct packet *in_pkt, struct tuple *tuple6,
 			tuple6->l4_proto);
 	if (!bib) {
 		log_debug("Failed to allocate a BIB entry.");
+		if (block)
+			subscriber_return_port(sub, block);
 		return -ENOMEM;
 	}
 
+	bib->subscriber = sub;
+	bib->block = block;
+	bib->is_deterministic = deterministic;
+	bib->mark = in_pkt->skb->mark;
+	bib->mark_set = true;
+	subscriber_add_bib(sub);
+
 	*result = bib;
 	return 0;
 }
@@ -147,7 +274,10 @@ static int create_bib6(struct packet *in_pkt, struct tuple *tuple6,
 static int get_or_create_bib6(struct packet *in_pkt, struct tuple *tuple6,
 		struct bib_entry **result)
 {
+	struct admission_limits limits;
+	struct subscriber *sub;
 	struct bib_entry *bib;
+	struct bib_entry *old;
 	int error;
 
 	error = bibdb_get(tuple6, result);
@@ -155,20 +285,34 @@ static int get_or_create_bib6(struct packet *in_pkt, struct tuple *tuple6,
 		return error; /* entry found and misc errors.*/
 
 	/* entry not found. */
-	error = create_bib6(in_pkt, tuple6, &bib);
-	if (error)
+	config_get_limits(&limits);
+	sub = subscriber_get(&tuple6->src.addr6.l3,
+			limits.subscriber_prefix_len);
+	if (!sub)
+		return -ENOMEM;
+
+	error = admit(sub, &limits, tuple6->l4_proto, true);
+	if (error) {
+		subscriber_put(sub);
 		return error;
+	}
+
+	error = create_bib6(in_pkt, tuple6, sub, &bib);
+	if (error) {
+		subscriber_put(sub);
+		return error;
+	}
 
 	/*
-	 * TODO (fine) this could be better.
-	 * If somebody inserted a colliding BIB since we last searched,
-	 * this will fail. Instead, it should fall back to use the already
-	 * official entry.
+	 * If another CPU inserted the mapping since we last searched, @old is
+	 * that one, and ours (along with its port) is given back.
 	 */
-	error = bibdb_add(bib);
+	error = bibdb_add(bib, &old);
 	if (error) {
 		bibentry_kfree(bib);
-		return error;
+		if (!old)
+			return error;
+		bib = old;
 	}
 
 	*result = bib;
@@ -239,6 +383,7 @@ static int get_or_create_session(struct tuple *tuple, struct packet *pkt,
 		struct bib_entry *bib, struct session_entry **result)
 {
 	struct session_entry *session;
+	struct session_entry *old;
 	int error;
 
 	error = sessiondb_get(tuple, update_timer, pkt, result);
@@ -246,14 +391,20 @@ static int get_or_create_session(struct tuple *tuple, struct packet *pkt,
 		return error; /* entry found and misc errors.*/
 
 	/* entry not found. */
+	error = admit_session(bib, tuple->l4_proto);
+	if (error)
+		return error;
 	error = create_session(tuple, bib, &session);
 	if (error)
 		return error;
 
-	error = sessiondb_add(session, true);
+	/* If another CPU created the session first, @old is that one. */
+	error = sessiondb_add(session, true, &old);
 	if (error) {
 		session_return(session);
-		return error;
+		if (!old)
+			return error;
+		session = old;
 	}
 
 	*result = session;
@@ -268,8 +419,10 @@ static int get_or_create_session(struct tuple *tuple, struct packet *pkt,
  *
  * @pkt: tuple's packet. This is actually only used for error reporting.
  * @tuple: summary of the packet Jool is currently translating.
+ * @session_out: the packet's session will be placed here, unless it's NULL.
  */
-static verdict ipv6_simple(struct packet *pkt, struct tuple *tuple6)
+static verdict ipv6_simple(struct packet *pkt, struct tuple *tuple6,
+		struct session_entry **session_out)
 {
 	struct bib_entry *bib;
 	struct session_entry *session;
@@ -290,7 +443,7 @@ static verdict ipv6_simple(struct packet *pkt, struct tuple *tuple6)
 	}
 	log_session(session);
 
-	session_return(session);
+	hand_over(session, session_out);
 	bibdb_return(bib);
 
 	return VERDICT_CONTINUE;
@@ -335,9 +488,12 @@ static int get_bib4(struct packet *pkt, struct tuple *tuple4,
  *
  * @param[in] skb tuple's packet. This is actually only used for error reporting.
  * @param[in] tuple summary of the packet Jool is currently translating.
+ * @param[out] session_out the packet's session will be placed here, unless
+ *	it's NULL.
  * @return VER_CONTINUE if everything went OK, VER_DROP otherwise.
  */
-static verdict ipv4_simple(struct packet *pkt, struct tuple *tuple4)
+static verdict ipv4_simple(struct packet *pkt, struct tuple *tuple4,
+		struct session_entry **session_out)
 {
 	int error;
 	struct bib_entry *bib;
@@ -358,39 +514,87 @@ static verdict ipv4_simple(struct packet *pkt, struct tuple *tuple4)
 	}
 	log_session(session);
 
-	session_return(session);
+	hand_over(session, session_out);
 	bibdb_return(bib);
 
 	return VERDICT_CONTINUE;
 }
 
+/**
+ * Returns true if @pkt (an IPv6 SYN-ACK) answers an IPv4 SYN that was
+ * translated without a session. See syn_cookie.h.
+ */
+static bool syn_ack_is_expected(struct packet *pkt, struct tuple *tuple6,
+		struct bib_entry *bib)
+{
+	struct ipv4_transport_addr remote4;
+
+	if (xlat_addr64(tuple6, &remote4.l3))
+		return false;
+	remote4.l4 = tuple6->dst.addr6.l4;
+
+	if (!syncookie_validate(&bib->ipv4, &remote4,
+			be32_to_cpu(pkt_tcp_hdr(pkt)->ack_seq))) {
+		log_debug("SYN-ACK does not answer a known IPv4 SYN; dropping.");
+		return false;
+	}
+
+	return true;
+}
+
 /**
  * First half of the filtering and updating done during the CLOSED state of the TCP state machine.
  * Processes IPv6 SYN packets when there's no state.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static int tcp_closed_v6_syn(struct packet *pkt, struct tuple *tuple6)
+static int tcp_closed_v6_syn(struct packet *pkt, struct tuple *tuple6,
+		struct session_entry **session_out)
 {
 	struct bib_entry *bib;
 	struct session_entry *session;
+	struct session_entry *old;
+	bool cookie;
 	int error;
 
-	error = get_or_create_bib6(pkt, tuple6, &bib);
+	/*
+	 * With SYN cookies, a stateless SYN-ACK is the IPv6 half of an
+	 * IPv4-initiated handshake, so it needs an existing BIB entry.
+	 */
+	cookie = pkt_tcp_hdr(pkt)->ack && config_get_tcp_syn_cookies();
+
+	error = cookie
+			? bibdb_get(tuple6, &bib)
+			: get_or_create_bib6(pkt, tuple6, &bib);
 	if (error)
 		goto simple_end;
 	log_bib(bib);
 
+	if (cookie && !syn_ack_is_expected(pkt, tuple6, bib)) {
+		error = -EINVAL;
+		goto bib_end;
+	}
+
+	error = admit_session(bib, tuple6->l4_proto);
+	if (error)
+		goto bib_end;
 	error = create_session(tuple6, bib, &session);
 	if (error)
 		goto bib_end;
-	session->state = V6_INIT;
+	session->state = cookie ? ESTABLISHED : V6_INIT;
 
-	error = sessiondb_add(session, false);
-	if (error)
-		goto session_end;
+	error = sessiondb_add(session, cookie, &old);
+	if (error) {
+		if (!old)
+			goto session_end;
+		/* Another CPU created it first. */
+		session_return(session);
+		session = old;
+		error = 0;
+	}
 
 	log_session(session);
-	/* Fall through. */
+	hand_over(session, session_out);
+	goto bib_end;
 
 session_end:
 	session_return(session);
@@ -406,10 +610,12 @@ simple_end:
  * Processes IPv4 SYN packets when there's no state.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static verdict tcp_closed_v4_syn(struct packet *pkt, struct tuple *tuple4)
+static verdict tcp_closed_v4_syn(struct packet *pkt, struct tuple *tuple4,
+		struct session_entry **session_out)
 {
 	struct bib_entry *bib;
 	struct session_entry *session;
+	struct session_entry *old;
 	int error;
 	verdict result = VERDICT_DROP;
 
@@ -427,6 +633,32 @@ static verdict tcp_closed_v4_syn(struct packet *pkt, struct tuple *tuple4)
 	}
 	log_bib(bib);
 
+	/*
+	 * If the cookie table has no room for the SYN, fall back to the
+	 * stateful treatment below. See syn_cookie.h.
+	 */
+	if (bib && !config_get_addr_dependent_filtering()
+			&& config_get_tcp_syn_cookies()
+			&& !syncookie_store(&bib->ipv4, &tuple4->src.addr4,
+					be32_to_cpu(pkt_tcp_hdr(pkt)->seq))) {
+		error = create_session(tuple4, bib, &session);
+		if (error)
+			goto end_bib;
+		log_session(session);
+
+		/*
+		 * The session only lives as long as the packet; the SYN-ACK
+		 * will create the real one.
+		 */
+		session->state = V4_INIT;
+		hand_over(session, session_out);
+		result = VERDICT_CONTINUE;
+		goto end_bib;
+	}
+
+	error = admit_session(bib, tuple4->l4_proto);
+	if (error)
+		goto end_bib;
 	error = create_session(tuple4, bib, &session);
 	if (error)
 		goto end_bib;
@@ -443,14 +675,21 @@ static verdict tcp_closed_v4_syn(struct packet *pkt, struct tuple *tuple4)
 		result = VERDICT_STOLEN;
 
 	} else {
-		error = sessiondb_add(session, false);
+		error = sessiondb_add(session, false, &old);
 		if (error) {
-			log_debug("Error code %d while adding the session to "
-					"the DB.", error);
-			goto end_session;
+			if (!old) {
+				log_debug("Error code %d while adding the "
+						"session to the DB.", error);
+				goto end_session;
+			}
+			/* Another CPU created it first. */
+			session_return(session);
+			session = old;
 		}
 
+		hand_over(session, session_out);
 		result = VERDICT_CONTINUE;
+		goto end_bib;
 	}
 
 	/* Fall through. */
@@ -469,7 +708,8 @@ end_bib:
  * Filtering and updating done during the CLOSED state of the TCP state machine.
  * Part of RFC 6146 section 3.5.2.2.
  */
-static verdict tcp_closed_state(struct packet *pkt, struct tuple *tuple)
+static verdict tcp_closed_state(struct packet *pkt, struct tuple *tuple,
+		struct session_entry **session_out)
 {
 	struct bib_entry *bib;
 	verdict result;
@@ -478,7 +718,8 @@ static verdict tcp_closed_state(struct packet *pkt, struct tuple *tuple)
 	switch (pkt_l3_proto(pkt)) {
 	case L3PROTO_IPV6:
 		if (pkt_tcp_hdr(pkt)->syn) {
-			result = is_error(tcp_closed_v6_syn(pkt, tuple))
+			result = is_error(tcp_closed_v6_syn(pkt, tuple,
+					session_out))
 					? VERDICT_DROP
 					: VERDICT_CONTINUE;
 			goto syn_out;
@@ -487,7 +728,7 @@ static verdict tcp_closed_state(struct packet *pkt, struct tuple *tuple)
 
 	case L3PROTO_IPV4:
 		if (pkt_tcp_hdr(pkt)->syn) {
-			result = tcp_closed_v4_syn(pkt, tuple);
+			result = tcp_closed_v4_syn(pkt, tuple, session_out);
 			goto syn_out;
 		}
 		break;
@@ -661,14 +902,15 @@ static enum session_fate tcp_state_machine(struct session_entry *session,
  *
  * This is RFC 6146 section 3.5.2.
  */
-static verdict tcp(struct packet *pkt, struct tuple *tuple)
+static verdict tcp(struct packet *pkt, struct tuple *tuple,
+		struct session_entry **session_out)
 {
 	struct session_entry *session;
 	int error;
 
 	error = sessiondb_get(tuple, tcp_state_machine, pkt, &session);
 	if (error == -ESRCH)
-		return tcp_closed_state(pkt, tuple);
+		return tcp_closed_state(pkt, tuple, session_out);
 	if (error) {
 		log_debug("Error code %d while trying to find a TCP session.",
 				error);
@@ -677,21 +919,30 @@ static verdict tcp(struct packet *pkt, struct tuple *tuple)
 	}
 
 	log_session(session);
-	session_return(session);
+	hand_over(session, session_out);
 	return VERDICT_CONTINUE;
 }
 
 /**
  * filtering_and_updating - Main F&U routine. Decides if "skb" should be
  * processed, updating binding and session information.
+ *
+ * If "session_out" is not NULL and the verdict is VERDICT_CONTINUE, the
+ * packet's session is placed there so the following steps don't have to look
+ * it up again; remember to session_return() it. It is left NULL if the packet
+ * doesn't have one yet (eg. ICMP errors and orphaned TCP packets).
  */
-verdict filtering_and_updating(struct packet *pkt, struct tuple *in_tuple)
+verdict filtering_and_updating(struct packet *pkt, struct tuple *in_tuple,
+		struct session_entry **session_out)
 {
 	struct ipv6hdr *hdr_ip6;
 	verdict result = VERDICT_CONTINUE;
 
 	log_debug("Step 2: Filtering and Updating");
 
+	if (session_out)
+		*session_out = NULL;
+
 	switch (pkt_l3_proto(pkt)) {
 	case L3PROTO_IPV6:
 		/* Get rid of hairpinning loops and unwanted packets. */
@@ -732,16 +983,16 @@ verdict filtering_and_updating(struct packet *pkt, struct tuple *in_tuple)
 	case L4PROTO_UDP:
 		switch (pkt_l3_proto(pkt)) {
 		case L3PROTO_IPV6:
-			result = ipv6_simple(pkt, in_tuple);
+			result = ipv6_simple(pkt, in_tuple, session_out);
 			break;
 		case L3PROTO_IPV4:
-			result = ipv4_simple(pkt, in_tuple);
+			result = ipv4_simple(pkt, in_tuple, session_out);
 			break;
 		}
 		break;
 
 	case L4PROTO_TCP:
-		result = tcp(pkt, in_tuple);
+		result = tcp(pkt, in_tuple, session_out);
 		break;
 
 	case L4PROTO_ICMP:
@@ -754,10 +1005,10 @@ verdict filtering_and_updating(struct packet *pkt, struct tuple *in_tuple)
 				return VERDICT_DROP;
 			}
 
-			result = ipv6_simple(pkt, in_tuple);
+			result = ipv6_simple(pkt, in_tuple, session_out);
 			break;
 		case L3PROTO_IPV4:
-			result = ipv4_simple(pkt, in_tuple);
+			result = ipv4_simple(pkt, in_tuple, session_out);
 			break;
 		}
 		break;
@@ -0,0 +1,796 @@
+#include "nat64/mod/stateful/fragment_cache.h"
+#include "nat64/common/constants.h"
+#include "nat64/mod/common/config.h"
+
+#include <linux/jhash.h>
+#include <linux/list.h>
+#include <linux/netdevice.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <linux/version.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/netfilter/ipv6/nf_defrag_ipv6.h>
+
+/**
+ * The cache is split into 2^FRAGCACHE_SHARD_BITS shards. Each one has its own
+ * lock, hash table and expiration timer, so unrelated packets do not contend.
+ */
+#define FRAGCACHE_SHARD_BITS 4
+/** Every shard's hash table starts with 2^FRAGCACHE_MIN_BUCKET_BITS slots... */
+#define FRAGCACHE_MIN_BUCKET_BITS 4
+/** ...and never grows past 2^FRAGCACHE_MAX_BUCKET_BITS slots. */
+#define FRAGCACHE_MAX_BUCKET_BITS 12
+/** A shard's table grows once it averages more than this many entries/slot. */
+#define FRAGCACHE_MAX_LOAD 2
+/** Subsequent fragments one entry can hold while it waits for the first. */
+#define FRAGCACHE_MAX_PENDING 8
+
+/**
+ * Identifies the fragments of one packet.
+ * Always memset() before filling, because it is hashed and compared as bytes.
+ */
+struct fragcache_key {
+	union {
+		struct in6_addr addr6;
+		struct in_addr addr4;
+	} src, dst;
+	__u32 id;
+	__u8 l3_proto;
+	__u8 l4_proto;
+};
+
+struct fragcache_entry {
+	struct fragcache_key key;
+	/** jhash() of @key; cached so the table can be resized cheaply. */
+	u32 hash;
+	/** Has the first fragment been handled yet? */
+	bool resolved;
+	/**
+	 * The first fragment could not be translated on its own, so the rest
+	 * of them have to be reassembled as well.
+	 * Meaningless while @resolved is false.
+	 */
+	bool reassemble;
+	/**
+	 * What happened to the first fragment. Subsequent fragments share it.
+	 * VERDICT_CONTINUE means they have to be translated using @tuple.
+	 * Meaningless while @resolved is false, or if @reassemble is true.
+	 */
+	verdict fate;
+	struct tuple tuple;
+	/**
+	 * Subsequent fragments that arrived before the first one.
+	 * Chained through skb->next.
+	 */
+	struct sk_buff *pending;
+	unsigned int pending_count;
+	/** Bytes this entry is charged for: itself, plus @pending's truesizes. */
+	unsigned int truesize;
+	/** Jiffy at which the timer will delete this entry. */
+	unsigned long dying_time;
+
+	/** Chains this to its slot in its shard's table. */
+	struct hlist_node hash_hook;
+	/** Chains this to its shard's expire_list. */
+	struct list_head expire_hook;
+};
+
+struct fragcache_shard {
+	struct hlist_head *buckets;
+	unsigned int bucket_bits;
+	/** Number of entries in @buckets. */
+	unsigned int count;
+	/** The shard's entries, sorted by dying_time. */
+	struct list_head expire_list;
+	struct timer_list expire_timer;
+
+	/** Protects all of the above. */
+	spinlock_t lock;
+};
+
+/** Were we asked to translate fragments without reassembling them? */
+static bool enabled;
+
+/** Cache for struct fragcache_entries, for efficient allocation. */
+static struct kmem_cache *entry_cache;
+
+static struct fragcache_shard shards[1 << FRAGCACHE_SHARD_BITS];
+/**
+ * Bytes held by all the entries of all the shards. Bounded by
+ * --fragment-high-thresh, same as the fragment database's.
+ */
+static atomic_long_t mem = ATOMIC_LONG_INIT(0);
+
+/** Seeds the hash, so attackers can't predict the slots. */
+static u32 rnd;
+
+static void init_key(struct packet *pkt, struct fragcache_key *key)
+{
+	struct ipv6hdr *hdr6;
+	struct iphdr *hdr4;
+
+	memset(key, 0, sizeof(*key));
+
+	switch (pkt_l3_proto(pkt)) {
+	case L3PROTO_IPV6:
+		hdr6 = pkt_ip6_hdr(pkt);
+		key->src.addr6 = hdr6->saddr;
+		key->dst.addr6 = hdr6->daddr;
+		key->id = (__force __u32)pkt_frag_hdr(pkt)->identification;
+		break;
+	case L3PROTO_IPV4:
+		hdr4 = pkt_ip4_hdr(pkt);
+		key->src.addr4.s_addr = hdr4->saddr;
+		key->dst.addr4.s_addr = hdr4->daddr;
+		key->id = (__force __u32)hdr4->id;
+		break;
+	}
+
+	key->l3_proto = pkt_l3_proto(pkt);
+	key->l4_proto = pkt_l4_proto(pkt);
+}
+
+static u32 hash_key(const struct fragcache_key *key)
+{
+	return jhash(key, sizeof(*key), rnd);
+}
+
+static struct fragcache_shard *get_shard(u32 hash)
+{
+	return &shards[hash >> (32 - FRAGCACHE_SHARD_BITS)];
+}
+
+static struct hlist_head *get_slot(struct fragcache_shard *shard, u32 hash)
+{
+	return &shard->buckets[hash & ((1U << shard->bucket_bits) - 1)];
+}
+
+/**
+ * Shard lock must be held.
+ */
+static struct fragcache_entry *find_entry(struct fragcache_shard *shard,
+		const struct fragcache_key *key, u32 hash)
+{
+	struct fragcache_entry *entry;
+	struct hlist_node *node;
+
+	hlist_for_each(node, get_slot(shard, hash)) {
+		entry = hlist_entry(node, struct fragcache_entry, hash_hook);
+		if (entry->hash == hash
+				&& memcmp(&entry->key, key, sizeof(*key)) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Moves @shard's entries to a new table of 2^@bits slots.
+ * If the allocation fails, the shard keeps its current table; this is only an
+ * optimization.
+ *
+ * Shard lock must be held.
+ */
+static void resize(struct fragcache_shard *shard, unsigned int bits)
+{
+	struct hlist_head *old = shard->buckets;
+	unsigned int old_size = 1U << shard->bucket_bits;
+	struct fragcache_entry *entry;
+	struct hlist_node *node, *tmp;
+	unsigned int i;
+
+	shard->buckets = kmalloc_array(1U << bits, sizeof(*shard->buckets),
+			GFP_ATOMIC);
+	if (!shard->buckets) {
+		shard->buckets = old;
+		return;
+	}
+
+	shard->bucket_bits = bits;
+	for (i = 0; i < (1U << bits); i++)
+		INIT_HLIST_HEAD(&shard->buckets[i]);
+
+	for (i = 0; i < old_size; i++) {
+		hlist_for_each_safe(node, tmp, &old[i]) {
+			entry = hlist_entry(node, struct fragcache_entry,
+					hash_hook);
+			hlist_del(node);
+			hlist_add_head(node, get_slot(shard, entry->hash));
+		}
+	}
+
+	kfree(old);
+}
+
+/**
+ * Shard lock must be held.
+ */
+static struct fragcache_entry *create_entry(struct fragcache_shard *shard,
+		const struct fragcache_key *key, u32 hash)
+{
+	struct fragcache_entry *entry;
+
+	entry = kmem_cache_alloc(entry_cache, GFP_ATOMIC);
+	if (!entry)
+		return NULL;
+
+	entry->key = *key;
+	entry->hash = hash;
+	entry->resolved = false;
+	entry->reassemble = false;
+	entry->pending = NULL;
+	entry->pending_count = 0;
+	entry->truesize = sizeof(*entry);
+	entry->dying_time = jiffies + config_get_ttl_frag();
+	atomic_long_add(entry->truesize, &mem);
+
+	hlist_add_head(&entry->hash_hook, get_slot(shard, hash));
+	shard->count++;
+	if (shard->count > (FRAGCACHE_MAX_LOAD << shard->bucket_bits)
+			&& shard->bucket_bits < FRAGCACHE_MAX_BUCKET_BITS)
+		resize(shard, shard->bucket_bits + 1);
+
+	list_add_tail(&entry->expire_hook, &shard->expire_list);
+	if (!timer_pending(&shard->expire_timer)) {
+		mod_timer(&shard->expire_timer, entry->dying_time);
+		log_debug("The fragment cache timer will awake in %u msecs.",
+				jiffies_to_msecs(shard->expire_timer.expires - jiffies));
+	}
+
+	return entry;
+}
+
+static void drop_pending(struct sk_buff *skb)
+{
+	struct sk_buff *next;
+
+	for (; skb; skb = next) {
+		next = skb->next;
+		skb->next = NULL;
+		kfree_skb(skb);
+	}
+}
+
+/**
+ * Detaches and returns @entry's pending fragments.
+ * Shard lock must be held.
+ */
+static struct sk_buff *steal_pending(struct fragcache_entry *entry)
+{
+	struct sk_buff *pending = entry->pending;
+
+	atomic_long_sub(entry->truesize - sizeof(*entry), &mem);
+	entry->truesize = sizeof(*entry);
+	entry->pending = NULL;
+	entry->pending_count = 0;
+
+	return pending;
+}
+
+/**
+ * Shard lock must be held.
+ */
+static void destroy_entry(struct fragcache_shard *shard,
+		struct fragcache_entry *entry)
+{
+	hlist_del(&entry->hash_hook);
+	list_del(&entry->expire_hook);
+	shard->count--;
+	atomic_long_sub(entry->truesize, &mem);
+	drop_pending(entry->pending);
+	kmem_cache_free(entry_cache, entry);
+}
+
+static void clean_expired_shard(struct fragcache_shard *shard)
+{
+	struct fragcache_entry *entry;
+	unsigned int e = 0;
+
+	spin_lock_bh(&shard->lock);
+
+	while (!list_empty(&shard->expire_list)) {
+		entry = list_first_entry(&shard->expire_list,
+				struct fragcache_entry, expire_hook);
+		if (time_after(entry->dying_time, jiffies))
+			break;
+
+		if (entry->pending_count)
+			log_debug("Dropping %u fragments whose first fragment never arrived.",
+					entry->pending_count);
+		destroy_entry(shard, entry);
+		e++;
+	}
+
+	/* Give the memory back once the burst is over. */
+	if (shard->count == 0 && shard->bucket_bits > FRAGCACHE_MIN_BUCKET_BITS)
+		resize(shard, FRAGCACHE_MIN_BUCKET_BITS);
+
+	spin_unlock_bh(&shard->lock);
+
+	if (e)
+		log_debug("Deleted %u fragment cache entries.", e);
+}
+
+/**
+ * Executed by the kernel every once in a while to forget the packets of the
+ * shards[param] shard whose fragments are no longer expected.
+ */
+static void cleaner_timer(unsigned long param)
+{
+	struct fragcache_shard *shard = &shards[param];
+	struct fragcache_entry *entry;
+	unsigned long next_expire;
+	unsigned long min_time = jiffies + MIN_TIMER_SLEEP;
+
+	clean_expired_shard(shard);
+
+	spin_lock_bh(&shard->lock);
+
+	if (list_empty(&shard->expire_list)) {
+		spin_unlock_bh(&shard->lock);
+		/* No need to re-schedule the timer. */
+		return;
+	}
+
+	entry = list_first_entry(&shard->expire_list, struct fragcache_entry,
+			expire_hook);
+	next_expire = entry->dying_time;
+	spin_unlock_bh(&shard->lock);
+
+	if (next_expire < min_time)
+		next_expire = min_time;
+	mod_timer(&shard->expire_timer, next_expire);
+}
+
+/**
+ * Forgets the oldest packets until the cache holds no more than "low_thresh"
+ * bytes. The shards' expire_lists are sorted, so the oldest entry is at the
+ * head of one of them.
+ *
+ * No shard lock may be held.
+ */
+static void evict(unsigned long low_thresh)
+{
+	struct fragcache_shard *shard;
+	struct fragcache_shard *oldest;
+	struct fragcache_entry *entry;
+	unsigned long oldest_time = 0;
+	unsigned int i;
+	unsigned int e = 0;
+
+	while (atomic_long_read(&mem) > low_thresh) {
+		oldest = NULL;
+
+		for (i = 0; i < ARRAY_SIZE(shards); i++) {
+			shard = &shards[i];
+			spin_lock_bh(&shard->lock);
+			if (!list_empty(&shard->expire_list)) {
+				entry = list_first_entry(&shard->expire_list,
+						struct fragcache_entry,
+						expire_hook);
+				if (!oldest || time_before(entry->dying_time,
+						oldest_time)) {
+					oldest = shard;
+					oldest_time = entry->dying_time;
+				}
+			}
+			spin_unlock_bh(&shard->lock);
+		}
+
+		if (!oldest)
+			break;
+
+		/* Its head might have changed since; whatever it is now is old enough. */
+		spin_lock_bh(&oldest->lock);
+		if (!list_empty(&oldest->expire_list)) {
+			entry = list_first_entry(&oldest->expire_list,
+					struct fragcache_entry, expire_hook);
+			destroy_entry(oldest, entry);
+			e++;
+		}
+		spin_unlock_bh(&oldest->lock);
+	}
+
+	log_debug("Evicted %u fragment cache entries.", e);
+}
+
+static void evict_if_full(void)
+{
+	if (atomic_long_read(&mem) > config_get_frag_high_thresh())
+		evict(config_get_frag_low_thresh());
+}
+
+static void shards_destroy(unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		kfree(shards[i].buckets);
+}
+
+/**
+ * Call during initialization for the remaining functions to work properly.
+ * @is_enabled is the virtual_reassembly module argument.
+ */
+int fragcache_init(bool is_enabled)
+{
+	struct fragcache_shard *shard;
+	unsigned int i, j;
+
+	entry_cache = kmem_cache_create("jool_fragment_cache",
+			sizeof(struct fragcache_entry), 0, 0, NULL);
+	if (!entry_cache) {
+		log_err("Could not allocate the fragment cache.");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		shard = &shards[i];
+
+		shard->bucket_bits = FRAGCACHE_MIN_BUCKET_BITS;
+		shard->buckets = kmalloc_array(1U << shard->bucket_bits,
+				sizeof(*shard->buckets), GFP_KERNEL);
+		if (!shard->buckets) {
+			shards_destroy(i);
+			kmem_cache_destroy(entry_cache);
+			return -ENOMEM;
+		}
+		for (j = 0; j < (1U << shard->bucket_bits); j++)
+			INIT_HLIST_HEAD(&shard->buckets[j]);
+
+		shard->count = 0;
+		INIT_LIST_HEAD(&shard->expire_list);
+		spin_lock_init(&shard->lock);
+
+		init_timer(&shard->expire_timer);
+		shard->expire_timer.function = cleaner_timer;
+		shard->expire_timer.expires = 0;
+		shard->expire_timer.data = i;
+	}
+
+	get_random_bytes(&rnd, sizeof(rnd));
+	enabled = is_enabled;
+
+	return 0;
+}
+
+/**
+ * Empties the cache, freeing memory. Call during destruction to avoid memory
+ * leaks.
+ */
+void fragcache_destroy(void)
+{
+	struct fragcache_shard *shard;
+	struct fragcache_entry *entry;
+	struct fragcache_entry *tmp;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		shard = &shards[i];
+		del_timer_sync(&shard->expire_timer);
+
+		spin_lock_bh(&shard->lock);
+		list_for_each_entry_safe(entry, tmp, &shard->expire_list,
+				expire_hook)
+			destroy_entry(shard, entry);
+		spin_unlock_bh(&shard->lock);
+	}
+
+	shards_destroy(ARRAY_SIZE(shards));
+	kmem_cache_destroy(entry_cache);
+}
+
+bool fragcache_is_enabled(void)
+{
+	return enabled;
+}
+
+/**
+ * Returns how the core is supposed to handle @pkt.
+ */
+enum fragcache_type fragcache_type(struct packet *pkt)
+{
+	struct iphdr *hdr4;
+	bool first;
+
+	if (!enabled)
+		return FRAGCACHE_NONE;
+
+	switch (pkt_l3_proto(pkt)) {
+	case L3PROTO_IPV6:
+		if (!is_fragmented_ipv6(pkt_frag_hdr(pkt)))
+			return FRAGCACHE_NONE;
+		first = is_first_frag6(pkt_frag_hdr(pkt));
+		break;
+	case L3PROTO_IPV4:
+		hdr4 = pkt_ip4_hdr(pkt);
+		if (!is_fragmented_ipv4(hdr4))
+			return FRAGCACHE_NONE;
+		first = is_first_frag4(hdr4);
+		break;
+	default:
+		return FRAGCACHE_NONE;
+	}
+
+	switch (pkt_l4_proto(pkt)) {
+	case L4PROTO_TCP:
+		break;
+	case L4PROTO_UDP:
+		/*
+		 * A zero checksum has to be computed from scratch, and that
+		 * needs the whole payload.
+		 */
+		if (first && pkt_l3_proto(pkt) == L3PROTO_IPV4
+				&& pkt_udp_hdr(pkt)->check == 0) {
+			log_debug("Fragmented zero-checksum UDP packets need to be reassembled.");
+			return FRAGCACHE_UNSUPPORTED;
+		}
+		break;
+	case L4PROTO_ICMP:
+		/* ICMP checksums cover the whole message, and its length. */
+		log_debug("Fragmented ICMP packets need to be reassembled.");
+		return FRAGCACHE_UNSUPPORTED;
+	case L4PROTO_OTHER:
+		/* Whatever the core does with these, fragments won't change it. */
+		return FRAGCACHE_NONE;
+	}
+
+	return first ? FRAGCACHE_FIRST : FRAGCACHE_SUBSEQUENT;
+}
+
+/**
+ * Hands @pkt over to the kernel's reassembler (the one nf_defrag_ipv4 and
+ * nf_defrag_ipv6 would have used, had virtual reassembly been disabled).
+ *
+ * Returns VERDICT_CONTINUE if @pkt completed its packet. @pkt is the whole
+ * packet then; for IPv6 in kernels 3.13 through 4.4, that is a new skb, and
+ * the kernel already released the original one.
+ * Returns VERDICT_STOLEN if the kernel kept (or already dropped) the fragment,
+ * and VERDICT_DROP if it refused to take it.
+ */
+static verdict reassemble(struct packet *pkt)
+{
+	struct sk_buff *skb = pkt->skb;
+	int error;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0) \
+		&& LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+	struct sk_buff *reasm;
+#endif
+
+	switch (pkt_l3_proto(pkt)) {
+	case L3PROTO_IPV4:
+		local_bh_disable();
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+		error = ip_defrag(skb, IP_DEFRAG_CONNTRACK_IN);
+#else
+		error = ip_defrag(dev_net(skb->dev), skb,
+				IP_DEFRAG_CONNTRACK_IN);
+#endif
+		local_bh_enable();
+		if (error)
+			return VERDICT_STOLEN;
+
+		ip_send_check(ip_hdr(skb));
+		error = pkt_init_ipv4(pkt, skb);
+		break;
+
+	case L3PROTO_IPV6:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+		error = nf_ct_frag6_gather(dev_net(skb->dev), skb,
+				IP6_DEFRAG_CONNTRACK_IN);
+		if (error == -EINPROGRESS)
+			return VERDICT_STOLEN;
+		if (error)
+			return VERDICT_DROP;
+
+		error = pkt_init_ipv6(pkt, skb);
+		break;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+		reasm = nf_ct_frag6_gather(skb, IP6_DEFRAG_CONNTRACK_IN);
+		if (!reasm)
+			return VERDICT_STOLEN;
+		if (reasm == skb)
+			return VERDICT_DROP;
+
+		/* reasm is made of clones; the originals are no longer needed. */
+		nf_ct_frag6_consume_orig(reasm);
+		error = pkt_init_ipv6(pkt, reasm);
+		if (error) {
+			kfree_skb(reasm);
+			return VERDICT_STOLEN;
+		}
+		break;
+#else
+		/* In these kernels, nf_defrag_ipv6 can't hand us the packet. */
+		log_debug("This kernel cannot reassemble IPv6 for us; dropping.");
+		return VERDICT_DROP;
+#endif
+
+	default:
+		return VERDICT_DROP;
+	}
+
+	if (error)
+		return VERDICT_DROP;
+
+	log_debug("All the fragments are now available. Resuming translation...");
+	return VERDICT_CONTINUE;
+}
+
+/**
+ * Finds the tuple @pkt (a subsequent fragment) has to be translated with.
+ *
+ * If the first fragment hasn't arrived yet, @pkt is stored and this returns
+ * VERDICT_STOLEN. fragcache_add() will hand it back later.
+ * If the first fragment was not translated, this returns whatever happened to
+ * it.
+ * If the first fragment needed full reassembly, @pkt gets it too (see
+ * fragcache_reassemble()); if this completes the packet, this returns
+ * VERDICT_CONTINUE and @pkt is no longer a fragment.
+ */
+verdict fragcache_get(struct packet *pkt, struct tuple *tuple_out)
+{
+	struct fragcache_key key;
+	struct fragcache_shard *shard;
+	struct fragcache_entry *entry;
+	verdict result;
+	u32 hash;
+
+	evict_if_full();
+
+	init_key(pkt, &key);
+	hash = hash_key(&key);
+	shard = get_shard(hash);
+
+	spin_lock_bh(&shard->lock);
+
+	entry = find_entry(shard, &key, hash);
+	if (entry && entry->resolved) {
+		if (entry->reassemble) {
+			spin_unlock_bh(&shard->lock);
+			return reassemble(pkt);
+		}
+
+		result = entry->fate;
+		if (result == VERDICT_CONTINUE)
+			*tuple_out = entry->tuple;
+		spin_unlock_bh(&shard->lock);
+		return result;
+	}
+
+	if (entry && entry->pending_count >= FRAGCACHE_MAX_PENDING) {
+		spin_unlock_bh(&shard->lock);
+		log_debug("Too many fragments of this packet are waiting for the first one.");
+		return VERDICT_DROP;
+	}
+
+	if (!entry) {
+		entry = create_entry(shard, &key, hash);
+		if (!entry) {
+			spin_unlock_bh(&shard->lock);
+			return VERDICT_DROP;
+		}
+	}
+
+	pkt->skb->next = entry->pending;
+	entry->pending = pkt->skb;
+	entry->pending_count++;
+	entry->truesize += pkt->skb->truesize;
+	atomic_long_add(pkt->skb->truesize, &mem);
+
+	spin_unlock_bh(&shard->lock);
+
+	log_debug("The first fragment hasn't arrived yet; holding this one.");
+	return VERDICT_STOLEN;
+}
+
+/**
+ * Records the first fragment's (@pkt's) outcome.
+ * Returns the fragments that were waiting for it, chained through skb->next.
+ */
+static struct sk_buff *resolve(struct packet *pkt, verdict fate,
+		struct tuple *tuple_out, bool reassemble)
+{
+	struct fragcache_key key;
+	struct fragcache_shard *shard;
+	struct fragcache_entry *entry;
+	struct sk_buff *pending;
+	u32 hash;
+
+	evict_if_full();
+
+	init_key(pkt, &key);
+	hash = hash_key(&key);
+	shard = get_shard(hash);
+
+	spin_lock_bh(&shard->lock);
+
+	entry = find_entry(shard, &key, hash);
+	if (!entry) {
+		entry = create_entry(shard, &key, hash);
+		if (!entry) {
+			spin_unlock_bh(&shard->lock);
+			/* The rest of the fragments will be dropped later. */
+			log_debug("Could not cache the first fragment's outcome.");
+			return NULL;
+		}
+	}
+
+	entry->resolved = true;
+	entry->reassemble = reassemble;
+	entry->fate = fate;
+	if (tuple_out)
+		entry->tuple = *tuple_out;
+	pending = steal_pending(entry);
+
+	spin_unlock_bh(&shard->lock);
+
+	return pending;
+}
+
+/**
+ * The fragments in the @skb chain were stolen from the kernel, so they cannot
+ * be simply accepted anymore. Feeds them to the stack again; this time around,
+ * fragcache_get() will know what to do with them.
+ */
+static void reinject(struct sk_buff *skb)
+{
+	struct sk_buff *next;
+
+	for (; skb; skb = next) {
+		next = skb->next;
+		skb->next = NULL;
+		netif_rx(skb);
+	}
+}
+
+/**
+ * Remembers that the fragments of @pkt (a first fragment) have to be
+ * translated using @tuple_out.
+ *
+ * Returns the subsequent fragments that were waiting for @pkt, chained through
+ * skb->next. They belong to the caller now.
+ */
+struct sk_buff *fragcache_add(struct packet *pkt, struct tuple *tuple_out)
+{
+	return resolve(pkt, VERDICT_CONTINUE, tuple_out, false);
+}
+
+/**
+ * Remembers that @pkt (a first fragment) was not translated; @result is what
+ * the core did with it instead. The rest of its fragments will get the same
+ * treatment.
+ */
+void fragcache_reject(struct packet *pkt, verdict result)
+{
+	struct sk_buff *skb;
+
+	/* Stolen first fragments leave nothing to translate the rest with. */
+	if (result != VERDICT_ACCEPT)
+		result = VERDICT_DROP;
+
+	skb = resolve(pkt, result, NULL, false);
+	if (result == VERDICT_DROP)
+		drop_pending(skb);
+	else
+		reinject(skb);
+}
+
+/**
+ * Falls back to full reassembly for @pkt, a fragment virtual reassembly cannot
+ * translate (FRAGCACHE_UNSUPPORTED, or a first fragment that turned out to be a
+ * hairpin). If @pkt is a first fragment, the rest of its fragments will be
+ * reassembled as well.
+ *
+ * Returns VERDICT_CONTINUE if @pkt completed its packet; @pkt is the whole
+ * packet then. Otherwise returns VERDICT_STOLEN or VERDICT_DROP.
+ */
+verdict fragcache_reassemble(struct packet *pkt)
+{
+	if (!pkt_is_subsequent_frag(pkt))
+		reinject(resolve(pkt, VERDICT_DROP, NULL, true));
+	return reassemble(pkt);
+}
@@ -6,9 +6,23 @@
 
 #include <linux/version.h>
 #include <linux/ip.h>
+#include <linux/jhash.h>
+#include <linux/slab.h>
 #include <linux/ipv6.h>
 #include <net/ipv6.h>
 
+/**
+ * The database is split into 2^FRAGDB_SHARD_BITS shards. Each one has its own
+ * lock, hash table and expiration timer, so unrelated packets do not contend.
+ */
+#define FRAGDB_SHARD_BITS 4
+/** Every shard's hash table starts with 2^FRAGDB_MIN_BUCKET_BITS slots... */
+#define FRAGDB_MIN_BUCKET_BITS 4
+/** ...and never grows past 2^FRAGDB_MAX_BUCKET_BITS slots. */
+#define FRAGDB_MAX_BUCKET_BITS 10
+/** A shard's table grows when it averages more than this many buffers per slot. */
+#define FRAGDB_MAX_LOAD 2
+
 struct reassembly_buffer {
 	/** first fragment (fragment offset zero) of the packet. */
 	struct packet pkt;
@@ -16,18 +30,43 @@ struct reassembly_buffer {
 	struct sk_buff **next_slot;
 	/* Jiffy at which the fragment timer will delete this buffer. */
 	unsigned long dying_time;
-
+	/** hash_function(&pkt); cached so the table can be resized cheaply. */
+	u32 hash;
+	/** Sum of the truesizes of the fragments queued so far. */
+	unsigned int truesize;
+
+	/** Chains this to its slot in its shard's table. */
+	struct hlist_node hash_hook;
+	/** Chains this to its shard's expire_list. */
 	struct list_head list_hook;
 };
 
+struct fragdb_shard {
+	struct hlist_head *buckets;
+	unsigned int bucket_bits;
+	/** Number of buffers in @buckets. */
+	unsigned int count;
+	/** The shard's buffers, sorted by dying_time. */
+	struct list_head expire_list;
+	struct timer_list expire_timer;
+
+	/** Buffers that received all their fragments. */
+	__u64 reassemblies;
+	/** Buffers that were dropped because their fragments took too long. */
+	__u64 timeouts;
+	/** Buffers that were dropped because the database was too big. */
+	__u64 evictions;
+
+	/** Protects all of the above. */
+	spinlock_t lock;
+};
+
 /** Cache for struct reassembly_buffers, for efficient allocation. */
 static struct kmem_cache *buffer_cache;
 
-#define HTABLE_NAME fragdb_table
-#define KEY_TYPE struct packet
-#define VALUE_TYPE struct reassembly_buffer
-#define HASH_TABLE_SIZE 256
-#include "../common/hash_table.c"
+static struct fragdb_shard shards[1 << FRAGDB_SHARD_BITS];
+/** Bytes (truesize) held by all the buffers of all the shards. */
+static atomic_long_t mem = ATOMIC_LONG_INIT(0);
 
 /**
  * Just a random number, initialized at startup.
@@ -37,16 +76,9 @@ static struct kmem_cache *buffer_cache;
  */
 static u32 rnd;
 
-static struct fragdb_table table;
-static DEFINE_SPINLOCK(table_lock);
-
-static struct timer_list expire_timer;
-static LIST_HEAD(expire_list);
-
 
 /**
- * As specified above, the database is (mostly) a hash table. This is one of two functions used
- * internally by the table to search for values.
+ * Decides whether key1 and key2 are fragments of the same packet.
  */
 static bool equals_function(const struct packet *key1, const struct packet *key2)
 {
@@ -70,45 +102,113 @@ static bool equals_function(const struct packet *key1, const struct packet *key2
 	return true;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
 /**
- * Hash function for IPv6 keys from reassembly.c
+ * Hash function for IPv6 keys from reassembly.c (inet6_hash_frag()).
+ * Unlike the kernel's, it is not truncated to INETFRAGS_HASHSZ (64) slots; the
+ * high bits pick the shard and the low bits pick the slot within it.
  */
-static unsigned int inet6_hash_frag(__be32 id, const struct in6_addr *saddr,
+static u32 inet6_hash_frag_full(__be32 id, const struct in6_addr *saddr,
 		const struct in6_addr *daddr, u32 rnd)
 {
-	u32 c;
-	c = jhash_3words(ipv6_addr_hash(saddr), ipv6_addr_hash(daddr), (__force u32)id, rnd);
-	return c & (INETFRAGS_HASHSZ - 1);
+	return jhash_3words(ipv6_addr_hash(saddr), ipv6_addr_hash(daddr),
+			(__force u32)id, rnd);
+}
+
+static u32 hash_function(const struct packet *key)
+{
+	struct ipv6hdr *hdr = pkt_ip6_hdr(key);
+	return inet6_hash_frag_full(pkt_frag_hdr(key)->identification,
+			&hdr->saddr, &hdr->daddr, rnd);
+}
+
+static struct fragdb_shard *get_shard(u32 hash)
+{
+	return &shards[hash >> (32 - FRAGDB_SHARD_BITS)];
+}
+
+static struct hlist_head *get_slot(struct fragdb_shard *shard, u32 hash)
+{
+	return &shard->buckets[hash & ((1U << shard->bucket_bits) - 1)];
 }
-#endif
 
 /**
- * As specified above, the database is a hash table. This is one of two functions used internally
- * by the table to search for values.
+ * Shard lock must be held.
  */
-static unsigned int hash_function(const struct packet *key)
+static struct reassembly_buffer *find_buffer(struct fragdb_shard *shard,
+		u32 hash, struct packet *pkt)
 {
-	struct ipv6hdr *hdr = pkt_ip6_hdr(key);
-	return inet6_hash_frag(pkt_frag_hdr(key)->identification, &hdr->saddr, &hdr->daddr, rnd);
+	struct reassembly_buffer *buffer;
+	struct hlist_node *node;
+
+	hlist_for_each(node, get_slot(shard, hash)) {
+		buffer = hlist_entry(node, struct reassembly_buffer, hash_hook);
+		if (buffer->hash == hash && equals_function(&buffer->pkt, pkt))
+			return buffer;
+	}
+
+	return NULL;
+}
+
+/**
+ * Moves @shard's buffers to a new table of 2^@bits slots.
+ * If the allocation fails, the shard keeps its current table; this is only an
+ * optimization.
+ *
+ * Shard lock must be held.
+ */
+static void resize(struct fragdb_shard *shard, unsigned int bits)
+{
+	struct hlist_head *old = shard->buckets;
+	unsigned int old_size = 1U << shard->bucket_bits;
+	struct reassembly_buffer *buffer;
+	struct hlist_node *node, *tmp;
+	unsigned int i;
+
+	shard->buckets = kmalloc_array(1U << bits, sizeof(*shard->buckets),
+			GFP_ATOMIC);
+	if (!shard->buckets) {
+		shard->buckets = old;
+		return;
+	}
+
+	shard->bucket_bits = bits;
+	for (i = 0; i < (1U << bits); i++)
+		INIT_HLIST_HEAD(&shard->buckets[i]);
+
+	for (i = 0; i < old_size; i++) {
+		hlist_for_each_safe(node, tmp, &old[i]) {
+			buffer = hlist_entry(node, struct reassembly_buffer,
+					hash_hook);
+			hlist_del(node);
+			hlist_add_head(node, get_slot(shard, buffer->hash));
+		}
+	}
+
+	kfree(old);
 }
 
 #define COMMON_MSG " Looks like nf_defrag_ipv6 is not sorting the fragments, " \
 		"or something's shuffling them later. Please report."
-static struct reassembly_buffer *add_pkt(struct packet *pkt)
+/**
+ * Shard lock must be held.
+ */
+static struct reassembly_buffer *add_pkt(struct fragdb_shard *shard, u32 hash,
+		struct packet *pkt)
 {
 	struct reassembly_buffer *buffer;
 	struct frag_hdr *hdr_frag = pkt_frag_hdr(pkt);
 	unsigned int payload_len;
 
 	/* Does it already exist? If so, add to and return existing buffer */
-	buffer = fragdb_table_get(&table, pkt);
+	buffer = find_buffer(shard, hash, pkt);
 	if (buffer) {
 		if (WARN(is_first_frag6(hdr_frag), "Non-first fragment's offset is zero." COMMON_MSG))
 			return NULL;
 
 		*buffer->next_slot = pkt->skb;
 		buffer->next_slot = &pkt->skb->next;
+		buffer->truesize += pkt->skb->truesize;
+		atomic_long_add(pkt->skb->truesize, &mem);
 
 		/* Why this? Dunno, both defrags do it when they support frag_list. */
 		/*
@@ -126,8 +226,14 @@ static struct reassembly_buffer *add_pkt(struct packet *pkt)
 		return buffer;
 	}
 
-	if (WARN(!is_first_frag6(hdr_frag), "First fragment's offset is nonzero." COMMON_MSG))
+	if (!is_first_frag6(hdr_frag)) {
+		/*
+		 * Either nf_defrag_ipv6 did not sort the fragments, or (far more likely) the first
+		 * fragment's buffer already timed out or was evicted.
+		 */
+		log_debug("Fragment has no first fragment to be queued to; dropping.");
 		return NULL;
+	}
 
 	/*
 	 * TODO (fine) Maybe pskb_expand_head() can be used here as fallback.
@@ -152,18 +258,22 @@ static struct reassembly_buffer *add_pkt(struct packet *pkt)
 	buffer->pkt.original_pkt = &buffer->pkt;
 	buffer->next_slot = &skb_shinfo(pkt->skb)->frag_list;
 	buffer->dying_time = jiffies + config_get_ttl_frag();
+	buffer->hash = hash;
+	buffer->truesize = pkt->skb->truesize;
+	atomic_long_add(buffer->truesize, &mem);
 
-	if (is_error(fragdb_table_put(&table, pkt, buffer))) {
-		kmem_cache_free(buffer_cache, buffer);
-		return NULL;
-	}
+	hlist_add_head(&buffer->hash_hook, get_slot(shard, hash));
+	shard->count++;
+	if (shard->count > (FRAGDB_MAX_LOAD << shard->bucket_bits)
+			&& shard->bucket_bits < FRAGDB_MAX_BUCKET_BITS)
+		resize(shard, shard->bucket_bits + 1);
 
 	/* Schedule for automatic deletion */
-	list_add(&buffer->list_hook, expire_list.prev);
-	if (!timer_pending(&expire_timer)) {
-		mod_timer(&expire_timer, buffer->dying_time);
+	list_add_tail(&buffer->list_hook, &shard->expire_list);
+	if (!timer_pending(&shard->expire_timer)) {
+		mod_timer(&shard->expire_timer, buffer->dying_time);
 		log_debug("The fragment cleaning timer will awake in %u msecs.",
-				jiffies_to_msecs(expire_timer.expires - jiffies));
+				jiffies_to_msecs(shard->expire_timer.expires - jiffies));
 	}
 
 	return buffer;
@@ -177,76 +287,147 @@ static void buffer_dealloc(struct reassembly_buffer *buffer)
 }
 
 /**
- * Removes "buffer" from the database and destroys it.
+ * Removes "buffer" from its shard and destroys it.
+ * Shard lock must be held.
  */
-static void buffer_destroy(struct reassembly_buffer *buffer, struct packet *pkt)
+static void buffer_destroy(struct fragdb_shard *shard,
+		struct reassembly_buffer *buffer)
 {
-	if (WARN(!fragdb_table_remove(&table, pkt, NULL),
-			"Something is attempting to delete a buffer that wasn't stored in the database."))
-		return;
-
+	hlist_del(&buffer->hash_hook);
 	list_del(&buffer->list_hook);
+	shard->count--;
+	atomic_long_sub(buffer->truesize, &mem);
 	buffer_dealloc(buffer);
 }
 
 /**
- * Core of the cleaner_timer() function, intended to actually clean the database from obsolete
+ * Core of the cleaner_timer() function, intended to actually clean the shard from obsolete
  * fragments.
  */
-static void clean_expired_buffers(void)
+static void clean_expired_shard(struct fragdb_shard *shard)
 {
 	unsigned int b = 0;
 	struct reassembly_buffer *buffer;
 
-	log_debug("Deleting expired reassembly buffers...");
-
-	spin_lock_bh(&table_lock);
-
-	while (!list_empty(&expire_list)) {
-		buffer = list_entry(expire_list.next, struct reassembly_buffer, list_hook);
+	spin_lock_bh(&shard->lock);
 
-		if (time_after(buffer->dying_time, jiffies)) {
-			spin_unlock_bh(&table_lock);
-			log_debug("Deleted %u reassembly buffers.", b);
-			return;
-		}
+	while (!list_empty(&shard->expire_list)) {
+		buffer = list_entry(shard->expire_list.next, struct reassembly_buffer, list_hook);
+		if (time_after(buffer->dying_time, jiffies))
+			break;
 
-		buffer_destroy(buffer, &buffer->pkt);
+		buffer_destroy(shard, buffer);
 		b++;
 	}
+	shard->timeouts += b;
+
+	/* Give the memory back once the burst is over. */
+	if (shard->count == 0 && shard->bucket_bits > FRAGDB_MIN_BUCKET_BITS)
+		resize(shard, FRAGDB_MIN_BUCKET_BITS);
+
+	spin_unlock_bh(&shard->lock);
 
-	spin_unlock_bh(&table_lock);
-	log_debug("Deleted %u reassembly buffers. The database is now empty.", b);
+	if (b)
+		log_debug("Deleted %u reassembly buffers.", b);
+}
+
+static void clean_expired_buffers(void)
+{
+	unsigned int i;
+
+	log_debug("Deleting expired reassembly buffers...");
+	for (i = 0; i < ARRAY_SIZE(shards); i++)
+		clean_expired_shard(&shards[i]);
 }
 
 /**
- * Executed by the kernel every once in a while to exterminate expired fragments.
+ * Executed by the kernel every once in a while to exterminate the expired fragments of the
+ * shards[param] shard.
  */
 static void cleaner_timer(unsigned long param)
 {
+	struct fragdb_shard *shard = &shards[param];
 	struct reassembly_buffer *buffer;
 	unsigned long next_expire;
 	unsigned long min_time = jiffies + MIN_TIMER_SLEEP;
 
-	clean_expired_buffers();
+	clean_expired_shard(shard);
 
-	spin_lock_bh(&table_lock);
+	spin_lock_bh(&shard->lock);
 
-	if (list_empty(&expire_list)) {
-		spin_unlock_bh(&table_lock);
+	if (list_empty(&shard->expire_list)) {
+		spin_unlock_bh(&shard->lock);
 		/* No need to re-schedule the timer. */
 		return;
 	}
 
 	/* Restart the timer. */
-	buffer = list_entry(expire_list.next, struct reassembly_buffer, list_hook);
+	buffer = list_entry(shard->expire_list.next, struct reassembly_buffer, list_hook);
 	next_expire = buffer->dying_time;
-	spin_unlock_bh(&table_lock);
+	spin_unlock_bh(&shard->lock);
 
 	if (next_expire < min_time)
 		next_expire = min_time;
 
-	mod_timer(&expire_timer, next_expire);
+	mod_timer(&shard->expire_timer, next_expire);
+}
+
+/**
+ * Drops the oldest incomplete packets until the database holds no more than "low_thresh" bytes.
+ * The shards' expire_lists are sorted, so the oldest buffer is at the head of one of them.
+ *
+ * No shard lock may be held.
+ */
+static void evict(unsigned long low_thresh)
+{
+	struct fragdb_shard *shard;
+	struct fragdb_shard *oldest;
+	struct reassembly_buffer *buffer;
+	unsigned long oldest_time = 0;
+	unsigned int i;
+	unsigned int b = 0;
+
+	while (atomic_long_read(&mem) > low_thresh) {
+		oldest = NULL;
+
+		for (i = 0; i < ARRAY_SIZE(shards); i++) {
+			shard = &shards[i];
+			spin_lock_bh(&shard->lock);
+			if (!list_empty(&shard->expire_list)) {
+				buffer = list_first_entry(&shard->expire_list,
+						struct reassembly_buffer, list_hook);
+				if (!oldest || time_before(buffer->dying_time, oldest_time)) {
+					oldest = shard;
+					oldest_time = buffer->dying_time;
+				}
+			}
+			spin_unlock_bh(&shard->lock);
+		}
+
+		if (!oldest)
+			break;
+
+		/* Its head might have changed since; whatever it is now is old enough. */
+		spin_lock_bh(&oldest->lock);
+		if (!list_empty(&oldest->expire_list)) {
+			buffer = list_first_entry(&oldest->expire_list,
+					struct reassembly_buffer, list_hook);
+			buffer_destroy(oldest, buffer);
+			oldest->evictions++;
+			b++;
+		}
+		spin_unlock_bh(&oldest->lock);
+	}
+
+	log_debug("Evicted %u reassembly buffers.", b);
+}
+
+static void shards_destroy(unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		kfree(shards[i].buckets);
 }
 
 /**
@@ -254,7 +435,8 @@ static void cleaner_timer(unsigned long param)
  */
 int fragdb_init(void)
 {
-	int error;
+	struct fragdb_shard *shard;
+	unsigned int i, j;
 
 	buffer_cache = kmem_cache_create("jool_reassembly_buffers", sizeof(struct reassembly_buffer),
 			0, 0, NULL);
@@ -263,16 +445,32 @@ int fragdb_init(void)
 		return -ENOMEM;
 	}
 
-	error = fragdb_table_init(&table, equals_function, hash_function);
-	if (error) {
-		kmem_cache_destroy(buffer_cache);
-		return error;
-	}
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		shard = &shards[i];
 
-	init_timer(&expire_timer);
-	expire_timer.function = cleaner_timer;
-	expire_timer.expires = 0;
-	expire_timer.data = 0;
+		shard->bucket_bits = FRAGDB_MIN_BUCKET_BITS;
+		shard->buckets = kmalloc_array(1U << shard->bucket_bits,
+				sizeof(*shard->buckets), GFP_KERNEL);
+		if (!shard->buckets) {
+			shards_destroy(i);
+			kmem_cache_destroy(buffer_cache);
+			return -ENOMEM;
+		}
+		for (j = 0; j < (1U << shard->bucket_bits); j++)
+			INIT_HLIST_HEAD(&shard->buckets[j]);
+
+		shard->count = 0;
+		shard->reassemblies = 0;
+		shard->timeouts = 0;
+		shard->evictions = 0;
+		INIT_LIST_HEAD(&shard->expire_list);
+		spin_lock_init(&shard->lock);
+
+		init_timer(&shard->expire_timer);
+		shard->expire_timer.function = cleaner_timer;
+		shard->expire_timer.expires = 0;
+		shard->expire_timer.data = i;
+	}
 
 	get_random_bytes(&rnd, sizeof(rnd));
 
@@ -311,7 +509,9 @@ verdict fragdb_handle(struct packet *pkt)
 {
 	/* The fragment collector skb belongs to. */
 	struct reassembly_buffer *buffer;
+	struct fragdb_shard *shard;
 	struct frag_hdr *hdr_frag = pkt_frag_hdr(pkt);
+	u32 hash;
 	int error;
 
 	if (!is_fragmented_ipv6(hdr_frag))
@@ -334,11 +534,16 @@ verdict fragdb_handle(struct packet *pkt)
 	if (error)
 		return VERDICT_DROP;
 
-	spin_lock_bh(&table_lock);
+	if (atomic_long_read(&mem) > config_get_frag_high_thresh())
+		evict(config_get_frag_low_thresh());
+
+	hash = hash_function(pkt);
+	shard = get_shard(hash);
+	spin_lock_bh(&shard->lock);
 
-	buffer = add_pkt(pkt);
+	buffer = add_pkt(shard, hash, pkt);
 	if (!buffer) {
-		spin_unlock_bh(&table_lock);
+		spin_unlock_bh(&shard->lock);
 		return VERDICT_DROP;
 	}
 
@@ -350,7 +555,7 @@ verdict fragdb_handle(struct packet *pkt)
 	 * to reuse it.
 	 */
 	if (is_more_fragments_set_ipv6(hdr_frag)) {
-		spin_unlock_bh(&table_lock);
+		spin_unlock_bh(&shard->lock);
 		return VERDICT_STOLEN;
 	}
 
@@ -358,8 +563,9 @@ verdict fragdb_handle(struct packet *pkt)
 	pkt->original_pkt = pkt;
 	buffer->pkt.skb = NULL;
 	/* Note, at this point, buffer->pkt is invalid. Do not use. */
-	buffer_destroy(buffer, pkt);
-	spin_unlock_bh(&table_lock);
+	buffer_destroy(shard, buffer);
+	shard->reassemblies++;
+	spin_unlock_bh(&shard->lock);
 
 	if (!skb_make_writable(pkt->skb, pkt_l3hdr_len(pkt)))
 		return VERDICT_DROP;
@@ -381,7 +587,40 @@ verdict fragdb_handle(struct packet *pkt)
  */
 void fragdb_destroy(void)
 {
-	del_timer_sync(&expire_timer);
-	fragdb_table_empty(&table, buffer_dealloc);
+	struct fragdb_shard *shard;
+	struct reassembly_buffer *buffer, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		shard = &shards[i];
+		del_timer_sync(&shard->expire_timer);
+		list_for_each_entry_safe(buffer, tmp, &shard->expire_list, list_hook)
+			buffer_destroy(shard, buffer);
+	}
+
+	shards_destroy(ARRAY_SIZE(shards));
 	kmem_cache_destroy(buffer_cache);
 }
+
+/**
+ * Returns the database's current size and lifetime counters.
+ */
+void fragdb_stats(struct response_fragment *stats)
+{
+	struct fragdb_shard *shard;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		shard = &shards[i];
+		spin_lock_bh(&shard->lock);
+		stats->buffers += shard->count;
+		stats->reassemblies += shard->reassemblies;
+		stats->timeouts += shard->timeouts;
+		stats->evictions += shard->evictions;
+		spin_unlock_bh(&shard->lock);
+	}
+
+	stats->mem = atomic_long_read(&mem);
+}
@@ -42,23 +42,29 @@ verdict handling_hairpinning(struct packet *in, struct tuple *tuple_in)
 {
 	struct packet out;
 	struct tuple tuple_out;
+	struct session_entry *session = NULL;
 	verdict result;
 
 	log_debug("Step 5: Handling Hairpinning...");
 
-	result = filtering_and_updating(in, tuple_in);
+	result = filtering_and_updating(in, tuple_in, &session);
 	if (result != VERDICT_CONTINUE)
-		return result;
-	result = compute_out_tuple(tuple_in, &tuple_out, in);
+		goto end;
+	result = compute_out_tuple(tuple_in, session, &tuple_out, in);
 	if (result != VERDICT_CONTINUE)
-		return result;
+		goto end;
 	result = translating_the_packet(&tuple_out, in, &out);
 	if (result != VERDICT_CONTINUE)
-		return result;
+		goto end;
 	result = sendpkt_send(in, &out);
 	if (result != VERDICT_CONTINUE)
-		return result;
+		goto end;
 
 	log_debug("Done step 5.");
-	return VERDICT_CONTINUE;
+	/* Fall through. */
+
+end:
+	if (session)
+		session_return(session);
+	return result;
 }
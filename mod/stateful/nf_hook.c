@@ -6,9 +6,13 @@
 #include "nat64/mod/common/namespace.h"
 #include "nat64/mod/common/nl_handler.h"
 #include "nat64/mod/common/pool6.h"
+#include "nat64/mod/stateful/bib/deterministic.h"
 #include "nat64/mod/stateful/filtering_and_updating.h"
+#include "nat64/mod/stateful/fragment_cache.h"
 #include "nat64/mod/stateful/fragment_db.h"
 #include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/replication.h"
+#include "nat64/mod/stateful/snapshot.h"
 
 #include <linux/kernel.h>
 #include <linux/module.h>
@@ -38,6 +42,14 @@ static bool disabled;
 module_param(disabled, bool, 0);
 MODULE_PARM_DESC(disabled, "Disable the translation at the beginning of the module insertion.");
 
+static bool virtual_reassembly;
+module_param(virtual_reassembly, bool, 0);
+MODULE_PARM_DESC(virtual_reassembly, "Translate fragments as they arrive, instead of reassembling them first.");
+
+static unsigned int syn_cookie_slots;
+module_param(syn_cookie_slots, uint, 0);
+MODULE_PARM_DESC(syn_cookie_slots, "Capacity of the SYN cookie table. Zero scales it with the RAM.");
+
 
 static char *banner = "\n"
 	"                                   ,----,                       \n"
@@ -101,8 +113,10 @@ static int __init nat64_init(void)
 	log_debug("%s", banner);
 	log_debug("Inserting %s...", xlat_get_name());
 
-	nf_defrag_ipv6_enable();
-	nf_defrag_ipv4_enable();
+	if (!virtual_reassembly) {
+		nf_defrag_ipv6_enable();
+		nf_defrag_ipv4_enable();
+	}
 
 	/* Init Jool's submodules. */
 	error = joolns_init();
@@ -120,12 +134,18 @@ static int __init nat64_init(void)
 	error = pool4db_init(pool4_size, pool4, pool4_len);
 	if (error)
 		goto pool4_failure;
-	error = filtering_init();
+	error = replication_init();
+	if (error)
+		goto replication_failure;
+	error = filtering_init(syn_cookie_slots);
 	if (error)
 		goto filtering_failure;
 	error = fragdb_init();
 	if (error)
 		goto fragdb_failure;
+	error = fragcache_init(virtual_reassembly);
+	if (error)
+		goto fragcache_failure;
 #ifdef BENCHMARK
 	error = logtime_init();
 	if (error)
@@ -147,12 +167,18 @@ nf_register_hooks_failure:
 
 log_time_failure:
 #endif
+	fragcache_destroy();
+
+fragcache_failure:
 	fragdb_destroy();
 
 fragdb_failure:
 	filtering_destroy();
 
 filtering_failure:
+	replication_destroy();
+
+replication_failure:
 	pool4db_destroy();
 
 pool4_failure:
@@ -180,7 +206,11 @@ static void __exit nat64_exit(void)
 #ifdef BENCHMARK
 	logtime_destroy();
 #endif
+	fragcache_destroy();
 	fragdb_destroy();
+	snapshot_destroy();
+	detmap_destroy();
+	replication_destroy();
 	filtering_destroy();
 	pool4db_destroy();
 	pool6_destroy();
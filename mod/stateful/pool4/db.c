@@ -2,14 +2,19 @@
 
 #include <linux/hash.h>
 #include <linux/list.h>
+#include <linux/mm.h>
 #include <linux/rculist.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "nat64/common/constants.h"
 #include "nat64/mod/common/rcu.h"
 #include "nat64/mod/common/tags.h"
 #include "nat64/mod/common/types.h"
 #include "nat64/mod/stateful/pool4/table.h"
 #include "nat64/mod/stateful/pool4/empty.h"
+#include "nat64/mod/stateful/pool4/usage.h"
 
 /** Note, this is an array (size 2^@power). */
 static struct hlist_head __rcu *db;
@@ -24,7 +29,66 @@ static unsigned int tables;
  */
 static unsigned int power;
 
-/** Protects @db and @tables, only on updater code. */
+/**
+ * A port range of some address, in the flattened version of pool4.
+ * (See struct pool4_index.)
+ */
+struct pool4_index_range {
+	/** Host byte order, so the ranges can be sorted numerically. */
+	__u32 addr;
+	struct port_range ports;
+};
+
+/**
+ * A flattened copy of pool4 that only knows which transport addresses belong
+ * to it, regardless of mark. It answers pool4db_contains() (which the packet
+ * path calls on every 6-to-4 packet) with a binary search, instead of a visit
+ * to every range of every table.
+ *
+ * It's rebuilt from scratch whenever pool4 changes.
+ */
+struct pool4_index {
+	/** Queues the release of the index once it's been replaced. */
+	struct rcu_head rcu;
+	/** vfree() cannot run in RCU callbacks, so it's deferred to this. */
+	struct work_struct work;
+	/**
+	 * The ranges of protocol "p" are @ranges[@offsets[p]] through
+	 * @ranges[@offsets[p + 1] - 1]. They are sorted and do not touch each
+	 * other.
+	 */
+	unsigned int offsets[L4_PROTO_COUNT + 1];
+	struct pool4_index_range ranges[0];
+};
+
+/**
+ * Index of @db. NULL means it could not be built, so the readers have to fall
+ * back to iterating @db.
+ */
+static struct pool4_index __rcu *members;
+
+/**
+ * The private copy of @db the current pool4 transaction is editing, or NULL if
+ * there is no transaction in progress. Its tables are all staged.
+ */
+static struct hlist_head *staging;
+/** Number of tables in @staging. */
+static unsigned int staging_tables;
+/** Netlink port ID of the client the transaction in @staging belongs to. */
+static __u32 staging_owner;
+/** Jiffy @staging was last touched by its owner. */
+static unsigned long staging_time;
+
+/**
+ * Transactions idle for longer than this can be taken over by other clients.
+ * (In case the owner died without committing or aborting.)
+ */
+#define BATCH_TIMEOUT msecs_to_jiffies(60 * 1000)
+
+/**
+ * Protects @db, @tables, @members and the @staging variables, only on
+ * updater code.
+ */
 static DEFINE_MUTEX(lock);
 
 RCUTAG_FREE
@@ -54,6 +118,220 @@ static struct hlist_head *init_db(unsigned int size)
 	return result;
 }
 
+RCUTAG_FREE
+static void free_index(struct pool4_index *index)
+{
+	if (is_vmalloc_addr(index))
+		vfree(index);
+	else
+		kfree(index);
+}
+
+RCUTAG_USR
+static void index_vfree(struct work_struct *work)
+{
+	vfree(container_of(work, struct pool4_index, work));
+}
+
+RCUTAG_FREE
+static void index_free_rcu(struct rcu_head *rcu)
+{
+	struct pool4_index *index = container_of(rcu, struct pool4_index, rcu);
+
+	if (is_vmalloc_addr(index)) {
+		INIT_WORK(&index->work, index_vfree);
+		schedule_work(&index->work);
+	} else {
+		kfree(index);
+	}
+}
+
+RCUTAG_FREE
+static int compare_index_range(const void *r1, const void *r2)
+{
+	const struct pool4_index_range *range1 = r1;
+	const struct pool4_index_range *range2 = r2;
+
+	if (range1->addr != range2->addr)
+		return (range1->addr < range2->addr) ? -1 : 1;
+	return ((int)range1->ports.min) - range2->ports.min;
+}
+
+/**
+ * Sorts the @count ranges from @ranges, and fuses the ones that overlap or
+ * touch. Returns the new number of ranges.
+ */
+RCUTAG_FREE
+static unsigned int fuse_index_ranges(struct pool4_index_range *ranges,
+		unsigned int count)
+{
+	unsigned int i, last;
+
+	if (!count)
+		return 0;
+
+	sort(ranges, count, sizeof(*ranges), compare_index_range, NULL);
+
+	for (i = 1, last = 0; i < count; i++) {
+		if (ranges[last].addr == ranges[i].addr
+				&& ranges[i].ports.min
+				<= ((unsigned int)ranges[last].ports.max) + 1) {
+			ranges[last].ports.max = max(ranges[last].ports.max,
+					ranges[i].ports.max);
+		} else {
+			ranges[++last] = ranges[i];
+		}
+	}
+
+	return last + 1;
+}
+
+/**
+ * Builds the index of @database. Returns NULL on failure.
+ */
+RCUTAG_USR
+static struct pool4_index *build_index(struct hlist_head *database)
+{
+	struct pool4_index *result;
+	struct pool4_table *table;
+	struct pool4_addr *addr;
+	struct pool4_ports *ports;
+	struct hlist_node *node;
+	unsigned int counts[L4_PROTO_COUNT];
+	unsigned int cursors[L4_PROTO_COUNT];
+	unsigned int total = 0;
+	unsigned int i;
+	size_t size;
+	unsigned int proto;
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < slots(); i++) {
+		hlist_for_each(node, &database[i]) {
+			table = table_entry(node);
+			list_for_each_entry(addr, &table->rows, list_hook)
+				list_for_each_entry(ports, &addr->ports,
+						list_hook)
+					counts[table->proto]++;
+		}
+	}
+
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+		cursors[proto] = total;
+		total += counts[proto];
+	}
+
+	size = sizeof(*result) + total * sizeof(result->ranges[0]);
+	if (size <= PAGE_SIZE)
+		result = kmalloc(size, GFP_KERNEL);
+	else
+		result = vmalloc(size);
+	if (!result)
+		return NULL;
+
+	for (i = 0; i < slots(); i++) {
+		hlist_for_each(node, &database[i]) {
+			table = table_entry(node);
+			list_for_each_entry(addr, &table->rows, list_hook) {
+				list_for_each_entry(ports, &addr->ports,
+						list_hook) {
+					result->ranges[cursors[table->proto]]
+							.addr = be32_to_cpu(
+							addr->addr.s_addr);
+					result->ranges[cursors[table->proto]]
+							.ports = ports->range;
+					cursors[table->proto]++;
+				}
+			}
+		}
+	}
+
+	/* Fuse each protocol's ranges, and pack them to the left. */
+	total = 0;
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+		i = cursors[proto] - counts[proto];
+		memmove(&result->ranges[total], &result->ranges[i],
+				counts[proto] * sizeof(result->ranges[0]));
+		result->offsets[proto] = total;
+		total += fuse_index_ranges(&result->ranges[total],
+				counts[proto]);
+	}
+	result->offsets[L4_PROTO_COUNT] = total;
+
+	return result;
+}
+
+/**
+ * Replaces @members with the index of the current @db. Returns the old index,
+ * which the caller has to free after a grace period.
+ *
+ * @lock must be held.
+ */
+RCUTAG_USR
+static struct pool4_index *swap_index(void)
+{
+	struct hlist_head *database;
+	struct pool4_index *old, *new;
+
+	database = rcu_dereference_protected(db, lockdep_is_held(&lock));
+	new = database ? build_index(database) : NULL;
+	if (database && !new)
+		log_debug("Could not index pool4; lookups will be slower.");
+
+	old = rcu_dereference_protected(members, lockdep_is_held(&lock));
+	rcu_assign_pointer(members, new);
+
+	/* pool4 changed, so the full tables might not be full anymore. */
+	pool4usage_forget_all();
+	return old;
+}
+
+/**
+ * Same as swap_index(), except it also frees the old index once the grace
+ * period is over. (Without waiting for it.)
+ *
+ * @lock must be held.
+ */
+RCUTAG_USR
+static void update_index(void)
+{
+	struct pool4_index *old;
+
+	old = swap_index();
+	if (old)
+		call_rcu_bh(&old->rcu, index_free_rcu);
+}
+
+/**
+ * Returns whether @addr is one of the @proto transport addresses from @index.
+ */
+RCUTAG_FREE
+static bool index_contains(struct pool4_index *index, enum l4_protocol proto,
+		const struct ipv4_transport_addr *addr)
+{
+	struct pool4_index_range *range;
+	unsigned int left, right, middle;
+	__u32 key = be32_to_cpu(addr->l3.s_addr);
+
+	/* Find the last range that starts at or before @addr. */
+	left = index->offsets[proto];
+	right = index->offsets[proto + 1];
+	while (left < right) {
+		middle = left + (right - left) / 2;
+		range = &index->ranges[middle];
+		if (range->addr < key || (range->addr == key
+				&& range->ports.min <= addr->l4))
+			left = middle + 1;
+		else
+			right = middle;
+	}
+
+	if (left == index->offsets[proto])
+		return false;
+
+	range = &index->ranges[left - 1];
+	return range->addr == key && addr->l4 <= range->ports.max;
+}
+
 RCUTAG_USR
 static int add_prefix_strings(char *prefix_strs[], int prefix_count)
 {
@@ -131,6 +409,10 @@ int pool4db_init(unsigned int size, char *prefix_strs[], int prefix_count)
 		return -ENOMEM;
 	rcu_assign_pointer(db, tmp);
 
+	mutex_lock(&lock);
+	update_index();
+	mutex_unlock(&lock);
+
 	error = add_prefix_strings(prefix_strs, prefix_count);
 	if (error)
 		pool4db_destroy();
@@ -155,6 +437,22 @@ static void __destroy(struct hlist_head *db)
 	kfree(db);
 }
 
+/**
+ * Drops the transaction in progress, if any.
+ *
+ * @lock must be held.
+ */
+RCUTAG_USR
+static void discard_staging(void)
+{
+	if (!staging)
+		return;
+
+	__destroy(staging);
+	staging = NULL;
+	staging_tables = 0;
+}
+
 RCUTAG_USR
 static void pool4db_replace(struct hlist_head *new, unsigned int count)
 {
@@ -164,6 +462,7 @@ static void pool4db_replace(struct hlist_head *new, unsigned int count)
 	old = rcu_dereference_protected(db, lockdep_is_held(&lock));
 	rcu_assign_pointer(db, new);
 	tables = count;
+	update_index();
 	mutex_unlock(&lock);
 
 	synchronize_rcu_bh();
@@ -174,7 +473,17 @@ static void pool4db_replace(struct hlist_head *new, unsigned int count)
 RCUTAG_USR
 void pool4db_destroy(void)
 {
+	mutex_lock(&lock);
+	discard_staging();
+	mutex_unlock(&lock);
+
 	pool4db_replace(NULL, 0);
+	/* The BIB is already gone. */
+	pool4usage_flush();
+
+	/* Wait for the deferred releases before the module goes away. */
+	rcu_barrier_bh();
+	flush_scheduled_work();
 }
 
 RCUTAG_PKT /* Assumes locking (whether RCU or mutex) has already been done. */
@@ -204,80 +513,110 @@ static struct pool4_table *find_table(struct hlist_head *database,
 	return NULL;
 }
 
+/**
+ * Adds @prefix and @ports to the @mark/@proto table of @database, which
+ * contains @count tables. @staged tells whether @database is a transaction's
+ * private copy.
+ *
+ * @lock must be held.
+ */
 RCUTAG_USR
-int pool4db_add(const __u32 mark, enum l4_protocol proto,
+static int __add(struct hlist_head *database, unsigned int *count,
+		bool staged, const __u32 mark, enum l4_protocol proto,
 		struct ipv4_prefix *prefix, struct port_range *ports)
 {
-	struct hlist_head *database;
 	struct pool4_table *table;
 	int error;
 
-	mutex_lock(&lock);
-
-	database = rcu_dereference_protected(db, lockdep_is_held(&lock));
 	table = find_table(database, mark, proto);
-	if (!table) {
-		table = pool4table_create(mark, proto);
-		if (!table) {
-			error = -ENOMEM;
-			goto end;
-		}
-
-		error = pool4table_add(table, prefix, ports);
-		if (error) {
-			pool4table_destroy(table);
-			goto end;
-		}
+	if (table)
+		return pool4table_add(table, prefix, ports);
 
-		tables++;
-		hlist_add_head_rcu(&table->hlist_hook,
-				&database[hash_32(mark, power)]);
-		if (tables > slots()) {
-			log_warn_once("You have lots of pool4s, which can lag "
-					"Jool. Consider increasing "
-					"pool4_size.");
-		}
+	table = pool4table_create(mark, proto);
+	if (!table)
+		return -ENOMEM;
+	table->is_staged = staged;
 
-	} else {
-		error = pool4table_add(table, prefix, ports);
+	error = pool4table_add(table, prefix, ports);
+	if (error) {
+		pool4table_destroy(table);
+		return error;
+	}
 
+	(*count)++;
+	hlist_add_head_rcu(&table->hlist_hook, &database[hash_32(mark, power)]);
+	if (*count > slots()) {
+		log_warn_once("You have lots of pool4s, which can lag "
+				"Jool. Consider increasing "
+				"pool4_size.");
 	}
 
-end:
-	mutex_unlock(&lock);
-	return error;
+	return 0;
 }
 
+/**
+ * Removes @prefix and @ports from the @mark/@proto table of @database, which
+ * contains @count tables. @staged tells whether @database is a transaction's
+ * private copy.
+ *
+ * @lock must be held.
+ */
 RCUTAG_USR
-int pool4db_rm(const __u32 mark, enum l4_protocol proto,
+static int __rm(struct hlist_head *database, unsigned int *count,
+		bool staged, const __u32 mark, enum l4_protocol proto,
 		struct ipv4_prefix *prefix, struct port_range *ports)
 {
-	struct hlist_head *database;
 	struct pool4_table *table;
 	int error;
 
-	mutex_lock(&lock);
-
-	database = rcu_dereference_protected(db, lockdep_is_held(&lock));
 	table = find_table(database, mark, proto);
-	if (!table) {
-		error = -ESRCH;
-		goto end;
-	}
+	if (!table)
+		return -ESRCH;
 
 	error = pool4table_rm(table, prefix, ports);
 	if (error)
-		goto end;
+		return error;
 
 	if (pool4table_is_empty(table)) {
 		hlist_del_rcu(&table->hlist_hook);
-		synchronize_rcu_bh();
+		if (!staged)
+			synchronize_rcu_bh();
 		pool4table_destroy(table);
-		tables--;
+		(*count)--;
 	}
 
-end:
+	return 0;
+}
+
+RCUTAG_USR
+int pool4db_add(const __u32 mark, enum l4_protocol proto,
+		struct ipv4_prefix *prefix, struct port_range *ports)
+{
+	int error;
+
+	mutex_lock(&lock);
+	error = __add(rcu_dereference_protected(db, lockdep_is_held(&lock)),
+			&tables, false, mark, proto, prefix, ports);
+	/* Even on failure; some of the addresses might have made it. */
+	update_index();
+	mutex_unlock(&lock);
+
+	return error;
+}
+
+RCUTAG_USR
+int pool4db_rm(const __u32 mark, enum l4_protocol proto,
+		struct ipv4_prefix *prefix, struct port_range *ports)
+{
+	int error;
+
+	mutex_lock(&lock);
+	error = __rm(rcu_dereference_protected(db, lockdep_is_held(&lock)),
+			&tables, false, mark, proto, prefix, ports);
+	if (!error)
+		update_index();
 	mutex_unlock(&lock);
+
 	return error;
 }
 
@@ -294,11 +633,197 @@ int pool4db_flush(void)
 	return 0;
 }
 
+/**
+ * Starts a pool4 transaction. The transaction edits a private copy of pool4,
+ * which is swapped in as a whole by pool4db_batch_commit(). This way, the
+ * packet path never sees half of the changes, and the grace period is paid
+ * once instead of once per range.
+ *
+ * If @replace is true, the copy starts empty (ie. the transaction defines the
+ * complete pool4). Otherwise it starts as a clone of the current pool4.
+ *
+ * The transaction belongs to @owner (the requester's Netlink port ID); the
+ * other pool4db_batch_*() functions refuse to touch it on behalf of anyone
+ * else. Only one transaction can exist at a time, so this fails with -EBUSY
+ * if someone else's is in progress (unless it has been idle for
+ * BATCH_TIMEOUT).
+ * @owner's own uncommitted transaction is discarded.
+ */
+RCUTAG_USR
+int pool4db_batch_begin(__u32 owner, bool replace)
+{
+	struct hlist_head *database;
+	struct hlist_head *new;
+	struct pool4_table *clone;
+	struct hlist_node *node;
+	unsigned int count = 0;
+	unsigned int i;
+
+	new = init_db(slots());
+	if (!new)
+		return -ENOMEM;
+
+	mutex_lock(&lock);
+
+	if (staging && staging_owner != owner
+			&& time_before(jiffies, staging_time + BATCH_TIMEOUT)) {
+		mutex_unlock(&lock);
+		__destroy(new);
+		log_err("Somebody else is in the middle of a pool4 transaction.");
+		return -EBUSY;
+	}
+
+	if (staging)
+		log_debug("Discarding an uncommitted pool4 transaction.");
+	discard_staging();
+
+	if (!replace) {
+		database = rcu_dereference_protected(db,
+				lockdep_is_held(&lock));
+		for (i = 0; i < slots(); i++) {
+			hlist_for_each(node, &database[i]) {
+				clone = pool4table_clone(table_entry(node));
+				if (!clone) {
+					mutex_unlock(&lock);
+					__destroy(new);
+					return -ENOMEM;
+				}
+				hlist_add_head(&clone->hlist_hook, &new[i]);
+				count++;
+			}
+		}
+	}
+
+	staging = new;
+	staging_tables = count;
+	staging_owner = owner;
+	staging_time = jiffies;
+	mutex_unlock(&lock);
+	return 0;
+}
+
+/**
+ * Returns -EINVAL if there is no transaction in progress, and -EBUSY if it
+ * doesn't belong to @owner.
+ *
+ * @lock must be held.
+ */
+RCUTAG_USR
+static int validate_staging(__u32 owner)
+{
+	if (!staging) {
+		log_err("There is no pool4 transaction in progress.");
+		return -EINVAL;
+	}
+	if (staging_owner != owner) {
+		log_err("The pool4 transaction in progress belongs to somebody else.");
+		return -EBUSY;
+	}
+
+	staging_time = jiffies;
+	return 0;
+}
+
+/**
+ * pool4db_add(), except on the current transaction's copy of pool4.
+ */
+RCUTAG_USR
+int pool4db_batch_add(__u32 owner, const __u32 mark, enum l4_protocol proto,
+		struct ipv4_prefix *prefix, struct port_range *ports)
+{
+	int error;
+
+	mutex_lock(&lock);
+	error = validate_staging(owner);
+	if (!error) {
+		error = __add(staging, &staging_tables, true, mark, proto,
+				prefix, ports);
+	}
+	mutex_unlock(&lock);
+
+	return error;
+}
+
+/**
+ * pool4db_rm(), except on the current transaction's copy of pool4.
+ */
+RCUTAG_USR
+int pool4db_batch_rm(__u32 owner, const __u32 mark, enum l4_protocol proto,
+		struct ipv4_prefix *prefix, struct port_range *ports)
+{
+	int error;
+
+	mutex_lock(&lock);
+	error = validate_staging(owner);
+	if (!error) {
+		error = __rm(staging, &staging_tables, true, mark, proto,
+				prefix, ports);
+	}
+	mutex_unlock(&lock);
+
+	return error;
+}
+
+/**
+ * Publishes the current transaction's copy of pool4, and ends the transaction.
+ */
+RCUTAG_USR
+int pool4db_batch_commit(__u32 owner)
+{
+	struct hlist_head *old;
+	struct pool4_index *old_index;
+	struct hlist_node *node;
+	unsigned int i;
+	int error;
+
+	mutex_lock(&lock);
+
+	error = validate_staging(owner);
+	if (error) {
+		mutex_unlock(&lock);
+		return error;
+	}
+
+	for (i = 0; i < slots(); i++)
+		hlist_for_each(node, &staging[i])
+			pool4table_publish(table_entry(node));
+
+	old = rcu_dereference_protected(db, lockdep_is_held(&lock));
+	rcu_assign_pointer(db, staging);
+	tables = staging_tables;
+	staging = NULL;
+	staging_tables = 0;
+	old_index = swap_index();
+
+	mutex_unlock(&lock);
+
+	/* The only grace period of the whole transaction. */
+	synchronize_rcu_bh();
+
+	if (old_index)
+		free_index(old_index);
+	__destroy(old);
+	return 0;
+}
+
+/**
+ * Ends @owner's transaction without publishing it.
+ */
+RCUTAG_USR
+void pool4db_batch_abort(__u32 owner)
+{
+	mutex_lock(&lock);
+	if (staging_owner == owner)
+		discard_staging();
+	mutex_unlock(&lock);
+}
+
 RCUTAG_PKT
 bool pool4db_contains(enum l4_protocol proto, struct ipv4_transport_addr *addr)
 {
 	struct hlist_head *database;
 	struct pool4_table *table;
+	struct pool4_index *index;
 	struct hlist_node *node;
 	unsigned int i;
 	bool found = false;
@@ -310,6 +835,12 @@ bool pool4db_contains(enum l4_protocol proto, struct ipv4_transport_addr *addr)
 		goto end;
 	}
 
+	index = rcu_dereference_bh(members);
+	if (index) {
+		found = index_contains(index, proto, addr);
+		goto end;
+	}
+
 	database = rcu_dereference_bh(db);
 	for (i = 0; i < slots(); i++) {
 		hlist_for_each_rcu_bh(node, &database[i]) {
@@ -333,12 +864,19 @@ RCUTAG_PKT
 bool pool4db_is_empty(void)
 {
 	struct hlist_head *database;
+	struct pool4_index *index;
 	struct hlist_node *node;
 	unsigned int i;
 	bool empty = true;
 
 	rcu_read_lock_bh();
 
+	index = rcu_dereference_bh(members);
+	if (index) {
+		empty = !index->offsets[L4_PROTO_COUNT];
+		goto end;
+	}
+
 	database = rcu_dereference_bh(db);
 	for (i = 0; i < slots(); i++) {
 		hlist_for_each_rcu_bh(node, &database[i]) {
@@ -436,9 +974,9 @@ end:
  * @result: resulting address and port allocation will be placed here.
  */
 RCUTAG_PKT
-int pool4db_foreach_taddr4(struct packet *in, enum l4_protocol l4_proto,
+int pool4db_foreach_range(struct packet *in, enum l4_protocol l4_proto,
 		struct in_addr *daddr,
-		int (*cb)(struct ipv4_transport_addr *, void *), void *arg,
+		int (*cb)(struct pool4_sample *, void *), void *arg,
 		unsigned int offset)
 {
 	struct pool4_table *table;
@@ -447,14 +985,35 @@ int pool4db_foreach_taddr4(struct packet *in, enum l4_protocol l4_proto,
 	rcu_read_lock_bh();
 
 	if (pool4db_is_empty()) {
-		error = pool4empty_foreach_taddr4(in, daddr, cb, arg, offset);
+		error = pool4empty_foreach_range(in, daddr, cb, arg, offset);
 	} else {
 		table = find_table(rcu_dereference_bh(db), in->skb->mark,
 				l4_proto);
-		error = table ? pool4table_foreach_taddr4(table, cb, arg, offset)
+		error = table ? pool4table_foreach_range(table, cb, arg, offset)
 				: -ESRCH;
 	}
 
 	rcu_read_unlock_bh();
 	return error;
 }
+
+/**
+ * Runs pool4table_foreach_slice() on the @mark/@l4_proto table. Unlike
+ * pool4db_foreach_range(), the empty pool4 is not taken into account.
+ */
+RCUTAG_PKT
+int pool4db_foreach_mark_slice(__u32 mark, enum l4_protocol l4_proto,
+		int (*get_offset)(__u64, void *, __u64 *), void *offset_arg,
+		int (*func)(struct pool4_sample *, void *), void *arg)
+{
+	struct pool4_table *table;
+	int error;
+
+	rcu_read_lock_bh();
+	table = find_table(rcu_dereference_bh(db), mark, l4_proto);
+	error = table ? pool4table_foreach_slice(table, get_offset, offset_arg,
+			func, arg) : -ESRCH;
+	rcu_read_unlock_bh();
+
+	return error;
+}
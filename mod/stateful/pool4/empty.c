@@ -110,38 +110,33 @@ static int pick_addr(struct dst_entry *dst, struct in_addr *daddr,
 	return error;
 }
 
-static int foreach_port(struct in_addr *addr,
-		int (*cb)(struct ipv4_transport_addr *, void *), void *arg,
+static int foreach_range(struct in_addr *addr,
+		int (*cb)(struct pool4_sample *, void *), void *arg,
 		unsigned int offset)
 {
 	const unsigned int MIN = DEFAULT_POOL4_MIN_PORT;
 	const unsigned int MAX = DEFAULT_POOL4_MAX_PORT;
-	unsigned int i;
-	struct ipv4_transport_addr tmp;
+	struct pool4_sample sample;
 	int error;
 
 	offset = MIN + (offset % (MAX - MIN + 1));
-	tmp.l3 = *addr;
-
-	for (i = offset; i <= MAX; i++) {
-		tmp.l4 = i;
-		error = cb(&tmp, arg);
-		if (error)
-			return error;
-	}
-
-	for (i = DEFAULT_POOL4_MIN_PORT; i < offset; i++) {
-		tmp.l4 = i;
-		error = cb(&tmp, arg);
-		if (error)
-			return error;
-	}
-
-	return 0;
+	sample.mark = 0;
+	sample.proto = 0;
+	sample.addr = *addr;
+
+	sample.range.min = offset;
+	sample.range.max = MAX;
+	error = cb(&sample, arg);
+	if (error || offset == MIN)
+		return error;
+
+	sample.range.min = MIN;
+	sample.range.max = offset - 1;
+	return cb(&sample, arg);
 }
 
-int pool4empty_foreach_taddr4(struct packet *in, struct in_addr *daddr,
-		int (*cb)(struct ipv4_transport_addr *, void *), void *arg,
+int pool4empty_foreach_range(struct packet *in, struct in_addr *daddr,
+		int (*cb)(struct pool4_sample *, void *), void *arg,
 		unsigned int offset)
 {
 	struct in_addr saddr;
@@ -156,7 +151,7 @@ int pool4empty_foreach_taddr4(struct packet *in, struct in_addr *daddr,
 	if (error)
 		goto end;
 
-	error = foreach_port(&saddr, cb, arg, offset);
+	error = foreach_range(&saddr, cb, arg, offset);
 	/* Fall through. */
 
 end:
@@ -2,8 +2,112 @@
 #include "nat64/mod/common/address.h"
 #include "nat64/mod/common/types.h"
 
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/rculist.h>
+#include <linux/vmalloc.h>
+
+static void free_snapshot(struct pool4_snapshot *snapshot)
+{
+	if (is_vmalloc_addr(snapshot))
+		vfree(snapshot);
+	else
+		kfree(snapshot);
+}
+
+static void snapshot_vfree(struct work_struct *work)
+{
+	vfree(container_of(work, struct pool4_snapshot, work));
+}
+
+static void snapshot_free_rcu(struct rcu_head *rcu)
+{
+	struct pool4_snapshot *snapshot;
+
+	snapshot = container_of(rcu, struct pool4_snapshot, rcu);
+	if (is_vmalloc_addr(snapshot)) {
+		INIT_WORK(&snapshot->work, snapshot_vfree);
+		schedule_work(&snapshot->work);
+	} else {
+		kfree(snapshot);
+	}
+}
+
+/**
+ * The writers are serialized by the caller, so they are the only ones who can
+ * use this.
+ */
+static struct pool4_snapshot *get_snapshot(struct pool4_table *table)
+{
+	return rcu_dereference_protected(table->snapshot, true);
+}
+
+/**
+ * Replaces @table's snapshot with a fresh copy of its rows.
+ *
+ * If the copy cannot be allocated, the snapshot is dropped, so the readers
+ * don't get stale answers.
+ *
+ * The old snapshot is released after the grace period, without waiting for
+ * it. (The owner of the tables has to rcu_barrier_bh() and
+ * flush_scheduled_work() before the module goes away.)
+ */
+static void update_snapshot(struct pool4_table *table)
+{
+	struct pool4_snapshot *old, *new;
+	struct pool4_flat_range *flat;
+	struct pool4_addr *addr;
+	struct pool4_ports *ports;
+	unsigned int count = 0;
+	size_t size;
+
+	list_for_each_entry(addr, &table->rows, list_hook)
+		list_for_each_entry(ports, &addr->ports, list_hook)
+			count++;
+
+	size = sizeof(*new) + count * sizeof(new->ranges[0]);
+	if (size <= PAGE_SIZE)
+		new = kmalloc(size, GFP_KERNEL);
+	else
+		new = vmalloc(size);
+
+	if (new) {
+		new->addrs = 0;
+		new->taddrs = 0;
+		new->count = count;
+		flat = new->ranges;
+		list_for_each_entry(addr, &table->rows, list_hook) {
+			new->addrs++;
+			list_for_each_entry(ports, &addr->ports, list_hook) {
+				flat->addr = addr->addr;
+				flat->range = ports->range;
+				flat->offset = new->taddrs;
+				new->taddrs += port_range_count(&ports->range);
+				flat++;
+			}
+		}
+	} else {
+		log_debug("Could not snapshot pool4 table %u; iteration will be slower.",
+				table->mark);
+	}
+
+	old = get_snapshot(table);
+	rcu_assign_pointer(table->snapshot, new);
+
+	if (old)
+		call_rcu_bh(&old->rcu, snapshot_free_rcu);
+}
+
+/**
+ * Waits until the packet path can no longer be looking at whatever was just
+ * unlinked from @table. Staged tables are private, so there's nothing to wait
+ * for.
+ */
+static void wait_for_readers(struct pool4_table *table)
+{
+	if (!table->is_staged)
+		synchronize_rcu_bh();
+}
 
 struct pool4_table *pool4table_create(__u32 mark, enum l4_protocol proto)
 {
@@ -16,6 +120,9 @@ struct pool4_table *pool4table_create(__u32 mark, enum l4_protocol proto)
 	result->mark = mark;
 	result->proto = proto;
 	INIT_LIST_HEAD(&result->rows);
+	/* The first pool4table_add() will take care of it. */
+	RCU_INIT_POINTER(result->snapshot, NULL);
+	result->is_staged = false;
 	return result;
 }
 
@@ -37,15 +144,68 @@ void pool4table_destroy(struct pool4_table *table)
 		kfree(addr);
 	}
 
+	if (get_snapshot(table))
+		free_snapshot(get_snapshot(table));
 	kfree(table);
 }
 
+/**
+ * Returns a staged copy of @table's rows. (See struct pool4_table.is_staged.)
+ */
+struct pool4_table *pool4table_clone(struct pool4_table *table)
+{
+	struct pool4_table *result;
+	struct pool4_addr *addr, *new_addr;
+	struct pool4_ports *ports, *new_ports;
+
+	result = pool4table_create(table->mark, table->proto);
+	if (!result)
+		return NULL;
+	result->is_staged = true;
+
+	list_for_each_entry(addr, &table->rows, list_hook) {
+		new_addr = kmalloc(sizeof(*new_addr), GFP_KERNEL);
+		if (!new_addr)
+			goto fail;
+		new_addr->addr = addr->addr;
+		INIT_LIST_HEAD(&new_addr->ports);
+		list_add_tail(&new_addr->list_hook, &result->rows);
+
+		list_for_each_entry(ports, &addr->ports, list_hook) {
+			new_ports = pool4_ports_create(ports->range.min,
+					ports->range.max);
+			if (!new_ports)
+				goto fail;
+			list_add_tail(&new_ports->list_hook, &new_addr->ports);
+		}
+	}
+
+	return result;
+
+fail:
+	pool4table_destroy(result);
+	return NULL;
+}
+
+/**
+ * Readies staged @table for the packet path. Has to be called before @table
+ * becomes visible to it.
+ */
+void pool4table_publish(struct pool4_table *table)
+{
+	table->is_staged = false;
+	update_snapshot(table);
+}
+
 static unsigned int count_ports(struct pool4_table *table)
 {
 	struct pool4_addr *addr;
 	struct pool4_ports *ports;
 	unsigned int result = 0;
 
+	if (get_snapshot(table))
+		return get_snapshot(table)->taddrs;
+
 	list_for_each_entry_rcu(addr, &table->rows, list_hook) {
 		list_for_each_entry_rcu(ports, &addr->ports, list_hook) {
 			result += port_range_count(&ports->range);
@@ -62,7 +222,8 @@ static void fuse(struct port_range *first, struct port_range *second,
 	result->max = max(first->max, second->max);
 }
 
-static bool try_fusion(struct pool4_addr *addr, struct port_range *range)
+static bool try_fusion(struct pool4_table *table, struct pool4_addr *addr,
+		struct port_range *range)
 {
 	struct pool4_ports *ports, *tmp;
 	struct pool4_ports *fusion = NULL;
@@ -72,7 +233,7 @@ static bool try_fusion(struct pool4_addr *addr, struct port_range *range)
 			continue;
 
 		list_del_rcu(&ports->list_hook);
-		synchronize_rcu_bh();
+		wait_for_readers(table);
 
 		if (fusion) {
 			fuse(&ports->range, &fusion->range, &fusion->range);
@@ -91,11 +252,12 @@ static bool try_fusion(struct pool4_addr *addr, struct port_range *range)
 	return false;
 }
 
-static int add_ports(struct pool4_addr *addr, struct port_range *range)
+static int add_ports(struct pool4_table *table, struct pool4_addr *addr,
+		struct port_range *range)
 {
 	struct pool4_ports *ports;
 
-	if (try_fusion(addr, range))
+	if (try_fusion(table, addr, range))
 		return 0;
 
 	ports = kmalloc(sizeof(*ports), GFP_KERNEL);
@@ -123,7 +285,7 @@ static int add_sample(struct pool4_table *table, struct pool4_sample *sample)
 
 	list_for_each_entry(addr, &table->rows, list_hook) {
 		if (addr4_equals(&addr->addr, &sample->addr))
-			return add_ports(addr, &sample->range);
+			return add_ports(table, addr, &sample->range);
 	}
 
 	addr = kmalloc(sizeof(*addr), GFP_KERNEL);
@@ -132,7 +294,7 @@ static int add_sample(struct pool4_table *table, struct pool4_sample *sample)
 	addr->addr = sample->addr;
 	INIT_LIST_HEAD(&addr->ports);
 
-	error = add_ports(addr, &sample->range);
+	error = add_ports(table, addr, &sample->range);
 	if (error) {
 		kfree(addr);
 		return error;
@@ -193,7 +355,7 @@ int pool4table_add(struct pool4_table *table, struct ipv4_prefix *prefix,
 	 *
 	 * In order to achieve address preservation (ie. always *try* to mask an
 	 * IPv6 node with the same IPv4 address or addresses),
-	 * pool4table_foreach_taddr4() (which is the key function used during
+	 * pool4table_foreach_range() (which is the key function used during
 	 * port allocations) needs to group transport addresses by address. This
 	 * is so port allocations will *try* to use up all of an address's ports
 	 * before falling back to testing ports on the next one.
@@ -230,10 +392,14 @@ int pool4table_add(struct pool4_table *table, struct ipv4_prefix *prefix,
 			break;
 	}
 
+	/* Even on failure; some of the addresses might have made it. */
+	if (!table->is_staged)
+		update_snapshot(table);
 	return error;
 }
 
-static int rm_range(struct pool4_addr *addr, const struct port_range *rm)
+static int rm_range(struct pool4_table *table, struct pool4_addr *addr,
+		const struct port_range *rm)
 {
 	struct pool4_ports *ports, *tmpp;
 	struct pool4_ports *new1;
@@ -250,7 +416,7 @@ static int rm_range(struct pool4_addr *addr, const struct port_range *rm)
 				list_del_rcu(&addr->list_hook);
 			}
 
-			synchronize_rcu_bh();
+			wait_for_readers(table);
 			kfree(ports);
 			kfree(tmp);
 			continue;
@@ -301,7 +467,7 @@ static int rm_sample(struct pool4_table *table, struct pool4_sample *sample)
 
 	list_for_each_entry(addr, &table->rows, list_hook) {
 		if (addr4_equals(&addr->addr, &sample->addr))
-			return rm_range(addr, &sample->range);
+			return rm_range(table, addr, &sample->range);
 	}
 
 	return 0;
@@ -327,6 +493,8 @@ int pool4table_rm(struct pool4_table *table, struct ipv4_prefix *prefix,
 			break;
 	}
 
+	if (!table->is_staged)
+		update_snapshot(table);
 	return error;
 }
 
@@ -377,76 +545,203 @@ int pool4table_foreach_sample(struct pool4_table *table,
 }
 
 /**
- * pool4table_foreach_port - run @func on every transport address on @table.
+ * Returns the index of the range from @snapshot that contains its @offset'th
+ * transport address. @offset has to be smaller than @snapshot->taddrs.
+ */
+static unsigned int find_range(struct pool4_snapshot *snapshot,
+		unsigned int offset)
+{
+	unsigned int left = 0;
+	unsigned int right = snapshot->count;
+	unsigned int middle;
+
+	/* Find the last range that starts at or before @offset. */
+	while (left < right) {
+		middle = left + (right - left) / 2;
+		if (snapshot->ranges[middle].offset <= offset)
+			left = middle + 1;
+		else
+			right = middle;
+	}
+
+	return left - 1;
+}
+
+static int foreach_flat_range(struct pool4_table *table,
+		struct pool4_snapshot *snapshot,
+		int (*func)(struct pool4_sample *, void *), void *arg,
+		unsigned int offset)
+{
+	struct pool4_flat_range *flat;
+	struct pool4_sample sample;
+	unsigned int first;
+	unsigned int skip;
+	unsigned int i;
+	int error;
+
+	if (snapshot->taddrs == 0)
+		return 0;
+	offset %= snapshot->taddrs;
+
+	first = find_range(snapshot, offset);
+	skip = offset - snapshot->ranges[first].offset;
+
+	sample.mark = table->mark;
+	sample.proto = table->proto;
+
+	for (i = first; i < snapshot->count; i++) {
+		flat = &snapshot->ranges[i];
+		sample.addr = flat->addr;
+		sample.range = flat->range;
+		sample.range.min += (i == first) ? skip : 0;
+		error = func(&sample, arg);
+		if (error)
+			return error;
+	}
+
+	/* Wrap around. */
+	for (i = 0; i < first; i++) {
+		flat = &snapshot->ranges[i];
+		sample.addr = flat->addr;
+		sample.range = flat->range;
+		error = func(&sample, arg);
+		if (error)
+			return error;
+	}
+
+	if (!skip)
+		return 0;
+
+	flat = &snapshot->ranges[first];
+	sample.addr = flat->addr;
+	sample.range.min = flat->range.min;
+	sample.range.max = flat->range.min + skip - 1;
+	return func(&sample, arg);
+}
+
+/**
+ * pool4table_foreach_range - run @func on every transport address on @table,
+ * one port range at a time.
  * @table: sample collection that will be iterated.
- * @func: callback to be run for every transport address in @table.
+ * @func: callback to be run for every range of transport addresses in @table.
+ *	@func receives samples whose range might be a slice of the original.
  * @arg: additional argument to send to @func on every iteration.
- * @offset: iteration will start from the @offset'th element (inclusive).
+ * @offset: iteration will start from the @offset'th transport address
+ *	(inclusive).
  *
- * Iterations wraps around and doesn't stop naturally until the @offset'th
- * element is reached. You want @func to break iteration early!
+ * The transport addresses are visited in the same order as if the ranges were
+ * expanded: Iteration starts in the middle of the range that contains the
+ * @offset'th transport address, wraps around, and stops right before it. You
+ * want @func to break iteration early!
  */
-int pool4table_foreach_taddr4(struct pool4_table *table,
-		int (*func)(struct ipv4_transport_addr *, void *), void *arg,
-		unsigned int offset_main)
+int pool4table_foreach_range(struct pool4_table *table,
+		int (*func)(struct pool4_sample *, void *), void *arg,
+		unsigned int offset)
 {
 	struct pool4_addr *addr;
 	struct pool4_ports *ports;
-	struct ipv4_transport_addr tmp;
+	struct pool4_sample sample;
+	struct pool4_ports *first = NULL;
+	struct pool4_snapshot *snapshot;
+	struct in_addr first_addr;
 	unsigned int num_ports;
-	unsigned int offset;
-	unsigned int i;
-	int error = 0;
+	unsigned int skip = 0;
+	int error;
+
+	snapshot = rcu_dereference_bh(table->snapshot);
+	if (snapshot)
+		return foreach_flat_range(table, snapshot, func, arg, offset);
 
 	num_ports = count_ports(table);
 	if (num_ports == 0)
 		return 0;
-	offset_main %= num_ports;
+	offset %= num_ports;
+
+	sample.mark = table->mark;
+	sample.proto = table->proto;
 
-	offset = offset_main;
 	list_for_each_entry_rcu(addr, &table->rows, list_hook) {
-		tmp.l3 = addr->addr;
+		sample.addr = addr->addr;
 		list_for_each_entry_rcu(ports, &addr->ports, list_hook) {
-			num_ports = port_range_count(&ports->range);
-
-			if (offset > num_ports) {
-				offset -= num_ports;
-				continue;
+			if (!first) {
+				num_ports = port_range_count(&ports->range);
+				if (offset >= num_ports) {
+					offset -= num_ports;
+					continue;
+				}
+				first = ports;
+				first_addr = addr->addr;
+				skip = offset;
 			}
 
-			for (i = offset; i < num_ports; i++) {
-				tmp.l4 = ports->range.min + i;
-				error = func(&tmp, arg);
-				if (error)
-					return error;
-			}
-			offset = 0;
+			sample.range = ports->range;
+			sample.range.min += (ports == first) ? skip : 0;
+			error = func(&sample, arg);
+			if (error)
+				return error;
 		}
 	}
 
-	offset = offset_main;
+	/* The ranges changed under our feet; never mind. */
+	if (!first)
+		return 0;
+
+	/* Wrap around. */
 	list_for_each_entry_rcu(addr, &table->rows, list_hook) {
-		tmp.l3 = addr->addr;
+		sample.addr = addr->addr;
 		list_for_each_entry_rcu(ports, &addr->ports, list_hook) {
-			num_ports = port_range_count(&ports->range);
-
-			for (i = 0; i < num_ports; i++) {
-				if (i >= offset)
+			if (ports == first) {
+				if (!skip)
 					return 0;
-
-				tmp.l4 = ports->range.min + i;
-				error = func(&tmp, arg);
-				if (error)
-					return error;
+				sample.addr = first_addr;
+				sample.range.min = ports->range.min;
+				sample.range.max = ports->range.min + skip - 1;
+				return func(&sample, arg);
 			}
 
-			offset -= num_ports;
+			sample.range = ports->range;
+			error = func(&sample, arg);
+			if (error)
+				return error;
 		}
 	}
 
 	return 0;
 }
 
+/**
+ * Same as pool4table_foreach_range(), except the offset is chosen by
+ * @get_offset, which receives the number of transport addresses @table has
+ * (and @offset_arg). Both the count and the iteration are taken from the same
+ * snapshot of @table, so they agree even if pool4 changes in the meantime.
+ * (If there's no snapshot, the rows are walked twice; best effort.)
+ *
+ * If @get_offset returns nonzero, nothing is iterated and that is the result.
+ */
+int pool4table_foreach_slice(struct pool4_table *table,
+		int (*get_offset)(__u64, void *, __u64 *), void *offset_arg,
+		int (*func)(struct pool4_sample *, void *), void *arg)
+{
+	struct pool4_snapshot *snapshot;
+	__u64 taddrs;
+	__u64 offset;
+	int error;
+
+	snapshot = rcu_dereference_bh(table->snapshot);
+	taddrs = snapshot ? snapshot->taddrs : count_ports(table);
+
+	error = get_offset(taddrs, offset_arg, &offset);
+	if (error)
+		return error;
+	/* validate_overflow() also keeps @offset within an unsigned int. */
+	if (offset >= taddrs)
+		return -ESRCH;
+
+	return snapshot
+			? foreach_flat_range(table, snapshot, func, arg, offset)
+			: pool4table_foreach_range(table, func, arg, offset);
+}
+
 /**
  * pool4table_contains - is @taddr listed within @table?
  */
@@ -478,9 +773,17 @@ bool pool4table_is_empty(struct pool4_table *table)
 
 void pool4table_count(struct pool4_table *table, __u64 *samples, __u64 *taddrs)
 {
+	struct pool4_snapshot *snapshot;
 	struct pool4_addr *addr;
 	struct pool4_ports *ports;
 
+	snapshot = rcu_dereference_bh(table->snapshot);
+	if (snapshot) {
+		(*samples) += snapshot->addrs;
+		(*taddrs) += snapshot->taddrs;
+		return;
+	}
+
 	list_for_each_entry_rcu(addr, &table->rows, list_hook) {
 		(*samples)++;
 		list_for_each_entry_rcu(ports, &addr->ports, list_hook) {
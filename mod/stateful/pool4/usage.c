@@ -0,0 +1,439 @@
+#include "nat64/mod/stateful/pool4/usage.h"
+
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include "nat64/mod/common/address.h"
+#include "nat64/mod/common/rcu.h"
+
+/** Each protocol's counters are split into 2^USAGE_SHARD_BITS shards, by mark. */
+#define USAGE_SHARD_BITS 4
+/** Each shard's hash tables have 2^USAGE_HASH_BITS buckets. */
+#define USAGE_HASH_BITS 6
+
+/** Transport addresses of one address that one mark's entries are using. */
+struct usage_addr {
+	__u32 mark;
+	struct in_addr addr;
+	unsigned int used;
+	/** Chains this to its bucket in usage_shard.addrs. */
+	struct hlist_node hook;
+};
+
+/** Transport addresses of one pool4 table that the entries are using. */
+struct usage_table {
+	__u32 mark;
+	unsigned int used;
+	/**
+	 * Did the port allocator fail to find a free transport address in this
+	 * table, and nothing has been freed since?
+	 * Written under the shard's lock, but read without it.
+	 */
+	bool exhausted;
+	/** Chains this to its bucket in usage_shard.tables. */
+	struct hlist_node hook;
+	struct rcu_head rcu;
+};
+
+/**
+ * The counters of the marks that hash into one shard.
+ * They only exist while they are nonzero (or the table is exhausted).
+ */
+struct usage_shard {
+	struct hlist_head addrs[1 << USAGE_HASH_BITS];
+	/** RCU-protected, so the exhaustion flags can be read locklessly. */
+	struct hlist_head tables[1 << USAGE_HASH_BITS];
+	spinlock_t lock;
+};
+
+/** The counters of one protocol. */
+struct usage_db {
+	struct usage_shard shards[1 << USAGE_SHARD_BITS];
+	/**
+	 * Bumped every time a transport address might have been freed.
+	 * Protects pool4usage_set_exhausted() from scans that raced with it.
+	 * (Tables of different marks can share addresses, so this is not
+	 * per shard.)
+	 */
+	atomic_long_t epoch;
+	/** Number of tables currently flagged as exhausted. */
+	atomic_t exhausted;
+};
+
+static struct usage_db dbs[L4_PROTO_COUNT] = {
+	[0 ... L4_PROTO_COUNT - 1] = {
+		.shards = {
+			[0 ... (1 << USAGE_SHARD_BITS) - 1] = {
+				.lock = __SPIN_LOCK_UNLOCKED(dbs.shards.lock),
+			},
+		},
+		.epoch = ATOMIC_LONG_INIT(0),
+		.exhausted = ATOMIC_INIT(0),
+	},
+};
+
+static struct usage_shard *get_shard(l4_protocol proto, __u32 mark)
+{
+	return &dbs[proto].shards[hash_32(mark, USAGE_SHARD_BITS)];
+}
+
+static struct hlist_head *addr_slot(struct usage_shard *shard, __u32 mark,
+		const struct in_addr *addr)
+{
+	return &shard->addrs[hash_32(mark ^ (__force __u32)addr->s_addr,
+			USAGE_HASH_BITS)];
+}
+
+static struct hlist_head *table_slot(struct usage_shard *shard, __u32 mark)
+{
+	return &shard->tables[hash_32(mark, USAGE_HASH_BITS)];
+}
+
+/**
+ * Shard lock must be held.
+ */
+static struct usage_addr *find_addr(struct usage_shard *shard, __u32 mark,
+		const struct in_addr *addr)
+{
+	struct usage_addr *usage;
+	struct hlist_node *node;
+
+	hlist_for_each(node, addr_slot(shard, mark, addr)) {
+		usage = hlist_entry(node, struct usage_addr, hook);
+		if (usage->mark == mark && addr4_equals(&usage->addr, addr))
+			return usage;
+	}
+
+	return NULL;
+}
+
+/**
+ * Requires the shard lock or rcu_read_lock_bh().
+ */
+static struct usage_table *find_table(struct usage_shard *shard, __u32 mark)
+{
+	struct usage_table *table;
+	struct hlist_node *node;
+
+	hlist_for_each_rcu_bh(node, table_slot(shard, mark)) {
+		table = hlist_entry(node, struct usage_table, hook);
+		if (table->mark == mark)
+			return table;
+	}
+
+	return NULL;
+}
+
+/**
+ * Shard lock must be held.
+ */
+static struct usage_table *get_table(struct usage_shard *shard, __u32 mark)
+{
+	struct usage_table *table;
+
+	table = find_table(shard, mark);
+	if (table)
+		return table;
+
+	table = kzalloc(sizeof(*table), GFP_ATOMIC);
+	if (!table)
+		return NULL;
+	table->mark = mark;
+	hlist_add_head_rcu(&table->hook, table_slot(shard, mark));
+	return table;
+}
+
+/**
+ * Shard lock must be held.
+ */
+static void unlatch(l4_protocol proto, struct usage_table *table)
+{
+	if (table->exhausted) {
+		table->exhausted = false;
+		atomic_dec(&dbs[proto].exhausted);
+	}
+}
+
+static void table_free(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct usage_table, rcu));
+}
+
+/**
+ * Shard lock must be held.
+ */
+static void maybe_free_table(struct usage_table *table)
+{
+	if (!table->used && !table->exhausted) {
+		hlist_del_rcu(&table->hook);
+		call_rcu_bh(&table->rcu, table_free);
+	}
+}
+
+/**
+ * Records that one of @addr's transport addresses is being used by an entry
+ * that was masked by @mark's table.
+ */
+int pool4usage_charge(__u32 mark, l4_protocol proto,
+		const struct in_addr *addr)
+{
+	struct usage_shard *shard = get_shard(proto, mark);
+	struct usage_table *table;
+	struct usage_addr *usage;
+	int error = 0;
+
+	spin_lock_bh(&shard->lock);
+
+	table = get_table(shard, mark);
+	if (!table) {
+		error = -ENOMEM;
+		goto end;
+	}
+
+	usage = find_addr(shard, mark, addr);
+	if (!usage) {
+		usage = kzalloc(sizeof(*usage), GFP_ATOMIC);
+		if (!usage) {
+			maybe_free_table(table);
+			error = -ENOMEM;
+			goto end;
+		}
+		usage->mark = mark;
+		usage->addr = *addr;
+		hlist_add_head(&usage->hook, addr_slot(shard, mark, addr));
+	}
+
+	usage->used++;
+	table->used++;
+	/* Fall through. */
+
+end:
+	spin_unlock_bh(&shard->lock);
+	return error;
+}
+
+/**
+ * Reverts pool4usage_charge().
+ *
+ * Tables of different marks can share @addr, so the freed transport address
+ * might also be room for them. This module doesn't know which tables cover
+ * @addr, so all of @proto's exhausted tables are released.
+ */
+void pool4usage_refund(__u32 mark, l4_protocol proto,
+		const struct in_addr *addr)
+{
+	struct usage_shard *shard = get_shard(proto, mark);
+	struct usage_table *table;
+	struct usage_addr *usage;
+
+	spin_lock_bh(&shard->lock);
+
+	atomic_long_inc(&dbs[proto].epoch);
+	table = find_table(shard, mark);
+	usage = find_addr(shard, mark, addr);
+	if (WARN(!table || !usage, "pool4 usage is out of sync."))
+		goto end;
+
+	if (--usage->used == 0) {
+		hlist_del(&usage->hook);
+		kfree(usage);
+	}
+	table->used--;
+	unlatch(proto, table);
+	maybe_free_table(table);
+	/* Fall through. */
+
+end:
+	spin_unlock_bh(&shard->lock);
+
+	/* Exhaustion is rare, so this is usually skipped. */
+	if (atomic_read(&dbs[proto].exhausted))
+		pool4usage_forget(proto);
+}
+
+/**
+ * Assumes every @proto table might have free transport addresses again.
+ *
+ * This is for the transport addresses that were freed by entries that weren't
+ * charged to any table (such as the static ones).
+ */
+void pool4usage_forget(l4_protocol proto)
+{
+	struct usage_db *db = &dbs[proto];
+	struct usage_shard *shard;
+	struct usage_table *table;
+	struct hlist_node *node, *tmp;
+	unsigned int s, i;
+
+	atomic_long_inc(&db->epoch);
+	for (s = 0; s < ARRAY_SIZE(db->shards); s++) {
+		shard = &db->shards[s];
+		spin_lock_bh(&shard->lock);
+		for (i = 0; i < ARRAY_SIZE(shard->tables); i++) {
+			hlist_for_each_safe(node, tmp, &shard->tables[i]) {
+				table = hlist_entry(node, struct usage_table,
+						hook);
+				unlatch(proto, table);
+				maybe_free_table(table);
+			}
+		}
+		spin_unlock_bh(&shard->lock);
+	}
+}
+
+/**
+ * Assumes every table might have free transport addresses again. Meant for
+ * when pool4 changes.
+ */
+void pool4usage_forget_all(void)
+{
+	unsigned int proto;
+
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++)
+		pool4usage_forget(proto);
+}
+
+/**
+ * Drops every counter. Meant for when the BIB is gone.
+ */
+void pool4usage_flush(void)
+{
+	struct usage_shard *shard;
+	struct usage_table *table;
+	struct hlist_node *node, *tmp;
+	unsigned int proto;
+	unsigned int s, i;
+
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+		atomic_long_inc(&dbs[proto].epoch);
+
+		for (s = 0; s < ARRAY_SIZE(dbs[proto].shards); s++) {
+			shard = &dbs[proto].shards[s];
+			spin_lock_bh(&shard->lock);
+
+			for (i = 0; i < ARRAY_SIZE(shard->addrs); i++) {
+				hlist_for_each_safe(node, tmp,
+						&shard->addrs[i]) {
+					hlist_del(node);
+					kfree(hlist_entry(node,
+							struct usage_addr,
+							hook));
+				}
+			}
+			for (i = 0; i < ARRAY_SIZE(shard->tables); i++) {
+				hlist_for_each_safe(node, tmp,
+						&shard->tables[i]) {
+					table = hlist_entry(node,
+							struct usage_table,
+							hook);
+					unlatch(proto, table);
+					hlist_del_rcu(node);
+					call_rcu_bh(&table->rcu, table_free);
+				}
+			}
+
+			spin_unlock_bh(&shard->lock);
+		}
+	}
+}
+
+/**
+ * Returns the current epoch of @proto. Query it before scanning a table, and
+ * hand it over to pool4usage_set_exhausted() if the scan fails.
+ *
+ * Lockless.
+ */
+unsigned long pool4usage_epoch(l4_protocol proto)
+{
+	return atomic_long_read(&dbs[proto].epoch);
+}
+
+/**
+ * Records that the @mark/@proto table is full, unless some transport address
+ * might have been freed since @epoch.
+ */
+void pool4usage_set_exhausted(__u32 mark, l4_protocol proto,
+		unsigned long epoch)
+{
+	struct usage_shard *shard = get_shard(proto, mark);
+	struct usage_table *table;
+
+	spin_lock_bh(&shard->lock);
+	if (atomic_long_read(&dbs[proto].epoch) == epoch) {
+		table = get_table(shard, mark);
+		/* If it failed, the next allocation will just scan again. */
+		if (table && !table->exhausted) {
+			table->exhausted = true;
+			atomic_inc(&dbs[proto].exhausted);
+		}
+	}
+	spin_unlock_bh(&shard->lock);
+}
+
+/**
+ * Lockless.
+ */
+bool pool4usage_is_exhausted(__u32 mark, l4_protocol proto)
+{
+	struct usage_table *table;
+	bool result;
+
+	rcu_read_lock_bh();
+	table = find_table(get_shard(proto, mark), mark);
+	result = table && ACCESS_ONCE(table->exhausted);
+	rcu_read_unlock_bh();
+
+	return result;
+}
+
+/**
+ * Returns the number of @addr's @proto transport addresses that are being used
+ * by entries masked by @mark's table.
+ */
+__u32 pool4usage_get(__u32 mark, l4_protocol proto,
+		const struct in_addr *addr)
+{
+	struct usage_shard *shard = get_shard(proto, mark);
+	struct usage_addr *usage;
+	__u32 result;
+
+	spin_lock_bh(&shard->lock);
+	usage = find_addr(shard, mark, addr);
+	result = usage ? usage->used : 0;
+	spin_unlock_bh(&shard->lock);
+
+	return result;
+}
+
+/**
+ * Returns the number of transport addresses being used, across all tables.
+ */
+__u64 pool4usage_count(void)
+{
+	struct usage_shard *shard;
+	struct usage_table *table;
+	struct hlist_node *node;
+	unsigned int proto;
+	unsigned int s, i;
+	__u64 result = 0;
+
+	for (proto = 0; proto < L4_PROTO_COUNT; proto++) {
+		for (s = 0; s < ARRAY_SIZE(dbs[proto].shards); s++) {
+			shard = &dbs[proto].shards[s];
+			spin_lock_bh(&shard->lock);
+			for (i = 0; i < ARRAY_SIZE(shard->tables); i++) {
+				hlist_for_each(node, &shard->tables[i]) {
+					table = hlist_entry(node,
+							struct usage_table,
+							hook);
+					result += table->used;
+				}
+			}
+			spin_unlock_bh(&shard->lock);
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,483 @@
+#include "nat64/mod/stateful/replication.h"
+
+#include <linux/notifier.h>
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#include <net/ipv6.h>
+#include <net/netlink.h>
+#include "nat64/mod/common/address.h"
+#include "nat64/mod/common/config.h"
+#include "nat64/mod/common/namespace.h"
+#include "nat64/mod/common/nl_handler.h"
+#include "nat64/mod/common/types.h"
+#include "nat64/mod/stateful/bib/db.h"
+#include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/session/db.h"
+#include "nat64/mod/stateful/subscriber.h"
+
+/** Maximum number of events per Netlink message. */
+#define REPL_BATCH ((NLMSG_GOODSIZE - NLMSG_HDRLEN) \
+		/ sizeof(struct replication_event))
+/** Maximum time an event can wait in a half-empty batch, in jiffies. */
+#define REPL_FLUSH_DELAY (HZ / 20)
+/**
+ * Maximum number of full batches waiting to be sent. Beyond this, the events
+ * are dropped so memory doesn't grow while the sender is starved.
+ */
+#define REPL_MAX_BACKLOG 1024
+/**
+ * Extra time the standby grants the sessions it receives, in jiffies.
+ * The active instance only reports plain refreshes when its expiration wheels
+ * reach the session's previous expiration (one fine tick late at most), and it
+ * reports the deaths anyway.
+ */
+#define REPL_GRACE (EXPIRER_SLOTS * EXPIRER_TICK)
+
+/** The batch a CPU is currently filling. */
+struct repl_buffer {
+	spinlock_t lock;
+	/** NULL if the CPU hasn't published anything since the last flush. */
+	struct sk_buff *skb;
+	unsigned int count;
+};
+
+static DEFINE_PER_CPU(struct repl_buffer, buffers);
+/** Full batches, waiting for @sender. */
+static struct sk_buff_head backlog;
+/** Publishes the @backlog. */
+static struct work_struct sender;
+/** Moves the half-empty batches to the @backlog, so they don't wait forever. */
+static struct delayed_work flusher;
+/**
+ * Netlink port ID of the socket the events are sent to. Zero means nobody is
+ * listening.
+ */
+static atomic_t listener;
+/**
+ * Can events be published? Only changes during init and destroy. Read and
+ * written while holding the buffer locks.
+ */
+static bool enabled;
+
+static atomic64_t event_count;
+static atomic64_t drop_count;
+static atomic64_t batch_count;
+static atomic64_t applied_count;
+static atomic64_t rejected_count;
+
+static void send_backlog(struct work_struct *work)
+{
+	struct sk_buff *skb;
+	unsigned int events;
+	u32 portid;
+	int error;
+
+	while ((skb = skb_dequeue(&backlog)) != NULL) {
+		portid = atomic_read(&listener);
+		if (!portid) {
+			kfree_skb(skb);
+			continue;
+		}
+
+		/* The unicast consumes the skb, even on failure. */
+		events = nlmsg_len(nlmsg_hdr(skb))
+				/ sizeof(struct replication_event);
+
+		error = nlhandler_unicast(skb, portid);
+		if (!error) {
+			atomic64_inc(&batch_count);
+			continue;
+		}
+
+		if (error == -ECONNREFUSED) {
+			/* The listener is gone. */
+			atomic_cmpxchg(&listener, portid, 0);
+		} else {
+			/* Probably a full receive buffer; the events are lost. */
+			log_debug("Unicast failed with errcode %d.", error);
+			atomic64_add(events, &drop_count);
+		}
+	}
+}
+
+/**
+ * Forgets the listener as soon as its socket is closed, so nobody else can
+ * bind to its port ID and inherit the events.
+ */
+static int netlink_event(struct notifier_block *nb, unsigned long event,
+		void *ptr)
+{
+	struct netlink_notify *notify = ptr;
+
+	if (event != NETLINK_URELEASE || notify->protocol != NETLINK_USERSOCK)
+		return NOTIFY_DONE;
+	if (notify->net != joolns_get())
+		return NOTIFY_DONE;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 7, 0)
+	atomic_cmpxchg(&listener, notify->pid, 0);
+#else
+	atomic_cmpxchg(&listener, notify->portid, 0);
+#endif
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block netlink_notifier = {
+	.notifier_call = netlink_event,
+};
+
+/**
+ * Sends the events to the Netlink socket whose port ID is "portid" from now on.
+ * The previous listener (if any) stops receiving them.
+ *
+ * The caller has to make sure the socket belongs to an administrator.
+ */
+void replication_listen(u32 portid)
+{
+	atomic_set(&listener, portid);
+}
+
+/**
+ * Hands "buffer"'s batch over to the sender.
+ *
+ * The buffer's lock must be held.
+ */
+static void close_batch(struct repl_buffer *buffer)
+{
+	struct sk_buff *skb = buffer->skb;
+	unsigned int count = buffer->count;
+
+	buffer->skb = NULL;
+	buffer->count = 0;
+
+	if (skb_queue_len(&backlog) >= REPL_MAX_BACKLOG) {
+		atomic64_add(count, &drop_count);
+		kfree_skb(skb);
+		return;
+	}
+
+	skb_queue_tail(&backlog, skb);
+	schedule_work(&sender);
+}
+
+static void flush_buffers(struct work_struct *work)
+{
+	struct repl_buffer *buffer;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		buffer = per_cpu_ptr(&buffers, cpu);
+		spin_lock_bh(&buffer->lock);
+		if (buffer->skb)
+			close_batch(buffer);
+		spin_unlock_bh(&buffer->lock);
+	}
+}
+
+int replication_init(void)
+{
+	struct repl_buffer *buffer;
+	int cpu;
+	int error;
+
+	for_each_possible_cpu(cpu) {
+		buffer = per_cpu_ptr(&buffers, cpu);
+		spin_lock_init(&buffer->lock);
+		buffer->skb = NULL;
+		buffer->count = 0;
+	}
+
+	skb_queue_head_init(&backlog);
+	INIT_WORK(&sender, send_backlog);
+	INIT_DELAYED_WORK(&flusher, flush_buffers);
+
+	atomic64_set(&event_count, 0);
+	atomic64_set(&drop_count, 0);
+	atomic64_set(&batch_count, 0);
+	atomic64_set(&applied_count, 0);
+	atomic64_set(&rejected_count, 0);
+
+	atomic_set(&listener, 0);
+	error = netlink_register_notifier(&netlink_notifier);
+	if (error)
+		return error;
+
+	enabled = true;
+	return 0;
+}
+
+/**
+ * Has to be called before the session tables are destroyed, so their deaths
+ * are not published. (The standby should keep them.)
+ */
+void replication_destroy(void)
+{
+	struct repl_buffer *buffer;
+	int cpu;
+
+	/* After this, nobody will touch the buffers or queue work. */
+	for_each_possible_cpu(cpu) {
+		buffer = per_cpu_ptr(&buffers, cpu);
+		spin_lock_bh(&buffer->lock);
+		enabled = false;
+		spin_unlock_bh(&buffer->lock);
+	}
+
+	cancel_delayed_work_sync(&flusher);
+	cancel_work_sync(&sender);
+	skb_queue_purge(&backlog);
+	netlink_unregister_notifier(&netlink_notifier);
+
+	for_each_possible_cpu(cpu) {
+		buffer = per_cpu_ptr(&buffers, cpu);
+		if (buffer->skb)
+			kfree_skb(buffer->skb);
+		buffer->skb = NULL;
+	}
+}
+
+static struct sk_buff *open_batch(void)
+{
+	struct sk_buff *skb;
+
+	skb = nlmsg_new(REPL_BATCH * sizeof(struct replication_event),
+			GFP_ATOMIC);
+	if (!skb)
+		return NULL;
+
+	if (!nlmsg_put(skb, 0, 0, MSG_SETCFG, 0, 0)) {
+		kfree_skb(skb);
+		return NULL;
+	}
+
+	return skb;
+}
+
+/**
+ * Returns the number of milliseconds "session" has left.
+ *
+ * Spinlock of "session"'s shard must be held.
+ */
+static __u32 get_lifetime(struct session_entry *session)
+{
+	unsigned long timeout;
+	unsigned long expiration;
+
+	timeout = sessiondb_get_timeout(session);
+	if (!timeout)
+		return 0;
+
+	expiration = session->update_time + timeout;
+	return time_before(jiffies, expiration)
+			? jiffies_to_msecs(expiration - jiffies)
+			: 0;
+}
+
+/**
+ * Publishes "type" on "session". Never sleeps nor waits for the listeners.
+ *
+ * The session table calls this while holding the spinlock of "session"'s shard.
+ */
+void replication_session(struct session_entry *session,
+		enum replication_type type)
+{
+	struct repl_buffer *buffer;
+	struct replication_event *event;
+	bool first;
+
+	if (!atomic_read(&listener))
+		return;
+
+	local_bh_disable();
+	buffer = this_cpu_ptr(&buffers);
+	spin_lock(&buffer->lock);
+
+	if (!enabled)
+		goto end;
+
+	first = !buffer->skb;
+	if (first) {
+		buffer->skb = open_batch();
+		if (!buffer->skb) {
+			atomic64_inc(&drop_count);
+			goto end;
+		}
+	}
+
+	event = (struct replication_event *)skb_put(buffer->skb,
+			sizeof(*event));
+	event->remote6 = session->remote6;
+	event->local6 = session->local6;
+	event->local4 = session->local4;
+	event->remote4 = session->remote4;
+	event->lifetime = (type != REPL_RM) ? get_lifetime(session) : 0;
+	event->type = type;
+	event->l4_proto = session->l4_proto;
+	event->state = session->state;
+	event->is_est = session->queued && session->established;
+	nlmsg_end(buffer->skb, nlmsg_hdr(buffer->skb));
+	atomic64_inc(&event_count);
+
+	if (++buffer->count >= REPL_BATCH)
+		close_batch(buffer);
+	else if (first)
+		schedule_delayed_work(&flusher, REPL_FLUSH_DELAY);
+
+end:
+	spin_unlock(&buffer->lock);
+	local_bh_enable();
+}
+
+/**
+ * Creates the BIB entry and session "event" describes.
+ *
+ * The BIB entry is reused if it exists, which is always the case for static
+ * entries (those have to be configured on both instances).
+ */
+static int create_session(struct replication_event *event)
+{
+	struct admission_limits limits;
+	struct subscriber *sub;
+	struct bib_entry *bib;
+	struct session_entry *session;
+	int error;
+
+	error = bibdb_get4(&event->local4, event->l4_proto, &bib);
+	if (error == -ESRCH) {
+		if (ipv6_addr_any(&event->remote6.l3))
+			return -ESRCH; /* Simultaneous open; no BIB yet. */
+
+		bib = bibentry_create(&event->local4, &event->remote6, false,
+				event->l4_proto);
+		if (!bib)
+			return -ENOMEM;
+
+		/*
+		 * The admission limits are not enforced; the active instance
+		 * already did that.
+		 */
+		config_get_limits(&limits);
+		sub = subscriber_get(&event->remote6.l3,
+				limits.subscriber_prefix_len);
+		if (!sub) {
+			bibentry_kfree(bib);
+			return -ENOMEM;
+		}
+		/* The BIB entry inherits our reference to sub. */
+		bib->subscriber = sub;
+		subscriber_add_bib(sub);
+
+		error = bibdb_add(bib, NULL);
+		if (error) {
+			bibentry_kfree(bib);
+			return error;
+		}
+	} else if (error) {
+		return error;
+	}
+
+	if (!ipv6_transport_addr_equals(&bib->ipv6, &event->remote6)) {
+		/* Our own traffic grabbed the mapping. */
+		bibdb_return(bib);
+		return -EEXIST;
+	}
+
+	session = session_create(&event->remote6, &event->local6,
+			&event->local4, &event->remote4, event->l4_proto, bib);
+	bibdb_return(bib);
+	if (!session)
+		return -ENOMEM;
+	session->state = event->state;
+
+	error = sessiondb_add(session, event->is_est, NULL);
+	if (!error)
+		error = sessiondb_update(session, event->state, event->is_est,
+				msecs_to_jiffies(event->lifetime) + REPL_GRACE);
+
+	session_return(session);
+	return error;
+}
+
+static int apply_event(struct replication_event *event)
+{
+	struct tuple tuple6;
+	struct session_entry *session;
+	int error;
+
+	switch (event->l4_proto) {
+	case L4PROTO_TCP:
+	case L4PROTO_UDP:
+	case L4PROTO_ICMP:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	/*
+	 * The active instance can only have masked the connection with one of
+	 * the addresses both instances share.
+	 */
+	if (!pool4db_contains(event->l4_proto, &event->local4))
+		return -EINVAL;
+
+	tuple6.src.addr6 = event->remote6;
+	tuple6.dst.addr6 = event->local6;
+	tuple6.l3_proto = L3PROTO_IPV6;
+	tuple6.l4_proto = event->l4_proto;
+
+	error = sessiondb_get(&tuple6, NULL, NULL, &session);
+	if (error == -ESRCH) {
+		/* A death we never heard the birth of is already applied. */
+		return (event->type != REPL_RM) ? create_session(event) : 0;
+	}
+	if (error)
+		return error;
+
+	switch (event->type) {
+	case REPL_ADD:
+	case REPL_UPDATE:
+		error = sessiondb_update(session, event->state, event->is_est,
+				msecs_to_jiffies(event->lifetime) + REPL_GRACE);
+		break;
+	case REPL_RM:
+		error = sessiondb_rm(session);
+		break;
+	default:
+		error = -EINVAL;
+	}
+
+	session_return(session);
+	return error;
+}
+
+/**
+ * Applies the "count" "events" an active instance published, in order.
+ *
+ * Events that cannot be applied are counted and skipped; a standby that
+ * missed a few events is still better than one that stops listening.
+ */
+int replication_apply(struct replication_event *events, size_t count)
+{
+	size_t i;
+	u64 rejected = 0;
+
+	for (i = 0; i < count; i++) {
+		if (apply_event(&events[i]))
+			rejected++;
+	}
+
+	atomic64_add(count - rejected, &applied_count);
+	atomic64_add(rejected, &rejected_count);
+	return 0;
+}
+
+void replication_stats(struct response_replication *stats)
+{
+	stats->events = atomic64_read(&event_count);
+	stats->drops = atomic64_read(&drop_count);
+	stats->batches = atomic64_read(&batch_count);
+	stats->applied = atomic64_read(&applied_count);
+	stats->rejected = atomic64_read(&rejected_count);
+}
@@ -52,17 +52,32 @@ int sessiondb_init(fate_cb tcpest_fn, fate_cb tcptrans_fn)
 		return error;
 	}
 
-	sessiontable_init(&session_table_udp,
+	error = sessiontable_init(&session_table_udp,
 			config_get_ttl_udp, just_die,
 			NULL, NULL);
-	sessiontable_init(&session_table_tcp,
+	if (error)
+		goto udp_fail;
+	error = sessiontable_init(&session_table_tcp,
 			config_get_ttl_tcpest, tcpest_fn,
 			config_get_ttl_tcptrans, tcptrans_fn);
-	sessiontable_init(&session_table_icmp,
+	if (error)
+		goto tcp_fail;
+	error = sessiontable_init(&session_table_icmp,
 			config_get_ttl_icmp, just_die,
 			NULL, NULL);
+	if (error)
+		goto icmp_fail;
 
 	return 0;
+
+icmp_fail:
+	sessiontable_destroy(&session_table_tcp);
+tcp_fail:
+	sessiontable_destroy(&session_table_udp);
+udp_fail:
+	pktqueue_destroy();
+	session_destroy();
+	return error;
 }
 
 
@@ -91,10 +106,34 @@ bool sessiondb_allow(struct tuple *tuple4)
 	return table ? sessiontable_allow(table, tuple4) : false;
 }
 
-int sessiondb_add(struct session_entry *session, bool is_est)
+/**
+ * Adds "session" to the table it belongs to. See sessiontable_add() for the
+ * meaning of "old".
+ */
+int sessiondb_add(struct session_entry *session, bool is_est,
+		struct session_entry **old)
 {
 	struct session_table *table = get_table(session->l4_proto);
-	return table ? sessiontable_add(table, session, is_est) : -EINVAL;
+
+	if (!table) {
+		if (old)
+			*old = NULL;
+		return -EINVAL;
+	}
+
+	return sessiontable_add(table, session, is_est, old);
+}
+
+/**
+ * Adds a bunch of sessions (from the "proto" table) in one go. See
+ * sessiontable_restore().
+ */
+int sessiondb_restore(l4_protocol proto, struct session_restore *restores,
+		size_t count, size_t *added)
+{
+	struct session_table *table = get_table(proto);
+	return table ? sessiontable_restore(table, restores, count, added)
+			: -EINVAL;
 }
 
 int sessiondb_foreach(l4_protocol proto,
@@ -113,6 +152,22 @@ int sessiondb_count(l4_protocol proto, __u64 *result)
 	return table ? sessiontable_count(table, result) : -EINVAL;
 }
 
+int sessiondb_expiry_stats(l4_protocol proto, __u64 *backlog, __u64 *batches)
+{
+	struct session_table *table = get_table(proto);
+	if (!table)
+		return -EINVAL;
+
+	sessiontable_expiry_stats(table, backlog, batches);
+	return 0;
+}
+
+unsigned long sessiondb_get_timeout(struct session_entry *session)
+{
+	struct session_table *table = get_table(session->l4_proto);
+	return table ? sessiontable_get_timeout(table, session) : 0;
+}
+
 int sessiondb_delete_by_bib(struct bib_entry *bib)
 {
 	struct session_table *table = get_table(bib->l4_proto);
@@ -123,6 +178,36 @@ int sessiondb_delete_by_bib(struct bib_entry *bib)
 	return 0;
 }
 
+/**
+ * Removes "session" from the database right away, regardless of its state.
+ */
+int sessiondb_rm(struct session_entry *session)
+{
+	struct session_table *table = get_table(session->l4_proto);
+	return table ? sessiontable_rm(table, session) : -EINVAL;
+}
+
+/**
+ * Overrides "session"'s state and timer. (See sessiontable_update().)
+ */
+int sessiondb_update(struct session_entry *session, __u8 state,
+		bool established, unsigned long lifetime)
+{
+	struct session_table *table = get_table(session->l4_proto);
+	return table ? sessiontable_update(table, session, state, established,
+			lifetime) : -EINVAL;
+}
+
+/**
+ * Returns one of the least recently used sessions from the "proto" table, or
+ * NULL. Remember to session_return() it.
+ */
+struct session_entry *sessiondb_lru(l4_protocol proto)
+{
+	struct session_table *table = get_table(proto);
+	return table ? sessiontable_lru(table) : NULL;
+}
+
 void sessiondb_delete_taddr4s(struct ipv4_prefix *prefix,
 		struct port_range *ports)
 {
@@ -16,11 +16,14 @@ int session_init(void)
 		return -ENOMEM;
 	}
 
+	log_debug("Session entries take %u bytes.", kmem_cache_size(entry_cache));
 	return 0;
 }
 
 void session_destroy(void)
 {
+	/* Wait for the pending session_free()s. */
+	rcu_barrier_bh();
 	kmem_cache_destroy(entry_cache);
 }
 
@@ -39,7 +42,7 @@ struct session_entry *session_create(const struct ipv6_transport_addr *remote6,
 			.bib = bib,
 			.l4_proto = l4_proto,
 			.state = 0,
-			.expirer = NULL,
+			.queued = false,
 	};
 	return session_clone(&tmp);
 }
@@ -57,8 +60,11 @@ struct session_entry *session_clone(struct session_entry *session)
 
 	memcpy(result, session, sizeof(*session));
 	kref_init(&result->refcounter);
+	result->queued = false;
 	INIT_LIST_HEAD(&result->list_hook);
-	RB_CLEAR_NODE(&result->tree6_hook);
+	INIT_LIST_HEAD(&result->subscriber_hook);
+	INIT_HLIST_NODE(&result->hash6_hook);
+	INIT_HLIST_NODE(&result->hash4_hook);
 	RB_CLEAR_NODE(&result->tree4_hook);
 
 	if (session->bib)
@@ -72,6 +78,24 @@ void session_get(struct session_entry *session)
 	kref_get(&session->refcounter);
 }
 
+/**
+ * Like session_get(), except it fails if @session is already dying.
+ *
+ * Meant for lockless lookups, which might stumble upon sessions whose last
+ * reference has already been dropped.
+ */
+bool session_get_unless_zero(struct session_entry *session)
+{
+	return kref_get_unless_zero(&session->refcounter);
+}
+
+static void session_free(struct rcu_head *rcu)
+{
+	struct session_entry *session;
+	session = container_of(rcu, struct session_entry, rcu);
+	kmem_cache_free(entry_cache, session);
+}
+
 static void session_release(struct kref *ref)
 {
 	struct session_entry *session;
@@ -79,7 +103,7 @@ static void session_release(struct kref *ref)
 
 	if (session->bib)
 		bibdb_return(session->bib);
-	kmem_cache_free(entry_cache, session);
+	call_rcu_bh(&session->rcu, session_free);
 }
 
 /**
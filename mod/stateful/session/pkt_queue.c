@@ -1,9 +1,34 @@
 #include "nat64/mod/stateful/session/pkt_queue.h"
 
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/slab.h>
 #include "nat64/common/constants.h"
+#include "nat64/mod/common/address.h"
 #include "nat64/mod/common/config.h"
 #include "nat64/mod/common/icmp_wrapper.h"
-#include "nat64/mod/common/rbtree.h"
+
+/**
+ * The store is split into 2^PKTQUEUE_SHARD_BITS shards, each with its own
+ * lock, indexes and timer. A source's packets always land in the same shard.
+ */
+#define PKTQUEUE_SHARD_BITS 4
+/** Each shard's indexes have 2^PKTQUEUE_HASH_BITS slots. */
+#define PKTQUEUE_HASH_BITS 6
+/** IPv4 addresses sharing this many leading bits share a quota. */
+#define PKTQUEUE_SRC_PREFIX_LEN 24
+
+/**
+ * The IPv4 network some stored packets came from, along with the number of
+ * them. Only exists while the number is nonzero.
+ */
+struct pktqueue_source {
+	/** remote4 address, masked to PKTQUEUE_SRC_PREFIX_LEN bits. */
+	__be32 prefix;
+	unsigned int count;
+	/** Links this source to its slot in its shard's sources index. */
+	struct hlist_node hook;
+};
 
 /**
  * A stored packet.
@@ -13,69 +38,191 @@ struct packet_node {
 	struct session_entry *session;
 	/** The packet. */
 	struct packet pkt;
-
-	/** Links this packet to the list. See @node_list. */
+	/** The network this packet is charged to. */
+	struct pktqueue_source *source;
+	/** Jiffy at which the ICMP error will be sent. */
+	unsigned long dying_time;
+
+	/** Links this packet to its slot in its shard's nodes index. */
+	struct hlist_node hash_hook;
+	/** Links this packet to its shard's expire_list. */
 	struct list_head list_hook;
-	/** Links this packet to the tree. See @node_tree. */
-	struct rb_node tree_hook;
 };
 
-static struct list_head node_list;
-/** The same packets, sorted by IPv4 identifiers. */
-static struct rb_root node_tree;
-/** Current number of packets in the database. */
-static int node_count;
-/** Protects @nodes_list, @nodes_tree and @node_count. */
-static DEFINE_SPINLOCK(lock);
+struct pktqueue_shard {
+	/** The packets, indexed by their sessions' IPv4 addresses. */
+	struct hlist_head nodes[1 << PKTQUEUE_HASH_BITS];
+	/** The networks the packets came from, indexed by prefix. */
+	struct hlist_head sources[1 << PKTQUEUE_HASH_BITS];
+	/** The same packets, sorted by dying_time. */
+	struct list_head expire_list;
+	struct timer_list timer;
+	/** Protects all of the above. */
+	spinlock_t lock;
+};
+
+static struct pktqueue_shard shards[1 << PKTQUEUE_SHARD_BITS];
+/** Current number of packets in the database, all shards combined. */
+static atomic_t node_count;
 
-static struct timer_list timer;
+static struct kmem_cache *node_cache;
+static struct kmem_cache *source_cache;
+
+/** Random seed of the hash functions, so attackers can't predict the slots. */
+static u32 rnd;
 
 static unsigned long get_timeout(void)
 {
 	return msecs_to_jiffies(1000 * TCP_INCOMING_SYN);
 }
 
-static void send_icmp_error(struct packet_node *node)
+static __be32 get_prefix(const struct session_entry *session)
+{
+	return session->remote4.l3.s_addr
+			& cpu_to_be32(0xffffffffU << (32 - PKTQUEUE_SRC_PREFIX_LEN));
+}
+
+static u32 hash_prefix(__be32 prefix)
+{
+	return jhash_1word((__force u32)prefix, rnd);
+}
+
+/**
+ * The high bits pick the shard; the low bits pick the slot within it.
+ */
+static struct pktqueue_shard *get_shard(__be32 prefix)
+{
+	return &shards[hash_prefix(prefix) >> (32 - PKTQUEUE_SHARD_BITS)];
+}
+
+static struct hlist_head *get_source_slot(struct pktqueue_shard *shard,
+		__be32 prefix)
+{
+	return &shard->sources[hash_prefix(prefix)
+			& ((1 << PKTQUEUE_HASH_BITS) - 1)];
+}
+
+static struct hlist_head *get_node_slot(struct pktqueue_shard *shard,
+		const struct session_entry *session)
+{
+	u32 hash;
+
+	hash = jhash_3words((__force u32)session->remote4.l3.s_addr,
+			(__force u32)session->local4.l3.s_addr,
+			(session->remote4.l4 << 16) | session->local4.l4, rnd);
+	return &shard->nodes[hash & ((1 << PKTQUEUE_HASH_BITS) - 1)];
+}
+
+/**
+ * Shard lock must be held.
+ */
+static struct packet_node *find_node(struct pktqueue_shard *shard,
+		const struct session_entry *session)
+{
+	struct packet_node *node;
+	struct hlist_node *hnode;
+
+	hlist_for_each(hnode, get_node_slot(shard, session)) {
+		node = hlist_entry(hnode, struct packet_node, hash_hook);
+		if (ipv4_transport_addr_equals(&node->session->remote4,
+				&session->remote4)
+				&& ipv4_transport_addr_equals(&node->session->local4,
+				&session->local4))
+			return node;
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the @prefix source of @shard, creating it if it doesn't exist.
+ * Shard lock must be held.
+ */
+static struct pktqueue_source *get_source(struct pktqueue_shard *shard,
+		__be32 prefix)
+{
+	struct pktqueue_source *source;
+	struct hlist_head *slot = get_source_slot(shard, prefix);
+	struct hlist_node *hnode;
+
+	hlist_for_each(hnode, slot) {
+		source = hlist_entry(hnode, struct pktqueue_source, hook);
+		if (source->prefix == prefix)
+			return source;
+	}
+
+	source = kmem_cache_alloc(source_cache, GFP_ATOMIC);
+	if (!source)
+		return NULL;
+	source->prefix = prefix;
+	source->count = 0;
+	hlist_add_head(&source->hook, slot);
+	return source;
+}
+
+/**
+ * Shard lock must be held.
+ */
+static void maybe_free_source(struct pktqueue_source *source)
+{
+	if (source->count == 0) {
+		hlist_del(&source->hook);
+		kmem_cache_free(source_cache, source);
+	}
+}
+
+static void node_free(struct packet_node *node)
 {
-	icmp64_send(&node->pkt, ICMPERR_PORT_UNREACHABLE, 0);
 	session_return(node->session);
 	kfree_skb(node->pkt.skb);
-	kfree(node);
+	kmem_cache_free(node_cache, node);
 }
 
+static void send_icmp_error(struct packet_node *node)
+{
+	icmp64_send(&node->pkt, ICMPERR_PORT_UNREACHABLE, 0);
+	node_free(node);
+}
+
+/**
+ * Shard lock must be held.
+ */
 static void rm(struct packet_node *node)
 {
+	hlist_del(&node->hash_hook);
 	list_del(&node->list_hook);
-	rb_erase(&node->tree_hook, &node_tree);
-	node_count--;
+	node->source->count--;
+	maybe_free_source(node->source);
+	atomic_dec(&node_count);
 }
 
+/**
+ * Sends the ICMP errors of the shards[param] shard's expired packets.
+ */
 static void cleaner_timer(unsigned long param)
 {
+	struct pktqueue_shard *shard = &shards[param];
 	struct packet_node *node, *tmp;
-	const unsigned long TIMEOUT = get_timeout();
-	unsigned long next_timeout;
 	LIST_HEAD(icmps);
 
 	log_debug("===============================================");
 	log_debug("Handling expired SYN sessions...");
 
-	spin_lock_bh(&lock);
-	list_for_each_entry_safe(node, tmp, &node_list, list_hook) {
+	spin_lock_bh(&shard->lock);
+	list_for_each_entry_safe(node, tmp, &shard->expire_list, list_hook) {
 		/*
 		 * "list" is sorted by expiration date,
 		 * so stop on the first unexpired session.
 		 */
-		next_timeout = node->session->update_time + TIMEOUT;
-		if (time_before(jiffies, next_timeout)) {
-			mod_timer(&timer, next_timeout);
+		if (time_before(jiffies, node->dying_time)) {
+			mod_timer(&shard->timer, node->dying_time);
 			break;
 		}
 
 		rm(node);
 		list_add(&node->list_hook, &icmps);
 	}
-	spin_unlock_bh(&lock);
+	spin_unlock_bh(&shard->lock);
 
 	list_for_each_entry_safe(node, tmp, &icmps, list_hook)
 		send_icmp_error(node);
@@ -83,72 +230,73 @@ static void cleaner_timer(unsigned long param)
 
 int pktqueue_init(void)
 {
-	INIT_LIST_HEAD(&node_list);
-	node_tree = RB_ROOT;
-	node_count = 0;
+	struct pktqueue_shard *shard;
+	unsigned int i;
+
+	node_cache = kmem_cache_create("jool_pktqueue_nodes",
+			sizeof(struct packet_node), 0, 0, NULL);
+	if (!node_cache)
+		return -ENOMEM;
+	source_cache = kmem_cache_create("jool_pktqueue_sources",
+			sizeof(struct pktqueue_source), 0, 0, NULL);
+	if (!source_cache) {
+		kmem_cache_destroy(node_cache);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		shard = &shards[i];
+		memset(shard->nodes, 0, sizeof(shard->nodes));
+		memset(shard->sources, 0, sizeof(shard->sources));
+		INIT_LIST_HEAD(&shard->expire_list);
+		spin_lock_init(&shard->lock);
+
+		init_timer(&shard->timer);
+		shard->timer.function = cleaner_timer;
+		shard->timer.expires = 0;
+		shard->timer.data = i;
+	}
 
-	init_timer(&timer);
-	timer.function = cleaner_timer;
-	timer.expires = 0;
-	timer.data = 0;
+	atomic_set(&node_count, 0);
+	get_random_bytes(&rnd, sizeof(rnd));
 
 	return 0;
 }
 
 void pktqueue_destroy(void)
 {
+	struct pktqueue_shard *shard;
 	struct packet_node *node, *tmp;
+	unsigned int i;
 
-	del_timer_sync(&timer);
-
-	list_for_each_entry_safe(node, tmp, &node_list, list_hook)
-		send_icmp_error(node);
-}
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		shard = &shards[i];
+		del_timer_sync(&shard->timer);
 
-/**
- * Returns > 0 if node.session.*4 > session.*4.
- * Returns < 0 if node.session.*4 < session.*4.
- * Returns 0 if node.session.*4 == session.*4.
- *
- * Doesn't care about spinlocks.
- */
-static int compare_fn(const struct packet_node *node,
-		const struct session_entry *session)
-{
-	int gap;
-
-	gap = ipv4_addr_cmp(&node->session->remote4.l3, &session->remote4.l3);
-	if (gap)
-		return gap;
-
-	gap = node->session->remote4.l4 - session->remote4.l4;
-	if (gap)
-		return gap;
-
-	gap = ipv4_addr_cmp(&node->session->local4.l3, &session->local4.l3);
-	if (gap)
-		return gap;
-
-	gap = node->session->local4.l4 - session->local4.l4;
-	return gap;
-}
+		list_for_each_entry_safe(node, tmp, &shard->expire_list,
+				list_hook) {
+			rm(node);
+			send_icmp_error(node);
+		}
+	}
 
-static int __tree_add(struct packet_node *node)
-{
-	return rbtree_add(node, node->session, &node_tree, compare_fn,
-			struct packet_node, tree_hook);
+	kmem_cache_destroy(source_cache);
+	kmem_cache_destroy(node_cache);
 }
 
 int pktqueue_add(struct session_entry *session, struct packet *pkt)
 {
+	struct pktqueue_shard *shard;
+	struct pktqueue_source *source;
 	struct packet_node *node;
-	int error;
+	unsigned int max_per_src;
+	__be32 prefix;
 
 	/* Note: this if assumes ICMP errors don't reach this code. */
 	if (session->l4_proto != L4PROTO_TCP)
 		return 0;
 
-	node = kmalloc(sizeof(*node), GFP_ATOMIC);
+	node = kmem_cache_alloc(node_cache, GFP_ATOMIC);
 	if (!node) {
 		log_debug("Allocation of packet node failed.");
 		return -ENOMEM;
@@ -156,33 +304,51 @@ int pktqueue_add(struct session_entry *session, struct packet *pkt)
 	node->session = session;
 	node->pkt = *pkt_original_pkt(pkt);
 	node->pkt.original_pkt = &node->pkt;
-	RB_CLEAR_NODE(&node->tree_hook);
-
-	spin_lock_bh(&lock);
+	node->dying_time = jiffies + get_timeout();
 
-	if (node_count + 1 >= config_get_max_pkts()) {
-		spin_unlock_bh(&lock);
+	if (atomic_inc_return(&node_count) > config_get_max_pkts()) {
 		log_debug("Too many IPv4-initiated TCP connections.");
-		/* Fall back to assume there's no Simultaneous Open. */
-		icmp64_send(&node->pkt, ICMPERR_PORT_UNREACHABLE, 0);
-		kfree(node);
-		return -E2BIG;
+		goto too_many;
 	}
 
-	error = __tree_add(node);
-	if (error) {
-		spin_unlock_bh(&lock);
+	prefix = get_prefix(session);
+	shard = get_shard(prefix);
+	max_per_src = config_get_max_pkts_per_src();
+
+	spin_lock_bh(&shard->lock);
+
+	if (find_node(shard, session)) {
+		spin_unlock_bh(&shard->lock);
+		atomic_dec(&node_count);
 		log_debug("Simultaneous Open already exists; ignoring packet.");
-		kfree(node);
-		return error;
+		kmem_cache_free(node_cache, node);
+		return -EEXIST;
+	}
+
+	source = get_source(shard, prefix);
+	if (!source) {
+		spin_unlock_bh(&shard->lock);
+		atomic_dec(&node_count);
+		kmem_cache_free(node_cache, node);
+		return -ENOMEM;
+	}
+
+	if (max_per_src && source->count >= max_per_src) {
+		maybe_free_source(source);
+		spin_unlock_bh(&shard->lock);
+		log_debug("Too many IPv4-initiated TCP connections from %pI4/%u.",
+				&prefix, PKTQUEUE_SRC_PREFIX_LEN);
+		goto too_many;
 	}
-	list_add_tail(&node->list_hook, &node_list);
-	node_count++;
 
-	node = list_entry(node_list.next, typeof(*node), list_hook);
-	mod_timer(&timer, node->session->update_time + get_timeout());
+	source->count++;
+	node->source = source;
+	hlist_add_head(&node->hash_hook, get_node_slot(shard, session));
+	list_add_tail(&node->list_hook, &shard->expire_list);
+	if (!timer_pending(&shard->timer))
+		mod_timer(&shard->timer, node->dying_time);
 
-	spin_unlock_bh(&lock);
+	spin_unlock_bh(&shard->lock);
 
 	/*
 	 * I'm assuming caller has a reference; that's why it's legal to do this
@@ -192,35 +358,37 @@ int pktqueue_add(struct session_entry *session, struct packet *pkt)
 
 	log_debug("Pkt queue - I just stored a packet.");
 	return 0;
-}
 
-static struct packet_node *__tree_find(struct session_entry *session)
-{
-	return rbtree_find(session, &node_tree, compare_fn, struct packet_node,
-			tree_hook);
+too_many:
+	atomic_dec(&node_count);
+	/* Fall back to assume there's no Simultaneous Open. */
+	icmp64_send(&node->pkt, ICMPERR_PORT_UNREACHABLE, 0);
+	kmem_cache_free(node_cache, node);
+	return -E2BIG;
 }
 
 void pktqueue_remove(struct session_entry *session)
 {
+	struct pktqueue_shard *shard;
 	struct packet_node *node;
 
 	/* Note: this if assumes ICMP errors don't reach this code. */
 	if (session->l4_proto != L4PROTO_TCP)
 		return;
 
-	spin_lock_bh(&lock);
-	node = __tree_find(session);
+	shard = get_shard(get_prefix(session));
+
+	spin_lock_bh(&shard->lock);
+	node = find_node(shard, session);
 	if (!node) {
-		spin_unlock_bh(&lock);
+		spin_unlock_bh(&shard->lock);
 		return;
 	}
 
 	rm(node);
-	spin_unlock_bh(&lock);
+	spin_unlock_bh(&shard->lock);
 
-	session_return(node->session);
-	kfree_skb(node->pkt.skb);
-	kfree(node);
+	node_free(node);
 
 	log_debug("Pkt queue - I just cancelled an ICMP error.");
 }
@@ -0,0 +1,193 @@
+#include "nat64/mod/stateful/session/syn_cookie.h"
+
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include "nat64/common/constants.h"
+#include "nat64/mod/common/types.h"
+
+/** Number of slots a SYN can choose from. */
+#define SYNCOOKIE_BUCKET_SLOTS 4
+/** Smallest and largest number of slots the table is allowed to have. */
+#define SYNCOOKIE_MIN_SLOTS (1U << 12)
+#define SYNCOOKIE_MAX_SLOTS (1U << 22)
+/**
+ * If the user doesn't ask for a size, the table gets one slot per this many
+ * bytes of RAM. (The slots are 16 bytes, so this is 1/4096th of the memory.)
+ */
+#define SYNCOOKIE_BYTES_PER_SLOT (1U << 16)
+/** The buckets are protected by 2^SYNCOOKIE_LOCK_BITS locks. */
+#define SYNCOOKIE_LOCK_BITS 6
+
+/**
+ * What's left of an IPv4 SYN that was translated without a session.
+ */
+struct syncookie_slot {
+	/**
+	 * Hash of the connection's IPv4 addresses, taken with a different seed
+	 * than the bucket's index. Zero means the slot is empty.
+	 */
+	u32 check;
+	/** Sequence number of the SYN. */
+	u32 seq;
+	/** Jiffy at which the slot stops being valid. */
+	unsigned long expires;
+};
+
+struct syncookie_bucket {
+	struct syncookie_slot slots[SYNCOOKIE_BUCKET_SLOTS];
+};
+
+static struct syncookie_bucket *buckets;
+/** Length of @buckets. Always a power of two. */
+static unsigned int bucket_count;
+static spinlock_t locks[1 << SYNCOOKIE_LOCK_BITS];
+
+/** Random seeds of the hash functions, so attackers can't predict the slots. */
+static u32 rnd_index;
+static u32 rnd_check;
+
+static unsigned long get_timeout(void)
+{
+	return msecs_to_jiffies(1000 * TCP_INCOMING_SYN);
+}
+
+static u32 hash(const struct ipv4_transport_addr *local4,
+		const struct ipv4_transport_addr *remote4, u32 rnd)
+{
+	return jhash_3words((__force u32)remote4->l3.s_addr,
+			(__force u32)local4->l3.s_addr,
+			(remote4->l4 << 16) | local4->l4, rnd);
+}
+
+static unsigned int get_index(const struct ipv4_transport_addr *local4,
+		const struct ipv4_transport_addr *remote4)
+{
+	return hash(local4, remote4, rnd_index) & (bucket_count - 1);
+}
+
+static spinlock_t *get_lock(unsigned int index)
+{
+	return &locks[index & ((1 << SYNCOOKIE_LOCK_BITS) - 1)];
+}
+
+static unsigned int compute_slots(unsigned int slots)
+{
+	if (!slots) {
+		/* Do the division first so 32-bit machines don't overflow. */
+		slots = totalram_pages
+				/ (SYNCOOKIE_BYTES_PER_SLOT >> PAGE_SHIFT);
+	}
+
+	if (slots < SYNCOOKIE_MIN_SLOTS)
+		slots = SYNCOOKIE_MIN_SLOTS;
+	if (slots > SYNCOOKIE_MAX_SLOTS)
+		slots = SYNCOOKIE_MAX_SLOTS;
+
+	return rounddown_pow_of_two(slots);
+}
+
+int syncookie_init(unsigned int slots)
+{
+	unsigned int i;
+
+	slots = compute_slots(slots);
+	bucket_count = slots / SYNCOOKIE_BUCKET_SLOTS;
+	buckets = vzalloc(bucket_count * sizeof(*buckets));
+	if (!buckets) {
+		log_err("Could not allocate the SYN cookie table.");
+		return -ENOMEM;
+	}
+	log_debug("The SYN cookie table has %u slots.", slots);
+
+	for (i = 0; i < ARRAY_SIZE(locks); i++)
+		spin_lock_init(&locks[i]);
+
+	get_random_bytes(&rnd_index, sizeof(rnd_index));
+	get_random_bytes(&rnd_check, sizeof(rnd_check));
+
+	return 0;
+}
+
+void syncookie_destroy(void)
+{
+	vfree(buckets);
+	buckets = NULL;
+}
+
+/**
+ * Remembers that the IPv4 SYN @remote4 -> @local4 (whose sequence number is
+ * @seq) was translated.
+ *
+ * A retransmitted SYN refreshes its own slot. Otherwise the SYN takes an empty
+ * or expired slot from its bucket; if all of them are still waiting for their
+ * SYN-ACKs, nothing is stored and -ENOSPC is returned. (The caller is expected
+ * to handle the SYN statefully then.) Records are never evicted before they
+ * expire, so an attacker cannot steal legitimate handshakes' slots.
+ */
+int syncookie_store(const struct ipv4_transport_addr *local4,
+		const struct ipv4_transport_addr *remote4, __u32 seq)
+{
+	unsigned int index = get_index(local4, remote4);
+	spinlock_t *lock = get_lock(index);
+	struct syncookie_slot *slots = buckets[index].slots;
+	struct syncookie_slot *slot = NULL;
+	u32 check = hash(local4, remote4, rnd_check) | 1;
+	unsigned long now = jiffies;
+	unsigned int i;
+	int error = -ENOSPC;
+
+	spin_lock_bh(lock);
+
+	for (i = 0; i < SYNCOOKIE_BUCKET_SLOTS; i++) {
+		if (slots[i].check == check) {
+			slot = &slots[i];
+			break;
+		}
+		if (!slot && (!slots[i].check
+				|| time_after_eq(now, slots[i].expires)))
+			slot = &slots[i];
+	}
+
+	if (slot) {
+		slot->check = check;
+		slot->seq = seq;
+		slot->expires = now + get_timeout();
+		error = 0;
+	}
+
+	spin_unlock_bh(lock);
+	return error;
+}
+
+/**
+ * Returns true if @ack acknowledges a SYN stored by syncookie_store() for the
+ * same addresses, and it hasn't expired. A successful validation empties the
+ * slot, so each SYN can validate one SYN-ACK at most.
+ */
+bool syncookie_validate(const struct ipv4_transport_addr *local4,
+		const struct ipv4_transport_addr *remote4, __u32 ack)
+{
+	unsigned int index = get_index(local4, remote4);
+	spinlock_t *lock = get_lock(index);
+	struct syncookie_slot *slots = buckets[index].slots;
+	u32 check = hash(local4, remote4, rnd_check) | 1;
+	unsigned int i;
+	bool result = false;
+
+	spin_lock_bh(lock);
+	for (i = 0; i < SYNCOOKIE_BUCKET_SLOTS; i++) {
+		if (slots[i].check == check && slots[i].seq + 1 == ack
+				&& time_before(jiffies, slots[i].expires)) {
+			slots[i].check = 0;
+			result = true;
+			break;
+		}
+	}
+	spin_unlock_bh(lock);
+
+	return result;
+}
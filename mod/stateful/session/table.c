@@ -1,105 +1,355 @@
 #include "nat64/mod/stateful/session/table.h"
 
+#include <linux/jhash.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 #include <net/ipv6.h>
 #include "nat64/common/constants.h"
 #include "nat64/mod/common/rbtree.h"
+#include "nat64/mod/common/rcu.h"
 #include "nat64/mod/common/route.h"
+#include "nat64/mod/stateful/replication.h"
 #include "nat64/mod/stateful/session/pkt_queue.h"
+#include "nat64/mod/stateful/subscriber.h"
+
+/** Initial size of each hash index shard, in bits. */
+#define HASH_MIN_BITS 6
+/** Hash index shards will not grow beyond this size (in bits). */
+#define HASH_MAX_BITS 20
+/** Number of buckets a resize migrates before releasing the lock. */
+#define HASH_MIGRATE_BATCH 64
+/** Sessions sessiontable_restore() hashes per critical section. */
+#define RESTORE_BATCH 256
+
+static u32 hash4(struct session_table *table,
+		const struct ipv4_transport_addr *local4,
+		const struct in_addr *remote4)
+{
+	return jhash_3words((__force u32)local4->l3.s_addr, local4->l4,
+			(__force u32)remote4->s_addr, table->hash_seed);
+}
+
+static u32 hash6(struct session_table *table,
+		const struct ipv6_transport_addr *remote6,
+		const struct ipv6_transport_addr *local6)
+{
+	u32 hash;
+
+	hash = jhash2(remote6->l3.s6_addr32, 4, table->hash_seed);
+	hash = jhash2(local6->l3.s6_addr32, 4, hash);
+	return jhash_2words(remote6->l4, local6->l4, hash);
+}
+
+static u32 session_hash4(struct session_table *table,
+		const struct session_entry *session)
+{
+	return hash4(table, &session->local4, &session->remote4.l3);
+}
+
+static u32 session_hash6(struct session_table *table,
+		const struct session_entry *session)
+{
+	return hash6(table, &session->remote6, &session->local6);
+}
 
 /**
- * Removes all of this database's references towards "session", and drops its
- * refcount accordingly.
+ * Returns the shard the sessions whose hash4() is @hash live in.
  *
- * "table"'s spinlock must already be held.
+ * The remote port is left out of the hash on purpose; sessiontable_allow()
+ * needs to find the shard without it.
  */
-static void rm(struct session_table *table, struct session_entry *session,
-		struct list_head *rms)
+static struct session_shard *get_shard(struct session_table *table, u32 hash)
 {
-	if (!WARN(RB_EMPTY_NODE(&session->tree6_hook), "Faulty IPv6 index"))
-		rb_erase(&session->tree6_hook, &table->tree6);
-	if (!WARN(RB_EMPTY_NODE(&session->tree4_hook), "Faulty IPv4 index"))
-		rb_erase(&session->tree4_hook, &table->tree4);
-	table->count--;
-	list_del(&session->list_hook);
-	list_add(&session->list_hook, rms);
-	session->expirer = NULL;
+	return &table->shards[hash & (SESSIONTABLE_SHARDS - 1)];
+}
 
-	session_log(session, "Forgot session");
+/**
+ * Returns the slice of the IPv6 index the sessions whose hash6() is @hash are
+ * stored in.
+ */
+static struct session_index6 *get_index6(struct session_table *table, u32 hash)
+{
+	return &table->index6[hash & (SESSIONTABLE_SHARDS - 1)];
 }
 
-static void delete(struct list_head *sessions)
+/**
+ * Returns the bucket @hash belongs to. The lowest bits of @hash already chose
+ * the shard, so they are skipped.
+ */
+static struct hlist_head *get_bucket(struct session_buckets *buckets, u32 hash)
 {
-	struct session_entry *session;
-	unsigned long s = 0;
+	hash >>= SESSIONTABLE_SHARD_BITS;
+	return &buckets->heads[hash & ((1 << buckets->bits) - 1)];
+}
 
-	while (!list_empty(sessions)) {
-		session = list_entry(sessions->next, typeof(*session),
-				list_hook);
-		list_del(&session->list_hook);
-		session_return(session);
-		s++;
-	}
+static struct session_buckets *alloc_buckets(unsigned int bits, gfp_t flags)
+{
+	struct session_buckets *result;
+	size_t size;
+	unsigned int i;
+
+	size = sizeof(*result) + (sizeof(result->heads[0]) << bits);
+	if (size <= PAGE_SIZE)
+		result = kmalloc(size, flags);
+	else
+		result = (flags == GFP_KERNEL) ? vmalloc(size) : NULL;
+	if (!result)
+		return NULL;
 
-	log_debug("Deleted %lu sessions.", s);
+	result->bits = bits;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&result->heads[i]);
+
+	return result;
+}
+
+static void free_buckets(struct session_buckets *buckets)
+{
+	if (is_vmalloc_addr(buckets))
+		vfree(buckets);
+	else
+		kfree(buckets);
+}
+
+static int hash_init(struct session_hash *hash)
+{
+	struct session_buckets *buckets;
+
+	buckets = alloc_buckets(HASH_MIN_BITS, GFP_KERNEL);
+	if (!buckets)
+		return -ENOMEM;
+
+	RCU_INIT_POINTER(hash->buckets, buckets);
+	RCU_INIT_POINTER(hash->old, NULL);
+	seqcount_init(&hash->seq);
+	return 0;
+}
+
+/**
+ * Doesn't care about RCU; nobody else can be reading @hash anymore.
+ */
+static void hash_destroy(struct session_hash *hash)
+{
+	struct session_buckets *buckets;
+
+	buckets = rcu_dereference_raw(hash->buckets);
+	if (buckets)
+		free_buckets(buckets);
+	RCU_INIT_POINTER(hash->buckets, NULL);
+	/* Resizes finish before the table is destroyed; this is paranoia. */
+	buckets = rcu_dereference_raw(hash->old);
+	if (buckets)
+		free_buckets(buckets);
+	RCU_INIT_POINTER(hash->old, NULL);
+}
+
+/**
+ * Returns the wheel second "time" (in jiffies) belongs to.
+ */
+static unsigned long wheel_time(unsigned long time)
+{
+	return time / EXPIRER_TICK;
 }
 
 /**
+ * Returns the index of the slot where sessions that expire at "expiration"
+ * (in jiffies) should wait.
+ *
+ * The division truncates, so the slot is the one *after* the expiration;
+ * sessions can expire late, but never early.
+ *
+ * Sessions that are not due during the current fine lap go to the coarse
+ * level. Their coarse slot is always cascaded before they are due, and never
+ * the one the wheel is currently cascading.
+ */
+static unsigned int slot_of(struct expire_timer *expirer,
+		unsigned long expiration)
+{
+	unsigned long slot_time = wheel_time(expiration) + 1;
+	unsigned long lap;
+	unsigned long last_lap;
+
+	if (time_before(slot_time, expirer->clock))
+		slot_time = expirer->clock;
+	if (time_before(slot_time, expirer->clock + EXPIRER_SLOTS))
+		return slot_time & (EXPIRER_SLOTS - 1);
+
+	lap = slot_time / EXPIRER_SLOTS;
+	last_lap = expirer->clock / EXPIRER_SLOTS + EXPIRER_SLOTS - 1;
+	if (time_after(lap, last_lap))
+		lap = last_lap;
+
+	return EXPIRER_SLOTS + (lap & (EXPIRER_SLOTS - 1));
+}
+
+/**
+ * Moves "session" (which is already queued in "expirer") to the tail of slot
+ * #"slot".
+ *
  * Spinlock must be held.
  */
-static void force_reschedule(struct expire_timer *expirer)
+static void move_to_slot(struct expire_timer *expirer,
+		struct session_entry *session, unsigned int slot)
 {
-	struct session_entry *first;
-	unsigned long next_time;
-	const unsigned long min_next_time = jiffies + MIN_TIMER_SLEEP;
+	expirer->slot_counts[session->expirer_slot]--;
+	list_move_tail(&session->list_hook, &expirer->slots[slot]);
+	session->expirer_slot = slot;
+	expirer->slot_counts[slot]++;
+}
 
-	if (list_empty(&expirer->sessions))
-		return;
+/**
+ * Queues "session" in "expirer", according to its current update_time.
+ *
+ * Spinlock must be held.
+ */
+static void expirer_add(struct expire_timer *expirer,
+		struct session_entry *session)
+{
+	unsigned long expiration;
+	unsigned int slot;
 
-	first = list_entry(expirer->sessions.next, typeof(*first), list_hook);
-	next_time = first->update_time + expirer->get_timeout();
+	if (!expirer->count) {
+		expirer->clock = wheel_time(jiffies);
+		expirer->todo = 0;
+	}
 
-	if (time_before(next_time, min_next_time))
-		next_time = min_next_time;
+	expiration = session->update_time + expirer->get_timeout();
+	slot = slot_of(expirer, expiration);
+	list_add_tail(&session->list_hook, &expirer->slots[slot]);
+	session->queued = true;
+	session->established = (expirer == &expirer->shard->est_timer);
+	session->expirer_slot = slot;
+	expirer->slot_counts[slot]++;
+
+	/* This does nothing if the cleaner is already scheduled. */
+	if (!expirer->count++)
+		schedule_delayed_work(&expirer->work, EXPIRER_TICK);
+}
 
-	mod_timer(&expirer->timer, next_time);
-	log_debug("Timer will awake in %u msecs.",
-			jiffies_to_msecs(expirer->timer.expires - jiffies));
+/**
+ * Returns the expirer "session" is queued in, or NULL if it isn't queued.
+ * "shard" has to be "session"'s home shard.
+ */
+static struct expire_timer *get_expirer(struct session_shard *shard,
+		const struct session_entry *session)
+{
+	if (!session->queued)
+		return NULL;
+	return session->established ? &shard->est_timer : &shard->trans_timer;
 }
 
 /**
+ * Unqueues "session" from its expirer.
+ *
  * Spinlock must be held.
  */
-static void reschedule(struct expire_timer *expirer)
+static void expirer_del(struct session_shard *shard,
+		struct session_entry *session)
 {
-	/*
-	 * Any existing sessions will expire before the new one (because they
-	 * are sorted that way).
-	 * The timer should always trigger on the earliest session.
-	 */
-	if (timer_pending(&expirer->timer))
-		return;
+	struct expire_timer *expirer = get_expirer(shard, session);
 
-	force_reschedule(expirer);
+	list_del(&session->list_hook);
+	expirer->slot_counts[session->expirer_slot]--;
+	expirer->count--;
+	session->queued = false;
+}
+
+/**
+ * Moves "session" to "expirer" unless it's already there. The timeout is
+ * assumed to have been refreshed already.
+ *
+ * Spinlock must be held.
+ */
+static void expirer_move(struct expire_timer *expirer,
+		struct session_entry *session)
+{
+	if (get_expirer(expirer->shard, session) == expirer)
+		return; /* The wheel will notice the new update_time lazily. */
+
+	expirer_del(expirer->shard, session);
+	expirer_add(expirer, session);
+}
+
+/**
+ * Returns the subscriber "session" is charged to, if any.
+ */
+static struct subscriber *get_subscriber(const struct session_entry *session)
+{
+	return session->bib ? session->bib->subscriber : NULL;
+}
+
+/**
+ * Removes all of this database's references towards "session", and drops its
+ * refcount accordingly.
+ *
+ * "shard" must be "session"'s home shard, and its spinlock must already be
+ * held.
+ */
+static void rm(struct session_table *table, struct session_shard *shard,
+		struct session_entry *session, struct list_head *rms)
+{
+	struct session_index6 *index6;
+
+	index6 = get_index6(table, session_hash6(table, session));
+	spin_lock(&index6->lock);
+	if (!WARN(hlist_unhashed(&session->hash6_hook), "Faulty IPv6 index")) {
+		hlist_del_init_rcu(&session->hash6_hook);
+		index6->count--;
+	}
+	spin_unlock(&index6->lock);
+
+	if (!WARN(hlist_unhashed(&session->hash4_hook), "Faulty IPv4 index"))
+		hlist_del_init_rcu(&session->hash4_hook);
+	if (!WARN(RB_EMPTY_NODE(&session->tree4_hook), "Faulty IPv4 tree")) {
+		rb_erase(&session->tree4_hook, &shard->tree4);
+		RB_CLEAR_NODE(&session->tree4_hook);
+	}
+	shard->count--;
+	replication_session(session, REPL_RM);
+	expirer_del(shard, session);
+	list_add(&session->list_hook, rms);
+	if (get_subscriber(session))
+		subscriber_rm_session(get_subscriber(session), session);
+
+	session_log(session, "Forgot session");
+}
+
+static void delete(struct list_head *sessions)
+{
+	struct session_entry *session;
+	unsigned long s = 0;
+
+	while (!list_empty(sessions)) {
+		session = list_entry(sessions->next, typeof(*session),
+				list_hook);
+		list_del(&session->list_hook);
+		session_return(session);
+		s++;
+	}
+
+	log_debug("Deleted %lu sessions.", s);
 }
 
 static void decide_fate(fate_cb cb,
 		struct packet *pkt,
 		struct session_table *table,
+		struct session_shard *shard,
 		struct session_entry *session,
 		struct list_head *rms,
 		struct list_head *probes)
 {
 	enum session_fate fate;
 	struct session_entry *tmp;
+	struct expire_timer *old_expirer = get_expirer(shard, session);
+	__u8 old_state = session->state;
 
 	fate = cb(session, pkt);
 	switch (fate) {
 	case FATE_TIMER_EST:
 		session->update_time = jiffies;
-		session->expirer = &table->est_timer;
-		list_del(&session->list_hook);
-		list_add_tail(&session->list_hook, &session->expirer->sessions);
-		reschedule(&table->est_timer);
+		expirer_move(&shard->est_timer, session);
 		break;
 	case FATE_PROBE:
 		tmp = session_clone(session);
@@ -114,17 +364,22 @@ static void decide_fate(fate_cb cb,
 		/*  Fall through. */
 	case FATE_TIMER_TRANS:
 		session->update_time = jiffies;
-		session->expirer = &table->trans_timer;
-		list_del(&session->list_hook);
-		list_add_tail(&session->list_hook, &session->expirer->sessions);
-		reschedule(&table->trans_timer);
+		expirer_move(&shard->trans_timer, session);
 		break;
 	case FATE_RM:
-		rm(table, session, rms);
-		break;
+		rm(table, shard, session, rms);
+		return;
 	case FATE_PRESERVE:
 		break;
 	}
+
+	/*
+	 * Plain timer refreshes are not replicated here; there's one per
+	 * packet. clean_session() catches them once per lap instead.
+	 */
+	if (session->state != old_state
+			|| get_expirer(shard, session) != old_expirer)
+		replication_session(session, REPL_UPDATE);
 }
 
 /**
@@ -219,6 +474,7 @@ static void post_fate(struct list_head *rms, struct list_head *probes)
 	struct session_entry *session, *tmp;
 
 	list_for_each_entry_safe(session, tmp, probes, list_hook) {
+		list_del(&session->list_hook);
 		send_probe_packet(session);
 		session_return(session);
 	}
@@ -227,69 +483,468 @@ static void post_fate(struct list_head *rms, struct list_head *probes)
 }
 
 /**
- * Called once in a while to kick off the scheduled expired sessions massacre.
+ * Reaps "session" if it has expired. Otherwise, moves it to the slot it
+ * belongs to now. (It was either refreshed since it was queued, or it belongs
+ * to a later lap of the wheel.)
+ *
+ * Spinlock must be held.
+ */
+static void clean_session(struct expire_timer *expirer,
+		struct session_entry *session, unsigned long timeout,
+		struct list_head *rms, struct list_head *probes)
+{
+	unsigned long expiration;
+
+	expiration = session->update_time + timeout;
+	if (time_before(jiffies, expiration)) {
+		move_to_slot(expirer, session, slot_of(expirer, expiration));
+		/*
+		 * Sessions only reach the fine level when they are about to
+		 * expire, so this one was refreshed. Tell the standby.
+		 */
+		replication_session(session, REPL_UPDATE);
+		return;
+	}
+
+	decide_fate(expirer->decide_fate_cb, NULL, expirer->table,
+			expirer->shard, session, rms, probes);
+
+	/*
+	 * If the session stayed in this expirer (FATE_PRESERVE or
+	 * FATE_TIMER_EST), move it out of the way.
+	 */
+	if (get_expirer(expirer->shard, session) == expirer)
+		move_to_slot(expirer, session, slot_of(expirer,
+				session->update_time + timeout));
+}
+
+/**
+ * Moves the sessions from the coarse slot of the fine lap that starts at
+ * "expirer->clock" to their fine slots, spending one unit of "budget" per
+ * session. Returns false if the budget ran out first.
+ *
+ * The sessions never go back to the slot they came from, so the cascading can
+ * be resumed simply by calling this again.
+ *
+ * Spinlock must be held.
+ */
+static bool cascade(struct expire_timer *expirer, unsigned long timeout,
+		unsigned int *budget)
+{
+	struct list_head *slot_list;
+	struct session_entry *session;
+	unsigned int slot;
+
+	slot = EXPIRER_SLOTS
+			+ ((expirer->clock / EXPIRER_SLOTS) & (EXPIRER_SLOTS - 1));
+	slot_list = &expirer->slots[slot];
+
+	while (!list_empty(slot_list)) {
+		if (!*budget)
+			return false;
+		session = list_first_entry(slot_list, struct session_entry,
+				list_hook);
+		move_to_slot(expirer, session, slot_of(expirer,
+				session->update_time + timeout));
+		(*budget)--;
+	}
+
+	return true;
+}
+
+/**
+ * Requeues all of "expirer"'s sessions, because they might be sitting in the
+ * wrong slots.
+ *
+ * Spinlock must be held.
+ */
+static void requeue(struct expire_timer *expirer)
+{
+	struct session_entry *session, *tmp;
+	unsigned long timeout;
+	unsigned int i;
+	LIST_HEAD(sessions);
+
+	expirer->todo = 0;
+	if (!expirer->count)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(expirer->slots); i++) {
+		list_splice_tail_init(&expirer->slots[i], &sessions);
+		expirer->slot_counts[i] = 0;
+	}
+
+	timeout = expirer->get_timeout();
+	list_for_each_entry_safe(session, tmp, &sessions, list_hook) {
+		session->expirer_slot = slot_of(expirer,
+				session->update_time + timeout);
+		list_move_tail(&session->list_hook,
+				&expirer->slots[session->expirer_slot]);
+		expirer->slot_counts[session->expirer_slot]++;
+	}
+}
+
+/**
+ * Visits at most EXPIRER_BATCH sessions from "expirer"'s due slots.
+ * Returns true if the due slots could not be finished.
+ *
+ * Sessions visited are always moved away from the head of their slot, so
+ * the next session to visit is always the first one. expirer->todo is the
+ * number of sessions that were in the current slot when we started it; it
+ * keeps sessions from being visited twice in the same lap.
+ *
+ * Spinlock must be held.
+ */
+static bool clean_batch(struct expire_timer *expirer, struct list_head *rms,
+		struct list_head *probes)
+{
+	struct list_head *slot_list;
+	unsigned int slot;
+	unsigned long now;
+	unsigned long timeout;
+	unsigned int budget = EXPIRER_BATCH;
+
+	now = wheel_time(jiffies);
+	/*
+	 * jiffies / EXPIRER_TICK is not continuous when jiffies wraps.
+	 * Also, if we're more than a lap late, one lap covers everything
+	 * anyway. Either way, coarse slots would be skipped, so the sessions
+	 * are placed again, relative to the new clock.
+	 */
+	if (time_after(expirer->clock, now + 1)) {
+		expirer->clock = now;
+		requeue(expirer);
+	} else if (time_after(now, expirer->clock + EXPIRER_SLOTS)) {
+		expirer->clock = now - EXPIRER_SLOTS + 1;
+		requeue(expirer);
+	}
+
+	timeout = expirer->get_timeout();
+
+	while (!time_after(expirer->clock, now)) {
+		if (!(expirer->clock & (EXPIRER_SLOTS - 1))
+				&& !cascade(expirer, timeout, &budget))
+			goto exhausted;
+
+		slot = expirer->clock & (EXPIRER_SLOTS - 1);
+		slot_list = &expirer->slots[slot];
+		if (!expirer->todo)
+			expirer->todo = expirer->slot_counts[slot];
+
+		for (; expirer->todo && !list_empty(slot_list); expirer->todo--) {
+			if (!budget)
+				goto exhausted;
+			clean_session(expirer, list_first_entry(slot_list,
+					struct session_entry, list_hook),
+					timeout, rms, probes);
+			budget--;
+		}
+
+		expirer->todo = 0;
+		expirer->clock++;
+	}
+
+	expirer->batches++;
+	return false;
+
+exhausted:
+	expirer->batches++;
+	return true;
+}
+
+/**
+ * Runs every EXPIRER_TICK to kick off the scheduled expired sessions
+ * massacre. Only the slots whose time has come are visited.
+ *
+ * This is a work item rather than a timer so the sessions are not reaped in
+ * softirq context. It also only handles one batch per run; if there's more
+ * to do, it releases the lock and requeues itself right away.
  *
  * In that sense, it's a public function, so it requires spinlocks to NOT be
  * held.
  */
-static void cleaner_timer(unsigned long param)
+static void cleaner_work(struct work_struct *work)
 {
-	struct expire_timer *expirer = (struct expire_timer *) param;
-	unsigned long timeout;
-	struct session_entry *session, *tmp;
+	struct expire_timer *expirer;
+	bool pending;
 	LIST_HEAD(rms);
 	LIST_HEAD(probes);
 
+	expirer = container_of(to_delayed_work(work), struct expire_timer,
+			work);
+
 	log_debug("===============================================");
 	log_debug("Handling expired sessions...");
 
-	timeout = expirer->get_timeout();
+	spin_lock_bh(&expirer->shard->lock);
 
-	spin_lock_bh(&expirer->table->lock);
-	list_for_each_entry_safe(session, tmp, &expirer->sessions, list_hook) {
-		/*
-		 * "list" is sorted by expiration date,
-		 * so stop on the first unexpired session.
-		 */
-		if (time_before(jiffies, session->update_time + timeout))
-			break;
+	pending = clean_batch(expirer, &rms, &probes);
+	if (pending)
+		schedule_delayed_work(&expirer->work, 0);
+	else if (expirer->count)
+		schedule_delayed_work(&expirer->work, EXPIRER_TICK);
 
-		decide_fate(expirer->decide_fate_cb, NULL, expirer->table,
-				session, &rms, &probes);
-	}
+	spin_unlock_bh(&expirer->shard->lock);
 
-	if (!list_empty(&expirer->sessions))
-		reschedule(expirer);
+	post_fate(&rms, &probes);
+}
 
-	spin_unlock_bh(&expirer->table->lock);
+/**
+ * Returns the number of sessions from "expirer" that are due but haven't been
+ * visited by the cleaner yet.
+ *
+ * Spinlock must be held.
+ */
+static u64 get_backlog(struct expire_timer *expirer)
+{
+	unsigned long now = wheel_time(jiffies);
+	unsigned long clock = expirer->clock;
+	u64 result;
+	unsigned int i;
 
-	post_fate(&rms, &probes);
+	if (!expirer->count || time_after(clock, now))
+		return 0;
+
+	result = expirer->todo
+			? expirer->todo
+			: expirer->slot_counts[clock & (EXPIRER_SLOTS - 1)];
+	clock++;
+	for (i = 1; i < EXPIRER_SLOTS && !time_after(clock, now); i++) {
+		result += expirer->slot_counts[clock & (EXPIRER_SLOTS - 1)];
+		clock++;
+	}
+
+	return result;
 }
 
 static void init_expirer(struct expire_timer *expirer,
 		timeout_cb timeout_cb, fate_cb decide_fate_cb,
-		struct session_table *table)
+		struct session_table *table, struct session_shard *shard)
 {
-	init_timer(&expirer->timer);
-	expirer->timer.function = cleaner_timer;
-	expirer->timer.expires = 0;
-	expirer->timer.data = (unsigned long) expirer;
-	INIT_LIST_HEAD(&expirer->sessions);
+	unsigned int i;
+
+	INIT_DELAYED_WORK(&expirer->work, cleaner_work);
+	for (i = 0; i < ARRAY_SIZE(expirer->slots); i++) {
+		INIT_LIST_HEAD(&expirer->slots[i]);
+		expirer->slot_counts[i] = 0;
+	}
+	expirer->clock = wheel_time(jiffies);
+	expirer->todo = 0;
+	expirer->count = 0;
+	expirer->batches = 0;
 	expirer->get_timeout = timeout_cb;
 	expirer->decide_fate_cb = decide_fate_cb;
 	expirer->table = table;
+	expirer->shard = shard;
 }
 
-void sessiontable_init(struct session_table *table,
+/**
+ * Returns the size (in bits) a hash index needs to hold @count sessions
+ * without getting crowded.
+ */
+static unsigned int fit_bits(u64 count)
+{
+	unsigned int bits = HASH_MIN_BITS;
+
+	while (bits < HASH_MAX_BITS && count > (2ULL << bits))
+		bits++;
+
+	return bits;
+}
+
+/**
+ * Moves the sessions from @old's buckets [@first, @last) to @new.
+ *
+ * @lock must be held.
+ */
+static void migrate_buckets(struct session_table *table,
+		struct session_buckets *old, struct session_buckets *new,
+		bool is6, unsigned int first, unsigned int last)
+{
+	struct session_entry *session;
+	struct hlist_node *node, *tmp;
+	unsigned int i;
+
+	for (i = first; i < last; i++) {
+		hlist_for_each_safe(node, tmp, &old->heads[i]) {
+			hlist_del_rcu(node);
+			if (is6) {
+				session = hlist_entry(node, struct session_entry,
+						hash6_hook);
+				hlist_add_head_rcu(node, get_bucket(new,
+						session_hash6(table, session)));
+			} else {
+				session = hlist_entry(node, struct session_entry,
+						hash4_hook);
+				hlist_add_head_rcu(node, get_bucket(new,
+						session_hash4(table, session)));
+			}
+		}
+	}
+}
+
+/**
+ * Moves @hash's sessions to a bucket array of 2^@bits buckets.
+ *
+ * The new array is published right away, (so new sessions go there) and the
+ * old sessions are migrated HASH_MIGRATE_BATCH buckets at a time. The lock is
+ * released between batches, so neither the writers nor the bottom halves are
+ * stalled by the whole rehash. Lookups query both arrays meanwhile.
+ *
+ * Lookups that happen while a batch is being moved might get lost as their
+ * sessions change buckets; that's what @hash->seq is for.
+ *
+ * @table->resize_lock must be held.
+ */
+static int grow_hash(struct session_table *table, struct session_hash *hash,
+		spinlock_t *lock, bool is6, unsigned int bits)
+{
+	struct session_buckets *old, *new;
+	unsigned int i;
+
+	new = alloc_buckets(bits, GFP_KERNEL);
+	if (!new) {
+		log_debug("Could not allocate a bigger session hash index.");
+		return -ENOMEM;
+	}
+
+	spin_lock_bh(lock);
+	old = rcu_dereference_protected(hash->buckets, lockdep_is_held(lock));
+	write_seqcount_begin(&hash->seq);
+	rcu_assign_pointer(hash->old, old);
+	rcu_assign_pointer(hash->buckets, new);
+	write_seqcount_end(&hash->seq);
+	spin_unlock_bh(lock);
+
+	for (i = 0; i < (1 << old->bits); i += HASH_MIGRATE_BATCH) {
+		spin_lock_bh(lock);
+		write_seqcount_begin(&hash->seq);
+		migrate_buckets(table, old, new, is6, i,
+				min(i + HASH_MIGRATE_BATCH, 1U << old->bits));
+		write_seqcount_end(&hash->seq);
+		spin_unlock_bh(lock);
+		cond_resched();
+	}
+
+	spin_lock_bh(lock);
+	write_seqcount_begin(&hash->seq);
+	RCU_INIT_POINTER(hash->old, NULL);
+	write_seqcount_end(&hash->seq);
+	spin_unlock_bh(lock);
+
+	synchronize_rcu_bh();
+	free_buckets(old);
+	return 0;
+}
+
+/**
+ * Grows @hash (if needed) so it can hold @extra more sessions than @count
+ * without getting crowded.
+ *
+ * @table->resize_lock must be held.
+ */
+static int reserve_hash(struct session_table *table, struct session_hash *hash,
+		spinlock_t *lock, u64 *count, u64 extra, bool is6)
+{
+	unsigned int old_bits, new_bits;
+
+	spin_lock_bh(lock);
+	old_bits = rcu_dereference_protected(hash->buckets,
+			lockdep_is_held(lock))->bits;
+	new_bits = fit_bits(*count + extra);
+	spin_unlock_bh(lock);
+
+	if (new_bits <= old_bits)
+		return 0;
+
+	return grow_hash(table, hash, lock, is6, new_bits);
+}
+
+static void resize_hashes(struct work_struct *work)
+{
+	struct session_table *table;
+	struct session_shard *shard;
+	struct session_index6 *index6;
+	unsigned int i;
+
+	table = container_of(work, struct session_table, resizer);
+
+	mutex_lock(&table->resize_lock);
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		shard = &table->shards[i];
+		if (reserve_hash(table, &shard->hash4, &shard->lock,
+				&shard->count, 0, false))
+			break;
+
+		index6 = &table->index6[i];
+		if (reserve_hash(table, &index6->hash6, &index6->lock,
+				&index6->count, 0, true))
+			break;
+	}
+	mutex_unlock(&table->resize_lock);
+}
+
+/**
+ * Requests a resize if the hash index pointed by @buckets has too many
+ * sessions.
+ */
+static void maybe_resize(struct session_table *table,
+		struct session_buckets *buckets, u64 count)
+{
+	if (buckets->bits < HASH_MAX_BITS && count > (2ULL << buckets->bits))
+		schedule_work(&table->resizer);
+}
+
+static void hashes_destroy(struct session_table *table)
+{
+	unsigned int i;
+
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		hash_destroy(&table->shards[i].hash4);
+		hash_destroy(&table->index6[i].hash6);
+	}
+}
+
+int sessiontable_init(struct session_table *table,
 		timeout_cb est_timeout, fate_cb est_callback,
 		timeout_cb trans_timeout, fate_cb trans_callback)
 {
-	table->tree6 = RB_ROOT;
-	table->tree4 = RB_ROOT;
-	table->count = 0;
-	init_expirer(&table->est_timer, est_timeout, est_callback, table);
-	init_expirer(&table->trans_timer, trans_timeout, trans_callback, table);
-	spin_lock_init(&table->lock);
+	struct session_shard *shard;
+	struct session_index6 *index6;
+	unsigned int i;
+
+	memset(table, 0, sizeof(*table));
+
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		shard = &table->shards[i];
+		if (hash_init(&shard->hash4))
+			goto fail;
+		shard->tree4 = RB_ROOT;
+		shard->count = 0;
+		init_expirer(&shard->est_timer, est_timeout, est_callback,
+				table, shard);
+		init_expirer(&shard->trans_timer, trans_timeout, trans_callback,
+				table, shard);
+		spin_lock_init(&shard->lock);
+	}
+
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		index6 = &table->index6[i];
+		if (hash_init(&index6->hash6))
+			goto fail;
+		index6->count = 0;
+		spin_lock_init(&index6->lock);
+	}
+
+	get_random_bytes(&table->hash_seed, sizeof(table->hash_seed));
+	INIT_WORK(&table->resizer, resize_hashes);
+	mutex_init(&table->resize_lock);
+	return 0;
+
+fail:
+	hashes_destroy(table);
+	log_err("Could not allocate the session hash indexes.");
+	return -ENOMEM;
 }
 
 /**
@@ -300,18 +955,34 @@ void sessiontable_init(struct session_table *table,
  */
 static void __destroy_aux(struct rb_node *node)
 {
-	session_return(rb_entry(node, struct session_entry, tree6_hook));
+	struct session_entry *session;
+
+	session = rb_entry(node, struct session_entry, tree4_hook);
+	if (get_subscriber(session))
+		subscriber_rm_session(get_subscriber(session), session);
+	session_return(session);
 }
 
 void sessiontable_destroy(struct session_table *table)
 {
-	del_timer_sync(&table->est_timer.timer);
-	del_timer_sync(&table->trans_timer.timer);
-	/*
-	 * The values need to be released only in one of the trees
-	 * because both trees point to the same values.
-	 */
-	rbtree_clear(&table->tree6, __destroy_aux);
+	struct session_shard *shard;
+	unsigned int i;
+
+	cancel_work_sync(&table->resizer);
+
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		shard = &table->shards[i];
+		cancel_delayed_work_sync(&shard->est_timer.work);
+		cancel_delayed_work_sync(&shard->trans_timer.work);
+		/*
+		 * Every session is in exactly one IPv4 tree, so these are
+		 * the only references that need to be released.
+		 * The hashes point to the same values.
+		 */
+		rbtree_clear(&shard->tree4, __destroy_aux);
+	}
+
+	hashes_destroy(table);
 }
 
 static int compare_addr6(const struct ipv6_transport_addr *a1,
@@ -327,19 +998,6 @@ static int compare_addr6(const struct ipv6_transport_addr *a1,
 	return gap;
 }
 
-static int compare_session6(const struct session_entry *s1,
-		const struct session_entry *s2)
-{
-	int gap;
-
-	gap = compare_addr6(&s1->local6, &s2->local6);
-	if (gap)
-		return gap;
-
-	gap = compare_addr6(&s1->remote6, &s2->remote6);
-	return gap;
-}
-
 /**
  * Returns > 0 if session.*6 > tuple6.*.addr6.
  * Returns < 0 integer if session.*6 < tuple6.*.addr6.
@@ -429,55 +1087,174 @@ static int compare_full4(const struct session_entry *session,
 	return gap;
 }
 
-static struct session_entry *get_by_ipv6(struct session_table *table,
-		struct tuple *tuple)
+/**
+ * Returns the session from @buckets whose IPv4 side is "tuple".
+ * If "full" is false, the remote port is ignored. (See compare_addrs4().)
+ *
+ * Requires rcu_read_lock_bh().
+ */
+static struct session_entry *find4_in(struct session_buckets *buckets,
+		u32 hash, const struct tuple *tuple, bool full)
 {
-	return rbtree_find(tuple, &table->tree6, compare_full6,
-			struct session_entry, tree6_hook);
+	struct session_entry *session;
+	struct hlist_node *node;
+
+	hlist_for_each_rcu_bh(node, get_bucket(buckets, hash)) {
+		session = hlist_entry(node, struct session_entry, hash4_hook);
+		if (full ? !compare_full4(session, tuple)
+				: !compare_addrs4(session, tuple))
+			return session;
+	}
+
+	return NULL;
 }
 
-static struct session_entry *get_by_ipv4(struct session_table *table,
-		struct tuple *tuple)
-{
-	return rbtree_find(tuple, &table->tree4, compare_full4,
-			struct session_entry, tree4_hook);
+/**
+ * Returns the session "tuple" (an IPv4 tuple) belongs to.
+ * If "full" is false, the remote port is ignored. (See compare_addrs4().)
+ *
+ * Requires rcu_read_lock_bh(). The result is not reference-counted.
+ */
+static struct session_entry *find4(struct session_table *table,
+		const struct tuple *tuple, bool full)
+{
+	struct session_shard *shard;
+	struct session_buckets *old;
+	struct session_entry *session;
+	unsigned int seq;
+	u32 hash;
+
+	hash = hash4(table, &tuple->dst.addr4, &tuple->src.addr4.l3);
+	shard = get_shard(table, hash);
+
+	do {
+		seq = read_seqcount_begin(&shard->hash4.seq);
+		session = find4_in(rcu_dereference_bh(shard->hash4.buckets),
+				hash, tuple, full);
+		if (session)
+			return session;
+		/* If a resize is in progress, try the old array as well. */
+		old = rcu_dereference_bh(shard->hash4.old);
+		if (old) {
+			session = find4_in(old, hash, tuple, full);
+			if (session)
+				return session;
+		}
+	} while (read_seqcount_retry(&shard->hash4.seq, seq));
+
+	return NULL;
+}
+
+/**
+ * Returns the session from @buckets whose IPv6 side is "tuple".
+ *
+ * Requires rcu_read_lock_bh().
+ */
+static struct session_entry *find6_in(struct session_buckets *buckets,
+		u32 hash, const struct tuple *tuple)
+{
+	struct session_entry *session;
+	struct hlist_node *node;
+
+	hlist_for_each_rcu_bh(node, get_bucket(buckets, hash)) {
+		session = hlist_entry(node, struct session_entry, hash6_hook);
+		if (!compare_full6(session, tuple))
+			return session;
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the session "tuple" (an IPv6 tuple) belongs to.
+ *
+ * Requires rcu_read_lock_bh(). The result is not reference-counted.
+ */
+static struct session_entry *find6(struct session_table *table,
+		const struct tuple *tuple)
+{
+	struct session_index6 *index6;
+	struct session_buckets *old;
+	struct session_entry *session;
+	unsigned int seq;
+	u32 hash;
+
+	hash = hash6(table, &tuple->src.addr6, &tuple->dst.addr6);
+	index6 = get_index6(table, hash);
+
+	do {
+		seq = read_seqcount_begin(&index6->hash6.seq);
+		session = find6_in(rcu_dereference_bh(index6->hash6.buckets),
+				hash, tuple);
+		if (session)
+			return session;
+		/* If a resize is in progress, try the old array as well. */
+		old = rcu_dereference_bh(index6->hash6.old);
+		if (old) {
+			session = find6_in(old, hash, tuple);
+			if (session)
+				return session;
+		}
+	} while (read_seqcount_retry(&index6->hash6.seq, seq));
+
+	return NULL;
+}
+
+/**
+ * Lockless lookup. Returns the session "tuple" belongs to, with an extra
+ * reference.
+ */
+static struct session_entry *find(struct session_table *table,
+		const struct tuple *tuple)
+{
+	struct session_entry *session;
+
+	rcu_read_lock_bh();
+	session = (tuple->l3_proto == L3PROTO_IPV6)
+			? find6(table, tuple)
+			: find4(table, tuple, true);
+	if (session && !session_get_unless_zero(session))
+		session = NULL;
+	rcu_read_unlock_bh();
+
+	return session;
 }
 
 int sessiontable_get(struct session_table *table, struct tuple *tuple,
 		fate_cb cb, struct packet *pkt, struct session_entry **result)
 {
+	struct session_shard *shard;
 	struct session_entry *session;
 	LIST_HEAD(rms);
 	LIST_HEAD(probes);
 
-	spin_lock_bh(&table->lock);
-
 	switch (tuple->l3_proto) {
 	case L3PROTO_IPV6:
-		session = get_by_ipv6(table, tuple);
-		break;
 	case L3PROTO_IPV4:
-		session = get_by_ipv4(table, tuple);
 		break;
 	default:
 		WARN(true, "Unsupported network protocol: %u", tuple->l3_proto);
-		spin_unlock_bh(&table->lock);
 		return -EINVAL;
 	}
 
-	if (session) {
-		session_get(session);
-		if (cb)
-			decide_fate(cb, pkt, table, session, &rms, &probes);
-	}
+	session = find(table, tuple);
+	if (!session)
+		return -ESRCH;
 
-	spin_unlock_bh(&table->lock);
+	if (cb) {
+		shard = get_shard(table, session_hash4(table, session));
+		spin_lock_bh(&shard->lock);
+		if (RB_EMPTY_NODE(&session->tree4_hook)) {
+			/* It died while we weren't holding the lock. */
+			spin_unlock_bh(&shard->lock);
+			session_return(session);
+			return -ESRCH;
+		}
+		decide_fate(cb, pkt, table, shard, session, &rms, &probes);
+		spin_unlock_bh(&shard->lock);
 
-	if (cb)
 		post_fate(&rms, &probes);
-
-	if (!session)
-		return -ESRCH;
+	}
 
 	*result = session;
 	return 0;
@@ -485,27 +1262,18 @@ int sessiontable_get(struct session_table *table, struct tuple *tuple,
 
 bool sessiontable_allow(struct session_table *table, struct tuple *tuple4)
 {
-	struct session_entry *session;
 	bool result;
 
-	spin_lock_bh(&table->lock);
-	session = rbtree_find(tuple4, &table->tree4, compare_addrs4,
-			struct session_entry, tree4_hook);
-	result = session ? true : false;
-	spin_unlock_bh(&table->lock);
+	rcu_read_lock_bh();
+	result = find4(table, tuple4, false) ? true : false;
+	rcu_read_unlock_bh();
 
 	return result;
 }
 
-static int add6(struct session_table *table, struct session_entry *session)
-{
-	return rbtree_add(session, session, &table->tree6, compare_session6,
-			struct session_entry, tree6_hook);
-}
-
-static int add4(struct session_table *table, struct session_entry *session)
+static int add4(struct session_shard *shard, struct session_entry *session)
 {
-	return rbtree_add(session, session, &table->tree4, compare_session4,
+	return rbtree_add(session, session, &shard->tree4, compare_session4,
 			struct session_entry, tree4_hook);
 }
 
@@ -513,65 +1281,396 @@ static void attach_timer(struct session_entry *session,
 		struct expire_timer *expirer)
 {
 	session->update_time = jiffies;
-	list_add_tail(&session->list_hook, &expirer->sessions);
-	session->expirer = expirer;
-	reschedule(expirer);
+	expirer_add(expirer, session);
 }
 
+/**
+ * Adds "session" to "table".
+ *
+ * If "table" already has a session for "session"'s IPv6 tuple, fails with
+ * -EEXIST and, unless "old" is NULL, returns that session (with an extra
+ * reference) in "old". The lookup and the insertion happen in the same
+ * critical section, so the caller can use "old" instead of "session" even if
+ * another CPU won the race to create the session.
+ *
+ * "old" is set to NULL in any other case.
+ */
 int sessiontable_add(struct session_table *table, struct session_entry *session,
-		bool is_established)
+		bool is_established, struct session_entry **old)
 {
+	struct session_shard *shard;
+	struct session_index6 *index6;
+	struct session_buckets *buckets4, *buckets6;
+	struct session_entry *collision;
 	struct expire_timer *expirer;
+	struct tuple tuple6;
+	u32 h4, h6;
 	int error;
 
+	if (old)
+		*old = NULL;
+
 	pktqueue_remove(session);
-	expirer = is_established ? &table->est_timer : &table->trans_timer;
+	h4 = session_hash4(table, session);
+	h6 = session_hash6(table, session);
+	shard = get_shard(table, h4);
+	index6 = get_index6(table, h6);
+	expirer = is_established ? &shard->est_timer : &shard->trans_timer;
+
+	tuple6.src.addr6 = session->remote6;
+	tuple6.dst.addr6 = session->local6; /* the protos are not needed. */
+
+	spin_lock_bh(&shard->lock);
+	spin_lock(&index6->lock);
+	rcu_read_lock_bh();
+
+	collision = find6(table, &tuple6);
+	if (collision) {
+		if (old && session_get_unless_zero(collision))
+			*old = collision;
+		error = -EEXIST;
+		goto end;
+	}
+	/* The tree also checks the IPv4 side for duplicates. */
+	error = add4(shard, session);
+	if (error)
+		goto end;
 
-	spin_lock_bh(&table->lock);
+	buckets4 = rcu_dereference_bh(shard->hash4.buckets);
+	buckets6 = rcu_dereference_bh(index6->hash6.buckets);
+	hlist_add_head_rcu(&session->hash4_hook, get_bucket(buckets4, h4));
+	hlist_add_head_rcu(&session->hash6_hook, get_bucket(buckets6, h6));
 
-	error = add6(table, session);
-	if (error) {
-		spin_unlock_bh(&table->lock);
-		return error;
+	attach_timer(session, expirer);
+	session_get(session); /* Database's references. */
+	shard->count++;
+	index6->count++;
+	if (get_subscriber(session))
+		subscriber_add_session(get_subscriber(session), session);
+	replication_session(session, REPL_ADD);
+	maybe_resize(table, buckets4, shard->count);
+	maybe_resize(table, buckets6, index6->count);
+	/* Fall through. */
+
+end:
+	rcu_read_unlock_bh();
+	spin_unlock(&index6->lock);
+	spin_unlock_bh(&shard->lock);
+	if (!error)
+		session_log(session, "Added session");
+	return error;
+}
+
+static int restore_compare4(const void *r1, const void *r2)
+{
+	return compare_session4(((struct session_restore *)r1)->session,
+			((struct session_restore *)r2)->session);
+}
+
+/**
+ * Queues @session (which is not queued anywhere) in @shard's established or
+ * transitory expirer, backdating its update_time so it has (at most) @lifetime
+ * jiffies left.
+ *
+ * Spinlock must be held.
+ */
+static void set_timer(struct session_shard *shard,
+		struct session_entry *session, bool established,
+		unsigned long lifetime)
+{
+	struct expire_timer *expirer;
+	unsigned long timeout;
+
+	/* UDP and ICMP only have one timer. */
+	expirer = (established || !shard->trans_timer.get_timeout)
+			? &shard->est_timer
+			: &shard->trans_timer;
+	timeout = expirer->get_timeout();
+
+	session->update_time = jiffies - (timeout - min(lifetime, timeout));
+	expirer_add(expirer, session);
+}
+
+static void restore_timer(struct session_shard *shard,
+		struct session_restore *restore)
+{
+	set_timer(shard, restore->session, restore->established,
+			restore->lifetime);
+}
+
+/**
+ * Hashes the @count sessions from @restores (which all live in @shard, and are
+ * sorted by IPv4 side), RESTORE_BATCH at a time, so @shard's lock is not held
+ * for too long. Sessions that collide with others are skipped; the ones that
+ * make it are compacted at the beginning of @restores (still sorted) and
+ * @nodes. Returns how many of them made it.
+ *
+ * The sessions are not in the tree yet, so the rest of the table treats them as
+ * dying and leaves them alone until restore_tree() runs.
+ */
+static size_t restore_hashes(struct session_table *table,
+		struct session_shard *shard, struct session_restore *restores,
+		size_t count, struct session_entry **nodes)
+{
+	struct session_index6 *index6;
+	struct session_buckets *buckets4, *buckets6;
+	struct session_entry *session;
+	struct session_entry *last = NULL;
+	struct tuple tuple4, tuple6;
+	size_t i = 0;
+	size_t end;
+	size_t n = 0;
+	u32 h6;
+
+	while (i < count) {
+		end = min(i + RESTORE_BATCH, count);
+
+		spin_lock_bh(&shard->lock);
+		rcu_read_lock_bh();
+		/* The hash might have been resized while we weren't looking. */
+		buckets4 = rcu_dereference_bh(shard->hash4.buckets);
+
+		for (; i < end; i++) {
+			session = restores[i].session;
+			if (last && !compare_session4(last, session))
+				continue; /* Duplicate IPv4 side. */
+
+			/* Packets might have created it in the meantime. */
+			tuple4.src.addr4 = session->remote4;
+			tuple4.dst.addr4 = session->local4;
+			if (find4(table, &tuple4, true))
+				continue;
+
+			h6 = session_hash6(table, session);
+			index6 = get_index6(table, h6);
+			tuple6.src.addr6 = session->remote6;
+			tuple6.dst.addr6 = session->local6;
+
+			spin_lock(&index6->lock);
+			if (find6(table, &tuple6)) {
+				spin_unlock(&index6->lock);
+				continue;
+			}
+			buckets6 = rcu_dereference_bh(index6->hash6.buckets);
+			hlist_add_head_rcu(&session->hash6_hook,
+					get_bucket(buckets6, h6));
+			index6->count++;
+			spin_unlock(&index6->lock);
+
+			hlist_add_head_rcu(&session->hash4_hook,
+					get_bucket(buckets4,
+					session_hash4(table, session)));
+			shard->count++;
+
+			restores[n] = restores[i];
+			nodes[n++] = session;
+			last = session;
+		}
+
+		rcu_read_unlock_bh();
+		spin_unlock_bh(&shard->lock);
+		cond_resched();
 	}
 
-	error = add4(table, session);
-	if (error) {
-		rb_erase(&session->tree6_hook, &table->tree6);
-		spin_unlock_bh(&table->lock);
-		return error;
+	return n;
+}
+
+/**
+ * Reverts restore_hashes() for @session.
+ *
+ * Spinlock must be held.
+ */
+static void restore_unhash(struct session_table *table,
+		struct session_shard *shard, struct session_entry *session)
+{
+	struct session_index6 *index6;
+
+	index6 = get_index6(table, session_hash6(table, session));
+	spin_lock(&index6->lock);
+	hlist_del_init_rcu(&session->hash6_hook);
+	index6->count--;
+	spin_unlock(&index6->lock);
+
+	hlist_del_init_rcu(&session->hash4_hook);
+	shard->count--;
+}
+
+/**
+ * Adds the @n sessions restore_hashes() left in @restores and @nodes to
+ * @shard's tree, and starts their timers. This is the part of the restore that
+ * has to happen in one critical section, but it's a linear pass that only
+ * links nodes. Returns how many sessions made it.
+ */
+static size_t restore_tree(struct session_table *table,
+		struct session_shard *shard, struct session_restore *restores,
+		struct session_entry **nodes, size_t n)
+{
+	struct session_entry *session;
+	size_t kept = 0;
+	size_t i;
+
+	spin_lock_bh(&shard->lock);
+
+	if (RB_EMPTY_ROOT(&shard->tree4)) {
+		rbtree_build(&shard->tree4, nodes, n, struct session_entry,
+				tree4_hook);
+		kept = n;
+	} else {
+		/*
+		 * Some packet beat us to the shard, so the tree cannot be built
+		 * from scratch anymore; fall back to adding the sessions one by
+		 * one. (The tree also catches IPv4 sides the packets created
+		 * after restore_hashes() checked them.)
+		 */
+		for (i = 0; i < n; i++) {
+			if (add4(shard, nodes[i]))
+				restore_unhash(table, shard, nodes[i]);
+			else
+				restores[kept++] = restores[i];
+		}
 	}
 
-	attach_timer(session, expirer);
-	session_get(session); /* Database's references. */
-	table->count++;
+	for (i = 0; i < kept; i++) {
+		session = restores[i].session;
+		restore_timer(shard, &restores[i]);
+		session_get(session); /* Database's references. */
+		if (get_subscriber(session))
+			subscriber_add_session(get_subscriber(session), session);
+	}
 
-	spin_unlock_bh(&table->lock);
+	spin_unlock_bh(&shard->lock);
+	return kept;
+}
 
-	session_log(session, "Added session");
-	return 0;
+/**
+ * Adds the @count sessions from @restores (which all live in @shard, and are
+ * sorted by IPv4 side) to the table. Returns how many of them made it.
+ *
+ * @nodes is scratch space for @count pointers.
+ */
+static size_t restore_shard(struct session_table *table,
+		struct session_shard *shard, struct session_restore *restores,
+		size_t count, struct session_entry **nodes)
+{
+	size_t n;
+
+	n = restore_hashes(table, shard, restores, count, nodes);
+	return restore_tree(table, shard, restores, nodes, n);
 }
 
 /**
- * Requires "table"'s spinlock to already be held.
+ * Adds the @count sessions from @restores to @table in one go. This is meant
+ * for snapshot restoration, and is a lot faster than sessiontable_add()ing
+ * them one by one:
+ *
+ * - The hash indexes are grown to their final size beforehand.
+ * - The sessions are grouped by shard and sorted, so each shard's tree is
+ *   built bottom-up in one pass.
+ *
+ * Sessions that collide with others (either from @restores or already in the
+ * table) are skipped. As with sessiontable_add(), the caller keeps its
+ * references. (So the skipped sessions die once the caller returns them.)
+ *
+ * Sessions are not logged; they were already logged when they were first
+ * created.
+ *
+ * @added will point to the number of sessions that made it.
  */
-static struct rb_node *find_starting_point(struct session_table *table,
-		const struct ipv4_transport_addr *offset_remote,
-		const struct ipv4_transport_addr *offset_local,
-		const bool include_offset)
+int sessiontable_restore(struct session_table *table,
+		struct session_restore *restores, size_t count, size_t *added)
+{
+	struct session_restore *sorted;
+	struct session_entry **nodes;
+	size_t offsets[SESSIONTABLE_SHARDS + 1];
+	size_t cursors[SESSIONTABLE_SHARDS];
+	u64 counts6[SESSIONTABLE_SHARDS];
+	size_t max = 0;
+	size_t i;
+	unsigned int s;
+	int error = 0;
+
+	*added = 0;
+	if (!count)
+		return 0;
+
+	/* Group the sessions by shard. (Counting sort.) */
+	memset(offsets, 0, sizeof(offsets));
+	memset(counts6, 0, sizeof(counts6));
+	for (i = 0; i < count; i++) {
+		s = get_shard(table, session_hash4(table, restores[i].session))
+				- table->shards;
+		offsets[s + 1]++;
+		s = get_index6(table, session_hash6(table, restores[i].session))
+				- table->index6;
+		counts6[s]++;
+	}
+	for (s = 0; s < SESSIONTABLE_SHARDS; s++) {
+		max = max(max, offsets[s + 1]);
+		offsets[s + 1] += offsets[s];
+		cursors[s] = offsets[s];
+	}
+
+	sorted = vmalloc(count * sizeof(*sorted));
+	nodes = vmalloc(max * sizeof(*nodes));
+	if (!sorted || !nodes) {
+		error = -ENOMEM;
+		goto end;
+	}
+
+	for (i = 0; i < count; i++) {
+		s = get_shard(table, session_hash4(table, restores[i].session))
+				- table->shards;
+		sorted[cursors[s]++] = restores[i];
+	}
+
+	mutex_lock(&table->resize_lock);
+	for (s = 0; s < SESSIONTABLE_SHARDS && !error; s++) {
+		error = reserve_hash(table, &table->shards[s].hash4,
+				&table->shards[s].lock, &table->shards[s].count,
+				offsets[s + 1] - offsets[s], false);
+		if (!error)
+			error = reserve_hash(table, &table->index6[s].hash6,
+					&table->index6[s].lock,
+					&table->index6[s].count, counts6[s], true);
+	}
+	mutex_unlock(&table->resize_lock);
+	if (error)
+		goto end;
+
+	for (s = 0; s < SESSIONTABLE_SHARDS; s++) {
+		sort(&sorted[offsets[s]], offsets[s + 1] - offsets[s],
+				sizeof(*sorted), restore_compare4, NULL);
+		*added += restore_shard(table, &table->shards[s],
+				&sorted[offsets[s]], offsets[s + 1] - offsets[s],
+				nodes);
+		cond_resched();
+	}
+
+	log_debug("Restored %zu sessions (%zu dropped).", *added,
+			count - *added);
+	/* Fall through. */
+
+end:
+	vfree(nodes);
+	vfree(sorted);
+	return error;
+}
+
+/**
+ * Requires "shard"'s spinlock to already be held.
+ */
+static struct rb_node *find_starting_point(struct session_shard *shard,
+		const struct tuple *offset, const bool include_offset)
 {
 	struct rb_node **node, *parent;
 	struct session_entry *session;
-	struct tuple offset;
 
 	/* If there's no offset, start from the beginning. */
-	if (!offset_remote || !offset_local)
-		return rb_first(&table->tree4);
+	if (!offset)
+		return rb_first(&shard->tree4);
 
 	/* If offset is found, start from offset or offset's next. */
-	offset.src.addr4 = *offset_remote;
-	offset.dst.addr4 = *offset_local; /* the protos are not needed. */
-	rbtree_find_node(&offset, &table->tree4, compare_full4,
+	rbtree_find_node(offset, &shard->tree4, compare_full4,
 			struct session_entry, tree4_hook, parent, node);
 	if (*node)
 		return include_offset ? (*node) : rb_next(*node);
@@ -585,32 +1684,156 @@ static struct rb_node *find_starting_point(struct session_table *table,
 	 * the caller wasn't holding the spinlock; it's nothing to worry about.)
 	 */
 	session = rb_entry(parent, struct session_entry, tree4_hook);
-	return (compare_full4(session, &offset) < 0) ? rb_next(parent) : parent;
+	return (compare_full4(session, offset) < 0) ? rb_next(parent) : parent;
 }
 
-static int __foreach(struct session_table *table,
+static void session_to_offset(const struct session_entry *session,
+		struct tuple *offset)
+{
+	offset->src.addr4 = session->remote4;
+	offset->dst.addr4 = session->local4; /* the protos are not needed. */
+}
+
+static int compare_offsets(const struct tuple *o1, const struct tuple *o2)
+{
+	int gap;
+
+	gap = compare_addr4(&o1->dst.addr4, &o2->dst.addr4);
+	if (gap)
+		return gap;
+
+	gap = compare_addr4(&o1->src.addr4, &o2->src.addr4);
+	return gap;
+}
+
+/**
+ * Iterates over "shard"'s sessions, in IPv4 order. No other shards are
+ * visited.
+ *
+ * "func" runs with "shard"'s spinlock held.
+ */
+static int __foreach_shard(struct session_shard *shard,
 		int (*func)(struct session_entry *, void *), void *arg,
-		const struct ipv4_transport_addr *offset_remote,
-		const struct ipv4_transport_addr *offset_local,
-		const bool include_offset)
+		const struct tuple *offset)
 {
 	struct rb_node *node, *next;
 	struct session_entry *session;
 	int error = 0;
-	spin_lock_bh(&table->lock);
+	spin_lock_bh(&shard->lock);
 
-	node = find_starting_point(table, offset_remote, offset_local,
-			include_offset);
+	node = find_starting_point(shard, offset, true);
 	for (; node && !error; node = next) {
 		next = rb_next(node);
 		session = rb_entry(node, struct session_entry, tree4_hook);
 		error = func(session, arg);
 	}
 
-	spin_unlock_bh(&table->lock);
+	spin_unlock_bh(&shard->lock);
 	return error;
 }
 
+/**
+ * Stores in "next" the key of the first session of "shard" that comes after
+ * "offset". Returns false if there's no such session.
+ */
+static bool peek_shard(struct session_shard *shard, const struct tuple *offset,
+		const bool include_offset, struct tuple *next)
+{
+	struct rb_node *node;
+	spin_lock_bh(&shard->lock);
+
+	node = find_starting_point(shard, offset, include_offset);
+	if (node)
+		session_to_offset(rb_entry(node, struct session_entry,
+				tree4_hook), next);
+
+	spin_unlock_bh(&shard->lock);
+	return node ? true : false;
+}
+
+/**
+ * Iterates over all of "table"'s sessions in IPv4 order, regardless of the
+ * shard they are stored in.
+ *
+ * This is a merge of the shards' sorted trees. Only one shard is locked at a
+ * time, and we stay in it until its next session is no longer the smallest
+ * one. As usual, sessions that die or are born while we are visiting other
+ * shards might or might not be seen.
+ */
+static int __foreach(struct session_table *table,
+		int (*func)(struct session_entry *, void *), void *arg,
+		const struct ipv4_transport_addr *offset_remote,
+		const struct ipv4_transport_addr *offset_local,
+		const bool include_offset)
+{
+	struct tuple heads[SESSIONTABLE_SHARDS];
+	bool has_head[SESSIONTABLE_SHARDS];
+	struct tuple offset;
+	struct session_shard *shard;
+	struct rb_node *node;
+	struct session_entry *session;
+	int best, second;
+	unsigned int i;
+	int error;
+
+	if (offset_remote && offset_local) {
+		offset.src.addr4 = *offset_remote;
+		offset.dst.addr4 = *offset_local;
+	}
+
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		has_head[i] = peek_shard(&table->shards[i],
+				(offset_remote && offset_local) ? &offset : NULL,
+				include_offset, &heads[i]);
+	}
+
+	while (true) {
+		best = -1;
+		second = -1;
+		for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+			if (!has_head[i])
+				continue;
+			if (best == -1 || compare_offsets(&heads[i],
+					&heads[best]) < 0) {
+				second = best;
+				best = i;
+			} else if (second == -1 || compare_offsets(&heads[i],
+					&heads[second]) < 0) {
+				second = i;
+			}
+		}
+
+		if (best == -1)
+			return 0;
+
+		shard = &table->shards[best];
+		spin_lock_bh(&shard->lock);
+
+		node = find_starting_point(shard, &heads[best], true);
+		while (node) {
+			session = rb_entry(node, struct session_entry,
+					tree4_hook);
+			if (second != -1 && compare_full4(session,
+					&heads[second]) > 0)
+				break;
+
+			node = rb_next(node);
+			error = func(session, arg);
+			if (error) {
+				spin_unlock_bh(&shard->lock);
+				return error;
+			}
+		}
+
+		has_head[best] = node ? true : false;
+		if (node)
+			session_to_offset(rb_entry(node, struct session_entry,
+					tree4_hook), &heads[best]);
+
+		spin_unlock_bh(&shard->lock);
+	}
+}
+
 int sessiontable_foreach(struct session_table *table,
 		int (*func)(struct session_entry *, void *), void *arg,
 		const struct ipv4_transport_addr *offset_remote,
@@ -621,14 +1844,24 @@ int sessiontable_foreach(struct session_table *table,
 
 int sessiontable_count(struct session_table *table, __u64 *result)
 {
-	spin_lock_bh(&table->lock);
-	*result = table->count;
-	spin_unlock_bh(&table->lock);
+	struct session_shard *shard;
+	unsigned int i;
+	__u64 count = 0;
+
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		shard = &table->shards[i];
+		spin_lock_bh(&shard->lock);
+		count += shard->count;
+		spin_unlock_bh(&shard->lock);
+	}
+
+	*result = count;
 	return 0;
 }
 
 struct bib_remove_args {
 	struct session_table *table;
+	struct session_shard *shard;
 	const struct ipv4_transport_addr *addr4;
 	struct list_head removed;
 };
@@ -640,7 +1873,7 @@ static int __rm_by_bib(struct session_entry *session, void *args_void)
 	if (!ipv4_transport_addr_equals(args->addr4, &session->local4))
 		return 1; /* positive = break iteration early, no error. */
 
-	rm(args->table, session, &args->removed);
+	rm(args->table, args->shard, session, &args->removed);
 	return 0;
 }
 
@@ -652,17 +1885,145 @@ void sessiontable_delete_by_bib(struct session_table *table,
 			.addr4 = &bib->ipv4,
 			.removed = LIST_HEAD_INIT(args.removed),
 	};
-	struct ipv4_transport_addr remote = {
-			.l3.s_addr = 0,
-			.l4 = 0,
-	};
+	struct tuple offset;
+	unsigned int i;
+
+	offset.src.addr4.l3.s_addr = 0;
+	offset.src.addr4.l4 = 0;
+	offset.dst.addr4 = bib->ipv4;
+
+	/* The BIB's sessions are scattered by remote address. */
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		args.shard = &table->shards[i];
+		__foreach_shard(args.shard, __rm_by_bib, &args, &offset);
+	}
 
-	__foreach(table, __rm_by_bib, &args, &remote, &bib->ipv4, true);
 	delete(&args.removed);
 }
 
+/**
+ * Removes "session" from "table", unless somebody else already did.
+ * The caller's reference is not touched.
+ */
+int sessiontable_rm(struct session_table *table, struct session_entry *session)
+{
+	struct session_shard *shard;
+	int error = 0;
+	LIST_HEAD(rms);
+
+	shard = get_shard(table, session_hash4(table, session));
+
+	spin_lock_bh(&shard->lock);
+	if (!RB_EMPTY_NODE(&session->tree4_hook))
+		rm(table, shard, session, &rms);
+	else
+		error = -ESRCH;
+	spin_unlock_bh(&shard->lock);
+
+	if (!list_empty(&rms))
+		delete(&rms);
+	return error;
+}
+
+/**
+ * Overrides @session's state and timer. This is meant for replication; the
+ * active instance decides these, so the standby just copies them.
+ *
+ * @lifetime is the time (in jiffies) @session should have left.
+ */
+int sessiontable_update(struct session_table *table,
+		struct session_entry *session, __u8 state, bool established,
+		unsigned long lifetime)
+{
+	struct session_shard *shard;
+	int error = 0;
+
+	shard = get_shard(table, session_hash4(table, session));
+
+	spin_lock_bh(&shard->lock);
+	if (!RB_EMPTY_NODE(&session->tree4_hook)) {
+		session->state = state;
+		expirer_del(shard, session);
+		set_timer(shard, session, established, lifetime);
+		replication_session(session, REPL_UPDATE);
+	} else {
+		error = -ESRCH;
+	}
+	spin_unlock_bh(&shard->lock);
+
+	return error;
+}
+
+/**
+ * Compares the (up to) "*budget" sessions "expirer" is going to visit first
+ * against "victim", and returns the one that was used least recently.
+ *
+ * Spinlock must be held.
+ */
+static struct session_entry *sample_expirer(struct expire_timer *expirer,
+		struct session_entry *victim, unsigned int *budget)
+{
+	struct session_entry *session;
+	struct list_head *slot_list;
+	unsigned long lap = expirer->clock / EXPIRER_SLOTS;
+	unsigned int i;
+
+	/* Fine level first, then the coarse one, in visiting order. */
+	for (i = 0; i < 2 * EXPIRER_SLOTS && *budget; i++) {
+		slot_list = (i < EXPIRER_SLOTS)
+				? &expirer->slots[(expirer->clock + i)
+						& (EXPIRER_SLOTS - 1)]
+				: &expirer->slots[EXPIRER_SLOTS + ((lap + i)
+						& (EXPIRER_SLOTS - 1))];
+		list_for_each_entry(session, slot_list, list_hook) {
+			if (!victim || time_before(session->update_time,
+					victim->update_time))
+				victim = session;
+			if (!--(*budget))
+				break;
+		}
+	}
+
+	return victim;
+}
+
+/**
+ * Returns (roughly) the least recently used session of a random shard of
+ * "table". If that shard has nothing to evict, the following shards are tried
+ * in turn, so the result is only NULL if the whole table is empty.
+ *
+ * The wheels are only lazily sorted, so this compares the first few sessions
+ * the expirers are going to visit. Transitory sessions are looked at first.
+ *
+ * Increases the result's refcount; session_return() it when you're done.
+ */
+struct session_entry *sessiontable_lru(struct session_table *table)
+{
+	struct session_shard *shard;
+	struct session_entry *victim = NULL;
+	unsigned int budget;
+	unsigned int start;
+	unsigned int i;
+
+	start = get_random_int();
+	for (i = 0; i < SESSIONTABLE_SHARDS && !victim; i++) {
+		shard = get_shard(table, start + i);
+		budget = SESSIONTABLE_LRU_SAMPLES;
+
+		spin_lock_bh(&shard->lock);
+		victim = sample_expirer(&shard->trans_timer, victim, &budget);
+		victim = sample_expirer(&shard->est_timer, victim, &budget);
+		if (victim)
+			session_get(victim);
+		spin_unlock_bh(&shard->lock);
+	}
+
+	return victim;
+}
+
 struct taddr4_remove_args {
 	struct session_table *table;
+	struct session_shard *shard;
 	const struct ipv4_prefix *prefix;
 	const struct port_range *ports;
 	struct list_head removed;
@@ -677,7 +2038,7 @@ static int __rm_taddr4s(struct session_entry *session, void *args_void)
 	if (!port_range_contains(args->ports, session->local4.l4))
 		return 0;
 
-	rm(args->table, session, &args->removed);
+	rm(args->table, args->shard, session, &args->removed);
 	return 0;
 }
 
@@ -690,58 +2051,35 @@ void sessiontable_delete_taddr4s(struct session_table *table,
 			.ports = ports,
 			.removed = LIST_HEAD_INIT(args.removed),
 	};
-	struct ipv4_transport_addr remote = {
-			.l3.s_addr = 0,
-			.l4 = 0,
-	};
-	struct ipv4_transport_addr local = {
-			.l3 = prefix->address,
-			.l4 = ports->min,
-	};
-
-	__foreach(table, __rm_taddr4s, &args, &remote, &local, true);
-	delete(&args.removed);
-}
-
-/**
- * Requires "table"'s spinlock to already be held.
- */
-static struct rb_node *find_starting_point6(struct session_table *table,
-		const struct ipv6_transport_addr *local)
-{
-	struct rb_node **node, *parent;
-	struct session_entry *session;
 	struct tuple offset;
+	unsigned int i;
 
-	memset(&offset.src.addr6, 0, sizeof(offset.src.addr6));
-	offset.dst.addr6 = *local;
-	/* the protos are not needed. */
-
-	rbtree_find_node(&offset, &table->tree6, compare_full6,
-			struct session_entry, tree6_hook, parent, node);
-	if (*node)
-		return *node;
+	offset.src.addr4.l3.s_addr = 0;
+	offset.src.addr4.l4 = 0;
+	offset.dst.addr4.l3 = prefix->address;
+	offset.dst.addr4.l4 = ports->min;
 
-	if (!parent)
-		return NULL;
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		args.shard = &table->shards[i];
+		__foreach_shard(args.shard, __rm_taddr4s, &args, &offset);
+	}
 
-	session = rb_entry(parent, struct session_entry, tree6_hook);
-	return (compare_full6(session, &offset) < 0) ? rb_next(parent) : parent;
+	delete(&args.removed);
 }
 
 struct taddr6_remove_args {
 	struct session_table *table;
+	struct session_shard *shard;
 	const struct ipv6_prefix *prefix;
 	struct list_head removed;
 };
 
-static int __rm_taddr6s(struct session_entry *session,
-		struct taddr6_remove_args *args)
+static int __rm_taddr6s(struct session_entry *session, void *args_void)
 {
-	if (!prefix6_contains(args->prefix, &session->local6.l3))
-		return 1; /* positive = break iteration early, no error. */
+	struct taddr6_remove_args *args = args_void;
 
-	rm(args->table, session, &args->removed);
+	if (prefix6_contains(args->prefix, &session->local6.l3))
+		rm(args->table, args->shard, session, &args->removed);
 	return 0;
 }
 
@@ -753,35 +2091,31 @@ void sessiontable_delete_taddr6s(struct session_table *table,
 			.prefix = prefix,
 			.removed = LIST_HEAD_INIT(args.removed),
 	};
-	struct ipv6_transport_addr local = {
-			.l3 = prefix->address,
-			.l4 = 0,
-	};
-	struct rb_node *node, *next;
-	struct session_entry *session;
-	int error = 0;
-	spin_lock_bh(&table->lock);
+	unsigned int i;
 
-	node = find_starting_point6(table, &local);
-	for (; node && !error; node = next) {
-		next = rb_next(node);
-		session = rb_entry(node, struct session_entry, tree6_hook);
-		error = __rm_taddr6s(session, &args);
+	/*
+	 * The IPv6 index cannot be walked here because its locks have to be
+	 * taken after the home shards' ones. pool6 doesn't change often, so
+	 * a full traversal is fine.
+	 */
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		args.shard = &table->shards[i];
+		__foreach_shard(args.shard, __rm_taddr6s, &args, NULL);
 	}
 
-	spin_unlock_bh(&table->lock);
 	delete(&args.removed);
 }
 
 struct flush_args {
 	struct session_table *table;
+	struct session_shard *shard;
 	struct list_head removed;
 };
 
 static int __flush(struct session_entry *session, void *args_void)
 {
 	struct flush_args *args = args_void;
-	rm(args->table, session, &args->removed);
+	rm(args->table, args->shard, session, &args->removed);
 	return 0;
 }
 
@@ -791,15 +2125,63 @@ void sessiontable_flush(struct session_table *table)
 			.table = table,
 			.removed = LIST_HEAD_INIT(args.removed),
 	};
+	unsigned int i;
+
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		args.shard = &table->shards[i];
+		__foreach_shard(args.shard, __flush, &args, NULL);
+	}
 
-	__foreach(table, __flush, &args, NULL, NULL, 0);
 	delete(&args.removed);
 }
 
 void sessiontable_update_timers(struct session_table *table)
 {
-	spin_lock_bh(&table->lock);
-	force_reschedule(&table->est_timer);
-	force_reschedule(&table->trans_timer);
-	spin_unlock_bh(&table->lock);
+	struct session_shard *shard;
+	unsigned int i;
+
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		shard = &table->shards[i];
+		spin_lock_bh(&shard->lock);
+		/* The timeout changed. */
+		requeue(&shard->est_timer);
+		requeue(&shard->trans_timer);
+		spin_unlock_bh(&shard->lock);
+	}
+}
+
+/**
+ * Returns the timeout of the expirer @session is queued in, in jiffies, or zero
+ * if it isn't queued anywhere.
+ *
+ * Spinlock of @session's home shard must be held.
+ */
+unsigned long sessiontable_get_timeout(struct session_table *table,
+		const struct session_entry *session)
+{
+	struct expire_timer *expirer;
+
+	expirer = get_expirer(get_shard(table, session_hash4(table, session)),
+			session);
+	return (expirer && expirer->get_timeout) ? expirer->get_timeout() : 0;
+}
+
+void sessiontable_expiry_stats(struct session_table *table, __u64 *backlog,
+		__u64 *batches)
+{
+	struct session_shard *shard;
+	unsigned int i;
+
+	*backlog = 0;
+	*batches = 0;
+
+	for (i = 0; i < SESSIONTABLE_SHARDS; i++) {
+		shard = &table->shards[i];
+		spin_lock_bh(&shard->lock);
+		*backlog += get_backlog(&shard->est_timer);
+		*backlog += get_backlog(&shard->trans_timer);
+		*batches += shard->est_timer.batches;
+		*batches += shard->trans_timer.batches;
+		spin_unlock_bh(&shard->lock);
+	}
 }
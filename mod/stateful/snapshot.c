@@ -0,0 +1,425 @@
+#include "nat64/mod/stateful/snapshot.h"
+
+#include <linux/jiffies.h>
+#include <linux/vmalloc.h>
+#include "nat64/common/session.h"
+#include "nat64/common/str_utils.h"
+#include "nat64/mod/common/address.h"
+#include "nat64/mod/common/config.h"
+#include "nat64/mod/common/types.h"
+#include "nat64/mod/stateful/bib/db.h"
+#include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/session/db.h"
+#include "nat64/mod/stateful/subscriber.h"
+
+/** Initial capacity of the staging arrays. */
+#define STAGE_MIN_CAPACITY 1024
+
+/**
+ * Restorations idle for longer than this can be taken over by other clients.
+ * (In case the owner died halfway.)
+ */
+#define STAGE_TIMEOUT msecs_to_jiffies(60 * 1000)
+
+/**
+ * The restoration in progress.
+ *
+ * Only the Netlink handler touches this, so it's protected by the configuration
+ * mutex.
+ */
+static struct {
+	/** Is there a transaction in progress? */
+	bool active;
+	/** Netlink port ID of the client the transaction belongs to. */
+	__u32 owner;
+	/** Jiffy the transaction was last touched by its owner. */
+	unsigned long time;
+	/** Table the transaction is restoring. */
+	l4_protocol proto;
+	/** Defines the subscribers the BIB entries are charged to. */
+	__u8 subscriber_prefix_len;
+
+	/**
+	 * The BIB entries received so far, along with their creator
+	 * references. Once the first session arrives, these are moved to the
+	 * database and this array becomes sorted by IPv4 transport address.
+	 */
+	struct bib_entry **bibs;
+	size_t bib_count;
+	size_t bib_capacity;
+	/** Are @bibs in the database already? */
+	bool bibs_committed;
+
+	/** The sessions received so far, along with their creator refs. */
+	struct session_restore *sessions;
+	size_t session_count;
+	size_t session_capacity;
+
+	/** Records that were rejected so far. */
+	u64 bib_drops;
+	u64 session_drops;
+} stage;
+
+/**
+ * Makes sure "*array" (whose elements are "size" bytes long) has room for
+ * "needed" elements.
+ */
+static int reserve(void **array, size_t *capacity, size_t needed, size_t size)
+{
+	size_t new_capacity;
+	void *tmp;
+
+	if (needed <= *capacity)
+		return 0;
+
+	new_capacity = max3(needed, 2 * *capacity, (size_t)STAGE_MIN_CAPACITY);
+	tmp = vmalloc(new_capacity * size);
+	if (!tmp) {
+		log_err("Could not allocate room for %zu snapshot records.",
+				new_capacity);
+		return -ENOMEM;
+	}
+
+	if (*array) {
+		memcpy(tmp, *array, *capacity * size);
+		vfree(*array);
+	}
+	*array = tmp;
+	*capacity = new_capacity;
+	return 0;
+}
+
+/**
+ * Drops the transaction's references, and forgets about it.
+ *
+ * If the tables were already built, this simply leaves the entries at the
+ * database's mercy. Otherwise, the entries die.
+ */
+static void release(void)
+{
+	struct bib_entry *bib;
+	size_t i;
+
+	for (i = 0; i < stage.session_count; i++)
+		session_return(stage.sessions[i].session);
+
+	for (i = 0; i < stage.bib_count; i++) {
+		bib = stage.bibs[i];
+		if (!stage.bibs_committed)
+			bibentry_kfree(bib);
+		else if (!bib->is_static)
+			bibdb_return(bib);
+		/* Static entries keep the reference as their fake user. */
+	}
+
+	vfree(stage.bibs);
+	vfree(stage.sessions);
+	memset(&stage, 0, sizeof(stage));
+}
+
+static int add_bibs(struct bib_entry_usr *records, __u32 count)
+{
+	struct bib_entry_usr *record;
+	struct bib_entry *bib;
+	struct subscriber *sub;
+	__u32 i;
+	int error;
+
+	if (stage.bibs_committed) {
+		log_err("The BIB entries have to be sent before the sessions.");
+		return -EINVAL;
+	}
+
+	error = reserve((void **)&stage.bibs, &stage.bib_capacity,
+			stage.bib_count + count, sizeof(*stage.bibs));
+	if (error)
+		return error;
+
+	for (i = 0; i < count; i++) {
+		record = &records[i];
+
+		/*
+		 * Static entries have to stay in pool4, because they don't
+		 * expire. The dynamic ones will die soon enough if they don't.
+		 * (And checking those would take ages.)
+		 */
+		if (record->is_static && !pool4db_contains(stage.proto,
+				&record->addr4)) {
+			log_debug("%pI4#%u is not in pool4 anymore.",
+					&record->addr4.l3, record->addr4.l4);
+			stage.bib_drops++;
+			continue;
+		}
+
+		bib = bibentry_create(&record->addr4, &record->addr6,
+				record->is_static, stage.proto);
+		if (!bib)
+			return -ENOMEM;
+
+		/*
+		 * The admission limits are not enforced; this state was
+		 * already admitted before the snapshot was taken.
+		 */
+		if (!record->is_static) {
+			sub = subscriber_get(&record->addr6.l3,
+					stage.subscriber_prefix_len);
+			if (!sub) {
+				bibentry_kfree(bib);
+				return -ENOMEM;
+			}
+			/* The BIB entry inherits our reference to sub. */
+			bib->subscriber = sub;
+			subscriber_add_bib(sub);
+		}
+
+		stage.bibs[stage.bib_count++] = bib;
+	}
+
+	return 0;
+}
+
+static int commit_bibs(void)
+{
+	size_t count = stage.bib_count;
+	int error;
+
+	error = bibdb_restore(stage.proto, stage.bibs, &count);
+	if (error)
+		return error;
+
+	stage.bib_drops += stage.bib_count - count;
+	stage.bib_count = count;
+	stage.bibs_committed = true;
+	return 0;
+}
+
+/**
+ * Returns the staged BIB entry whose IPv4 transport address is "addr", or NULL.
+ * The BIB entries have to be committed already.
+ */
+static struct bib_entry *find_bib(const struct ipv4_transport_addr *addr)
+{
+	struct bib_entry *bib;
+	size_t min = 0;
+	size_t max = stage.bib_count;
+	size_t middle;
+	int gap;
+
+	while (min < max) {
+		middle = min + (max - min) / 2;
+		bib = stage.bibs[middle];
+
+		gap = ipv4_addr_cmp(&bib->ipv4.l3, &addr->l3);
+		if (!gap)
+			gap = bib->ipv4.l4 - addr->l4;
+
+		if (gap < 0)
+			min = middle + 1;
+		else if (gap > 0)
+			max = middle;
+		else
+			return bib;
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the session "record" describes, bound to its BIB entry, or NULL if
+ * the BIB entry doesn't exist.
+ */
+static struct session_entry *create_session(struct session_entry_usr *record)
+{
+	struct session_entry *session = NULL;
+	struct bib_entry *bib;
+
+	bib = find_bib(&record->local4);
+	if (bib) {
+		bibentry_get(bib);
+	} else if (bibdb_get4(&record->local4, stage.proto, &bib)) {
+		/* Neither from the snapshot nor created by traffic. */
+		return NULL;
+	}
+
+	if (ipv6_transport_addr_equals(&bib->ipv6, &record->remote6)) {
+		session = session_create(&record->remote6, &record->local6,
+				&record->local4, &record->remote4,
+				stage.proto, bib);
+		if (session)
+			session->state = record->state;
+	}
+
+	bibdb_return(bib);
+	return session;
+}
+
+static int add_sessions(struct session_entry_usr *records, __u32 count)
+{
+	struct session_entry_usr *record;
+	struct session_restore *restore;
+	__u32 i;
+	int error;
+
+	if (!stage.bibs_committed) {
+		error = commit_bibs();
+		if (error)
+			return error;
+	}
+
+	error = reserve((void **)&stage.sessions, &stage.session_capacity,
+			stage.session_count + count, sizeof(*stage.sessions));
+	if (error)
+		return error;
+
+	for (i = 0; i < count; i++) {
+		record = &records[i];
+		restore = &stage.sessions[stage.session_count];
+
+		if (record->state > TRANS) {
+			stage.session_drops++;
+			continue;
+		}
+
+		restore->session = create_session(record);
+		if (!restore->session) {
+			stage.session_drops++;
+			continue;
+		}
+		restore->lifetime = msecs_to_jiffies(min_t(__u64,
+				record->dying_time, 0xFFFFFFFFU));
+		restore->established = record->is_est;
+		stage.session_count++;
+	}
+
+	return 0;
+}
+
+static int commit(struct response_snapshot *response)
+{
+	size_t added;
+	int error;
+
+	if (!stage.bibs_committed) {
+		error = commit_bibs();
+		if (error)
+			return error;
+	}
+
+	error = sessiondb_restore(stage.proto, stage.sessions,
+			stage.session_count, &added);
+	if (error)
+		return error;
+
+	response->bibs = stage.bib_count;
+	response->sessions = added;
+	response->bib_drops = stage.bib_drops;
+	response->session_drops = stage.session_drops
+			+ stage.session_count - added;
+
+	log_debug("Restored %llu BIB entries and %llu sessions.",
+			response->bibs, response->sessions);
+	release();
+	return 0;
+}
+
+static int validate_records(struct request_snapshot *request,
+		size_t records_len, size_t record_size)
+{
+	if (records_len / record_size < request->count) {
+		log_err("The request claims to carry %u records, but it only has room for %zu.",
+				request->count, records_len / record_size);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * Processes one of the requests of a snapshot restoration transaction. If it's
+ * the last one, builds the tables and fills "response".
+ *
+ * "records" is the payload that follows "request"; "records_len" is its
+ * length.
+ *
+ * The transaction belongs to "owner" (the requester's Netlink port ID). Only
+ * one can exist at a time, so chunks from anyone else (including new
+ * transactions, unless the current one has been idle for STAGE_TIMEOUT) are
+ * rejected with -EBUSY.
+ */
+int snapshot_restore(__u32 owner, struct request_snapshot *request,
+		void *records, size_t records_len,
+		struct response_snapshot *response)
+{
+	struct admission_limits limits;
+	int error;
+
+	if (request->begin) {
+		if (stage.active && stage.owner != owner
+				&& time_before(jiffies,
+						stage.time + STAGE_TIMEOUT)) {
+			log_err("Somebody else is in the middle of a snapshot restoration.");
+			return -EBUSY;
+		}
+
+		release();
+		switch (request->l4_proto) {
+		case L4PROTO_TCP:
+		case L4PROTO_UDP:
+		case L4PROTO_ICMP:
+			break;
+		default:
+			log_err("Unknown protocol: %u", request->l4_proto);
+			return -EINVAL;
+		}
+
+		stage.active = true;
+		stage.owner = owner;
+		stage.proto = request->l4_proto;
+		config_get_limits(&limits);
+		stage.subscriber_prefix_len = limits.subscriber_prefix_len;
+
+	} else if (!stage.active || stage.proto != request->l4_proto) {
+		log_err("There is no %s snapshot restoration in progress.",
+				l4proto_to_string(request->l4_proto));
+		return -EINVAL;
+
+	} else if (stage.owner != owner) {
+		log_err("The snapshot restoration in progress belongs to somebody else.");
+		return -EBUSY;
+	}
+
+	stage.time = jiffies;
+
+	switch (request->section) {
+	case SNAPSHOT_BIB:
+		error = validate_records(request, records_len,
+				sizeof(struct bib_entry_usr));
+		if (!error)
+			error = add_bibs(records, request->count);
+		break;
+	case SNAPSHOT_SESSION:
+		error = validate_records(request, records_len,
+				sizeof(struct session_entry_usr));
+		if (!error)
+			error = add_sessions(records, request->count);
+		break;
+	default:
+		log_err("Unknown snapshot section: %u", request->section);
+		error = -EINVAL;
+	}
+
+	if (!error && request->commit)
+		error = commit(response);
+	if (error)
+		release();
+
+	return error;
+}
+
+/**
+ * Aborts the restoration in progress, if any.
+ */
+void snapshot_destroy(void)
+{
+	release();
+}
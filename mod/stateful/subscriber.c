@@ -0,0 +1,443 @@
+#include "nat64/mod/stateful/subscriber.h"
+
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <net/ipv6.h>
+#include "nat64/mod/common/address.h"
+#include "nat64/mod/common/types.h"
+#include "nat64/mod/stateful/bib/db.h"
+#include "nat64/mod/stateful/bib/port_allocator.h"
+#include "nat64/mod/stateful/session/entry.h"
+
+/** The subscriber table has 2^SUBSCRIBER_HASH_BITS buckets. */
+#define SUBSCRIBER_HASH_BITS 14
+/**
+ * Number of sessions subscriber_lru() compares. The list is only roughly
+ * sorted (sessions are refreshed without moving them), so the oldest session
+ * of a small sample is taken instead of the head.
+ */
+#define SUBSCRIBER_LRU_SAMPLES 8
+
+struct subscriber_bucket {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
+/** Cache for struct subscribers, for efficient allocation. */
+static struct kmem_cache *subscriber_cache;
+static struct subscriber_bucket *buckets;
+static u32 hash_seed;
+
+/*
+ * Totals. These only count what has been charged to subscribers, so static
+ * BIB entries and their sessions are left out.
+ */
+static atomic64_t subscriber_count;
+static atomic64_t session_count;
+static atomic64_t bib_count;
+static atomic64_t drop_count;
+static atomic64_t eviction_count;
+
+int subscriber_init(void)
+{
+	unsigned int i;
+
+	subscriber_cache = kmem_cache_create("jool_subscribers",
+			sizeof(struct subscriber), 0, 0, NULL);
+	if (!subscriber_cache) {
+		log_err("Could not allocate the subscriber cache.");
+		return -ENOMEM;
+	}
+
+	buckets = vmalloc(sizeof(*buckets) << SUBSCRIBER_HASH_BITS);
+	if (!buckets) {
+		log_err("Could not allocate the subscriber table.");
+		kmem_cache_destroy(subscriber_cache);
+		return -ENOMEM;
+	}
+	for (i = 0; i < (1U << SUBSCRIBER_HASH_BITS); i++) {
+		spin_lock_init(&buckets[i].lock);
+		INIT_HLIST_HEAD(&buckets[i].head);
+	}
+
+	get_random_bytes(&hash_seed, sizeof(hash_seed));
+	atomic64_set(&subscriber_count, 0);
+	atomic64_set(&session_count, 0);
+	atomic64_set(&bib_count, 0);
+	atomic64_set(&drop_count, 0);
+	atomic64_set(&eviction_count, 0);
+	return 0;
+}
+
+/**
+ * By now, the BIB entries should have released every subscriber. This only
+ * cleans up if they didn't.
+ */
+void subscriber_destroy(void)
+{
+	struct subscriber *sub;
+	struct hlist_node *node, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < (1U << SUBSCRIBER_HASH_BITS); i++) {
+		hlist_for_each_safe(node, tmp, &buckets[i].head) {
+			sub = hlist_entry(node, struct subscriber, hook);
+			WARN(true, "Subscriber %pI6c/%u outlived its BIB entries.",
+					&sub->prefix.address, sub->prefix.len);
+			hlist_del(&sub->hook);
+			kmem_cache_free(subscriber_cache, sub);
+		}
+	}
+
+	vfree(buckets);
+	kmem_cache_destroy(subscriber_cache);
+}
+
+static struct subscriber_bucket *get_bucket(const struct ipv6_prefix *prefix)
+{
+	u32 hash;
+	hash = jhash2(prefix->address.s6_addr32, 4, hash_seed ^ prefix->len);
+	return &buckets[hash & ((1U << SUBSCRIBER_HASH_BITS) - 1)];
+}
+
+/**
+ * Bucket's spinlock must be held.
+ */
+static struct subscriber *find(struct subscriber_bucket *bucket,
+		const struct ipv6_prefix *prefix)
+{
+	struct subscriber *sub;
+	struct hlist_node *node;
+
+	hlist_for_each(node, &bucket->head) {
+		sub = hlist_entry(node, struct subscriber, hook);
+		if (prefix6_equals(&sub->prefix, prefix))
+			return sub;
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the subscriber @addr belongs to, given the subscribers are
+ * identified by prefixes of length @len. Creates it if it doesn't exist.
+ *
+ * Increases the result's refcount; subscriber_put() it or hand the reference
+ * over to a BIB entry (subscriber_add_bib()) when you're done.
+ *
+ * Returns NULL on memory allocation failure.
+ */
+struct subscriber *subscriber_get(const struct in6_addr *addr, __u8 len)
+{
+	struct ipv6_prefix prefix;
+	struct subscriber_bucket *bucket;
+	struct subscriber *sub;
+	struct subscriber *new;
+
+	ipv6_addr_prefix(&prefix.address, addr, len);
+	prefix.len = len;
+	bucket = get_bucket(&prefix);
+
+	spin_lock_bh(&bucket->lock);
+	sub = find(bucket, &prefix);
+	if (sub)
+		atomic_inc(&sub->refcount);
+	spin_unlock_bh(&bucket->lock);
+
+	if (sub)
+		return sub;
+
+	new = kmem_cache_alloc(subscriber_cache, GFP_ATOMIC);
+	if (!new)
+		return NULL;
+	new->prefix = prefix;
+	atomic_set(&new->refcount, 1);
+	spin_lock_init(&new->lock);
+	new->sessions = 0;
+	new->bibs = 0;
+	INIT_LIST_HEAD(&new->lru);
+	INIT_LIST_HEAD(&new->blocks);
+
+	spin_lock_bh(&bucket->lock);
+	/* Somebody might have added it while we were allocating. */
+	sub = find(bucket, &prefix);
+	if (sub) {
+		atomic_inc(&sub->refcount);
+	} else {
+		hlist_add_head(&new->hook, &bucket->head);
+		atomic64_inc(&subscriber_count);
+	}
+	spin_unlock_bh(&bucket->lock);
+
+	if (sub) {
+		kmem_cache_free(subscriber_cache, new);
+		return sub;
+	}
+	return new;
+}
+
+void subscriber_put(struct subscriber *sub)
+{
+	struct subscriber_bucket *bucket = get_bucket(&sub->prefix);
+
+	/*
+	 * Finders hold the bucket lock, so they will never see a subscriber
+	 * whose refcount has reached zero.
+	 */
+	local_bh_disable();
+	if (!atomic_dec_and_lock(&sub->refcount, &bucket->lock)) {
+		local_bh_enable();
+		return;
+	}
+	hlist_del(&sub->hook);
+	spin_unlock(&bucket->lock);
+	local_bh_enable();
+
+	WARN(sub->sessions || sub->bibs,
+			"Subscriber %pI6c/%u died owning %u sessions and %u BIBs.",
+			&sub->prefix.address, sub->prefix.len,
+			sub->sessions, sub->bibs);
+	atomic64_dec(&subscriber_count);
+	kmem_cache_free(subscriber_cache, sub);
+}
+
+/**
+ * Charges a new BIB entry to @sub. The BIB entry inherits the caller's
+ * reference to @sub, and will release it through subscriber_rm_bib().
+ */
+void subscriber_add_bib(struct subscriber *sub)
+{
+	spin_lock_bh(&sub->lock);
+	sub->bibs++;
+	spin_unlock_bh(&sub->lock);
+	atomic64_inc(&bib_count);
+}
+
+/**
+ * Reverts subscriber_add_bib(), including the BIB entry's reference.
+ *
+ * @block is the port block the BIB entry's port was taken from, or NULL if it
+ * didn't come from a block. The block is released along with its last entry.
+ */
+void subscriber_rm_bib(struct subscriber *sub, struct port_block *block)
+{
+	if (block)
+		subscriber_return_port(sub, block);
+
+	spin_lock_bh(&sub->lock);
+	sub->bibs--;
+	spin_unlock_bh(&sub->lock);
+	atomic64_dec(&bib_count);
+	subscriber_put(sub);
+}
+
+/**
+ * Charges @session, which was just added to the session DB, to @sub.
+ *
+ * The session DB calls this while holding its own spinlock (with bottom halves
+ * disabled).
+ */
+void subscriber_add_session(struct subscriber *sub,
+		struct session_entry *session)
+{
+	spin_lock(&sub->lock);
+	list_add_tail(&session->subscriber_hook, &sub->lru);
+	sub->sessions++;
+	spin_unlock(&sub->lock);
+	atomic64_inc(&session_count);
+}
+
+/**
+ * Reverts subscriber_add_session(). Same locking context.
+ */
+void subscriber_rm_session(struct subscriber *sub,
+		struct session_entry *session)
+{
+	spin_lock(&sub->lock);
+	list_del(&session->subscriber_hook);
+	sub->sessions--;
+	spin_unlock(&sub->lock);
+	atomic64_dec(&session_count);
+}
+
+/**
+ * Returns whether there's room for one more BIB entry.
+ *
+ * -EDQUOT means @sub reached its own limit, -ENOSPC means the global limit was
+ * reached.
+ *
+ * Nothing is reserved, so concurrent packets can overshoot the limits by (at
+ * most) one entry per CPU.
+ */
+int subscriber_check_bibs(struct subscriber *sub,
+		struct admission_limits *limits)
+{
+	unsigned int bibs;
+
+	if (limits->max_bibs_per_subscriber) {
+		spin_lock_bh(&sub->lock);
+		bibs = sub->bibs;
+		spin_unlock_bh(&sub->lock);
+		if (bibs >= limits->max_bibs_per_subscriber)
+			return -EDQUOT;
+	}
+
+	if (limits->max_bibs && atomic64_read(&bib_count) >= limits->max_bibs)
+		return -ENOSPC;
+
+	return 0;
+}
+
+/**
+ * Same as subscriber_check_bibs(), except for sessions.
+ */
+int subscriber_check_sessions(struct subscriber *sub,
+		struct admission_limits *limits)
+{
+	unsigned int sessions;
+
+	if (limits->max_sessions_per_subscriber) {
+		spin_lock_bh(&sub->lock);
+		sessions = sub->sessions;
+		spin_unlock_bh(&sub->lock);
+		if (sessions >= limits->max_sessions_per_subscriber)
+			return -EDQUOT;
+	}
+
+	if (limits->max_sessions
+			&& atomic64_read(&session_count) >= limits->max_sessions)
+		return -ENOSPC;
+
+	return 0;
+}
+
+/**
+ * Returns (roughly) the least recently used session @sub owns, or NULL if it
+ * doesn't own any.
+ *
+ * Increases the result's refcount; session_return() it when you're done.
+ */
+struct session_entry *subscriber_lru(struct subscriber *sub)
+{
+	struct session_entry *session;
+	struct session_entry *victim = NULL;
+	struct list_head *last = NULL;
+	unsigned int samples = 0;
+	LIST_HEAD(sampled);
+
+	spin_lock_bh(&sub->lock);
+
+	list_for_each_entry(session, &sub->lru, subscriber_hook) {
+		if (!victim || time_before(session->update_time,
+				victim->update_time))
+			victim = session;
+		last = &session->subscriber_hook;
+		if (++samples >= SUBSCRIBER_LRU_SAMPLES)
+			break;
+	}
+
+	if (victim) {
+		/*
+		 * The list holds a database reference, so @victim is not
+		 * dying. Send the sample to the back so the next call looks at
+		 * different sessions.
+		 */
+		session_get(victim);
+		list_cut_position(&sampled, &sub->lru, last);
+		list_splice_tail(&sampled, &sub->lru);
+	}
+
+	spin_unlock_bh(&sub->lock);
+	return victim;
+}
+
+/**
+ * Picks a free port out of the @proto blocks @sub reserved from the @mark pool4
+ * table, and charges it to its block. The block will live at least until the
+ * port is handed back through subscriber_rm_bib().
+ *
+ * Returns -ESRCH if every one of these blocks is full (or there are none). In
+ * that case, @hint will be the address of the blocks (so the next one can be
+ * reserved on the same address), or 0.0.0.0 if there are none.
+ */
+int subscriber_take_port(struct subscriber *sub, l4_protocol proto,
+		__u32 mark, struct ipv4_transport_addr *result,
+		struct port_block **block, struct in_addr *hint)
+{
+	struct port_block *candidate;
+	__u16 port;
+
+	hint->s_addr = 0;
+
+	spin_lock_bh(&sub->lock);
+	list_for_each_entry(candidate, &sub->blocks, hook) {
+		if (candidate->proto != proto || candidate->mark != mark)
+			continue;
+
+		if (!bibdb_find_free4(proto, &candidate->addr,
+				&candidate->range, &port)) {
+			candidate->refs++;
+			result->l3 = candidate->addr;
+			result->l4 = port;
+			*block = candidate;
+			spin_unlock_bh(&sub->lock);
+			return 0;
+		}
+
+		*hint = candidate->addr;
+	}
+	spin_unlock_bh(&sub->lock);
+
+	return -ESRCH;
+}
+
+/**
+ * Reverts the charge subscriber_take_port() (or palloc_allocate_block()) made
+ * to @block. The block is released along with its last port.
+ */
+void subscriber_return_port(struct subscriber *sub, struct port_block *block)
+{
+	bool release;
+
+	spin_lock_bh(&sub->lock);
+	release = (--block->refs == 0);
+	if (release)
+		list_del(&block->hook);
+	spin_unlock_bh(&sub->lock);
+
+	if (release)
+		palloc_release_block(block);
+}
+
+/**
+ * Hands a newly reserved @block (whose refs already account for its first
+ * port) over to @sub.
+ */
+void subscriber_add_block(struct subscriber *sub, struct port_block *block)
+{
+	spin_lock_bh(&sub->lock);
+	list_add_tail(&block->hook, &sub->blocks);
+	spin_unlock_bh(&sub->lock);
+}
+
+void subscriber_count_drop(void)
+{
+	atomic64_inc(&drop_count);
+}
+
+void subscriber_count_eviction(void)
+{
+	atomic64_inc(&eviction_count);
+}
+
+void subscriber_stats(__u64 *subscribers, __u64 *sessions, __u64 *bibs,
+		__u64 *drops, __u64 *evictions)
+{
+	*subscribers = atomic64_read(&subscriber_count);
+	*sessions = atomic64_read(&session_count);
+	*bibs = atomic64_read(&bib_count);
+	*drops = atomic64_read(&drop_count);
+	*evictions = atomic64_read(&eviction_count);
+}
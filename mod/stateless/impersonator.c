@@ -4,11 +4,16 @@
 #include "nat64/mod/stateful/compute_outgoing_tuple.h"
 #include "nat64/mod/stateful/determine_incoming_tuple.h"
 #include "nat64/mod/stateful/filtering_and_updating.h"
+#include "nat64/mod/stateful/fragment_cache.h"
 #include "nat64/mod/stateful/fragment_db.h"
 #include "nat64/mod/stateful/pool4/db.h"
+#include "nat64/mod/stateful/pool4/usage.h"
+#include "nat64/mod/stateful/replication.h"
 #include "nat64/mod/stateful/bib/db.h"
+#include "nat64/mod/stateful/bib/deterministic.h"
 #include "nat64/mod/stateful/bib/static_routes.h"
 #include "nat64/mod/stateful/session/db.h"
+#include "nat64/mod/stateful/subscriber.h"
 
 /**
  * @file
@@ -30,18 +35,25 @@ verdict determine_in_tuple(struct packet *pkt, struct tuple *in_tuple)
 	return VERDICT_DROP;
 }
 
-verdict filtering_and_updating(struct packet *pkt, struct tuple *in_tuple)
+verdict filtering_and_updating(struct packet *pkt, struct tuple *in_tuple,
+		struct session_entry **session_out)
 {
 	fail(__func__);
 	return VERDICT_DROP;
 }
 
-verdict compute_out_tuple(struct tuple *in, struct tuple *out, struct packet *pkt_in)
+verdict compute_out_tuple(struct tuple *in, struct session_entry *session,
+		struct tuple *out, struct packet *pkt_in)
 {
 	fail(__func__);
 	return VERDICT_DROP;
 }
 
+int session_return(struct session_entry *session)
+{
+	return fail(__func__);
+}
+
 int pool4db_add(const __u32 mark, enum l4_protocol proto,
 		struct ipv4_prefix *prefix, struct port_range *ports)
 {
@@ -59,6 +71,33 @@ int pool4db_flush(void)
 	return fail(__func__);
 }
 
+int pool4db_batch_begin(__u32 owner, bool replace)
+{
+	return fail(__func__);
+}
+
+int pool4db_batch_add(__u32 owner, const __u32 mark, enum l4_protocol proto,
+		struct ipv4_prefix *prefix, struct port_range *ports)
+{
+	return fail(__func__);
+}
+
+int pool4db_batch_rm(__u32 owner, const __u32 mark, enum l4_protocol proto,
+		struct ipv4_prefix *prefix, struct port_range *ports)
+{
+	return fail(__func__);
+}
+
+int pool4db_batch_commit(__u32 owner)
+{
+	return fail(__func__);
+}
+
+void pool4db_batch_abort(__u32 owner)
+{
+	fail(__func__);
+}
+
 int pool4db_foreach_sample(int (*cb)(struct pool4_sample *, void *), void *arg,
 		struct pool4_sample *offset)
 {
@@ -76,6 +115,19 @@ bool pool4db_is_empty(void)
 	return true;
 }
 
+__u32 pool4usage_get(__u32 mark, l4_protocol proto,
+		const struct in_addr *addr)
+{
+	fail(__func__);
+	return 0;
+}
+
+__u64 pool4usage_count(void)
+{
+	fail(__func__);
+	return 0;
+}
+
 void bibdb_delete_taddr4s(const struct ipv4_prefix *prefix,
 		struct port_range *ports)
 {
@@ -138,6 +190,73 @@ int sessiondb_count(l4_protocol proto, __u64 *result)
 	return fail(__func__);
 }
 
+int sessiondb_expiry_stats(l4_protocol proto, __u64 *backlog, __u64 *batches)
+{
+	return fail(__func__);
+}
+
+void subscriber_stats(__u64 *subscribers, __u64 *sessions, __u64 *bibs,
+		__u64 *drops, __u64 *evictions)
+{
+	fail(__func__);
+}
+
+int snapshot_restore(__u32 owner, struct request_snapshot *request,
+		void *records, size_t records_len,
+		struct response_snapshot *response)
+{
+	return fail(__func__);
+}
+
+void replication_listen(u32 portid)
+{
+	fail(__func__);
+}
+
+int replication_apply(struct replication_event *events, size_t count)
+{
+	return fail(__func__);
+}
+
+void replication_stats(struct response_replication *stats)
+{
+	fail(__func__);
+}
+
+int detmap_add(struct deterministic_entry *entry)
+{
+	return fail(__func__);
+}
+
+int detmap_rm(__u32 mark)
+{
+	return fail(__func__);
+}
+
+void detmap_flush(void)
+{
+	fail(__func__);
+}
+
+int detmap_foreach(int (*func)(struct deterministic_entry *, void *), void *arg,
+		__u32 *offset)
+{
+	return fail(__func__);
+}
+
+int detmap_test6(__u32 mark, l4_protocol proto, struct in6_addr *addr,
+		struct response_deterministic *result)
+{
+	return fail(__func__);
+}
+
+int detmap_test4(__u32 mark, l4_protocol proto,
+		struct ipv4_transport_addr *addr,
+		struct response_deterministic *result)
+{
+	return fail(__func__);
+}
+
 void sessiondb_update_timers(void)
 {
 	fail(__func__);
@@ -148,3 +267,43 @@ verdict fragdb_handle(struct packet *pkt)
 	fail(__func__);
 	return VERDICT_DROP;
 }
+
+void fragdb_stats(struct response_fragment *stats)
+{
+	fail(__func__);
+}
+
+bool fragcache_is_enabled(void)
+{
+	fail(__func__);
+	return false;
+}
+
+enum fragcache_type fragcache_type(struct packet *pkt)
+{
+	fail(__func__);
+	return FRAGCACHE_NONE;
+}
+
+verdict fragcache_get(struct packet *pkt, struct tuple *tuple_out)
+{
+	fail(__func__);
+	return VERDICT_DROP;
+}
+
+struct sk_buff *fragcache_add(struct packet *pkt, struct tuple *tuple_out)
+{
+	fail(__func__);
+	return NULL;
+}
+
+void fragcache_reject(struct packet *pkt, verdict result)
+{
+	fail(__func__);
+}
+
+verdict fragcache_reassemble(struct packet *pkt)
+{
+	fail(__func__);
+	return VERDICT_DROP;
+}
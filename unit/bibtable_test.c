@@ -1,4 +1,6 @@
 #include <linux/module.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
 #include "nat64/unit/unit_test.h"
 #include "nat64/common/str_utils.h"
 #include "nat64/mod/common/config.h"
@@ -8,12 +10,16 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alberto Leiva");
 MODULE_DESCRIPTION("BIB table module test.");
 
+static bool benchmark;
+module_param(benchmark, bool, 0);
+MODULE_PARM_DESC(benchmark, "Also measure lookups/sec with a million entries and up to 32 threads.");
+
 static struct bib_table table;
 #define TEST_BIB_COUNT 5
 static struct bib_entry *entries[TEST_BIB_COUNT];
 
-static bool inject(unsigned int index, char *addr4, u16 port4,
-		char *addr6, u16 port6)
+static bool __inject(unsigned int index, char *addr4, u16 port4,
+		char *addr6, u16 port6, bool mark_set, __u32 mark)
 {
 	struct ipv4_transport_addr taddr4;
 	struct ipv6_transport_addr taddr6;
@@ -31,8 +37,10 @@ static bool inject(unsigned int index, char *addr4, u16 port4,
 		log_err("Could not allocate entry %u.", index);
 		return false;
 	}
+	entries[index]->mark = mark;
+	entries[index]->mark_set = mark_set;
 
-	error = bibtable_add(&table, entries[index]);
+	error = bibtable_add(&table, entries[index], NULL);
 	if (error) {
 		log_err("Errcode %d on BIB table add %u.", error, index);
 		return false;
@@ -41,6 +49,12 @@ static bool inject(unsigned int index, char *addr4, u16 port4,
 	return true;
 }
 
+static bool inject(unsigned int index, char *addr4, u16 port4,
+		char *addr6, u16 port6)
+{
+	return __inject(index, addr4, port4, addr6, port6, false, 0);
+}
+
 static bool insert_test_bibs(void)
 {
 	return inject(0, "192.0.2.1", 100, "2001:db8::1", 100)
@@ -206,6 +220,457 @@ static bool test_foreach(void)
 	return success;
 }
 
+static bool assert_free(char *addr_str, __u16 min, __u16 max, int expected,
+		__u16 expected_port)
+{
+	struct in_addr addr;
+	struct port_range range = { .min = min, .max = max };
+	__u16 port = 0;
+	bool success = true;
+
+	if (str_to_addr4(addr_str, &addr))
+		return false;
+
+	success &= ASSERT_INT(expected, bibtable_find_free4(&table, &addr,
+			&range, &port), "%s#%u-%u result", addr_str, min, max);
+	if (!expected)
+		success &= ASSERT_UINT(expected_port, port, "%s#%u-%u port",
+				addr_str, min, max);
+	return success;
+}
+
+static bool test_find_free(void)
+{
+	struct in_addr addr;
+	bool success = true;
+
+	if (!insert_test_bibs())
+		return false;
+
+	/* Unknown address; everything is free. */
+	success &= assert_free("192.0.2.9", 7, 9, 0, 7);
+	/* Skip the taken ports. */
+	success &= assert_free("192.0.2.2", 50, 60, 0, 51);
+	success &= assert_free("192.0.2.2", 100, 150, 0, 101);
+	success &= assert_free("192.0.2.2", 149, 150, 0, 149);
+	/* Exhaustion. */
+	success &= assert_free("192.0.2.2", 100, 100, -ESRCH, 0);
+	success &= assert_free("192.0.2.2", 150, 150, -ESRCH, 0);
+
+	/* Removals give the ports back. */
+	bibtable_rm(&table, entries[2]);
+	bibentry_kfree(entries[2]);
+	success &= assert_free("192.0.2.2", 100, 100, 0, 100);
+
+	/* Once an address has no entries, it stops being tracked. */
+	bibtable_rm(&table, entries[0]);
+	bibentry_kfree(entries[0]);
+	success &= assert_free("192.0.2.1", 100, 100, 0, 100);
+	if (str_to_addr4("192.0.2.1", &addr))
+		return false;
+	success &= ASSERT_PTR(NULL, find_usage(&table, &addr), "usage");
+
+	return success;
+}
+
+static bool assert_findable(char *label)
+{
+	unsigned int i;
+	bool success = true;
+
+	rcu_read_lock_bh();
+	for (i = 0; i < TEST_BIB_COUNT; i++) {
+		success &= ASSERT_PTR(entries[i], find4(&table,
+				&entries[i]->ipv4), "%s, entry %u", label, i);
+	}
+	rcu_read_unlock_bh();
+
+	return success;
+}
+
+/**
+ * While a resize is migrating the entries, they have to be reachable from
+ * either bucket array.
+ */
+static bool test_migration(void)
+{
+	struct bib_buckets *old, *new;
+	unsigned int half;
+	bool success = true;
+
+	if (!insert_test_bibs())
+		return false;
+
+	new = alloc_buckets(HASH_MIN_BITS + 1);
+	if (!new)
+		return false;
+
+	/* Same as grow_hash(), but stop halfway. */
+	spin_lock_bh(&table.lock);
+	old = get_buckets(&table, &table.hash4);
+	half = 1U << (old->bits - 1);
+	rcu_assign_pointer(table.hash4.old, old);
+	rcu_assign_pointer(table.hash4.buckets, new);
+	migrate_buckets(&table, old, new, false, 0, half);
+	spin_unlock_bh(&table.lock);
+
+	success &= assert_findable("halfway");
+
+	spin_lock_bh(&table.lock);
+	migrate_buckets(&table, old, new, false, half, 2 * half);
+	RCU_INIT_POINTER(table.hash4.old, NULL);
+	spin_unlock_bh(&table.lock);
+	synchronize_rcu_bh();
+	free_buckets(old);
+
+	success &= assert_findable("done");
+	return success;
+}
+
+static bool assert_usage(__u32 mark, char *addr_str, __u32 expected)
+{
+	struct in_addr addr;
+
+	if (str_to_addr4(addr_str, &addr))
+		return false;
+
+	return ASSERT_UINT(expected, pool4usage_get(mark, L4PROTO_UDP, &addr),
+			"mark %u, %s usage", mark, addr_str);
+}
+
+static void remove_entry(unsigned int index)
+{
+	bibtable_rm(&table, entries[index]);
+	bibentry_kfree(entries[index]);
+}
+
+/**
+ * Port usage bitmaps are allocated in chunks; make sure the searches cross
+ * them properly, and that empty chunks are released.
+ */
+static bool test_find_free_chunks(void)
+{
+	struct port_usage *usage;
+	struct in_addr addr;
+	bool success = true;
+
+	if (!__inject(0, "192.0.2.5", 1022, "2001:db8::1", 1, false, 0))
+		return false;
+	if (!__inject(1, "192.0.2.5", 1023, "2001:db8::1", 2, false, 0))
+		return false;
+	if (!__inject(2, "192.0.2.5", 1024, "2001:db8::1", 3, false, 0))
+		return false;
+
+	success &= assert_free("192.0.2.5", 1022, 1030, 0, 1025);
+	success &= assert_free("192.0.2.5", 1022, 1024, -ESRCH, 0);
+	/* Chunk 2 was never allocated. */
+	success &= assert_free("192.0.2.5", 2048, 3000, 0, 2048);
+
+	if (str_to_addr4("192.0.2.5", &addr))
+		return false;
+	usage = find_usage(&table, &addr);
+	if (!ASSERT_BOOL(true, usage != NULL, "usage"))
+		return false;
+	success &= ASSERT_BOOL(true, usage->chunks[0] != NULL, "chunk 0");
+	success &= ASSERT_BOOL(true, usage->chunks[1] != NULL, "chunk 1");
+	success &= ASSERT_PTR(NULL, usage->chunks[2], "chunk 2");
+	success &= ASSERT_UINT(3, usage->used, "used");
+
+	remove_entry(2);
+	success &= ASSERT_PTR(NULL, usage->chunks[1], "chunk 1 released");
+	success &= assert_free("192.0.2.5", 1023, 1030, 0, 1024);
+
+	return success;
+}
+
+static bool test_usage(void)
+{
+	unsigned long epoch;
+	bool success = true;
+
+	if (!__inject(0, "192.0.2.1", 100, "2001:db8::1", 100, true, 1))
+		return false;
+	if (!__inject(1, "192.0.2.1", 200, "2001:db8::1", 200, true, 1))
+		return false;
+	if (!__inject(2, "192.0.2.1", 300, "2001:db8::2", 300, true, 2))
+		return false;
+	if (!__inject(3, "192.0.2.2", 100, "2001:db8::3", 100, true, 1))
+		return false;
+	/* Not charged to anyone. */
+	if (!inject(4, "192.0.2.3", 100, "2001:db8::4", 100))
+		return false;
+
+	success &= assert_usage(1, "192.0.2.1", 2);
+	success &= assert_usage(2, "192.0.2.1", 1);
+	success &= assert_usage(1, "192.0.2.2", 1);
+	success &= assert_usage(2, "192.0.2.2", 0);
+	success &= assert_usage(0, "192.0.2.3", 0);
+	success &= ASSERT_U64(4ULL, pool4usage_count(), "count");
+
+	/* Refunds give the table its room back. */
+	epoch = pool4usage_epoch(L4PROTO_UDP);
+	pool4usage_set_exhausted(1, L4PROTO_UDP, epoch);
+	success &= ASSERT_BOOL(true, pool4usage_is_exhausted(1, L4PROTO_UDP),
+			"exhausted");
+	success &= ASSERT_BOOL(false, pool4usage_is_exhausted(2, L4PROTO_UDP),
+			"other mark exhausted");
+	remove_entry(1);
+	success &= assert_usage(1, "192.0.2.1", 1);
+	success &= ASSERT_U64(3ULL, pool4usage_count(), "count after rm");
+	success &= ASSERT_BOOL(false, pool4usage_is_exhausted(1, L4PROTO_UDP),
+			"exhausted after refund");
+
+	/* Scans that raced with a refund cannot conclude anything. */
+	epoch = pool4usage_epoch(L4PROTO_UDP);
+	remove_entry(2);
+	pool4usage_set_exhausted(1, L4PROTO_UDP, epoch);
+	success &= ASSERT_BOOL(false, pool4usage_is_exhausted(1, L4PROTO_UDP),
+			"stale exhaustion");
+
+	/* Uncharged entries might have belonged to any table. */
+	epoch = pool4usage_epoch(L4PROTO_UDP);
+	pool4usage_set_exhausted(1, L4PROTO_UDP, epoch);
+	remove_entry(4);
+	success &= ASSERT_BOOL(false, pool4usage_is_exhausted(1, L4PROTO_UDP),
+			"exhausted after uncharged rm");
+
+	remove_entry(0);
+	remove_entry(3);
+	success &= assert_usage(1, "192.0.2.1", 0);
+	success &= ASSERT_U64(0ULL, pool4usage_count(), "final count");
+
+	return success;
+}
+
+/**
+ * A port freed by one mark's entry is also room for the other marks whose
+ * tables contain the address.
+ */
+static bool test_usage_shared(void)
+{
+	unsigned long epoch;
+	bool success = true;
+
+	if (!__inject(0, "192.0.2.1", 100, "2001:db8::1", 100, true, 1))
+		return false;
+	if (!__inject(1, "192.0.2.1", 200, "2001:db8::2", 200, true, 2))
+		return false;
+
+	epoch = pool4usage_epoch(L4PROTO_UDP);
+	pool4usage_set_exhausted(1, L4PROTO_UDP, epoch);
+	pool4usage_set_exhausted(2, L4PROTO_UDP, epoch);
+	success &= ASSERT_BOOL(true, pool4usage_is_exhausted(2, L4PROTO_UDP),
+			"exhausted");
+
+	remove_entry(0);
+	success &= ASSERT_BOOL(false, pool4usage_is_exhausted(1, L4PROTO_UDP),
+			"refunded mark exhausted");
+	success &= ASSERT_BOOL(false, pool4usage_is_exhausted(2, L4PROTO_UDP),
+			"sharing mark exhausted");
+
+	remove_entry(1);
+	success &= ASSERT_U64(0ULL, pool4usage_count(), "final count");
+
+	return success;
+}
+
+#define BENCH_ENTRIES 1000000u
+#define BENCH_LOOKUPS 1000000u
+
+/**
+ * Entry number @i of the benchmark. Every entry gets its own IPv6 node, and
+ * the IPv4 side packs 4096 entries per address.
+ */
+static void bench_addrs(unsigned int i, struct ipv4_transport_addr *addr4,
+		struct ipv6_transport_addr *addr6)
+{
+	addr4->l3.s_addr = cpu_to_be32(0x0a000000u | (i >> 12));
+	addr4->l4 = 1024 + (i & 0xfff);
+	memset(&addr6->l3, 0, sizeof(addr6->l3));
+	addr6->l3.s6_addr32[0] = cpu_to_be32(0x20010db8u);
+	addr6->l3.s6_addr32[3] = cpu_to_be32(i);
+	addr6->l4 = 5000;
+}
+
+/**
+ * Fills @table with BENCH_ENTRIES entries. The even ones are dynamic, and
+ * arrive in bulk (as if restored from a snapshot). The odd ones are static,
+ * and are added one by one, which keeps the resizer busy.
+ */
+static bool bench_populate(void)
+{
+	struct bib_entry **bibs;
+	struct bib_entry *bib;
+	struct ipv4_transport_addr addr4;
+	struct ipv6_transport_addr addr6;
+	size_t count = 0;
+	unsigned int i;
+	ktime_t start;
+	int error;
+
+	bibs = vmalloc(BENCH_ENTRIES / 2 * sizeof(*bibs));
+	if (!bibs)
+		return false;
+
+	for (i = 0; i < BENCH_ENTRIES; i += 2) {
+		bench_addrs(i, &addr4, &addr6);
+		bibs[count] = bibentry_create(&addr4, &addr6, false,
+				L4PROTO_UDP);
+		if (!bibs[count])
+			goto enomem;
+		count++;
+	}
+
+	start = ktime_get();
+	error = bibtable_restore(&table, bibs, &count);
+	vfree(bibs);
+	if (!ASSERT_INT(0, error, "restore result"))
+		return false;
+	log_info("Restored %zu entries in %lld ns.", count,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	start = ktime_get();
+	for (i = 1; i < BENCH_ENTRIES; i += 2) {
+		bench_addrs(i, &addr4, &addr6);
+		bib = bibentry_create(&addr4, &addr6, true, L4PROTO_UDP);
+		if (!bib)
+			return false;
+		error = bibtable_add(&table, bib, NULL);
+		if (!ASSERT_INT(0, error, "add %u result", i)) {
+			bibentry_kfree(bib);
+			return false;
+		}
+	}
+	flush_work(&table.resizer);
+	log_info("Added %u entries in %lld ns.", BENCH_ENTRIES / 2,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	return ASSERT_U64(BENCH_ENTRIES, table.count, "entry count");
+
+enomem:
+	while (count > 0)
+		bibentry_kfree(bibs[--count]);
+	vfree(bibs);
+	return false;
+}
+
+struct bench_worker {
+	/** Released when every worker has been created. */
+	struct completion *start;
+	struct completion done;
+	/** Seeds the entries this worker looks up. */
+	unsigned int seed;
+	unsigned int misses;
+	s64 nsecs;
+};
+
+static int bench_work(void *void_worker)
+{
+	struct bench_worker *worker = void_worker;
+	struct ipv4_transport_addr addr4;
+	struct ipv6_transport_addr addr6;
+	struct bib_entry *bib;
+	unsigned int index;
+	unsigned int i;
+	ktime_t start;
+	int error;
+
+	wait_for_completion(worker->start);
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		/* Hop around so the lookups don't hit the cache too much. */
+		index = (worker->seed + i * 7919u) % BENCH_ENTRIES;
+		bench_addrs(index, &addr4, &addr6);
+		error = (i & 1)
+				? bibtable_get4(&table, &addr4, &bib)
+				: bibtable_get6(&table, &addr6, &bib);
+		if (error)
+			worker->misses++;
+		else
+			bibentry_return(bib);
+	}
+	worker->nsecs = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	complete(&worker->done);
+	return 0;
+}
+
+/**
+ * Measures how many lookups "threads" threads can perform per second. Half of
+ * them are IPv6 lookups, and the other half are IPv4 lookups.
+ */
+static bool bench_lookups(unsigned int threads)
+{
+	struct bench_worker *workers;
+	struct task_struct *task;
+	DECLARE_COMPLETION_ONSTACK(start);
+	unsigned int created;
+	unsigned int misses = 0;
+	int cpu = -1;
+	s64 nsecs = 0;
+	u64 rate;
+	bool success = true;
+
+	workers = kcalloc(threads, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return false;
+
+	for (created = 0; created < threads; created++) {
+		workers[created].start = &start;
+		init_completion(&workers[created].done);
+		workers[created].seed = created * (BENCH_ENTRIES / threads);
+		task = kthread_create(bench_work, &workers[created],
+				"jool_bib_bench");
+		if (IS_ERR(task)) {
+			log_err("kthread_create() threw errcode %ld.",
+					PTR_ERR(task));
+			success = false;
+			break;
+		}
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+	}
+
+	complete_all(&start);
+	while (created > 0) {
+		created--;
+		wait_for_completion(&workers[created].done);
+		nsecs = max(nsecs, workers[created].nsecs);
+		misses += workers[created].misses;
+	}
+
+	if (success) {
+		success &= ASSERT_UINT(0, misses, "misses");
+		rate = nsecs ? div64_u64((u64)threads * BENCH_LOOKUPS
+				* NSEC_PER_SEC, nsecs) : 0;
+		success &= ASSERT_BOOL(true, rate != 0, "lookup rate");
+		log_info("%u threads on %u CPUs: %llu lookups/sec.", threads,
+				num_online_cpus(), rate);
+	}
+
+	kfree(workers);
+	return success;
+}
+
+static bool test_benchmark(void)
+{
+	bool success = true;
+
+	if (!bench_populate())
+		return false;
+
+	success &= bench_lookups(1);
+	success &= bench_lookups(8);
+	success &= bench_lookups(32);
+
+	return success;
+}
+
 static bool init(void)
 {
 	if (config_init(false))
@@ -214,7 +679,11 @@ static bool init(void)
 		config_destroy();
 		return false;
 	}
-	bibtable_init(&table);
+	if (bibtable_init(&table)) {
+		bibentry_destroy();
+		config_destroy();
+		return false;
+	}
 
 	return true;
 }
@@ -222,6 +691,7 @@ static bool init(void)
 static void end(void)
 {
 	bibtable_destroy(&table);
+	pool4usage_flush();
 	bibentry_destroy();
 	config_destroy();
 }
@@ -231,6 +701,14 @@ int init_module(void)
 	START_TESTS("BIB table");
 
 	INIT_CALL_END(init(), test_foreach(), end(), "Foreach");
+	INIT_CALL_END(init(), test_find_free(), end(), "Find free port");
+	INIT_CALL_END(init(), test_find_free_chunks(), end(), "Port usage chunks");
+	INIT_CALL_END(init(), test_migration(), end(), "Incremental resize");
+	INIT_CALL_END(init(), test_usage(), end(), "pool4 usage");
+	INIT_CALL_END(init(), test_usage_shared(), end(), "Shared usage");
+	if (benchmark) {
+		INIT_CALL_END(init(), test_benchmark(), end(), "Lookup benchmark");
+	}
 
 	END_TESTS;
 }
@@ -1,5 +1,7 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Roberto Aceves");
@@ -7,6 +9,7 @@ MODULE_AUTHOR("Alberto Leiva");
 MODULE_DESCRIPTION("Unit tests for the Filtering module");
 
 #include "nat64/common/str_utils.h"
+#include "nat64/unit/config.h"
 #include "nat64/unit/types.h"
 #include "nat64/unit/unit_test.h"
 #include "nat64/unit/skb_generator.h"
@@ -158,7 +161,7 @@ static bool test_filtering_and_updating(void)
 	if (pkt_init_ipv4(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, filtering_and_updating(&pkt, &tuple), "ICMP error");
+	success &= ASSERT_INT(VERDICT_CONTINUE, filtering_and_updating(&pkt, &tuple, NULL), "ICMP error");
 	success &= assert_bib_count(0, L4PROTO_TCP);
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_bib_count(0, L4PROTO_ICMP);
@@ -178,7 +181,7 @@ static bool test_filtering_and_updating(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, filtering_and_updating(&pkt, &tuple), "ICMP error");
+	success &= ASSERT_INT(VERDICT_CONTINUE, filtering_and_updating(&pkt, &tuple, NULL), "ICMP error");
 	success &= assert_bib_count(0, L4PROTO_TCP);
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_bib_count(0, L4PROTO_ICMP);
@@ -198,7 +201,7 @@ static bool test_filtering_and_updating(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_DROP, filtering_and_updating(&pkt, &tuple), "Hairpinning");
+	success &= ASSERT_INT(VERDICT_DROP, filtering_and_updating(&pkt, &tuple, NULL), "Hairpinning");
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_session_count(0, L4PROTO_UDP);
 
@@ -214,7 +217,7 @@ static bool test_filtering_and_updating(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_ACCEPT, filtering_and_updating(&pkt, &tuple), "Not pool6 packet");
+	success &= ASSERT_INT(VERDICT_ACCEPT, filtering_and_updating(&pkt, &tuple, NULL), "Not pool6 packet");
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_session_count(0, L4PROTO_UDP);
 
@@ -230,7 +233,7 @@ static bool test_filtering_and_updating(void)
 	if (pkt_init_ipv4(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_ACCEPT, filtering_and_updating(&pkt, &tuple), "Not pool4 packet");
+	success &= ASSERT_INT(VERDICT_ACCEPT, filtering_and_updating(&pkt, &tuple, NULL), "Not pool4 packet");
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_session_count(0, L4PROTO_UDP);
 
@@ -247,7 +250,7 @@ static bool test_filtering_and_updating(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, filtering_and_updating(&pkt, &tuple), "IPv6 success");
+	success &= ASSERT_INT(VERDICT_CONTINUE, filtering_and_updating(&pkt, &tuple, NULL), "IPv6 success");
 	success &= assert_bib_count(1, L4PROTO_UDP);
 	success &= assert_session_count(1, L4PROTO_UDP);
 
@@ -263,7 +266,7 @@ static bool test_filtering_and_updating(void)
 	if (pkt_init_ipv4(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, filtering_and_updating(&pkt, &tuple), "IPv4 success");
+	success &= ASSERT_INT(VERDICT_CONTINUE, filtering_and_updating(&pkt, &tuple, NULL), "IPv4 success");
 	success &= assert_bib_count(1, L4PROTO_UDP);
 	success &= assert_session_count(1, L4PROTO_UDP);
 
@@ -271,6 +274,81 @@ static bool test_filtering_and_updating(void)
 	return success;
 }
 
+/**
+ * Filtering hands its session over to the caller, so the next steps don't
+ * have to look it up again.
+ */
+static bool test_session_out(void)
+{
+	struct packet pkt;
+	struct sk_buff *skb;
+	struct tuple tuple;
+	struct session_entry *session;
+	struct session_entry *found;
+	bool success = true;
+
+	if (init_tuple6(&tuple, "1::2", 1212, "3::4", 3434, L4PROTO_UDP))
+		return false;
+	if (create_skb6_udp(&tuple, &skb, 16, 32))
+		return false;
+	if (pkt_init_ipv6(&pkt, skb))
+		return false;
+
+	success &= ASSERT_INT(VERDICT_CONTINUE,
+			filtering_and_updating(&pkt, &tuple, &session),
+			"IPv6 result");
+	kfree_skb(skb);
+	if (!success || !ASSERT_BOOL(true, session != NULL, "IPv6 session"))
+		return false;
+
+	success &= ASSERT_INT(0, sessiondb_get(&tuple, NULL, NULL, &found),
+			"IPv6 lookup");
+	if (success) {
+		success &= ASSERT_PTR(found, session, "IPv6 same session");
+		session_return(found);
+	}
+	session_return(session);
+
+	if (invert_tuple(&tuple))
+		return false;
+	if (create_skb4_udp(&tuple, &skb, 16, 32))
+		return false;
+	if (pkt_init_ipv4(&pkt, skb))
+		return false;
+
+	success &= ASSERT_INT(VERDICT_CONTINUE,
+			filtering_and_updating(&pkt, &tuple, &session),
+			"IPv4 result");
+	kfree_skb(skb);
+	if (!success || !ASSERT_BOOL(true, session != NULL, "IPv4 session"))
+		return false;
+	success &= ASSERT_INT(0, sessiondb_get(&tuple, NULL, NULL, &found),
+			"IPv4 lookup");
+	if (success) {
+		success &= ASSERT_PTR(found, session, "IPv4 same session");
+		session_return(found);
+	}
+	session_return(session);
+
+	/* ICMP errors are skipped, so they don't get a session. */
+	if (init_tuple4(&tuple, "8.7.6.5", 8765, "192.0.2.128", 65000,
+			L4PROTO_TCP))
+		return false;
+	if (create_skb4_icmp_error(&tuple, &skb, 100, 32))
+		return false;
+	if (pkt_init_ipv4(&pkt, skb))
+		return false;
+
+	session = (struct session_entry *) 0x1;
+	success &= ASSERT_INT(VERDICT_CONTINUE,
+			filtering_and_updating(&pkt, &tuple, &session),
+			"ICMP error result");
+	success &= ASSERT_PTR(NULL, session, "ICMP error session");
+	kfree_skb(skb);
+
+	return success;
+}
+
 static bool test_udp(void)
 {
 	struct packet pkt;
@@ -286,7 +364,7 @@ static bool test_udp(void)
 	if (pkt_init_ipv4(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_ACCEPT, ipv4_simple(&pkt, &tuple), "result 1");
+	success &= ASSERT_INT(VERDICT_ACCEPT, ipv4_simple(&pkt, &tuple, NULL), "result 1");
 	success &= assert_bib_count(0, L4PROTO_UDP);
 	success &= assert_session_count(0, L4PROTO_UDP);
 
@@ -300,7 +378,7 @@ static bool test_udp(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, ipv6_simple(&pkt, &tuple), "result 2");
+	success &= ASSERT_INT(VERDICT_CONTINUE, ipv6_simple(&pkt, &tuple, NULL), "result 2");
 	success &= assert_bib_count(1, L4PROTO_UDP);
 	success &= assert_bib_exists("1::2", 1212, "192.0.2.128", 1024, L4PROTO_UDP, 1);
 	success &= assert_session_count(1, L4PROTO_UDP);
@@ -318,7 +396,7 @@ static bool test_udp(void)
 	if (pkt_init_ipv4(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, ipv4_simple(&pkt, &tuple), "result 3");
+	success &= ASSERT_INT(VERDICT_CONTINUE, ipv4_simple(&pkt, &tuple, NULL), "result 3");
 	success &= assert_bib_count(1, L4PROTO_UDP);
 	success &= assert_bib_exists("1::2", 1212, "192.0.2.128", 1024, L4PROTO_UDP, 1);
 	success &= assert_session_count(1, L4PROTO_UDP);
@@ -346,7 +424,7 @@ static bool test_icmp(void)
 	if (pkt_init_ipv4(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_ACCEPT, ipv4_simple(&pkt, &tuple), "result 1");
+	success &= ASSERT_INT(VERDICT_ACCEPT, ipv4_simple(&pkt, &tuple, NULL), "result 1");
 	success &= assert_bib_count(0, L4PROTO_ICMP);
 	success &= assert_session_count(0, L4PROTO_ICMP);
 
@@ -360,7 +438,7 @@ static bool test_icmp(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, ipv6_simple(&pkt, &tuple), "result 2");
+	success &= ASSERT_INT(VERDICT_CONTINUE, ipv6_simple(&pkt, &tuple, NULL), "result 2");
 	success &= assert_bib_count(1, L4PROTO_ICMP);
 	success &= assert_bib_exists("1::2", 1212, "192.0.2.128", 1024, L4PROTO_ICMP, 1);
 	success &= assert_session_count(1, L4PROTO_ICMP);
@@ -378,7 +456,7 @@ static bool test_icmp(void)
 	if (pkt_init_ipv4(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, ipv4_simple(&pkt, &tuple), "result 3");
+	success &= ASSERT_INT(VERDICT_CONTINUE, ipv4_simple(&pkt, &tuple, NULL), "result 3");
 	success &= assert_bib_count(1, L4PROTO_ICMP);
 	success &= assert_bib_exists("1::2", 1212, "192.0.2.128", 1024, L4PROTO_ICMP, 1);
 	success &= assert_session_count(1, L4PROTO_ICMP);
@@ -405,7 +483,7 @@ static bool test_tcp_closed_state_handle_6(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, tcp_closed_state(&pkt, &tuple6),
+	success &= ASSERT_INT(VERDICT_CONTINUE, tcp_closed_state(&pkt, &tuple6, NULL),
 			"V6 syn-result");
 	success &= assert_session_exists("1::2", 1212, "3::4", 3434,
 			"192.0.2.128", 1024, "0.0.0.4", 3434,
@@ -435,7 +513,7 @@ static bool test_tcp_closed_state_handle_4(void)
 	hdr_tcp->rst = false;
 	hdr_tcp->fin = false;
 
-	success &= ASSERT_INT(VERDICT_STOLEN, tcp_closed_state(&pkt, &tuple4), "V4 syn-result");
+	success &= ASSERT_INT(VERDICT_STOLEN, tcp_closed_state(&pkt, &tuple4, NULL), "V4 syn-result");
 	success &= ASSERT_INT(-ESRCH, sessiondb_get(&tuple4, NULL, NULL, &session), "V4 syn-session.");
 	/*
 	 * Well, it would be nice to test the packet was actually linked in pkt
@@ -447,6 +525,118 @@ static bool test_tcp_closed_state_handle_4(void)
 	return success;
 }
 
+static bool set_syn_cookies(bool enabled)
+{
+	struct global_config *config;
+
+	config = config_clone_for_update();
+	if (!config)
+		return false;
+
+	config->nat64.tcp_syn_cookies = enabled;
+
+	config_replace(config);
+	return true;
+}
+
+/**
+ * Sends an IPv6 SYN-ACK from 1::2#1212 to 3::5.6.7.8#5678, acknowledging @ack.
+ */
+static bool send_syn_ack6(__u32 ack, verdict expected)
+{
+	struct tuple tuple6;
+	struct packet pkt;
+	struct sk_buff *skb;
+	bool success;
+
+	if (init_tuple6(&tuple6, "1::2", 1212, "3::506:708", 5678, L4PROTO_TCP))
+		return false;
+	if (create_skb6_tcp(&tuple6, &skb, 100, 32))
+		return false;
+	if (pkt_init_ipv6(&pkt, skb)) {
+		kfree_skb(skb);
+		return false;
+	}
+	tcp_hdr(skb)->ack = true;
+	tcp_hdr(skb)->ack_seq = cpu_to_be32(ack);
+
+	success = ASSERT_INT(expected, tcp_closed_state(&pkt, &tuple6, NULL),
+			"V6 SYN-ACK (ack %u)", ack);
+
+	kfree_skb(skb);
+	return success;
+}
+
+/**
+ * The chain is V6 SYN (creates the BIB) --> V4 SYN (stateless) --> V6 SYN-ACK.
+ */
+static bool test_syn_cookies(void)
+{
+	struct session_entry *session;
+	struct bib_entry *bib;
+	struct ipv6_transport_addr addr6;
+	struct tuple tuple6, tuple4;
+	struct packet pkt;
+	struct sk_buff *skb;
+	__u32 seq;
+	bool success = true;
+
+	if (!set_syn_cookies(true))
+		return false;
+
+	/* V6 SYN */
+	if (init_tuple6(&tuple6, "1::2", 1212, "3::4", 3434, L4PROTO_TCP))
+		return false;
+	if (create_skb6_tcp(&tuple6, &skb, 100, 32))
+		return false;
+	if (pkt_init_ipv6(&pkt, skb)) {
+		kfree_skb(skb);
+		return false;
+	}
+	success &= ASSERT_INT(VERDICT_CONTINUE,
+			tcp_closed_state(&pkt, &tuple6, NULL), "V6 SYN");
+	kfree_skb(skb);
+
+	if (str_to_addr6("1::2", &addr6.l3))
+		return false;
+	addr6.l4 = 1212;
+	if (!ASSERT_INT(0, bibdb_get6(&addr6, L4PROTO_TCP, &bib), "BIB"))
+		return false;
+	if (init_tuple4(&tuple4, "5.6.7.8", 5678, "192.0.2.128", bib->ipv4.l4,
+			L4PROTO_TCP)) {
+		bibdb_return(bib);
+		return false;
+	}
+	bibdb_return(bib);
+
+	/* V4 SYN; translated, but not stored. */
+	if (create_skb4_tcp(&tuple4, &skb, 100, 32))
+		return false;
+	if (pkt_init_ipv4(&pkt, skb)) {
+		kfree_skb(skb);
+		return false;
+	}
+	seq = be32_to_cpu(tcp_hdr(skb)->seq);
+	success &= ASSERT_INT(VERDICT_CONTINUE,
+			tcp_closed_state(&pkt, &tuple4, &session), "V4 SYN");
+	success &= ASSERT_BOOL(true, session != NULL, "V4 SYN's session");
+	if (session)
+		session_return(session);
+	success &= assert_session_count(1, L4PROTO_TCP);
+	kfree_skb(skb);
+
+	/* V6 SYN-ACKs */
+	success &= send_syn_ack6(seq + 2, VERDICT_DROP);
+	success &= assert_session_count(1, L4PROTO_TCP);
+	success &= send_syn_ack6(seq + 1, VERDICT_CONTINUE);
+	success &= assert_session_count(2, L4PROTO_TCP);
+	success &= assert_session_exists("1::2", 1212, "3::506:708", 5678,
+			"192.0.2.128", tuple4.dst.addr4.l4, "5.6.7.8", 5678,
+			L4PROTO_TCP, ESTABLISHED);
+
+	return success;
+}
+
 /**
  * We'll just chain a handful of packets, since testing every combination would take forever and
  * the inner functions are tested in session db anyway.
@@ -467,7 +657,7 @@ static bool test_tcp(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, tcp(&pkt, &tuple6), "Closed-result");
+	success &= ASSERT_INT(VERDICT_CONTINUE, tcp(&pkt, &tuple6, NULL), "Closed-result");
 	success &= assert_bib_count(1, L4PROTO_TCP);
 	success &= assert_bib_exists("1::2", 1212, "192.0.2.128", 1024, L4PROTO_TCP, 1);
 	success &= assert_session_count(1, L4PROTO_TCP);
@@ -486,7 +676,7 @@ static bool test_tcp(void)
 	if (pkt_init_ipv4(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, tcp(&pkt, &tuple4), "V6 init-result");
+	success &= ASSERT_INT(VERDICT_CONTINUE, tcp(&pkt, &tuple4, NULL), "V6 init-result");
 	success &= assert_bib_count(1, L4PROTO_TCP);
 	success &= assert_bib_exists("1::2", 1212, "192.0.2.128", 1024, L4PROTO_TCP, 1);
 	success &= assert_session_count(1, L4PROTO_TCP);
@@ -502,7 +692,7 @@ static bool test_tcp(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, tcp(&pkt, &tuple6), "Established-result");
+	success &= ASSERT_INT(VERDICT_CONTINUE, tcp(&pkt, &tuple6, NULL), "Established-result");
 	success &= assert_bib_count(1, L4PROTO_TCP);
 	success &= assert_bib_exists("1::2", 1212, "192.0.2.128", 1024, L4PROTO_TCP, 1);
 	success &= assert_session_count(1, L4PROTO_TCP);
@@ -518,7 +708,7 @@ static bool test_tcp(void)
 	if (pkt_init_ipv6(&pkt, skb))
 		return false;
 
-	success &= ASSERT_INT(VERDICT_CONTINUE, tcp(&pkt, &tuple6), "Trans-result");
+	success &= ASSERT_INT(VERDICT_CONTINUE, tcp(&pkt, &tuple6, NULL), "Trans-result");
 	success &= assert_bib_count(1, L4PROTO_TCP);
 	success &= assert_bib_exists("1::2", 1212, "192.0.2.128", 1024, L4PROTO_TCP, 1);
 	success &= assert_session_count(1, L4PROTO_TCP);
@@ -531,6 +721,354 @@ static bool test_tcp(void)
 	return success;
 }
 
+static bool set_limits(__u32 max_sessions_per_subscriber, bool evict)
+{
+	struct global_config *config;
+
+	config = config_clone_for_update();
+	if (!config)
+		return false;
+
+	config->nat64.limits.max_sessions_per_subscriber =
+			max_sessions_per_subscriber;
+	config->nat64.limits.subscriber_prefix_len = 64;
+	config->nat64.limits.evict = evict;
+
+	config_replace(config);
+	return true;
+}
+
+static bool send_udp6(char *saddr, u16 sport, u16 dport, verdict expected)
+{
+	struct packet pkt;
+	struct sk_buff *skb;
+	struct tuple tuple;
+	bool success;
+
+	if (init_tuple6(&tuple, saddr, sport, "3::4", dport, L4PROTO_UDP))
+		return false;
+	if (create_skb6_udp(&tuple, &skb, 16, 32))
+		return false;
+	if (pkt_init_ipv6(&pkt, skb)) {
+		kfree_skb(skb);
+		return false;
+	}
+
+	success = ASSERT_INT(expected, ipv6_simple(&pkt, &tuple, NULL),
+			"%pI6c#%u -> #%u", &tuple.src.addr6.l3, sport, dport);
+
+	kfree_skb(skb);
+	return success;
+}
+
+#define STRESS_THREADS 16
+#define STRESS_ROUNDS 256
+
+struct stress_worker {
+	/** Released when every worker has been created. */
+	struct completion *start;
+	struct completion done;
+	unsigned int drops;
+};
+
+static int stress_work(void *void_worker)
+{
+	struct stress_worker *worker = void_worker;
+	struct packet pkt;
+	struct sk_buff *skb;
+	struct tuple tuple;
+	unsigned int i;
+
+	wait_for_completion(worker->start);
+
+	/* Every worker sends the same flows in the same order. */
+	for (i = 0; i < STRESS_ROUNDS; i++) {
+		if (init_tuple6(&tuple, "1::2", 2000 + i, "3::4", 80,
+				L4PROTO_UDP)
+				|| create_skb6_udp(&tuple, &skb, 16, 32)) {
+			worker->drops++;
+			continue;
+		}
+		if (pkt_init_ipv6(&pkt, skb)) {
+			kfree_skb(skb);
+			worker->drops++;
+			continue;
+		}
+
+		if (ipv6_simple(&pkt, &tuple, NULL) != VERDICT_CONTINUE)
+			worker->drops++;
+		kfree_skb(skb);
+	}
+
+	complete(&worker->done);
+	return 0;
+}
+
+/**
+ * Several CPUs translate the first packet of the same flow at the same time.
+ * All of them should get the same BIB entry and session; nobody should drop.
+ */
+static bool test_concurrent_creation(void)
+{
+	struct stress_worker *workers;
+	struct task_struct *task;
+	DECLARE_COMPLETION_ONSTACK(start);
+	unsigned int created;
+	unsigned int drops = 0;
+	__u64 subscribers, sessions, bibs, sub_drops, evictions;
+	int cpu = -1;
+	bool success = true;
+
+	workers = kcalloc(STRESS_THREADS, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return false;
+
+	for (created = 0; created < STRESS_THREADS; created++) {
+		workers[created].start = &start;
+		init_completion(&workers[created].done);
+		task = kthread_create(stress_work, &workers[created],
+				"jool_filtering_stress");
+		if (IS_ERR(task)) {
+			log_err("kthread_create() threw errcode %ld.",
+					PTR_ERR(task));
+			success = false;
+			break;
+		}
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+	}
+
+	complete_all(&start);
+	while (created > 0) {
+		created--;
+		wait_for_completion(&workers[created].done);
+		drops += workers[created].drops;
+	}
+	kfree(workers);
+
+	success &= ASSERT_UINT(0, drops, "drops");
+	success &= assert_bib_count(STRESS_ROUNDS, L4PROTO_UDP);
+	success &= assert_session_count(STRESS_ROUNDS, L4PROTO_UDP);
+
+	/* The losers' entries were not left charged to the subscriber. */
+	subscriber_stats(&subscribers, &sessions, &bibs, &sub_drops,
+			&evictions);
+	success &= ASSERT_U64(STRESS_ROUNDS, bibs, "charged BIB entries");
+	success &= ASSERT_U64(STRESS_ROUNDS, sessions, "charged sessions");
+
+	return success;
+}
+
+static bool assert_subscriber_stats(__u64 subscribers, __u64 sessions,
+		__u64 drops, __u64 evictions)
+{
+	__u64 actual_subscribers, actual_sessions, bibs;
+	__u64 actual_drops, actual_evictions;
+	bool success = true;
+
+	subscriber_stats(&actual_subscribers, &actual_sessions, &bibs,
+			&actual_drops, &actual_evictions);
+	success &= ASSERT_U64(subscribers, actual_subscribers, "subscribers");
+	success &= ASSERT_U64(sessions, actual_sessions, "charged sessions");
+	success &= ASSERT_U64(drops, actual_drops, "drops");
+	success &= ASSERT_U64(evictions, actual_evictions, "evictions");
+
+	return success;
+}
+
+static bool test_admission(void)
+{
+	bool success = true;
+
+	if (!set_limits(2, false))
+		return false;
+
+	/* 1::2 and 1::3 are the same /64 subscriber; 2::2 is a different one. */
+	success &= send_udp6("1::2", 1212, 1000, VERDICT_CONTINUE);
+	success &= send_udp6("1::3", 1212, 1000, VERDICT_CONTINUE);
+	success &= send_udp6("1::2", 1212, 1001, VERDICT_DROP);
+	success &= send_udp6("2::2", 1212, 1000, VERDICT_CONTINUE);
+	success &= assert_session_count(3, L4PROTO_UDP);
+	success &= assert_subscriber_stats(2, 3, 1, 0);
+
+	/* Existing sessions are not affected by the limit. */
+	success &= send_udp6("1::2", 1212, 1000, VERDICT_CONTINUE);
+	success &= assert_subscriber_stats(2, 3, 1, 0);
+
+	if (!set_limits(2, true))
+		return false;
+
+	success &= send_udp6("1::2", 1212, 1001, VERDICT_CONTINUE);
+	success &= assert_session_count(3, L4PROTO_UDP);
+	success &= assert_subscriber_stats(2, 3, 1, 1);
+
+	return success;
+}
+
+static bool set_port_block_size(unsigned int size)
+{
+	struct global_config *config;
+
+	config = config_clone_for_update();
+	if (!config)
+		return false;
+
+	config->nat64.port_block_size = size;
+
+	config_replace(config);
+	return true;
+}
+
+static bool get_port4(char *addr6, u16 port6, unsigned int *result)
+{
+	struct ipv6_transport_addr addr;
+	struct bib_entry *bib;
+
+	if (str_to_addr6(addr6, &addr.l3))
+		return false;
+	addr.l4 = port6;
+
+	if (!ASSERT_INT(0, bibdb_get6(&addr, L4PROTO_UDP, &bib), "BIB exists"))
+		return false;
+	*result = bib->ipv4.l4;
+	bibdb_return(bib);
+
+	return true;
+}
+
+static bool test_port_blocks(void)
+{
+	unsigned int ports[4];
+	bool success = true;
+
+	if (!set_port_block_size(2))
+		return false;
+
+	/* 1::2 and 1::3 are the same /64 subscriber; 2::2 is a different one. */
+	success &= send_udp6("1::2", 1000, 80, VERDICT_CONTINUE);
+	success &= send_udp6("1::3", 1000, 80, VERDICT_CONTINUE);
+	success &= send_udp6("2::2", 1000, 80, VERDICT_CONTINUE);
+	success &= send_udp6("1::2", 1001, 80, VERDICT_CONTINUE);
+	if (!success)
+		return false;
+
+	success &= get_port4("1::2", 1000, &ports[0]);
+	success &= get_port4("1::3", 1000, &ports[1]);
+	success &= get_port4("2::2", 1000, &ports[2]);
+	success &= get_port4("1::2", 1001, &ports[3]);
+	if (!success)
+		return false;
+
+	success &= ASSERT_UINT(ports[0] / 2, ports[1] / 2, "Shared block");
+	success &= ASSERT_BOOL(true, ports[0] / 2 != ports[2] / 2,
+			"Other subscriber's block");
+	success &= ASSERT_BOOL(true, ports[3] / 2 != ports[0] / 2,
+			"Full block -> new block");
+	success &= ASSERT_BOOL(true, ports[3] / 2 != ports[2] / 2,
+			"New block is not the other subscriber's");
+
+	return success;
+}
+
+static bool assert_detmap_response(struct response_deterministic *response,
+		char *prefix6, unsigned int first_port)
+{
+	struct ipv6_prefix expected;
+	bool success = true;
+
+	if (str_to_addr6(prefix6, &expected.address))
+		return false;
+	expected.len = 128;
+
+	success &= ASSERT_BOOL(true, prefix6_equals(&expected,
+			&response->prefix6), "subscriber");
+	success &= ASSERT_UINT(first_port, response->first.l4, "first port");
+	success &= ASSERT_UINT(255, response->count, "slice length");
+	return success;
+}
+
+static bool test_deterministic(void)
+{
+	struct deterministic_entry entry;
+	struct response_deterministic response;
+	struct ipv4_transport_addr addr4;
+	struct in6_addr addr6;
+	struct bib_entry *bib;
+	unsigned int ports[3];
+	bool success = true;
+
+	/*
+	 * pool4 is 192.0.2.128#1-65535 (UDP), and there are 256 subscribers,
+	 * so each one owns 255 ports. 1::5 is subscriber number 5, so it owns
+	 * 1276-1530.
+	 */
+	entry.mark = 0;
+	if (str_to_addr6("1::", &entry.prefix6.address))
+		return false;
+	entry.prefix6.len = 120;
+	entry.subscriber_len = 128;
+	if (!ASSERT_INT(0, detmap_add(&entry), "add"))
+		return false;
+	success &= ASSERT_INT(-EEXIST, detmap_add(&entry), "add twice");
+
+	success &= send_udp6("1::5", 1000, 80, VERDICT_CONTINUE);
+	success &= send_udp6("1::5", 1001, 80, VERDICT_CONTINUE);
+	success &= send_udp6("2::5", 1000, 80, VERDICT_CONTINUE);
+	if (!success)
+		return false;
+
+	success &= get_port4("1::5", 1000, &ports[0]);
+	success &= get_port4("1::5", 1001, &ports[1]);
+	success &= get_port4("2::5", 1000, &ports[2]);
+	if (!success)
+		return false;
+
+	success &= ASSERT_BOOL(true, 1276 <= ports[0] && ports[0] <= 1530,
+			"first port within the slice");
+	success &= ASSERT_BOOL(true, 1276 <= ports[1] && ports[1] <= 1530,
+			"second port within the slice");
+	success &= ASSERT_BOOL(true, ports[0] != ports[1], "different ports");
+
+	/*
+	 * 2::5 is outside the mapping, so it only gets leftovers.
+	 * (1 + 255 * 256 = 65281; 65281-65535 are leftovers.)
+	 */
+	success &= ASSERT_BOOL(true, 65281 <= ports[2],
+			"outsider's port within the leftovers");
+	addr4.l3.s_addr = cpu_to_be32(0xc0000280);
+	addr4.l4 = ports[2];
+	if (!ASSERT_INT(0, bibdb_get4(&addr4, L4PROTO_UDP, &bib), "2::5's BIB"))
+		return false;
+	success &= ASSERT_BOOL(false, bib->is_deterministic, "2::5 regular");
+	bibdb_return(bib);
+
+	/* 6-to-4 */
+	if (str_to_addr6("1::5", &addr6))
+		return false;
+	success &= ASSERT_INT(0, detmap_test6(0, L4PROTO_UDP, &addr6,
+			&response), "test6 result");
+	success &= assert_detmap_response(&response, "1::5", 1276);
+
+	/* 4-to-6 */
+	addr4.l4 = 1300;
+	success &= ASSERT_INT(0, detmap_test4(0, L4PROTO_UDP, &addr4,
+			&response), "test4 result");
+	success &= assert_detmap_response(&response, "1::5", 1276);
+
+	addr4.l4 = 65281;
+	success &= ASSERT_INT(-ESRCH, detmap_test4(0, L4PROTO_UDP, &addr4,
+			&response), "leftover");
+
+	success &= ASSERT_INT(0, detmap_rm(0), "rm");
+	success &= ASSERT_INT(-ESRCH, detmap_rm(0), "rm twice");
+
+	return success;
+}
+
 static bool init(void)
 {
 	char *prefixes6[] = { "3::/96" };
@@ -542,7 +1080,7 @@ static bool init(void)
 		goto pool6_fail;
 	if (pool4db_init(16, prefixes4, 1))
 		goto pool4_fail;
-	if (filtering_init())
+	if (filtering_init(0))
 		goto filtering_fail;
 
 	return true;
@@ -560,6 +1098,7 @@ config_fail:
 static void end(void)
 {
 	icmp64_pop();
+	detmap_destroy();
 	filtering_destroy();
 	pool4db_destroy();
 	pool6_destroy();
@@ -572,6 +1111,7 @@ static int filtering_test_init(void)
 
 	/* General */
 	INIT_CALL_END(init(), test_filtering_and_updating(), end(), "core function");
+	INIT_CALL_END(init(), test_session_out(), end(), "session hand-over");
 
 	/* UDP */
 	INIT_CALL_END(init(), test_udp(), end(), "UDP");
@@ -583,6 +1123,15 @@ static int filtering_test_init(void)
 	INIT_CALL_END(init(), test_tcp_closed_state_handle_6(), end(), "TCP-CLOSED-6");
 	INIT_CALL_END(init(), test_tcp_closed_state_handle_4(), end(), "TCP-CLOSED-4");
 	INIT_CALL_END(init(), test_tcp(), end(), "test_tcp");
+	INIT_CALL_END(init(), test_syn_cookies(), end(), "SYN cookies");
+
+	/* Concurrency */
+	INIT_CALL_END(init(), test_concurrent_creation(), end(), "concurrent creation");
+
+	/* Admission control */
+	INIT_CALL_END(init(), test_admission(), end(), "admission");
+	INIT_CALL_END(init(), test_port_blocks(), end(), "port blocks");
+	INIT_CALL_END(init(), test_deterministic(), end(), "deterministic");
 
 	END_TESTS;
 }
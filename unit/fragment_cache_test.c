@@ -0,0 +1,454 @@
+#include <linux/module.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/unit/skb_generator.h"
+#include "nat64/unit/config.h"
+#include "nat64/unit/types.h"
+
+#include "fragment_cache.c"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("Fragment cache test");
+
+
+static struct tuple tuple6;
+static struct tuple tuple4;
+
+static bool init_pkt(struct packet *pkt, struct sk_buff *skb)
+{
+	int error;
+
+	error = pkt_init_ipv6(pkt, skb);
+	if (error)
+		log_debug("pkt_init_ipv6() returned errcode %d.", error);
+
+	return !error;
+}
+
+static struct sk_buff *create_frag(u16 frag_offset, bool mf)
+{
+	struct sk_buff *skb;
+	int error;
+
+	if (frag_offset == 0) {
+		error = create_skb6_udp_frag(&tuple6, &skb,
+				64 - sizeof(struct udphdr), 1024, false, mf, 0,
+				32);
+	} else {
+		error = create_skb6_udp_frag(&tuple6, &skb, 64, 1024, false, mf,
+				frag_offset, 32);
+	}
+
+	return error ? NULL : skb;
+}
+
+static bool assert_type(enum fragcache_type expected, struct sk_buff *skb)
+{
+	struct packet pkt;
+
+	if (!init_pkt(&pkt, skb))
+		return false;
+	return ASSERT_INT(expected, fragcache_type(&pkt), "fragment type");
+}
+
+static bool assert_get(verdict expected, struct sk_buff *skb)
+{
+	struct packet pkt;
+	struct tuple result;
+	bool success = true;
+
+	if (!init_pkt(&pkt, skb))
+		return false;
+
+	success &= ASSERT_INT(expected, fragcache_get(&pkt, &result),
+			"get verdict");
+	if (expected == VERDICT_CONTINUE)
+		success &= ASSERT_TUPLE(&tuple4, &result, "cached tuple");
+
+	return success;
+}
+
+static unsigned int count_skbs(struct sk_buff *skb)
+{
+	unsigned int result = 0;
+
+	for (; skb; skb = skb->next)
+		result++;
+
+	return result;
+}
+
+static bool validate_cache(unsigned int entries, unsigned int pending)
+{
+	struct fragcache_entry *entry;
+	unsigned int i;
+	unsigned int e = 0;
+	unsigned int p = 0;
+	unsigned int c = 0;
+	long bytes = 0;
+	bool success = true;
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		list_for_each_entry(entry, &shards[i].expire_list, expire_hook) {
+			e++;
+			p += entry->pending_count;
+			bytes += entry->truesize;
+		}
+		c += shards[i].count;
+	}
+
+	success &= ASSERT_UINT(entries, e, "entries");
+	success &= ASSERT_UINT(entries, c, "shard counts");
+	success &= ASSERT_UINT(pending, p, "pending fragments");
+	success &= ASSERT_INT(bytes, atomic_long_read(&mem), "memory");
+	return success;
+}
+
+/**
+ * Returns the cache entry of the packet @pkt is a fragment of, or NULL.
+ */
+static struct fragcache_entry *get_entry(struct packet *pkt)
+{
+	struct fragcache_key key;
+	struct fragcache_shard *shard;
+	struct fragcache_entry *entry;
+	u32 hash;
+
+	init_key(pkt, &key);
+	hash = hash_key(&key);
+	shard = get_shard(hash);
+
+	spin_lock_bh(&shard->lock);
+	entry = find_entry(shard, &key, hash);
+	spin_unlock_bh(&shard->lock);
+
+	return entry;
+}
+
+static bool test_type(void)
+{
+	struct sk_buff *skb;
+	bool success = true;
+
+	if (create_skb6_udp(&tuple6, &skb, 10, 32))
+		return false;
+	success &= assert_type(FRAGCACHE_NONE, skb);
+	kfree_skb(skb);
+
+	skb = create_frag(0, true);
+	if (!skb)
+		return false;
+	success &= assert_type(FRAGCACHE_FIRST, skb);
+	kfree_skb(skb);
+
+	skb = create_frag(64, true);
+	if (!skb)
+		return false;
+	success &= assert_type(FRAGCACHE_SUBSEQUENT, skb);
+	kfree_skb(skb);
+
+	if (create_skb6_icmp_info_frag(&tuple6, &skb, 64, 256, false, true, 0,
+			32))
+		return false;
+	success &= assert_type(FRAGCACHE_UNSUPPORTED, skb);
+	kfree_skb(skb);
+
+	return success;
+}
+
+/**
+ * The fragments arrive in order; none of them has to wait.
+ */
+static bool test_in_order(void)
+{
+	struct sk_buff *first, *skb;
+	struct packet pkt;
+	bool success = true;
+
+	first = create_frag(0, true);
+	if (!first)
+		return false;
+	if (!init_pkt(&pkt, first)) {
+		kfree_skb(first);
+		return false;
+	}
+	success &= ASSERT_PTR(NULL, fragcache_add(&pkt, &tuple4), "pending");
+	success &= validate_cache(1, 0);
+	kfree_skb(first);
+
+	skb = create_frag(64, true);
+	if (!skb)
+		return false;
+	success &= assert_get(VERDICT_CONTINUE, skb);
+	kfree_skb(skb);
+
+	skb = create_frag(128, false);
+	if (!skb)
+		return false;
+	success &= assert_get(VERDICT_CONTINUE, skb);
+	kfree_skb(skb);
+
+	success &= validate_cache(1, 0);
+	return success;
+}
+
+/**
+ * Two subsequent fragments arrive before the first one.
+ */
+static bool test_out_of_order(void)
+{
+	struct sk_buff *skb1, *skb2, *first, *pending;
+	struct packet pkt;
+	bool success = true;
+
+	skb2 = create_frag(128, false);
+	if (!skb2)
+		return false;
+	success &= assert_get(VERDICT_STOLEN, skb2);
+	success &= validate_cache(1, 1);
+
+	skb1 = create_frag(64, true);
+	if (!skb1)
+		return false;
+	success &= assert_get(VERDICT_STOLEN, skb1);
+	success &= validate_cache(1, 2);
+
+	first = create_frag(0, true);
+	if (!first)
+		return false;
+	if (!init_pkt(&pkt, first)) {
+		kfree_skb(first);
+		return false;
+	}
+	pending = fragcache_add(&pkt, &tuple4);
+	success &= ASSERT_UINT(2, count_skbs(pending), "pending count");
+	success &= validate_cache(1, 0);
+
+	drop_pending(pending);
+	kfree_skb(first);
+	return success;
+}
+
+/**
+ * The first fragment was dropped, so the rest should be too.
+ */
+static bool test_rejected(void)
+{
+	struct sk_buff *skb, *first;
+	struct packet pkt;
+	bool success = true;
+
+	skb = create_frag(64, true);
+	if (!skb)
+		return false;
+	success &= assert_get(VERDICT_STOLEN, skb);
+	success &= validate_cache(1, 1);
+
+	first = create_frag(0, true);
+	if (!first)
+		return false;
+	if (!init_pkt(&pkt, first)) {
+		kfree_skb(first);
+		return false;
+	}
+	fragcache_reject(&pkt, VERDICT_DROP);
+	kfree_skb(first);
+	success &= validate_cache(1, 0);
+
+	skb = create_frag(128, false);
+	if (!skb)
+		return false;
+	success &= assert_get(VERDICT_DROP, skb);
+	kfree_skb(skb);
+
+	return success;
+}
+
+static bool test_limit(void)
+{
+	struct sk_buff *skb;
+	unsigned int i;
+	bool success = true;
+
+	for (i = 0; i < FRAGCACHE_MAX_PENDING; i++) {
+		skb = create_frag(64 + 64 * i, true);
+		if (!skb)
+			return false;
+		success &= assert_get(VERDICT_STOLEN, skb);
+	}
+	success &= validate_cache(1, FRAGCACHE_MAX_PENDING);
+
+	skb = create_frag(64 + 64 * i, false);
+	if (!skb)
+		return false;
+	success &= assert_get(VERDICT_DROP, skb);
+	kfree_skb(skb);
+
+	success &= validate_cache(1, FRAGCACHE_MAX_PENDING);
+	return success;
+}
+
+/**
+ * The first fragment needs full reassembly; the subsequent fragments that were
+ * waiting for it are handed back to the kernel, and the cache remembers to
+ * reassemble the rest.
+ */
+static bool test_reassemble_flag(void)
+{
+	struct sk_buff *skb, *first;
+	struct fragcache_entry *entry;
+	struct packet pkt;
+	bool success = true;
+
+	skb = create_frag(64, true);
+	if (!skb)
+		return false;
+	success &= assert_get(VERDICT_STOLEN, skb);
+
+	first = create_frag(0, true);
+	if (!first)
+		return false;
+	if (!init_pkt(&pkt, first)) {
+		kfree_skb(first);
+		return false;
+	}
+	/* Same as fragcache_reassemble(), minus the kernel. */
+	skb = resolve(&pkt, VERDICT_DROP, NULL, true);
+	success &= ASSERT_UINT(1, count_skbs(skb), "pending count");
+	drop_pending(skb);
+	success &= validate_cache(1, 0);
+
+	entry = get_entry(&pkt);
+	success &= ASSERT_BOOL(true, entry && entry->resolved, "resolved");
+	success &= ASSERT_BOOL(true, entry && entry->reassemble, "reassemble");
+
+	kfree_skb(first);
+	return success;
+}
+
+/**
+ * Stores a subsequent fragment of packet @id; the first one never arrives.
+ */
+static bool store_orphan(__u32 id)
+{
+	struct sk_buff *skb;
+	struct packet pkt;
+	struct tuple result;
+
+	skb = create_frag(64, true);
+	if (!skb)
+		return false;
+	if (!init_pkt(&pkt, skb)) {
+		kfree_skb(skb);
+		return false;
+	}
+	pkt_frag_hdr(&pkt)->identification = cpu_to_be32(id);
+
+	return ASSERT_INT(VERDICT_STOLEN, fragcache_get(&pkt, &result),
+			"orphan stored");
+}
+
+static bool is_cached(__u32 id)
+{
+	struct fragcache_entry *entry;
+	struct sk_buff *skb;
+	struct packet pkt;
+
+	skb = create_frag(64, true);
+	if (!skb)
+		return false;
+	if (!init_pkt(&pkt, skb)) {
+		kfree_skb(skb);
+		return false;
+	}
+	pkt_frag_hdr(&pkt)->identification = cpu_to_be32(id);
+
+	entry = get_entry(&pkt);
+	kfree_skb(skb);
+	return entry != NULL;
+}
+
+/**
+ * Packets whose first fragments never arrive are forgotten, oldest first, once
+ * the cache exceeds --fragment-high-thresh.
+ */
+static bool test_eviction(void)
+{
+	struct global_config *config;
+	long cost;
+	bool success = true;
+
+	if (!store_orphan(0))
+		return false;
+	/* Every orphan is the same size. */
+	cost = atomic_long_read(&mem);
+
+	config = config_clone_for_update();
+	if (!config)
+		return false;
+	config->nat64.frag_high_thresh = 3 * cost;
+	config->nat64.frag_low_thresh = cost;
+	config_replace(config);
+
+	success &= store_orphan(1);
+	success &= store_orphan(2);
+	success &= store_orphan(3);
+	success &= validate_cache(4, 4);
+
+	/* The cache is over the limit, so this evicts 0, 1 and 2. */
+	success &= store_orphan(4);
+	success &= validate_cache(2, 2);
+	success &= ASSERT_BOOL(false, is_cached(0), "0 evicted");
+	success &= ASSERT_BOOL(false, is_cached(2), "2 evicted");
+	success &= ASSERT_BOOL(true, is_cached(3), "3 survived");
+	success &= ASSERT_BOOL(true, is_cached(4), "4 stored");
+
+	return success;
+}
+
+static bool init(void)
+{
+	if (init_tuple6(&tuple6, "1::2", 1212, "64::3.4.5.6", 3434,
+			L4PROTO_UDP))
+		return false;
+	if (init_tuple4(&tuple4, "192.0.2.1", 1000, "3.4.5.6", 3434,
+			L4PROTO_UDP))
+		return false;
+
+	if (config_init(false))
+		return false;
+	if (fragcache_init(true)) {
+		config_destroy();
+		return false;
+	}
+
+	return true;
+}
+
+static void end(void)
+{
+	fragcache_destroy();
+	config_destroy();
+}
+
+int init_module(void)
+{
+	START_TESTS("Fragment cache");
+
+	INIT_CALL_END(init(), test_type(), end(), "Fragment types");
+	INIT_CALL_END(init(), test_in_order(), end(), "In order");
+	INIT_CALL_END(init(), test_out_of_order(), end(), "Out of order");
+	INIT_CALL_END(init(), test_rejected(), end(), "Rejected first fragment");
+	INIT_CALL_END(init(), test_limit(), end(), "Pending limit");
+	INIT_CALL_END(init(), test_reassemble_flag(), end(), "Reassembly fallback");
+	INIT_CALL_END(init(), test_eviction(), end(), "Eviction");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -1,13 +1,17 @@
 #include <linux/module.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #include "nat64/mod/common/ipv6_hdr_iterator.h"
+#include "nat64/unit/config.h"
 #include "nat64/unit/unit_test.h"
 #include "nat64/unit/skb_generator.h"
 #include "nat64/unit/validator.h"
 #include "nat64/unit/types.h"
 
-#define GENERATE_FOR_EACH true
 #include "fragment_db.c"
 
 
@@ -16,6 +20,10 @@ MODULE_AUTHOR("Roberto Aceves");
 MODULE_AUTHOR("Alberto Leiva");
 MODULE_DESCRIPTION("Fragment database test");
 
+static bool benchmark;
+module_param(benchmark, bool, 0);
+MODULE_PARM_DESC(benchmark, "Also measure fragments/sec with several threads feeding the database at once.");
+
 
 static struct frag_hdr *get_frag_hdr(struct sk_buff *skb)
 {
@@ -92,29 +100,31 @@ static bool validate_fragment(struct sk_buff *skb, bool has_frag_hdr,
 	return success;
 }
 
-static int fragdb_counter(struct reassembly_buffer *buffer, void *arg)
-{
-	unsigned int *int_arg = arg;
-	(*int_arg)++;
-	return 0;
-}
-
 static bool validate_database(int expected_count)
 {
+	struct fragdb_shard *shard;
 	struct list_head *node;
-	int p = 0;
+	struct hlist_node *hnode;
+	unsigned int i, j;
+	int l = 0;
+	int t = 0;
+	int c = 0;
 	bool success = true;
 
-	/* list */
-	list_for_each(node, &expire_list) {
-		p++;
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		shard = &shards[i];
+
+		list_for_each(node, &shard->expire_list)
+			l++;
+		for (j = 0; j < (1U << shard->bucket_bits); j++)
+			hlist_for_each(hnode, &shard->buckets[j])
+				t++;
+		c += shard->count;
 	}
-	success &= ASSERT_INT(expected_count, p, "Packets in the list");
 
-	/* table */
-	p = 0;
-	fragdb_table_for_each(&table, fragdb_counter, &p);
-	success &= ASSERT_INT(expected_count, p, "Packets in the hash table");
+	success &= ASSERT_INT(expected_count, l, "Packets in the lists");
+	success &= ASSERT_INT(expected_count, t, "Packets in the hash tables");
+	success &= ASSERT_INT(expected_count, c, "Shard counters");
 
 	return success;
 }
@@ -208,33 +218,44 @@ struct frag_summary {
 	l4_protocol l4_proto;
 };
 
-static bool validate_list(struct frag_summary *expected, int expected_count)
+static struct reassembly_buffer *find_summary(struct frag_summary *summary)
 {
 	struct reassembly_buffer *buffer;
-	struct packet *pkt;
 	struct ipv6hdr *hdr6;
-	bool success = true;
-	int c = 0;
-
-	list_for_each_entry(buffer, &expire_list, list_hook) {
-		if (!ASSERT_BOOL(true, c < expected_count, "List count (%u %u)",
-				c, expected_count))
-			return false;
-
-		pkt = &buffer->pkt;
-
-		success &= ASSERT_UINT(L4PROTO_UDP, pkt_l4_proto(pkt), "proto");
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		list_for_each_entry(buffer, &shards[i].expire_list, list_hook) {
+			hdr6 = pkt_ip6_hdr(&buffer->pkt);
+			if (addr6_equals(&summary->src_addr, &hdr6->saddr)
+					&& addr6_equals(&summary->dst_addr, &hdr6->daddr)
+					&& be32_to_cpu(get_frag_hdr(buffer->pkt.skb)->identification)
+							== summary->identification)
+				return buffer;
+		}
+	}
 
-		hdr6 = pkt_ip6_hdr(pkt);
-		success &= __ASSERT_ADDR6(&expected[c].src_addr, &hdr6->saddr,
-				"src addr6");
-		success &= __ASSERT_ADDR6(&expected[c].dst_addr, &hdr6->daddr,
-				"dst addr6");
-		success &= ASSERT_BE32(expected[c].identification,
-				get_frag_hdr(pkt->skb)->identification,
-				"frag id 6");
+	return NULL;
+}
 
-		c++;
+/**
+ * The shards don't share an expiration list, so the order of the buffers is
+ * not validated; only their presence.
+ */
+static bool validate_list(struct frag_summary *expected, int expected_count)
+{
+	struct reassembly_buffer *buffer;
+	bool success = true;
+	int c;
+
+	for (c = 0; c < expected_count; c++) {
+		buffer = find_summary(&expected[c]);
+		if (!ASSERT_BOOL(true, buffer != NULL, "Buffer %d exists", c)) {
+			success = false;
+			continue;
+		}
+		success &= ASSERT_UINT(L4PROTO_UDP, pkt_l4_proto(&buffer->pkt),
+				"proto");
 	}
 
 	return success;
@@ -309,9 +330,13 @@ static bool test_timer(void)
 	success &= validate_list(&expected_keys[0], 2);
 
 	/* After 2 seconds, packet 1 should die. */
-	dummy_buffer = container_of(expire_list.next, struct reassembly_buffer, list_hook);
+	dummy_buffer = find_summary(&expected_keys[0]);
+	if (!ASSERT_BOOL(true, dummy_buffer != NULL, "Packet 1 is stored"))
+		return false;
 	dummy_buffer->dying_time = jiffies - 1;
-	dummy_buffer = container_of(dummy_buffer->list_hook.next, struct reassembly_buffer, list_hook);
+	dummy_buffer = find_summary(&expected_keys[1]);
+	if (!ASSERT_BOOL(true, dummy_buffer != NULL, "Packet 2 is stored"))
+		return false;
 	dummy_buffer->dying_time = jiffies + msecs_to_jiffies(4000);
 
 	clean_expired_buffers();
@@ -327,6 +352,342 @@ static bool test_timer(void)
 	return success;
 }
 
+/**
+ * Creates the first fragment (if @first) or the last fragment of packet
+ * number @index. Every packet gets its own source address.
+ */
+static struct sk_buff *create_indexed_frag(unsigned int index, bool first)
+{
+	struct tuple tuple6;
+	struct sk_buff *skb;
+	int error;
+
+	if (init_tuple6(&tuple6, "2001:db8::", 1212, "64:ff9b::c000:201", 53,
+			L4PROTO_UDP))
+		return NULL;
+	tuple6.src.addr6.l3.s6_addr32[3] = cpu_to_be32(index);
+
+	error = first
+			? create_skb6_udp_frag(&tuple6, &skb, 8, 24, true, true, 0, 32)
+			: create_skb6_udp_frag(&tuple6, &skb, 8, 24, true, false, 16, 32);
+	return error ? NULL : skb;
+}
+
+static unsigned int max_bucket_bits(void)
+{
+	unsigned int i;
+	unsigned int result = 0;
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++)
+		result = max(result, shards[i].bucket_bits);
+
+	return result;
+}
+
+#define RESIZE_PACKETS 2048
+
+/**
+ * Asserts the shards grow as packets pile up, and shrink back once they're
+ * gone.
+ */
+static bool test_resize(void)
+{
+	struct reassembly_buffer *buffer;
+	struct sk_buff *skb;
+	unsigned int i;
+	bool success = true;
+
+	for (i = 0; i < RESIZE_PACKETS; i++) {
+		skb = create_indexed_frag(i, true);
+		if (!skb)
+			return false;
+		success &= assert_fragdb_handle(skb, VERDICT_STOLEN);
+	}
+
+	success &= validate_database(RESIZE_PACKETS);
+	success &= ASSERT_BOOL(true,
+			max_bucket_bits() > FRAGDB_MIN_BUCKET_BITS,
+			"The tables grew");
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++)
+		list_for_each_entry(buffer, &shards[i].expire_list, list_hook)
+			buffer->dying_time = jiffies - 1;
+	clean_expired_buffers();
+
+	success &= validate_database(0);
+	success &= ASSERT_UINT(FRAGDB_MIN_BUCKET_BITS, max_bucket_bits(),
+			"The tables shrank");
+
+	return success;
+}
+
+static bool set_thresholds(unsigned int high, unsigned int low)
+{
+	struct global_config *config;
+
+	config = config_clone_for_update();
+	if (!config)
+		return false;
+
+	config->nat64.frag_high_thresh = high;
+	config->nat64.frag_low_thresh = low;
+
+	config_replace(config);
+	return true;
+}
+
+/**
+ * Returns the buffer of create_indexed_frag()'s packet number @index.
+ */
+static struct reassembly_buffer *find_indexed(unsigned int index)
+{
+	struct reassembly_buffer *buffer;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++) {
+		list_for_each_entry(buffer, &shards[i].expire_list, list_hook) {
+			if (pkt_ip6_hdr(&buffer->pkt)->saddr.s6_addr32[3]
+					== cpu_to_be32(index))
+				return buffer;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Asserts the oldest incomplete packets are dropped once the database holds
+ * too many bytes.
+ */
+static bool test_eviction(void)
+{
+	struct reassembly_buffer *buffer;
+	struct response_fragment before, after;
+	struct sk_buff *skb;
+	unsigned int truesize;
+	unsigned int i;
+	bool success = true;
+
+	fragdb_stats(&before);
+
+	/* Packet 0 is the oldest, packet 2 is the youngest. */
+	for (i = 0; i < 3; i++) {
+		skb = create_indexed_frag(i, true);
+		if (!skb)
+			return false;
+		success &= assert_fragdb_handle(skb, VERDICT_STOLEN);
+		buffer = find_indexed(i);
+		if (!buffer)
+			return false;
+		buffer->dying_time = jiffies + i;
+	}
+	truesize = buffer->truesize;
+	success &= ASSERT_U64(3 * truesize, atomic_long_read(&mem), "mem");
+
+	/* Two packets' worth is the most the database can hold. */
+	if (!set_thresholds(2 * truesize, truesize))
+		return false;
+
+	skb = create_indexed_frag(3, true);
+	if (!skb)
+		return false;
+	success &= assert_fragdb_handle(skb, VERDICT_STOLEN);
+
+	success &= validate_database(2);
+	success &= ASSERT_PTR(NULL, find_indexed(0), "packet 0 was evicted");
+	success &= ASSERT_PTR(NULL, find_indexed(1), "packet 1 was evicted");
+	success &= ASSERT_BOOL(true, !!find_indexed(2), "packet 2 survived");
+	success &= ASSERT_BOOL(true, !!find_indexed(3), "packet 3 was added");
+
+	fragdb_stats(&after);
+	success &= ASSERT_U64(2, after.buffers, "buffers stat");
+	success &= ASSERT_U64(2 * truesize, after.mem, "mem stat");
+	success &= ASSERT_U64(before.evictions + 2, after.evictions,
+			"evictions stat");
+
+	/* Clean up. */
+	for (i = 0; i < ARRAY_SIZE(shards); i++)
+		list_for_each_entry(buffer, &shards[i].expire_list, list_hook)
+			buffer->dying_time = jiffies - 1;
+	clean_expired_buffers();
+	success &= validate_database(0);
+	success &= ASSERT_U64(0, atomic_long_read(&mem), "mem after cleanup");
+
+	fragdb_stats(&after);
+	success &= ASSERT_U64(before.timeouts + 2, after.timeouts,
+			"timeouts stat");
+
+	success &= set_thresholds(DEFAULT_FRAG_HIGH_THRESH,
+			DEFAULT_FRAG_LOW_THRESH);
+	return success;
+}
+
+#define BENCH_PACKETS 4096u
+
+struct bench_worker {
+	unsigned int id;
+	/** Released when every worker has been created. */
+	struct completion *start;
+	struct completion done;
+	struct sk_buff *firsts[BENCH_PACKETS];
+	struct sk_buff *lasts[BENCH_PACKETS];
+	s64 nsecs;
+	bool success;
+};
+
+static bool bench_handle(struct sk_buff *skb, verdict expected)
+{
+	struct packet pkt;
+
+	if (pkt_init_ipv6(&pkt, skb))
+		return false;
+	return fragdb_handle(&pkt) == expected;
+}
+
+static int bench_work(void *void_worker)
+{
+	struct bench_worker *worker = void_worker;
+	unsigned int i;
+	ktime_t start;
+
+	wait_for_completion(worker->start);
+
+	/*
+	 * Every packet is two fragments, so the database fills up with
+	 * BENCH_PACKETS buffers per worker and then drains.
+	 */
+	start = ktime_get();
+	for (i = 0; i < BENCH_PACKETS; i++)
+		worker->success &= bench_handle(worker->firsts[i], VERDICT_STOLEN);
+	for (i = 0; i < BENCH_PACKETS; i++)
+		worker->success &= bench_handle(worker->lasts[i], VERDICT_CONTINUE);
+	worker->nsecs = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	complete(&worker->done);
+	return 0;
+}
+
+static void bench_free(struct bench_worker *worker)
+{
+	unsigned int i;
+
+	/* The lasts now hang from the firsts' frag_lists. */
+	for (i = 0; i < BENCH_PACKETS; i++)
+		kfree_skb(worker->firsts[i]);
+}
+
+static bool bench_init(struct bench_worker *worker, unsigned int id,
+		struct completion *start)
+{
+	unsigned int i;
+
+	worker->id = id;
+	worker->start = start;
+	init_completion(&worker->done);
+	worker->success = true;
+
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		worker->firsts[i] = create_indexed_frag(id * BENCH_PACKETS + i, true);
+		worker->lasts[i] = create_indexed_frag(id * BENCH_PACKETS + i, false);
+		if (!worker->firsts[i] || !worker->lasts[i]) {
+			kfree_skb(worker->firsts[i]);
+			kfree_skb(worker->lasts[i]);
+			while (i > 0) {
+				i--;
+				kfree_skb(worker->firsts[i]);
+				kfree_skb(worker->lasts[i]);
+			}
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Measures how many fragments "threads" threads can push through the database
+ * per second. Each thread reassembles its own packets; they only share the
+ * database.
+ */
+static bool bench_fragments(unsigned int threads)
+{
+	struct bench_worker *workers;
+	struct task_struct *task;
+	DECLARE_COMPLETION_ONSTACK(start);
+	unsigned int prepared;
+	unsigned int created;
+	int cpu = -1;
+	s64 nsecs = 0;
+	u64 rate;
+	bool success = true;
+
+	workers = vzalloc(threads * sizeof(*workers));
+	if (!workers)
+		return false;
+
+	for (prepared = 0; prepared < threads; prepared++) {
+		if (!bench_init(&workers[prepared], prepared, &start)) {
+			success = false;
+			goto end;
+		}
+	}
+
+	for (created = 0; created < threads; created++) {
+		task = kthread_create(bench_work, &workers[created],
+				"jool_fragdb_bench");
+		if (IS_ERR(task)) {
+			log_err("kthread_create() threw errcode %ld.",
+					PTR_ERR(task));
+			success = false;
+			break;
+		}
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+	}
+
+	complete_all(&start);
+	while (created > 0) {
+		created--;
+		wait_for_completion(&workers[created].done);
+		nsecs = max(nsecs, workers[created].nsecs);
+		success &= ASSERT_BOOL(true, workers[created].success,
+				"worker %u verdicts", created);
+	}
+
+	if (success) {
+		success &= validate_database(0);
+		rate = nsecs ? div64_u64((u64)threads * 2 * BENCH_PACKETS
+				* NSEC_PER_SEC, nsecs) : 0;
+		log_info("%u threads on %u CPUs: %llu fragments/sec (max %u slots per shard).",
+				threads, num_online_cpus(), rate,
+				1U << max_bucket_bits());
+	}
+	/* Fall through. */
+
+end:
+	while (prepared > 0) {
+		prepared--;
+		bench_free(&workers[prepared]);
+	}
+	vfree(workers);
+	return success;
+}
+
+static bool bench(void)
+{
+	bool success = true;
+
+	success &= bench_fragments(1);
+	success &= bench_fragments(4);
+	success &= bench_fragments(16);
+
+	return success;
+}
+
 int init_module(void)
 {
 	START_TESTS("Fragment database");
@@ -341,6 +702,11 @@ int init_module(void)
 	CALL_TEST(test_no_frags(), "Unfragmented IPv6 packet arrives");
 	CALL_TEST(test_happy_path(), "Happy defragmentation.");
 	CALL_TEST(test_timer(), "Timer test.");
+	CALL_TEST(test_resize(), "Table resizing.");
+	CALL_TEST(test_eviction(), "Memory limits.");
+	if (benchmark) {
+		CALL_TEST(bench(), "Benchmark.");
+	}
 
 	fragdb_destroy();
 	config_destroy();
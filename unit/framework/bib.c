@@ -37,7 +37,7 @@ struct bib_entry *bib_inject(char *addr6, u16 port6, char *addr4, u16 port4,
 		return NULL;
 	}
 
-	error = bibdb_add(bib);
+	error = bibdb_add(bib, NULL);
 	if (error) {
 		log_err("Errcode %d on BIB DB add.", error);
 		return NULL;
@@ -0,0 +1,27 @@
+#include "nat64/unit/config.h"
+
+#include <linux/slab.h>
+
+/**
+ * Returns a copy of the current configuration, meant to be modified by the
+ * test and then handed over to config_replace().
+ * Returns NULL on failure.
+ */
+struct global_config *config_clone_for_update(void)
+{
+	struct global_config *config;
+	int error;
+
+	config = kmalloc(sizeof(*config), GFP_KERNEL);
+	if (!config)
+		return NULL;
+
+	error = config_clone(config);
+	if (error) {
+		log_err("Errcode %d while trying to clone the config.", error);
+		kfree(config);
+		return NULL;
+	}
+
+	return config;
+}
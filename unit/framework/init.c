@@ -16,7 +16,7 @@ bool init_full(void)
 		goto pool6_fail;
 	if (pool4db_init(16, prefixes4, ARRAY_SIZE(prefixes4)))
 		goto pool4_fail;
-	if (filtering_init())
+	if (filtering_init(0))
 		goto filtering_fail;
 
 	return true;
@@ -20,18 +20,25 @@ void bibdb_return(struct bib_entry *bib)
 	BUG();
 }
 
-bool bibdb_contains4(const struct ipv4_transport_addr *addr,
-		const l4_protocol proto)
+int bibdb_find_free4(const l4_protocol proto, const struct in_addr *addr,
+		const struct port_range *range, __u16 *result)
 {
 	log_err("This function was called! The unit test is broken.");
 	BUG();
 }
 
-int pool4db_foreach_taddr4(struct packet *in, enum l4_protocol l4_proto,
+int pool4db_foreach_range(struct packet *in, enum l4_protocol l4_proto,
 		struct in_addr *daddr,
-		int (*func)(struct ipv4_transport_addr *, void *), void *arg,
+		int (*func)(struct pool4_sample *, void *), void *arg,
 		unsigned int offset)
 {
 	log_err("This function was called! The unit test is broken.");
 	BUG();
 }
+
+bool pool4db_is_empty(void)
+{
+	log_err("This function was called! The unit test is broken.");
+	BUG();
+	return true;
+}
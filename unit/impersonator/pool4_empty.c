@@ -5,8 +5,8 @@ bool pool4empty_contains(const struct ipv4_transport_addr *addr)
 	return false;
 }
 
-int pool4empty_foreach_taddr4(struct packet *in, struct in_addr *daddr,
-		int (*func)(struct ipv4_transport_addr *, void *), void *arg,
+int pool4empty_foreach_range(struct packet *in, struct in_addr *daddr,
+		int (*func)(struct pool4_sample *, void *), void *arg,
 		unsigned int offset)
 {
 	log_err("This function was called! The unit test is broken.");
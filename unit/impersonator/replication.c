@@ -0,0 +1,12 @@
+#include "nat64/mod/stateful/replication.h"
+
+/*
+ * Nobody subscribes to the replication events during the unit tests, so the
+ * real function would return early anyway.
+ */
+
+void replication_session(struct session_entry *session,
+		enum replication_type type)
+{
+	/* No code. */
+}
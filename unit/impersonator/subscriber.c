@@ -0,0 +1,41 @@
+#include "nat64/mod/stateful/subscriber.h"
+
+/*
+ * The BIB entries and sessions of the subscriber impersonator users are never
+ * charged to subscribers.
+ * Therefore, these functions should never be called.
+ */
+
+void subscriber_rm_bib(struct subscriber *sub, struct port_block *block)
+{
+	log_err("This function was called! The unit test is broken.");
+	BUG();
+}
+
+void subscriber_add_session(struct subscriber *sub,
+		struct session_entry *session)
+{
+	log_err("This function was called! The unit test is broken.");
+	BUG();
+}
+
+void subscriber_rm_session(struct subscriber *sub,
+		struct session_entry *session)
+{
+	log_err("This function was called! The unit test is broken.");
+	BUG();
+}
+
+int subscriber_take_port(struct subscriber *sub, l4_protocol proto,
+		__u32 mark, struct ipv4_transport_addr *result,
+		struct port_block **block, struct in_addr *hint)
+{
+	log_err("This function was called! The unit test is broken.");
+	BUG();
+}
+
+void subscriber_add_block(struct subscriber *sub, struct port_block *block)
+{
+	log_err("This function was called! The unit test is broken.");
+	BUG();
+}
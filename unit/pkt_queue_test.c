@@ -0,0 +1,264 @@
+#include <linux/module.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/unit/skb_generator.h"
+#include "nat64/unit/config.h"
+#include "nat64/unit/types.h"
+
+#include "session/pkt_queue.c"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("Packet queue test");
+
+
+static bool set_limits(__u64 max_pkts, __u32 max_pkts_per_src)
+{
+	struct global_config *config;
+
+	config = config_clone_for_update();
+	if (!config)
+		return false;
+
+	config->nat64.max_stored_pkts = max_pkts;
+	config->nat64.max_stored_pkts_per_src = max_pkts_per_src;
+
+	config_replace(config);
+	return true;
+}
+
+/**
+ * Creates the session and the IPv4 SYN of a connection from @remote4:@port to
+ * 192.0.2.1:80.
+ * Caller must session_return() the session.
+ */
+static struct session_entry *create_session(char *remote4, __u16 port,
+		struct packet *pkt)
+{
+	struct ipv6_transport_addr remote6, local6;
+	struct ipv4_transport_addr local4, remote4_addr;
+	struct session_entry *session;
+	struct sk_buff *skb;
+	struct tuple tuple4;
+
+	if (init_tuple4(&tuple4, remote4, port, "192.0.2.1", 80, L4PROTO_TCP))
+		return NULL;
+	if (str_to_addr6("2001:db8::1", &remote6.l3))
+		return NULL;
+	remote6.l4 = 80;
+	if (str_to_addr6("64:ff9b::1", &local6.l3))
+		return NULL;
+	local6.l4 = port;
+	local4 = tuple4.dst.addr4;
+	remote4_addr = tuple4.src.addr4;
+
+	if (create_skb4_tcp(&tuple4, &skb, 100, 32))
+		return NULL;
+	if (pkt_init_ipv4(pkt, skb)) {
+		kfree_skb(skb);
+		return NULL;
+	}
+
+	session = session_create(&remote6, &local6, &local4, &remote4_addr,
+			L4PROTO_TCP, NULL);
+	if (!session)
+		kfree_skb(skb);
+	return session;
+}
+
+/**
+ * Attempts to store a SYN from @remote4:@port; returns pktqueue_add()'s result.
+ * If the packet was not stored, it is released.
+ */
+static int store(char *remote4, __u16 port)
+{
+	struct session_entry *session;
+	struct packet pkt;
+	int error;
+
+	session = create_session(remote4, port, &pkt);
+	if (!session)
+		return -ENOMEM;
+
+	error = pktqueue_add(session, &pkt);
+	if (error)
+		kfree_skb(pkt.skb);
+	session_return(session);
+	return error;
+}
+
+/**
+ * Cancels the ICMP error of the SYN from @remote4:@port.
+ */
+static bool cancel(char *remote4, __u16 port)
+{
+	struct session_entry *session;
+	struct packet pkt;
+
+	session = create_session(remote4, port, &pkt);
+	if (!session)
+		return false;
+
+	pktqueue_remove(session);
+	kfree_skb(pkt.skb);
+	session_return(session);
+	return true;
+}
+
+static bool assert_count(int expected)
+{
+	return ASSERT_INT(expected, atomic_read(&node_count), "node count");
+}
+
+static bool test_add_remove(void)
+{
+	bool success = true;
+
+	success &= ASSERT_INT(0, store("203.0.113.1", 1000), "add 1");
+	success &= ASSERT_INT(0, store("203.0.113.1", 1001), "add 2");
+	success &= ASSERT_INT(0, store("198.51.100.1", 1000), "add 3");
+	success &= assert_count(3);
+
+	success &= cancel("203.0.113.1", 1001);
+	success &= assert_count(2);
+	/* Not stored; should be ignored. */
+	success &= cancel("203.0.113.1", 1002);
+	success &= assert_count(2);
+
+	success &= ASSERT_INT(0, icmp64_pop(), "ICMP errors");
+	return success;
+}
+
+static bool test_duplicate(void)
+{
+	bool success = true;
+
+	success &= ASSERT_INT(0, store("203.0.113.1", 1000), "first");
+	success &= ASSERT_INT(-EEXIST, store("203.0.113.1", 1000), "duplicate");
+	success &= assert_count(1);
+	success &= ASSERT_INT(0, icmp64_pop(), "ICMP errors");
+
+	return success;
+}
+
+static bool test_source_quota(void)
+{
+	bool success = true;
+
+	if (!set_limits(10, 2))
+		return false;
+
+	/* Same /24, different addresses. */
+	success &= ASSERT_INT(0, store("203.0.113.1", 1000), "add 1");
+	success &= ASSERT_INT(0, store("203.0.113.2", 1000), "add 2");
+	success &= ASSERT_INT(-E2BIG, store("203.0.113.3", 1000), "over quota");
+	success &= ASSERT_INT(1, icmp64_pop(), "quota ICMP error");
+
+	/* Other networks have their own quotas. */
+	success &= ASSERT_INT(0, store("203.0.114.1", 1000), "other /24");
+	success &= assert_count(3);
+
+	/* Cancelling a packet gives the quota back. */
+	success &= cancel("203.0.113.1", 1000);
+	success &= ASSERT_INT(0, store("203.0.113.3", 1000), "quota refunded");
+	success &= assert_count(3);
+
+	return success;
+}
+
+static bool test_global_limit(void)
+{
+	bool success = true;
+
+	if (!set_limits(2, 0))
+		return false;
+
+	success &= ASSERT_INT(0, store("203.0.113.1", 1000), "add 1");
+	success &= ASSERT_INT(0, store("198.51.100.1", 1000), "add 2");
+	success &= ASSERT_INT(-E2BIG, store("192.0.2.100", 1000), "over limit");
+	success &= ASSERT_INT(1, icmp64_pop(), "limit ICMP error");
+	success &= assert_count(2);
+
+	return success;
+}
+
+static bool test_expiration(void)
+{
+	const __be32 prefix = cpu_to_be32(0xcb007100); /* 203.0.113.0 */
+	struct pktqueue_shard *shard;
+	struct packet_node *node;
+	struct hlist_node *hnode;
+	unsigned int i;
+	bool success = true;
+
+	success &= ASSERT_INT(0, store("203.0.113.1", 1000), "add 1");
+	success &= ASSERT_INT(0, store("203.0.113.1", 1001), "add 2");
+	success &= ASSERT_INT(0, store("198.51.100.1", 1000), "add 3");
+
+	/* Pretend the 203.0.113.0/24 packets have been waiting for too long. */
+	shard = get_shard(prefix);
+	list_for_each_entry(node, &shard->expire_list, list_hook)
+		if (node->source->prefix == prefix)
+			node->dying_time = jiffies - 1;
+
+	for (i = 0; i < ARRAY_SIZE(shards); i++)
+		cleaner_timer(i);
+
+	success &= ASSERT_INT(2, icmp64_pop(), "ICMP errors");
+	success &= assert_count(1);
+
+	/* The quota should have been refunded as well. */
+	hlist_for_each(hnode, get_source_slot(shard, prefix)) {
+		success &= ASSERT_BOOL(false, hlist_entry(hnode,
+				struct pktqueue_source, hook)->prefix == prefix,
+				"source freed");
+	}
+
+	return success;
+}
+
+static bool init(void)
+{
+	if (config_init(false))
+		return false;
+	if (session_init())
+		goto fail1;
+	if (pktqueue_init())
+		goto fail2;
+
+	icmp64_pop();
+	return true;
+
+fail2:
+	session_destroy();
+fail1:
+	config_destroy();
+	return false;
+}
+
+static void end(void)
+{
+	pktqueue_destroy();
+	session_destroy();
+	config_destroy();
+	icmp64_pop();
+}
+
+int init_module(void)
+{
+	START_TESTS("Packet queue");
+
+	INIT_CALL_END(init(), test_add_remove(), end(), "Add/remove");
+	INIT_CALL_END(init(), test_duplicate(), end(), "Duplicates");
+	INIT_CALL_END(init(), test_source_quota(), end(), "Per-source quota");
+	INIT_CALL_END(init(), test_global_limit(), end(), "Global limit");
+	INIT_CALL_END(init(), test_expiration(), end(), "Expiration");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
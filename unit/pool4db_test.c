@@ -111,33 +111,71 @@ struct foreach_taddr4_args {
 	unsigned int i;
 };
 
-static int validate_taddr4(struct ipv4_transport_addr *addr, void *void_args)
+/*
+ * pool4db_foreach_range() hands over whole ranges; expand them so the
+ * transport addresses can be compared one by one.
+ */
+static int validate_range(struct pool4_sample *sample, void *void_args)
 {
 	struct foreach_taddr4_args *args = void_args;
+	unsigned int port;
 	bool success = true;
 
-	/* log_debug("foreaching %pI4:%u", &addr->l3, addr->l4); */
+	/* log_debug("foreaching %pI4:%u-%u", &sample->addr,
+			sample->range.min, sample->range.max); */
 
-	success &= ASSERT_BOOL(true, args->i < args->expected_len,
-			"overflow (%u %u)", args->i, args->expected_len);
-	if (!success)
-		return -EINVAL;
+	for (port = sample->range.min; port <= sample->range.max; port++) {
+		success &= ASSERT_BOOL(true, args->i < args->expected_len,
+				"overflow (%u %u)", args->i,
+				args->expected_len);
+		if (!success)
+			return -EINVAL;
 
-	success &= __ASSERT_ADDR4(&args->expected[args->i].l3, &addr->l3, "addr");
-	success &= ASSERT_UINT(args->expected[args->i].l4, addr->l4, "port");
+		success &= __ASSERT_ADDR4(&args->expected[args->i].l3,
+				&sample->addr, "addr");
+		success &= ASSERT_UINT(args->expected[args->i].l4, port,
+				"port");
+		if (!success)
+			return -EINVAL;
 
-	args->i++;
-	return success ? 0 : -EINVAL;
+		args->i++;
+	}
+
+	return 0;
 }
 
 #define COUNT 16
 
+/**
+ * Runs the foreach once per possible offset (plus some overflowing ones).
+ */
+static bool foreach_taddr4_offsets(struct ipv4_transport_addr *expected)
+{
+	struct foreach_taddr4_args args;
+	unsigned int i;
+	int error;
+	bool success = true;
+
+	for (i = 0; i < 3 * COUNT; i++) {
+		args.expected = &expected[i % COUNT];
+		args.expected_len = COUNT;
+		args.i = 0;
+		error = pool4db_foreach_range(&pkt, L4PROTO_TCP, NULL,
+				validate_range, &args, i);
+		success &= ASSERT_INT(0, error, "call %u", i);
+		success &= ASSERT_UINT(COUNT, args.i, "visited %u", i);
+		/* log_debug("--------------"); */
+	}
+
+	return success;
+}
+
 static bool test_foreach_taddr4(void)
 {
 	struct ipv4_transport_addr expected[2 * COUNT];
+	struct pool4_table *table;
+	struct pool4_snapshot *snapshot;
 	unsigned int i = 0;
-	struct foreach_taddr4_args args;
-	int error;
 	bool success = true;
 
 	if (!add_common_samples())
@@ -184,15 +222,20 @@ static bool test_foreach_taddr4(void)
 	 */
 	memcpy(&expected[COUNT], &expected[0], COUNT * sizeof(*expected));
 
-	for (i = 0; i < 3 * COUNT; i++) {
-		args.expected = &expected[i % COUNT];
-		args.expected_len = COUNT;
-		args.i = 0;
-		error = pool4db_foreach_taddr4(&pkt, L4PROTO_TCP, NULL,
-				validate_taddr4, &args, i);
-		success &= ASSERT_INT(0, error, "call %u", i);
-		/* log_debug("--------------"); */
-	}
+	/* Through the snapshot. */
+	table = find_table(rcu_dereference_raw(db), 1, L4PROTO_TCP);
+	if (!ASSERT_BOOL(true, table != NULL, "table"))
+		return false;
+	snapshot = rcu_dereference_raw(table->snapshot);
+	if (!ASSERT_BOOL(true, snapshot != NULL, "snapshot"))
+		return false;
+	success &= ASSERT_UINT(COUNT, snapshot->taddrs, "snapshot taddrs");
+	success &= foreach_taddr4_offsets(expected);
+
+	/* Through the lists, as if the snapshot could not be allocated. */
+	RCU_INIT_POINTER(table->snapshot, NULL);
+	success &= foreach_taddr4_offsets(expected);
+	RCU_INIT_POINTER(table->snapshot, snapshot);
 
 	return success;
 }
@@ -611,6 +654,208 @@ static bool test_rm(void)
 	return success;
 }
 
+static bool add_table(__u32 mark, l4_protocol proto, __u32 addr,
+		__u16 min, __u16 max)
+{
+	struct ipv4_prefix prefix;
+	struct port_range ports;
+
+	prefix.address.s_addr = cpu_to_be32(addr);
+	prefix.len = 32;
+	ports.min = min;
+	ports.max = max;
+
+	return ASSERT_INT(0, pool4db_add(mark, proto, &prefix, &ports),
+			"add of %u/%s/%pI4 (%u-%u)", mark,
+			l4proto_to_string(proto), &prefix.address, min, max);
+}
+
+static bool assert_contains(l4_protocol proto, __u32 addr, __u16 port,
+		bool expected)
+{
+	struct ipv4_transport_addr taddr;
+
+	taddr.l3.s_addr = cpu_to_be32(addr);
+	taddr.l4 = port;
+
+	return ASSERT_BOOL(expected, pool4db_contains(proto, &taddr),
+			"%s %pI4#%u", l4proto_to_string(proto), &taddr.l3,
+			port);
+}
+
+static bool test_index(void)
+{
+	struct ipv4_prefix prefix;
+	struct port_range ports;
+	bool success = true;
+
+	/* The marks don't matter, but the protocols do. */
+	if (!add_table(1, L4PROTO_TCP, 0xc0000201U, 100, 200))
+		return false;
+	if (!add_table(2, L4PROTO_TCP, 0xc0000201U, 201, 300))
+		return false;
+	if (!add_table(3, L4PROTO_TCP, 0xc0000201U, 250, 400))
+		return false;
+	if (!add_table(4, L4PROTO_TCP, 0xc0000203U, 1000, 1000))
+		return false;
+	if (!add_table(1, L4PROTO_UDP, 0xc0000202U, 500, 600))
+		return false;
+	/* Otherwise this would be testing the fallback. */
+	if (!ASSERT_BOOL(true, rcu_dereference_raw(members) != NULL, "index"))
+		return false;
+
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 99, false);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 100, true);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 201, true);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 400, true);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 401, false);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000202U, 550, false);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000203U, 999, false);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000203U, 1000, true);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000203U, 1001, false);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000204U, 1000, false);
+	success &= assert_contains(L4PROTO_UDP, 0xc0000201U, 150, false);
+	success &= assert_contains(L4PROTO_UDP, 0xc0000202U, 500, true);
+	success &= assert_contains(L4PROTO_UDP, 0xc0000202U, 600, true);
+	success &= assert_contains(L4PROTO_ICMP, 0xc0000202U, 500, false);
+
+	/* Removals reach the index too. */
+	prefix.address.s_addr = cpu_to_be32(0xc0000201U);
+	prefix.len = 32;
+	ports.min = 201;
+	ports.max = 300;
+	success &= ASSERT_INT(0, pool4db_rm(2, L4PROTO_TCP, &prefix, &ports),
+			"rm");
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 200, true);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 201, false);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 249, false);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 250, true);
+
+	/* So do flushes. */
+	success &= ASSERT_INT(0, pool4db_flush(), "flush");
+	success &= ASSERT_BOOL(true, pool4db_is_empty(), "empty");
+
+	return success;
+}
+
+/** Netlink port ID of the tests' batch client. */
+#define OWNER 1234
+
+static int batch_op(bool is_add, __u32 mark, l4_protocol proto, __u32 addr,
+		__u16 min, __u16 max)
+{
+	struct ipv4_prefix prefix;
+	struct port_range ports;
+
+	prefix.address.s_addr = cpu_to_be32(addr);
+	prefix.len = 32;
+	ports.min = min;
+	ports.max = max;
+
+	return is_add
+			? pool4db_batch_add(OWNER, mark, proto, &prefix, &ports)
+			: pool4db_batch_rm(OWNER, mark, proto, &prefix, &ports);
+}
+
+static bool assert_tables(__u32 expected)
+{
+	__u32 tables;
+	__u64 samples, taddrs;
+
+	pool4db_count(&tables, &samples, &taddrs);
+	return ASSERT_UINT(expected, tables, "table count");
+}
+
+static bool test_batch(void)
+{
+	bool success = true;
+
+	if (!add_table(1, L4PROTO_TCP, 0xc0000201U, 100, 200))
+		return false;
+	if (!add_table(2, L4PROTO_UDP, 0xc0000202U, 500, 600))
+		return false;
+
+	/* Nothing happens until the commit. */
+	success &= ASSERT_INT(0, pool4db_batch_begin(OWNER, false), "begin");
+	success &= ASSERT_INT(0, batch_op(true, 1, L4PROTO_TCP, 0xc0000201U,
+			300, 400), "add 1");
+	success &= ASSERT_INT(0, batch_op(false, 2, L4PROTO_UDP, 0xc0000202U,
+			500, 600), "rm 2");
+	success &= ASSERT_INT(0, batch_op(true, 3, L4PROTO_ICMP, 0xc0000203U,
+			0, 10), "add 3");
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 150, true);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 300, false);
+	success &= assert_contains(L4PROTO_UDP, 0xc0000202U, 500, true);
+	success &= assert_contains(L4PROTO_ICMP, 0xc0000203U, 5, false);
+	success &= assert_tables(2);
+
+	success &= ASSERT_INT(0, pool4db_batch_commit(OWNER), "commit");
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 150, true);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 300, true);
+	success &= assert_contains(L4PROTO_UDP, 0xc0000202U, 500, false);
+	success &= assert_contains(L4PROTO_ICMP, 0xc0000203U, 5, true);
+	success &= assert_tables(2);
+
+	/* Replacements start from scratch. */
+	success &= ASSERT_INT(0, pool4db_batch_begin(OWNER, true),
+			"begin replace");
+	success &= ASSERT_INT(0, batch_op(true, 5, L4PROTO_TCP, 0xc0000205U,
+			1, 1), "add 5");
+	success &= ASSERT_INT(0, pool4db_batch_commit(OWNER), "commit replace");
+	success &= assert_contains(L4PROTO_TCP, 0xc0000201U, 150, false);
+	success &= assert_contains(L4PROTO_ICMP, 0xc0000203U, 5, false);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000205U, 1, true);
+	success &= assert_tables(1);
+
+	/* Transactions are over after a commit. */
+	success &= ASSERT_INT(-EINVAL, pool4db_batch_commit(OWNER),
+			"commit again");
+
+	/* Aborted transactions leave no trace. */
+	success &= ASSERT_INT(0, pool4db_batch_begin(OWNER, false),
+			"begin abort");
+	success &= ASSERT_INT(0, batch_op(false, 5, L4PROTO_TCP, 0xc0000205U,
+			1, 1), "rm 5");
+	success &= ASSERT_INT(-ESRCH, batch_op(false, 9, L4PROTO_TCP,
+			0xc0000205U, 1, 1), "rm 9");
+	pool4db_batch_abort(OWNER);
+	success &= assert_contains(L4PROTO_TCP, 0xc0000205U, 1, true);
+	success &= assert_tables(1);
+	success &= ASSERT_INT(-EINVAL, batch_op(true, 5, L4PROTO_TCP,
+			0xc0000206U, 1, 1), "add after abort");
+
+	return success;
+}
+
+static bool test_batch_owner(void)
+{
+	bool success = true;
+
+	success &= ASSERT_INT(0, pool4db_batch_begin(OWNER, false), "begin");
+	success &= ASSERT_INT(0, batch_op(true, 1, L4PROTO_TCP, 0xc0000201U,
+			1, 1), "add");
+
+	/* Other clients can neither hijack nor clobber the transaction. */
+	success &= ASSERT_INT(-EBUSY, pool4db_batch_begin(OWNER + 1, true),
+			"concurrent begin");
+	success &= ASSERT_INT(-EBUSY, pool4db_batch_commit(OWNER + 1),
+			"foreign commit");
+	pool4db_batch_abort(OWNER + 1);
+	success &= ASSERT_INT(0, batch_op(true, 2, L4PROTO_TCP, 0xc0000202U,
+			1, 1), "add after foreign abort");
+
+	/* Unless the owner seems to be gone. */
+	staging_time = jiffies - BATCH_TIMEOUT - 1;
+	success &= ASSERT_INT(0, pool4db_batch_begin(OWNER + 1, true),
+			"takeover");
+	success &= ASSERT_INT(-EBUSY, batch_op(true, 3, L4PROTO_TCP,
+			0xc0000203U, 1, 1), "add after takeover");
+	success &= ASSERT_INT(0, pool4db_batch_commit(OWNER + 1), "commit");
+	success &= assert_tables(0);
+
+	return success;
+}
+
 static bool init(void)
 {
 	int error;
@@ -643,6 +888,9 @@ int init_module(void)
 	INIT_CALL_END(init(), test_foreach_sample(), destroy(), "Sample for");
 	INIT_CALL_END(init(), test_add(), destroy(), "Add");
 	INIT_CALL_END(init(), test_rm(), destroy(), "Rm");
+	INIT_CALL_END(init(), test_index(), destroy(), "Membership index");
+	INIT_CALL_END(init(), test_batch(), destroy(), "Batch");
+	INIT_CALL_END(init(), test_batch_owner(), destroy(), "Batch owner");
 
 	END_TESTS;
 }
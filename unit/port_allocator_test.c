@@ -1,13 +1,17 @@
 #include <linux/module.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
 #include "nat64/unit/unit_test.h"
+#include "nat64/common/constants.h"
 #include "bib/port_allocator.c"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alberto Leiva");
 MODULE_DESCRIPTION("Port allocator module test.");
 
-static bool test_md5(void)
+static bool test_siphash(void)
 {
+	struct palloc_key *key;
 	struct in6_addr arg1;
 	struct in6_addr arg2;
 	union {
@@ -15,51 +19,182 @@ static bool test_md5(void)
 		__u8 as8[2];
 	} arg3;
 	unsigned int result;
+	unsigned int i;
 
-	arg1.s6_addr[0] = 'a';
-	arg1.s6_addr[1] = 'b';
-	arg1.s6_addr[2] = 'c';
-	arg1.s6_addr[3] = 'd';
-	arg1.s6_addr[4] = 'e';
-	arg1.s6_addr[5] = 'f';
-	arg1.s6_addr[6] = 'g';
-	arg1.s6_addr[7] = 'h';
-	arg1.s6_addr[8] = 'i';
-	arg1.s6_addr[9] = 'j';
-	arg1.s6_addr[10] = 'k';
-	arg1.s6_addr[11] = 'l';
-	arg1.s6_addr[12] = 'm';
-	arg1.s6_addr[13] = 'n';
-	arg1.s6_addr[14] = 'o';
-	arg1.s6_addr[15] = 'p';
-
-	arg2.s6_addr[0] = 'q';
-	arg2.s6_addr[1] = 'r';
-	arg2.s6_addr[2] = 's';
-	arg2.s6_addr[3] = 't';
-	arg2.s6_addr[4] = 'u';
-	arg2.s6_addr[5] = 'v';
-	arg2.s6_addr[6] = 'w';
-	arg2.s6_addr[7] = 'x';
-	arg2.s6_addr[8] = 'y';
-	arg2.s6_addr[9] = 'z';
-	arg2.s6_addr[10] = 'A';
-	arg2.s6_addr[11] = 'B';
-	arg2.s6_addr[12] = 'C';
-	arg2.s6_addr[13] = 'D';
-	arg2.s6_addr[14] = 'E';
-	arg2.s6_addr[15] = 'F';
-
-	arg3.as8[0] = 'G';
-	arg3.as8[1] = 'H';
-
-	secret_key[0] = 'I';
-	secret_key[1] = 'J';
-	secret_key_len = 2;
-
-	/* Expected value gotten from DuckDuckGo. Look up "md5 abcdefg...". */
-	return ASSERT_INT(0, f(&arg1, &arg2, arg3.as16, &result), "errcode")
-			&& ASSERT_BE32(0xb6a824a9u, result, "hash");
+	/* Same input as the 34-byte vector from the SipHash reference code. */
+	for (i = 0; i < 16; i++) {
+		arg1.s6_addr[i] = i;
+		arg2.s6_addr[i] = 16 + i;
+	}
+	arg3.as8[0] = 32;
+	arg3.as8[1] = 33;
+
+	key = rcu_dereference_protected(secret_key, true);
+	key->k0 = 0x0706050403020100ULL;
+	key->k1 = 0x0f0e0d0c0b0a0908ULL;
+
+	/* Expected value is the lower half of 0x12e0b01abb051238. */
+	f(&arg1, &arg2, arg3.as16, &result);
+	return ASSERT_UINT(0xbb051238u, result, "hash");
+}
+
+static bool test_rotation(void)
+{
+	struct palloc_key *old;
+	struct in6_addr addr;
+	unsigned int before;
+	unsigned int after;
+
+	memset(&addr, 0, sizeof(addr));
+	f(&addr, &addr, 1234, &before);
+
+	old = rcu_dereference_protected(secret_key, true);
+	rotate_key(&rotator.work);
+	f(&addr, &addr, 1234, &after);
+
+	/* 1 in 2^32 chance of a false negative; fine. */
+	return ASSERT_BOOL(true, old != rcu_dereference_protected(secret_key,
+			true), "key replaced")
+			&& ASSERT_BOOL(true, before != after, "offset changed");
+}
+
+static bool assert_toeplitz(char *src, __u16 sport, char *dst, __u16 dport,
+		__u32 expected)
+{
+	__u8 key[] = DEFAULT_RSS_KEY;
+	struct in_addr saddr, daddr;
+	__be16 sport_be = cpu_to_be16(sport);
+	__be16 dport_be = cpu_to_be16(dport);
+	__u32 hash;
+
+	if (str_to_addr4(src, &saddr) || str_to_addr4(dst, &daddr))
+		return false;
+
+	hash = toeplitz(key, &saddr, 4, 0) ^ toeplitz(key, &daddr, 4, 4)
+			^ toeplitz(key, &sport_be, 2, 8)
+			^ toeplitz(key, &dport_be, 2, 10);
+	return ASSERT_UINT(expected, hash, "%s#%u -> %s#%u", src, sport, dst,
+			dport);
+}
+
+static bool test_toeplitz(void)
+{
+	bool success = true;
+
+	/* Microsoft's RSS verification suite, "IPv4 with TCP" column. */
+	success &= assert_toeplitz("66.9.149.187", 2794, "161.142.100.80", 1766,
+			0x51ccc178u);
+	success &= assert_toeplitz("199.92.111.2", 14230, "65.69.140.83", 4739,
+			0xc626b0eau);
+	success &= assert_toeplitz("24.19.198.95", 12898, "12.22.207.184",
+			38024, 0x5c2b394au);
+
+	return success;
+}
+
+#define BENCH_ITERATIONS 1000000u
+
+struct bench_worker {
+	/** Released when every worker has been created. */
+	struct completion *start;
+	struct completion done;
+	s64 nsecs;
+};
+
+static int bench_work(void *void_worker)
+{
+	struct bench_worker *worker = void_worker;
+	struct in6_addr local;
+	struct in6_addr remote;
+	unsigned int offset;
+	unsigned int i;
+	ktime_t start;
+
+	memset(&local, 0, sizeof(local));
+	memset(&remote, 0, sizeof(remote));
+	wait_for_completion(worker->start);
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_ITERATIONS; i++) {
+		/* Every iteration is a different new flow. */
+		remote.s6_addr32[3] = i;
+		f(&local, &remote, i, &offset);
+		/* What palloc_allocate() does when the first port is free. */
+		atomic_add(1, &next_ephemeral);
+	}
+	worker->nsecs = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	complete(&worker->done);
+	return 0;
+}
+
+/**
+ * Measures how many port allocation offsets "threads" threads can compute per
+ * second. The threads are spread over the online CPUs, so (unless the machine
+ * has at least "threads" CPUs) some of them will share.
+ */
+static bool bench_offsets(unsigned int threads)
+{
+	struct bench_worker *workers;
+	struct task_struct *task;
+	DECLARE_COMPLETION_ONSTACK(start);
+	unsigned int created;
+	int cpu = -1;
+	s64 nsecs = 0;
+	u64 rate;
+	bool success = true;
+
+	workers = kcalloc(threads, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return false;
+
+	for (created = 0; created < threads; created++) {
+		workers[created].start = &start;
+		init_completion(&workers[created].done);
+		task = kthread_create(bench_work, &workers[created],
+				"jool_palloc_bench");
+		if (IS_ERR(task)) {
+			log_err("kthread_create() threw errcode %ld.",
+					PTR_ERR(task));
+			success = false;
+			break;
+		}
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+	}
+
+	complete_all(&start);
+	while (created > 0) {
+		created--;
+		wait_for_completion(&workers[created].done);
+		nsecs = max(nsecs, workers[created].nsecs);
+	}
+
+	if (success) {
+		rate = nsecs ? div64_u64((u64)threads * BENCH_ITERATIONS
+				* NSEC_PER_SEC, nsecs) : 0;
+		success &= ASSERT_BOOL(true, rate != 0, "offset rate");
+		log_info("%u threads on %u CPUs: %llu offsets/sec.", threads,
+				num_online_cpus(), rate);
+	}
+
+	kfree(workers);
+	return success;
+}
+
+static bool benchmark(void)
+{
+	bool success = true;
+
+	success &= bench_offsets(1);
+	success &= bench_offsets(8);
+	success &= bench_offsets(32);
+
+	return success;
 }
 
 static bool init(void)
@@ -71,7 +206,10 @@ int init_module(void)
 {
 	START_TESTS("Port Allocator");
 
-	INIT_CALL_END(init(), test_md5(), palloc_destroy(), "MD5 Test");
+	INIT_CALL_END(init(), test_siphash(), palloc_destroy(), "SipHash");
+	INIT_CALL_END(init(), test_rotation(), palloc_destroy(), "Key rotation");
+	CALL_TEST(test_toeplitz(), "Toeplitz");
+	INIT_CALL_END(init(), benchmark(), palloc_destroy(), "Benchmark");
 
 	END_TESTS;
 }
@@ -1,5 +1,9 @@
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+#include <linux/rbtree_augmented.h>
+#endif
 
 #include "nat64/unit/unit_test.h"
 #include "nat64/mod/common/rbtree.h"
@@ -113,11 +117,89 @@ static bool test_add_and_remove(void)
 	return success;
 }
 
+/**
+ * Returns the black height of the subtree rooted at @node, or -1 if the subtree
+ * breaks any of the red-black rules.
+ */
+static int black_height(struct rb_node *node, struct rb_node *parent)
+{
+	int left, right;
+
+	if (!node)
+		return 1;
+	if (rb_parent(node) != parent)
+		return -1;
+	if (rb_is_red(node) && parent && rb_is_red(parent))
+		return -1;
+
+	left = black_height(node->rb_left, node);
+	right = black_height(node->rb_right, node);
+	if (left < 0 || left != right)
+		return -1;
+
+	return left + (rb_is_black(node) ? 1 : 0);
+}
+
+#define BUILD_MAX 70
+
+static bool test_build(void)
+{
+	struct rb_root root;
+	struct node_thing *nodes;
+	struct node_thing **array;
+	struct rb_node *node;
+	int i, n, expected;
+	bool success = true;
+
+	nodes = kmalloc(BUILD_MAX * sizeof(*nodes), GFP_KERNEL);
+	array = kmalloc(BUILD_MAX * sizeof(*array), GFP_KERNEL);
+	if (!nodes || !array) {
+		kfree(nodes);
+		kfree(array);
+		return false;
+	}
+
+	for (n = 0; n <= BUILD_MAX && success; n++) {
+		for (i = 0; i < n; i++) {
+			nodes[i].i = i;
+			array[i] = &nodes[i];
+		}
+
+		rbtree_build(&root, array, n, struct node_thing, hook);
+		success &= ASSERT_BOOL(true, !root.rb_node
+				|| rb_is_black(root.rb_node), "black root");
+		success &= ASSERT_BOOL(true,
+				black_height(root.rb_node, NULL) > 0,
+				"red-black rules (%d nodes)", n);
+
+		expected = 0;
+		for (node = rb_first(&root); node; node = rb_next(node)) {
+			success &= ASSERT_INT(expected,
+					rb_entry(node, struct node_thing, hook)->i,
+					"in order (%d nodes)", n);
+			expected++;
+		}
+		success &= ASSERT_INT(n, expected, "node count");
+
+		/* The stock functions have to be able to keep working on it. */
+		for (i = 0; i < n; i += 2)
+			rb_erase(&nodes[i].hook, &root);
+		success &= ASSERT_BOOL(true,
+				black_height(root.rb_node, NULL) > 0,
+				"red-black rules after erasing (%d nodes)", n);
+	}
+
+	kfree(nodes);
+	kfree(array);
+	return success;
+}
+
 int init_module(void)
 {
 	START_TESTS("RB Tree");
 
 	CALL_TEST(test_add_and_remove(), "Add/Remove Test");
+	CALL_TEST(test_build(), "Build Test");
 	/*
 	 * I'm lazy. The BIB and session modules already test the get functions
 	 * and whatnot.
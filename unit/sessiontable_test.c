@@ -1,4 +1,5 @@
 #include <linux/module.h>
+#include <linux/ktime.h>
 #include "nat64/unit/unit_test.h"
 #include "nat64/mod/common/config.h"
 #include "session/table.c"
@@ -7,12 +8,16 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alberto Leiva");
 MODULE_DESCRIPTION("Session table module test.");
 
+static bool benchmark;
+module_param(benchmark, bool, 0);
+MODULE_PARM_DESC(benchmark, "Also measure lookups/sec and restoration time with millions of sessions. (Needs a couple of GBs.)");
+
 static struct session_table table;
 #define TEST_SESSION_COUNT 9
 static struct session_entry *entries[TEST_SESSION_COUNT];
 
 static bool inject(unsigned int index, __u32 local4addr, __u16 local4id,
-		__u32 remote4addr, __u16 remote4id)
+		__u32 remote4addr, __u16 remote4id, bool add)
 {
 	struct ipv6_transport_addr remote6;
 	struct ipv6_transport_addr local6;
@@ -40,8 +45,10 @@ static bool inject(unsigned int index, __u32 local4addr, __u16 local4id,
 			L4PROTO_UDP, NULL);
 	if (!entries[index])
 		return false;
+	if (!add)
+		return true;
 
-	error = sessiontable_add(&table, entries[index], true);
+	error = sessiontable_add(&table, entries[index], true, NULL);
 	if (error) {
 		log_err("Errcode %d on sessiontable_add.", error);
 		return false;
@@ -50,7 +57,10 @@ static bool inject(unsigned int index, __u32 local4addr, __u16 local4id,
 	return true;
 }
 
-static bool insert_test_sessions(void)
+/**
+ * If "add" is false, the sessions are only created; not added to the table.
+ */
+static bool insert_test_sessions(bool add)
 {
 	/*
 	 * Notice:
@@ -66,15 +76,15 @@ static bool insert_test_sessions(void)
 	 * the insertion order is random; it doesn't have any purpose other
 	 * than tentatively messing with the add function.
 	 */
-	return inject(1, 2, 100, 3, 1300)
-			&& inject(6, 2, 200, 3, 1100)
-			&& inject(3, 2, 200, 2, 1100)
-			&& inject(7, 2, 300, 1, 1100)
-			&& inject(0, 1, 300, 3, 1300)
-			&& inject(8, 3, 100, 1, 1100)
-			&& inject(4, 2, 200, 2, 1200)
-			&& inject(2, 2, 200, 1, 1300)
-			&& inject(5, 2, 200, 2, 1300);
+	return inject(1, 2, 100, 3, 1300, add)
+			&& inject(6, 2, 200, 3, 1100, add)
+			&& inject(3, 2, 200, 2, 1100, add)
+			&& inject(7, 2, 300, 1, 1100, add)
+			&& inject(0, 1, 300, 3, 1300, add)
+			&& inject(8, 3, 100, 1, 1100, add)
+			&& inject(4, 2, 200, 2, 1200, add)
+			&& inject(2, 2, 200, 1, 1300, add)
+			&& inject(5, 2, 200, 2, 1300, add);
 }
 
 struct unit_iteration_args {
@@ -133,7 +143,7 @@ static bool test_foreach(void)
 
 	/* ----------------------------------- */
 
-	if (!insert_test_sessions())
+	if (!insert_test_sessions(true))
 		return false;
 
 	/* Populated table, no offset. */
@@ -244,6 +254,322 @@ static bool test_foreach(void)
 	return success;
 }
 
+static bool test_restore(void)
+{
+	struct session_restore restores[TEST_SESSION_COUNT];
+	struct unit_iteration_args args;
+	size_t added;
+	__u64 count;
+	unsigned int i;
+	int error;
+	bool success = true;
+
+	if (!insert_test_sessions(false))
+		return false;
+
+	/* Shuffled on purpose; restore has to sort them. */
+	for (i = 0; i < TEST_SESSION_COUNT; i++) {
+		restores[i].session = entries[(i * 4) % TEST_SESSION_COUNT];
+		restores[i].lifetime = msecs_to_jiffies(1000 * i);
+		restores[i].established = true;
+	}
+
+	error = sessiontable_restore(&table, restores, TEST_SESSION_COUNT,
+			&added);
+	success &= ASSERT_INT(0, error, "restore result");
+	success &= ASSERT_UINT(TEST_SESSION_COUNT, added, "restore count");
+	sessiontable_count(&table, &count);
+	success &= ASSERT_U64(TEST_SESSION_COUNT, count, "table count");
+
+	args.i = 0;
+	args.offset = 0;
+	error = __foreach(&table, cb, &args, NULL, NULL, 0);
+	success &= ASSERT_INT(0, error, "foreach result");
+	success &= ASSERT_UINT(TEST_SESSION_COUNT, args.i, "foreach counter");
+
+	/* The sessions that are already in the table win. */
+	error = sessiontable_restore(&table, restores, TEST_SESSION_COUNT,
+			&added);
+	success &= ASSERT_INT(0, error, "second restore result");
+	success &= ASSERT_UINT(0, added, "second restore count");
+
+	return success;
+}
+
+/**
+ * Session #"i" of the benchmark. Every index yields different IPv6 and IPv4
+ * sides.
+ */
+static void bench_tuples(unsigned int i, struct tuple *tuple6,
+		struct tuple *tuple4)
+{
+	tuple6->src.addr6.l3.s6_addr32[0] = cpu_to_be32(0x20010db8u);
+	tuple6->src.addr6.l3.s6_addr32[1] = 0;
+	tuple6->src.addr6.l3.s6_addr32[2] = 0;
+	tuple6->src.addr6.l3.s6_addr32[3] = cpu_to_be32(i);
+	tuple6->src.addr6.l4 = 5000;
+	tuple6->dst.addr6.l3.s6_addr32[0] = cpu_to_be32(0x0064ff9bu);
+	tuple6->dst.addr6.l3.s6_addr32[1] = 0;
+	tuple6->dst.addr6.l3.s6_addr32[2] = 0;
+	tuple6->dst.addr6.l3.s6_addr32[3] = cpu_to_be32(0xc0000201u);
+	tuple6->dst.addr6.l4 = 80;
+	tuple6->l3_proto = L3PROTO_IPV6;
+	tuple6->l4_proto = L4PROTO_UDP;
+
+	/* 198.18.0.0/15, all ports. */
+	tuple4->dst.addr4.l3.s_addr = cpu_to_be32(0xc6120000u + (i >> 16));
+	tuple4->dst.addr4.l4 = i & 0xFFFFu;
+	tuple4->src.addr4.l3.s_addr = cpu_to_be32(0xc0000201u);
+	tuple4->src.addr4.l4 = 80;
+	tuple4->l3_proto = L3PROTO_IPV4;
+	tuple4->l4_proto = L4PROTO_UDP;
+}
+
+static bool bench_fill(unsigned int count)
+{
+	struct tuple tuple6, tuple4;
+	struct session_entry *session;
+	unsigned int i;
+	int error;
+
+	for (i = 0; i < count; i++) {
+		bench_tuples(i, &tuple6, &tuple4);
+		session = session_create(&tuple6.src.addr6, &tuple6.dst.addr6,
+				&tuple4.dst.addr4, &tuple4.src.addr4,
+				L4PROTO_UDP, NULL);
+		if (!session) {
+			log_err("Ran out of memory after %u sessions.", i);
+			return false;
+		}
+
+		error = sessiontable_add(&table, session, true, NULL);
+		session_return(session);
+		if (error) {
+			log_err("Errcode %d on sessiontable_add.", error);
+			return false;
+		}
+
+		if ((i & 0xFFFFu) == 0)
+			cond_resched();
+	}
+
+	/* Let the indexes reach their final size before measuring. */
+	flush_work(&table.resizer);
+	return true;
+}
+
+/**
+ * Returns the number of lookups per second achieved while querying random
+ * sessions out of "count".
+ */
+static u64 bench_lookups(unsigned int count, l3_protocol proto)
+{
+	struct tuple tuple6, tuple4;
+	struct session_entry *session;
+	unsigned int lookups = min(count, 1000000u);
+	unsigned int i;
+	ktime_t start;
+	s64 nsecs;
+
+	start = ktime_get();
+	for (i = 0; i < lookups; i++) {
+		/* Knuth's multiplicative hash, to jump around the table. */
+		bench_tuples((i * 2654435761u) % count, &tuple6, &tuple4);
+		if (sessiontable_get(&table,
+				(proto == L3PROTO_IPV6) ? &tuple6 : &tuple4,
+				NULL, NULL, &session))
+			return 0;
+		session_return(session);
+	}
+	nsecs = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	return nsecs ? div64_u64((u64)lookups * NSEC_PER_SEC, nsecs) : 0;
+}
+
+static bool bench_run(unsigned int count)
+{
+	u64 lps6, lps4;
+	bool success = true;
+
+	if (!bench_fill(count)) {
+		sessiontable_flush(&table);
+		return false;
+	}
+
+	lps6 = bench_lookups(count, L3PROTO_IPV6);
+	lps4 = bench_lookups(count, L3PROTO_IPV4);
+	success &= ASSERT_BOOL(true, lps6 != 0, "IPv6 lookups");
+	success &= ASSERT_BOOL(true, lps4 != 0, "IPv4 lookups");
+	log_info("%u sessions: %llu IPv6 lookups/sec, %llu IPv4 lookups/sec.",
+			count, lps6, lps4);
+
+	sessiontable_flush(&table);
+	return success;
+}
+
+/**
+ * Measures how long it takes to restore "count" sessions into an empty table.
+ */
+static bool bench_restore(unsigned int count)
+{
+	struct tuple tuple6, tuple4;
+	struct session_restore *restores;
+	size_t added;
+	unsigned int i;
+	ktime_t start;
+	s64 nsecs;
+	int error;
+	bool success = true;
+
+	restores = vmalloc(count * sizeof(*restores));
+	if (!restores) {
+		log_err("Could not allocate the restore array.");
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		bench_tuples(i, &tuple6, &tuple4);
+		restores[i].session = session_create(&tuple6.src.addr6,
+				&tuple6.dst.addr6, &tuple4.dst.addr4,
+				&tuple4.src.addr4, L4PROTO_UDP, NULL);
+		if (!restores[i].session) {
+			log_err("Ran out of memory after %u sessions.", i);
+			count = i;
+			success = false;
+			goto end;
+		}
+		restores[i].lifetime = msecs_to_jiffies(60000);
+		restores[i].established = true;
+
+		if ((i & 0xFFFFu) == 0)
+			cond_resched();
+	}
+
+	start = ktime_get();
+	error = sessiontable_restore(&table, restores, count, &added);
+	nsecs = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	success &= ASSERT_INT(0, error, "restore result");
+	success &= ASSERT_UINT(count, added, "restored sessions");
+	log_info("%u sessions restored in %lld ms.", count,
+			nsecs / NSEC_PER_MSEC);
+
+end:
+	for (i = 0; i < count; i++)
+		session_return(restores[i].session);
+	vfree(restores);
+	sessiontable_flush(&table);
+	return success;
+}
+
+static bool test_benchmark(void)
+{
+	bool success = true;
+
+	success &= bench_run(100000);
+	success &= bench_run(1000000);
+	success &= bench_run(10000000);
+
+	success &= bench_restore(1000000);
+	success &= bench_restore(10000000);
+
+	return success;
+}
+
+/**
+ * One session lives in one shard; the rest are empty. The victim must be found
+ * no matter which shard the search starts from.
+ */
+static bool test_lru(void)
+{
+	struct session_entry *victim;
+	unsigned int i;
+	bool success = true;
+
+	success &= ASSERT_PTR(NULL, sessiontable_lru(&table), "empty table");
+
+	if (!inject(0, 1, 300, 3, 1300, true))
+		return false;
+
+	for (i = 0; i < 4 * SESSIONTABLE_SHARDS; i++) {
+		victim = sessiontable_lru(&table);
+		success &= ASSERT_PTR(entries[0], victim, "victim %u", i);
+		if (victim)
+			session_return(victim);
+	}
+
+	sessiontable_flush(&table);
+	session_return(entries[0]);
+	return success;
+}
+
+static bool test_slot_of(void)
+{
+	struct expire_timer expirer;
+	bool success = true;
+
+	/* Fine lap 15, slot 40. */
+	expirer.clock = 15 * EXPIRER_SLOTS + 40;
+
+	success &= ASSERT_UINT(40, slot_of(&expirer, 0), "expired");
+	success &= ASSERT_UINT(41, slot_of(&expirer,
+			expirer.clock * EXPIRER_TICK), "now");
+	success &= ASSERT_UINT(39, slot_of(&expirer,
+			(expirer.clock + 62) * EXPIRER_TICK), "end of fine lap");
+	success &= ASSERT_UINT(EXPIRER_SLOTS + 16, slot_of(&expirer,
+			(expirer.clock + 63) * EXPIRER_TICK), "next lap");
+	success &= ASSERT_UINT(EXPIRER_SLOTS + 14, slot_of(&expirer,
+			(expirer.clock + 100000) * EXPIRER_TICK), "horizon");
+
+	return success;
+}
+
+/**
+ * A session that expires beyond the fine lap waits in the coarse level, and is
+ * moved to its fine slot once its lap comes.
+ */
+static bool test_cascade(void)
+{
+	struct session_entry *session;
+	struct expire_timer *expirer;
+	unsigned long timeout;
+	unsigned long slot_time;
+	unsigned int budget = EXPIRER_BATCH;
+	bool success = true;
+
+	if (!inject(0, 1, 300, 3, 1300, true))
+		return false;
+	session = entries[0];
+	expirer = get_expirer(get_shard(&table,
+			session_hash4(&table, session)), session);
+	timeout = expirer->get_timeout();
+	slot_time = wheel_time(session->update_time + timeout) + 1;
+
+	spin_lock_bh(&expirer->shard->lock);
+
+	success &= ASSERT_BOOL(true, timeout > EXPIRER_SLOTS * EXPIRER_TICK,
+			"timeout is long enough");
+	success &= ASSERT_UINT(EXPIRER_SLOTS
+			+ ((slot_time / EXPIRER_SLOTS) & (EXPIRER_SLOTS - 1)),
+			session->expirer_slot, "coarse slot");
+
+	/* Pretend the session's lap has come. */
+	expirer->clock = slot_time - (slot_time % EXPIRER_SLOTS);
+	success &= ASSERT_BOOL(true, cascade(expirer, timeout, &budget),
+			"cascade result");
+	success &= ASSERT_UINT(slot_time & (EXPIRER_SLOTS - 1),
+			session->expirer_slot, "fine slot");
+	success &= ASSERT_UINT(1, expirer->slot_counts[session->expirer_slot],
+			"fine slot count");
+	success &= ASSERT_UINT(EXPIRER_BATCH - 1, budget, "budget");
+
+	spin_unlock_bh(&expirer->shard->lock);
+
+	sessiontable_flush(&table);
+	session_return(session);
+	return success;
+}
+
 static enum session_fate just_die(struct session_entry *session, void *arg)
 {
 	return FATE_RM;
@@ -257,7 +583,11 @@ static bool init(void)
 		config_destroy();
 		return false;
 	}
-	sessiontable_init(&table, config_get_ttl_udp, just_die, NULL, NULL);
+	if (sessiontable_init(&table, config_get_ttl_udp, just_die, NULL, NULL)) {
+		session_destroy();
+		config_destroy();
+		return false;
+	}
 
 	return true;
 }
@@ -274,6 +604,13 @@ int init_module(void)
 	START_TESTS("Session table");
 
 	INIT_CALL_END(init(), test_foreach(), end(), "Foreach");
+	INIT_CALL_END(init(), test_restore(), end(), "Restore");
+	INIT_CALL_END(init(), test_lru(), end(), "LRU");
+	CALL_TEST(test_slot_of(), "Wheel slots");
+	INIT_CALL_END(init(), test_cascade(), end(), "Wheel cascade");
+	if (benchmark) {
+		INIT_CALL_END(init(), test_benchmark(), end(), "Lookup benchmark");
+	}
 
 	END_TESTS;
 }
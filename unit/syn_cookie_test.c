@@ -0,0 +1,147 @@
+#include <linux/module.h>
+
+#include "nat64/unit/unit_test.h"
+#include "nat64/common/str_utils.h"
+
+#include "session/syn_cookie.c"
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alberto Leiva");
+MODULE_DESCRIPTION("SYN cookie table test");
+
+
+static struct ipv4_transport_addr local4;
+static struct ipv4_transport_addr remote4;
+
+/**
+ * Finds @count remote ports (other than remote4.l4) whose connections to
+ * @local4 land in the same bucket as remote4's.
+ */
+static bool find_collisions(__u16 *ports, unsigned int count)
+{
+	struct ipv4_transport_addr other = remote4;
+	unsigned int index = get_index(&local4, &remote4);
+	unsigned int found = 0;
+	unsigned int port;
+
+	for (port = 1; port <= 65535 && found < count; port++) {
+		if (port == remote4.l4)
+			continue;
+		other.l4 = port;
+		if (get_index(&local4, &other) == index)
+			ports[found++] = port;
+	}
+
+	return ASSERT_UINT(count, found, "colliding ports");
+}
+
+static bool test_store_validate(void)
+{
+	bool success = true;
+
+	success &= ASSERT_INT(0, syncookie_store(&local4, &remote4, 100), "store");
+	success &= ASSERT_BOOL(false, syncookie_validate(&local4, &remote4, 100),
+			"wrong ack");
+	success &= ASSERT_BOOL(true, syncookie_validate(&local4, &remote4, 101),
+			"right ack after a wrong one");
+	success &= ASSERT_BOOL(false, syncookie_validate(&local4, &remote4, 101),
+			"record was consumed");
+
+	return success;
+}
+
+static bool test_full_bucket(void)
+{
+	struct ipv4_transport_addr other = remote4;
+	struct syncookie_slot *slots;
+	__u16 ports[SYNCOOKIE_BUCKET_SLOTS];
+	unsigned int i;
+	bool success = true;
+
+	if (!find_collisions(ports, ARRAY_SIZE(ports)))
+		return false;
+
+	/* Fill the bucket. */
+	success &= ASSERT_INT(0, syncookie_store(&local4, &remote4, 100), "1st");
+	for (i = 0; i < ARRAY_SIZE(ports) - 1; i++) {
+		other.l4 = ports[i];
+		success &= ASSERT_INT(0, syncookie_store(&local4, &other, 200),
+				"colliding store");
+	}
+
+	/* Live records must not be evicted. */
+	other.l4 = ports[ARRAY_SIZE(ports) - 1];
+	success &= ASSERT_INT(-ENOSPC, syncookie_store(&local4, &other, 300),
+			"full bucket");
+	success &= ASSERT_BOOL(true, syncookie_validate(&local4, &remote4, 101),
+			"1st survived");
+
+	/* A retransmission refreshes its own record, even if the bucket's full. */
+	other.l4 = ports[0];
+	success &= ASSERT_INT(0, syncookie_store(&local4, &other, 250),
+			"retransmission");
+	success &= ASSERT_BOOL(true, syncookie_validate(&local4, &other, 251),
+			"retransmission's seq");
+
+	/* Expired records can be replaced. */
+	slots = buckets[get_index(&local4, &remote4)].slots;
+	for (i = 0; i < SYNCOOKIE_BUCKET_SLOTS; i++)
+		slots[i].expires = jiffies - 1;
+	other.l4 = ports[ARRAY_SIZE(ports) - 1];
+	success &= ASSERT_INT(0, syncookie_store(&local4, &other, 300),
+			"replaced expired record");
+	success &= ASSERT_BOOL(true, syncookie_validate(&local4, &other, 301),
+			"new record");
+	other.l4 = ports[1];
+	success &= ASSERT_BOOL(false, syncookie_validate(&local4, &other, 201),
+			"expired record");
+
+	return success;
+}
+
+static bool test_size(void)
+{
+	bool success = true;
+
+	success &= ASSERT_UINT(SYNCOOKIE_MIN_SLOTS, compute_slots(1), "min");
+	success &= ASSERT_UINT(SYNCOOKIE_MAX_SLOTS, compute_slots(0xFFFFFFFFU),
+			"max");
+	success &= ASSERT_UINT(1U << 16, compute_slots((1U << 17) - 1),
+			"round down");
+
+	return success;
+}
+
+static bool init(void)
+{
+	if (str_to_addr4("192.0.2.1", &local4.l3))
+		return false;
+	local4.l4 = 80;
+	if (str_to_addr4("203.0.113.1", &remote4.l3))
+		return false;
+	remote4.l4 = 1000;
+
+	return !syncookie_init(0);
+}
+
+static void end(void)
+{
+	syncookie_destroy();
+}
+
+int init_module(void)
+{
+	START_TESTS("SYN cookies");
+
+	INIT_CALL_END(init(), test_store_validate(), end(), "Store/validate");
+	INIT_CALL_END(init(), test_full_bucket(), end(), "Full bucket");
+	CALL_TEST(test_size(), "Table size");
+
+	END_TESTS;
+}
+
+void cleanup_module(void)
+{
+	/* No code. */
+}
@@ -7,6 +7,7 @@
 #define BOOL_FORMAT "BOOL"
 #define NUM_FORMAT "NUM"
 #define NUM_ARRAY_FORMAT "NUM[,NUM]*"
+#define HEX_ARRAY_FORMAT "HH[:HH]*"
 #define TRANSPORT6_FORMAT "ADDR6#NUM"
 #define TRANSPORT4_FORMAT "ADDR4#NUM"
 
@@ -51,6 +52,45 @@ static const struct argp_option session_opt = {
 		.group = 0,
 };
 
+static const struct argp_option snapshot_opt = {
+		.name = "snapshot",
+		.key = ARGP_SNAPSHOT,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "The command will save (--display) or restore (--add) "
+				"the BIBs and session tables.",
+		.group = 0,
+};
+
+static const struct argp_option replication_opt = {
+		.name = "replication",
+		.key = ARGP_REPLICATION,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "The command will operate on the session replication "
+				"stream.",
+		.group = 0,
+};
+
+static const struct argp_option deterministic_opt = {
+		.name = "deterministic",
+		.key = ARGP_DETERMINISTIC,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "The command will operate on the deterministic port "
+				"mappings.",
+		.group = 0,
+};
+
+static const struct argp_option fragment_opt = {
+		.name = "fragment",
+		.key = ARGP_FRAGMENT,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "The command will operate on the fragment database.",
+		.group = 0,
+};
+
 static const struct argp_option eamt_opt = {
 		.name = "eamt",
 		.key = ARGP_EAMT,
@@ -195,8 +235,8 @@ static const struct argp_option mark_opt = {
 		.arg = NUM_FORMAT,
 		.flags = 0,
 		.doc = "Only packets carrying this mark will match this pool4 "
-				"entry. Available on add and remove operations "
-				"only.",
+				"entry (or deterministic mapping). Available on "
+				"add, remove and test operations only.",
 		.group = 0,
 };
 static const struct argp_option force_opt = {
@@ -208,6 +248,17 @@ static const struct argp_option force_opt = {
 		.group = 0,
 };
 
+static const struct argp_option replace_opt = {
+		.name = "replace",
+		.key = ARGP_REPLACE,
+		.arg = NULL,
+		.flags = 0,
+		.doc = "The pool4 batch file describes the complete pool4, "
+				"instead of changes to it. Available on pool4 "
+				"update operation only.",
+		.group = 0,
+};
+
 static const struct argp_option icmp_opt = {
 		.name = "icmp",
 		.key = ARGP_ICMP,
@@ -255,6 +306,68 @@ static const struct argp_option csv_opt = {
 		.group = 0,
 };
 
+static const struct argp_option file_opt = {
+		.name = "file",
+		.key = ARGP_FILE,
+		.arg = "FILE",
+		.flags = 0,
+		.doc = "Snapshot file to write or read, or pool4 batch file "
+				"to apply.",
+		.group = 0,
+};
+
+static const struct argp_option send_opt = {
+		.name = "send",
+		.key = ARGP_SEND,
+		.arg = "ADDR4#PORT",
+		.flags = 0,
+		.doc = "Forward this instance's session events to the standby "
+				"listening on this UDP address. (Runs until killed.)",
+		.group = 0,
+};
+
+static const struct argp_option receive_opt = {
+		.name = "receive",
+		.key = ARGP_RECEIVE,
+		.arg = "ADDR4#PORT",
+		.flags = 0,
+		.doc = "Apply the session events received on this UDP address "
+				"to this instance. (Runs until killed.)",
+		.group = 0,
+};
+
+static const struct argp_option peer_opt = {
+		.name = "peer",
+		.key = ARGP_PEER,
+		.arg = "ADDR4",
+		.flags = 0,
+		.doc = "Address the active instance sends its session events "
+				"from. --receive ignores everyone else.",
+		.group = 0,
+};
+
+static const struct argp_option key_opt = {
+		.name = "key",
+		.key = ARGP_KEY,
+		.arg = "FILE",
+		.flags = 0,
+		.doc = "File whose first 16 bytes are the secret key that "
+				"authenticates the session events. Both instances "
+				"need the same one.",
+		.group = 0,
+};
+
+static const struct argp_option det_subscriber_len_opt = {
+		.name = "subscriber-length",
+		.key = ARGP_DET_SUBSCRIBER_LEN,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Length of the prefix each subscriber of the "
+				"deterministic mapping owns. Available on add "
+				"operation only.",
+		.group = 0,
+};
+
 static const struct argp_option globals_hdr_opt = {
 		.doc = "'Global' options:",
 		.group = 6,
@@ -385,6 +498,16 @@ static const struct argp_option tcp_filter_opt = {
 		.group = 0,
 };
 
+static const struct argp_option syn_cookies_opt = {
+		.name = OPTNAME_SYN_COOKIES,
+		.key = ARGP_SYN_COOKIES,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "Translate externally initiated TCP connections without "
+				"storing them until the IPv6 node answers?\n",
+		.group = 0,
+};
+
 static const struct argp_option tcp_filter_alias_opt = {
 		.name = "dropTCP",
 		.flags = OPTION_ALIAS,
@@ -478,6 +601,16 @@ static const struct argp_option max_so_opt = {
 		.group = 0,
 };
 
+static const struct argp_option max_so_src_opt = {
+		.name = OPTNAME_MAX_SO_SRC,
+		.key = ARGP_STORED_PKTS_SRC,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum Simultaneous Opens of TCP connections "
+				"a single IPv4 /24 can start (0 = unlimited).\n",
+		.group = 0,
+};
+
 static const struct argp_option max_so_alias_opt = {
 		.name = "maxStoredPkts",
 		.flags = OPTION_ALIAS,
@@ -512,6 +645,126 @@ static const struct argp_option logging_session_opt = {
 		.group = 0,
 };
 
+static const struct argp_option max_sessions_opt = {
+		.name = OPTNAME_MAX_SESSIONS,
+		.key = ARGP_MAX_SESSIONS,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of dynamic sessions "
+				"(0 = unlimited).\n",
+		.group = 0,
+};
+
+static const struct argp_option max_sessions_sub_opt = {
+		.name = OPTNAME_MAX_SESSIONS_SUB,
+		.key = ARGP_MAX_SESSIONS_SUB,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of sessions a single IPv6 "
+				"subscriber can own (0 = unlimited).\n",
+		.group = 0,
+};
+
+static const struct argp_option max_bibs_opt = {
+		.name = OPTNAME_MAX_BIBS,
+		.key = ARGP_MAX_BIBS,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of dynamic BIB entries "
+				"(0 = unlimited).\n",
+		.group = 0,
+};
+
+static const struct argp_option max_bibs_sub_opt = {
+		.name = OPTNAME_MAX_BIBS_SUB,
+		.key = ARGP_MAX_BIBS_SUB,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the maximum number of BIB entries a single IPv6 "
+				"subscriber can own (0 = unlimited).\n",
+		.group = 0,
+};
+
+static const struct argp_option subscriber_len_opt = {
+		.name = OPTNAME_SUBSCRIBER_LEN,
+		.key = ARGP_SUBSCRIBER_LEN,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Length of the IPv6 prefix that identifies a "
+				"subscriber (usually 64 or 128).\n",
+		.group = 0,
+};
+
+static const struct argp_option evict_opt = {
+		.name = OPTNAME_EVICT_ON_LIMIT,
+		.key = ARGP_EVICT_ON_LIMIT,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "When a session or BIB limit is reached, remove the "
+				"least recently used sessions? "
+				"Otherwise drop the packet.\n",
+		.group = 0,
+};
+
+static const struct argp_option port_block_opt = {
+		.name = OPTNAME_PORT_BLOCK_SIZE,
+		.key = ARGP_PORT_BLOCK_SIZE,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Reserve this many contiguous ports for each IPv6 "
+				"subscriber at a time (0 = allocate ports one by "
+				"one).\n",
+		.group = 0,
+};
+
+static const struct argp_option rss_affinity_opt = {
+		.name = OPTNAME_RSS_AFFINITY,
+		.key = ARGP_RSS_AFFINITY,
+		.arg = BOOL_FORMAT,
+		.flags = 0,
+		.doc = "Choose IPv4 ports whose return traffic is received by "
+				"the same NIC queue as the IPv6 packet.\n",
+		.group = 0,
+};
+
+static const struct argp_option rss_key_opt = {
+		.name = OPTNAME_RSS_KEY,
+		.key = ARGP_RSS_KEY,
+		.arg = HEX_ARRAY_FORMAT,
+		.flags = 0,
+		.doc = "Set the RSS hash key of the IPv4 NIC (40 bytes).\n",
+		.group = 0,
+};
+
+static const struct argp_option rss_indir_opt = {
+		.name = OPTNAME_RSS_INDIR,
+		.key = ARGP_RSS_INDIR,
+		.arg = NUM_ARRAY_FORMAT,
+		.flags = 0,
+		.doc = "Set the RSS indirection table of the IPv4 NIC.\n",
+		.group = 0,
+};
+
+static const struct argp_option frag_high_thresh_opt = {
+		.name = OPTNAME_FRAG_HIGH_THRESH,
+		.key = ARGP_FRAG_HIGH_THRESH,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the bytes the incomplete packets can hold before "
+				"the oldest ones are dropped.\n",
+		.group = 0,
+};
+
+static const struct argp_option frag_low_thresh_opt = {
+		.name = OPTNAME_FRAG_LOW_THRESH,
+		.key = ARGP_FRAG_LOW_THRESH,
+		.arg = NUM_FORMAT,
+		.flags = 0,
+		.doc = "Set the bytes the incomplete packets are trimmed down "
+				"to once the high threshold is crossed.\n",
+		.group = 0,
+};
+
 static const struct argp_option csum_fix_opt = {
 		.name = OPTNAME_AMEND_UDP_CSUM,
 		.key = ARGP_COMPUTE_CSUM_ZERO,
@@ -689,6 +942,10 @@ static const struct argp_option *options_nat64[] = {
 	&pool4_opt,
 	&bib_opt,
 	&session_opt,
+	&snapshot_opt,
+	&replication_opt,
+	&deterministic_opt,
+	&fragment_opt,
 	&global_opt,
 	&global_alias_opt,
 #ifdef BENCHMARK
@@ -698,6 +955,7 @@ static const struct argp_option *options_nat64[] = {
 	&operations_hdr_opt,
 	&display_opt,
 	&count_opt,
+	&test_opt,
 	&add_opt,
 	&update_opt,
 	&rm_opt,
@@ -707,11 +965,18 @@ static const struct argp_option *options_nat64[] = {
 	&quick_opt,
 	&mark_opt,
 	&force_opt,
+	&replace_opt,
 	&icmp_opt,
 	&tcp_opt,
 	&udp_opt,
 	&numeric_opt,
 	&csv_opt,
+	&file_opt,
+	&send_opt,
+	&receive_opt,
+	&peer_opt,
+	&key_opt,
+	&det_subscriber_len_opt,
 
 	&globals_hdr_opt,
 	&enable_opt,
@@ -730,6 +995,7 @@ static const struct argp_option *options_nat64[] = {
 	&icmp_filter_alias_opt,
 	&tcp_filter_opt,
 	&tcp_filter_alias_opt,
+	&syn_cookies_opt,
 	&ttl_udp_opt,
 	&ttl_udp_alias_opt,
 	&ttl_icmp_opt,
@@ -742,9 +1008,22 @@ static const struct argp_option *options_nat64[] = {
 	&ttl_frag_alias_opt,
 	&max_so_opt,
 	&max_so_alias_opt,
+	&max_so_src_opt,
 	&icmp_src_opt,
 	&logging_bib_opt,
 	&logging_session_opt,
+	&max_sessions_opt,
+	&max_sessions_sub_opt,
+	&max_bibs_opt,
+	&max_bibs_sub_opt,
+	&subscriber_len_opt,
+	&evict_opt,
+	&port_block_opt,
+	&rss_affinity_opt,
+	&rss_key_opt,
+	&rss_indir_opt,
+	&frag_high_thresh_opt,
+	&frag_low_thresh_opt,
 
 	&deprecated_hdr_opt,
 	&atomic_frags_opt,
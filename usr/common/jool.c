@@ -23,6 +23,10 @@
 #include "nat64/usr/pool4.h"
 #include "nat64/usr/bib.h"
 #include "nat64/usr/session.h"
+#include "nat64/usr/snapshot.h"
+#include "nat64/usr/replication.h"
+#include "nat64/usr/deterministic.h"
+#include "nat64/usr/fragment.h"
 #include "nat64/usr/eam.h"
 #include "nat64/usr/global.h"
 #include "nat64/usr/log_time.h"
@@ -54,6 +58,8 @@ struct arguments {
 			struct ipv4_prefix prefix;
 			struct port_range ports;
 			bool prefix_set;
+			/** Batch file describes the complete pool4? */
+			bool replace;
 		} pool4;
 
 		struct {
@@ -65,7 +71,24 @@ struct arguments {
 				struct ipv4_transport_addr addr4;
 				bool addr4_set;
 			} bib;
+
+			/** Snapshot file, or pool4 batch file (--pool4 --update). */
+			char *file;
 		} tables;
+
+		struct {
+			struct ipv4_transport_addr addr;
+			bool send;
+			bool receive;
+			struct in_addr peer;
+			bool peer_set;
+			char *key_file;
+		} replication;
+
+		struct {
+			__u8 subscriber_len;
+			bool subscriber_len_set;
+		} deterministic;
 	} db;
 
 	struct {
@@ -176,6 +199,18 @@ static int set_global_u16_array(struct arguments *args, int type, char *value)
 	return error;
 }
 
+static int set_global_rss_key(struct arguments *args, char *value)
+{
+	__u8 key[RSS_KEY_LEN];
+	int error;
+
+	error = str_to_hex_array(value, key, sizeof(key));
+	if (error)
+		return error;
+
+	return set_global_arg(args, RSS_KEY, sizeof(key), key);
+}
+
 static int set_ipv4_prefix(struct arguments *args, char *str)
 {
 	int error;
@@ -198,7 +233,8 @@ static int set_ipv6_prefix(struct arguments *args, char *str)
 {
 	int error;
 
-	error = update_state(args, MODE_POOL6 | MODE_EAMT, OP_TEST | OP_ADD | OP_UPDATE | OP_REMOVE);
+	error = update_state(args, MODE_POOL6 | MODE_EAMT | MODE_DETERMINISTIC,
+			OP_TEST | OP_ADD | OP_UPDATE | OP_REMOVE);
 	if (error)
 		return error;
 
@@ -243,7 +279,8 @@ static int set_bib4(struct arguments *args, char *str)
 		return -EINVAL;
 	}
 
-	error = update_state(args, MODE_BIB, OP_ADD | OP_REMOVE);
+	error = update_state(args, MODE_BIB | MODE_DETERMINISTIC,
+			OP_ADD | OP_REMOVE | OP_TEST);
 	if (error)
 		return error;
 
@@ -338,6 +375,18 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_SESSION:
 		error = update_state(args, MODE_SESSION, SESSION_OPS);
 		break;
+	case ARGP_SNAPSHOT:
+		error = update_state(args, MODE_SNAPSHOT, SNAPSHOT_OPS);
+		break;
+	case ARGP_REPLICATION:
+		error = update_state(args, MODE_REPLICATION, REPLICATION_OPS);
+		break;
+	case ARGP_DETERMINISTIC:
+		error = update_state(args, MODE_DETERMINISTIC, DETERMINISTIC_OPS);
+		break;
+	case ARGP_FRAGMENT:
+		error = update_state(args, MODE_FRAGMENT, FRAGMENT_OPS);
+		break;
 	case ARGP_LOGTIME:
 		error = update_state(args, MODE_LOGTIME, LOGTIME_OPS);
 		break;
@@ -365,18 +414,24 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		break;
 
 	case ARGP_UDP:
-		error = update_state(args, MODE_POOL4 | MODE_BIB | MODE_SESSION,
-				POOL4_OPS | BIB_OPS | SESSION_OPS);
+		error = update_state(args, MODE_POOL4 | MODE_BIB | MODE_SESSION
+				| MODE_SNAPSHOT | MODE_DETERMINISTIC,
+				(POOL4_OPS & ~OP_UPDATE) | BIB_OPS | SESSION_OPS
+				| SNAPSHOT_OPS | OP_TEST);
 		args->db.udp = true;
 		break;
 	case ARGP_TCP:
-		error = update_state(args, MODE_POOL4 | MODE_BIB | MODE_SESSION,
-				POOL4_OPS | BIB_OPS | SESSION_OPS);
+		error = update_state(args, MODE_POOL4 | MODE_BIB | MODE_SESSION
+				| MODE_SNAPSHOT | MODE_DETERMINISTIC,
+				(POOL4_OPS & ~OP_UPDATE) | BIB_OPS | SESSION_OPS
+				| SNAPSHOT_OPS | OP_TEST);
 		args->db.tcp = true;
 		break;
 	case ARGP_ICMP:
-		error = update_state(args, MODE_POOL4 | MODE_BIB | MODE_SESSION,
-				POOL4_OPS | BIB_OPS | SESSION_OPS);
+		error = update_state(args, MODE_POOL4 | MODE_BIB | MODE_SESSION
+				| MODE_SNAPSHOT | MODE_DETERMINISTIC,
+				(POOL4_OPS & ~OP_UPDATE) | BIB_OPS | SESSION_OPS
+				| SNAPSHOT_OPS | OP_TEST);
 		args->db.icmp = true;
 		break;
 	case ARGP_NUMERIC_HOSTNAME:
@@ -387,17 +442,53 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		error = update_state(args, MODE_GLOBAL
 				| MODE_POOL6 | MODE_POOL4
 				| MODE_BLACKLIST | MODE_RFC6791
-				| MODE_EAMT | MODE_BIB | MODE_SESSION,
+				| MODE_EAMT | MODE_BIB | MODE_SESSION
+				| MODE_DETERMINISTIC,
 				OP_DISPLAY);
 		args->csv_format = true;
 		break;
+	case ARGP_FILE:
+		error = update_state(args, MODE_SNAPSHOT | MODE_POOL4,
+				SNAPSHOT_OPS | OP_UPDATE);
+		args->db.tables.file = str;
+		break;
+	case ARGP_SEND:
+		error = update_state(args, MODE_REPLICATION, REPLICATION_OPS);
+		if (!error)
+			error = str_to_addr4_port(str, &args->db.replication.addr);
+		args->db.replication.send = true;
+		break;
+	case ARGP_RECEIVE:
+		error = update_state(args, MODE_REPLICATION, REPLICATION_OPS);
+		if (!error)
+			error = str_to_addr4_port(str, &args->db.replication.addr);
+		args->db.replication.receive = true;
+		break;
+	case ARGP_PEER:
+		error = update_state(args, MODE_REPLICATION, REPLICATION_OPS);
+		if (!error)
+			error = str_to_addr4(str, &args->db.replication.peer);
+		args->db.replication.peer_set = true;
+		break;
+	case ARGP_KEY:
+		error = update_state(args, MODE_REPLICATION, REPLICATION_OPS);
+		args->db.replication.key_file = str;
+		break;
+	case ARGP_DET_SUBSCRIBER_LEN:
+		error = update_state(args, MODE_DETERMINISTIC, OP_ADD);
+		if (!error)
+			error = str_to_u8(str, &args->db.deterministic.subscriber_len,
+					0, 128);
+		args->db.deterministic.subscriber_len_set = true;
+		break;
 
 	case ARGP_QUICK:
 		error = update_state(args, MODE_POOL6 | MODE_POOL4, OP_REMOVE | OP_FLUSH);
 		args->db.quick = true;
 		break;
 	case ARGP_MARK:
-		error = update_state(args, MODE_POOL4, OP_ADD | OP_REMOVE);
+		error = update_state(args, MODE_POOL4 | MODE_DETERMINISTIC,
+				OP_ADD | OP_REMOVE | OP_TEST);
 		if (!error)
 			error = str_to_u32(str, &args->db.pool4.mark, 0, MAX_U32);
 		break;
@@ -405,6 +496,10 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		error = update_state(args, MODE_POOL6 | MODE_POOL4 | MODE_EAMT, OP_ADD);
 		args->db.force = true;
 		break;
+	case ARGP_REPLACE:
+		error = update_state(args, MODE_POOL4, OP_UPDATE);
+		args->db.pool4.replace = true;
+		break;
 
 	case ARGP_BIB_IPV6:
 		error = set_bib6(args, str);
@@ -422,6 +517,9 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_DROP_TCP:
 		error = set_global_bool(args, DROP_EXTERNAL_TCP, str);
 		break;
+	case ARGP_SYN_COOKIES:
+		error = set_global_bool(args, TCP_SYN_COOKIES, str);
+		break;
 
 	case ARGP_UDP_TO:
 		error = set_global_u64(args, UDP_TIMEOUT, str, UDP_MIN, MAX_U32/1000, 1000);
@@ -442,6 +540,9 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 	case ARGP_STORED_PKTS:
 		error = set_global_u64(args, MAX_PKTS, str, 0, MAX_U64, 1);
 		break;
+	case ARGP_STORED_PKTS_SRC:
+		error = set_global_u64(args, MAX_PKTS_PER_SOURCE, str, 0, MAX_U32, 1);
+		break;
 	case ARGP_SRC_ICMP6ERRS_BETTER:
 		error = set_global_bool(args, SRC_ICMP6ERRS_BETTER, str);
 		break;
@@ -453,6 +554,45 @@ static int parse_opt(int key, char *str, struct argp_state *state)
 		error = set_global_bool(args, SESSION_LOGGING, str);
 		break;
 
+	case ARGP_MAX_SESSIONS:
+		error = set_global_u64(args, MAX_SESSIONS, str, 0, MAX_U64, 1);
+		break;
+	case ARGP_MAX_SESSIONS_SUB:
+		error = set_global_u64(args, MAX_SESSIONS_PER_SUBSCRIBER, str,
+				0, MAX_U32, 1);
+		break;
+	case ARGP_MAX_BIBS:
+		error = set_global_u64(args, MAX_BIBS, str, 0, MAX_U64, 1);
+		break;
+	case ARGP_MAX_BIBS_SUB:
+		error = set_global_u64(args, MAX_BIBS_PER_SUBSCRIBER, str,
+				0, MAX_U32, 1);
+		break;
+	case ARGP_SUBSCRIBER_LEN:
+		error = set_global_u8(args, SUBSCRIBER_PREFIX_LEN, str, 0, 128);
+		break;
+	case ARGP_EVICT_ON_LIMIT:
+		error = set_global_bool(args, EVICT_ON_LIMIT, str);
+		break;
+	case ARGP_PORT_BLOCK_SIZE:
+		error = set_global_u64(args, PORT_BLOCK_SIZE, str, 0, 65536, 1);
+		break;
+	case ARGP_RSS_AFFINITY:
+		error = set_global_bool(args, RSS_AFFINITY, str);
+		break;
+	case ARGP_RSS_KEY:
+		error = set_global_rss_key(args, str);
+		break;
+	case ARGP_RSS_INDIR:
+		error = set_global_u16_array(args, RSS_INDIRECTION, str);
+		break;
+	case ARGP_FRAG_HIGH_THRESH:
+		error = set_global_u64(args, FRAG_HIGH_THRESH, str, 0, MAX_U32, 1);
+		break;
+	case ARGP_FRAG_LOW_THRESH:
+		error = set_global_u64(args, FRAG_LOW_THRESH, str, 0, MAX_U32, 1);
+		break;
+
 	case ARGP_COMPUTE_CSUM_ZERO:
 		error = set_global_bool(args, COMPUTE_UDP_CSUM_ZERO, str);
 		break;
@@ -646,6 +786,13 @@ static int main_wrapped(int argc, char **argv)
 					args.db.quick);
 		case OP_FLUSH:
 			return pool4_flush(args.db.quick);
+		case OP_UPDATE:
+			if (!args.db.tables.file) {
+				log_err("Please enter the pool4 batch file (--file).");
+				return -EINVAL;
+			}
+			return pool4_batch(args.db.tables.file,
+					args.db.pool4.replace);
 		default:
 			log_err("Unknown operation for IPv4 pool mode: %u.", args.op);
 			return -EINVAL;
@@ -714,6 +861,122 @@ static int main_wrapped(int argc, char **argv)
 		}
 		break;
 
+	case MODE_SNAPSHOT:
+		if (xlat_is_siit()) {
+			log_err("SIIT doesn't have BIBs or sessions.");
+			return -EINVAL;
+		}
+		if (!args.db.tables.file) {
+			log_err("Please enter the snapshot file (--file).");
+			return -EINVAL;
+		}
+
+		switch (args.op) {
+		case OP_DISPLAY:
+			return snapshot_dump(args.db.tables.file,
+					args.db.tcp, args.db.udp, args.db.icmp);
+		case OP_ADD:
+			return snapshot_restore(args.db.tables.file,
+					args.db.tcp, args.db.udp, args.db.icmp);
+		default:
+			log_err("Unknown operation for snapshot mode: %u.", args.op);
+			return -EINVAL;
+		}
+		break;
+
+	case MODE_REPLICATION:
+		if (xlat_is_siit()) {
+			log_err("SIIT doesn't have sessions.");
+			return -EINVAL;
+		}
+		if (args.db.replication.send && args.db.replication.receive) {
+			log_err("An instance either sends (--send) or receives "
+					"(--receive) events, not both.");
+			return -EINVAL;
+		}
+
+		if ((args.db.replication.send || args.db.replication.receive)
+				&& !args.db.replication.key_file) {
+			log_err("The session events need to be authenticated; "
+					"please provide a --key file.");
+			return -EINVAL;
+		}
+		if (args.db.replication.receive && !args.db.replication.peer_set) {
+			log_err("Please provide the --peer the events are "
+					"expected to come from.");
+			return -EINVAL;
+		}
+
+		if (args.db.replication.send)
+			return replication_send(&args.db.replication.addr,
+					args.db.replication.key_file);
+		if (args.db.replication.receive)
+			return replication_receive(&args.db.replication.addr,
+					&args.db.replication.peer,
+					args.db.replication.key_file);
+
+		switch (args.op) {
+		case OP_COUNT:
+			return replication_count();
+		default:
+			log_err("Please choose --send or --receive.");
+			return -EINVAL;
+		}
+		break;
+
+	case MODE_DETERMINISTIC:
+		if (xlat_is_siit()) {
+			log_err("SIIT doesn't have BIBs.");
+			return -EINVAL;
+		}
+
+		switch (args.op) {
+		case OP_DISPLAY:
+			return deterministic_display(args.csv_format);
+		case OP_TEST:
+			return deterministic_test(args.db.pool4.mark,
+					args.db.tcp, args.db.udp, args.db.icmp,
+					args.db.pool6.prefix_set,
+					&args.db.pool6.prefix.address,
+					args.db.tables.bib.addr4_set,
+					&args.db.tables.bib.addr4);
+		case OP_ADD:
+			if (!args.db.pool6.prefix_set) {
+				log_err("Please enter the prefix of the subscribers (%s).", PREFIX6_FORMAT);
+				return -EINVAL;
+			}
+			if (!args.db.deterministic.subscriber_len_set) {
+				log_err("Please enter the length of the subscribers' prefixes (--subscriber-length).");
+				return -EINVAL;
+			}
+			return deterministic_add(args.db.pool4.mark,
+					&args.db.pool6.prefix,
+					args.db.deterministic.subscriber_len);
+		case OP_REMOVE:
+			return deterministic_remove(args.db.pool4.mark);
+		case OP_FLUSH:
+			return deterministic_flush();
+		default:
+			log_err("Unknown operation for deterministic mode: %u.", args.op);
+			return -EINVAL;
+		}
+		break;
+
+	case MODE_FRAGMENT:
+		if (xlat_is_siit()) {
+			log_err("SIIT doesn't have a fragment database.");
+			return -EINVAL;
+		}
+
+		switch (args.op) {
+		case OP_COUNT:
+			return fragment_count();
+		default:
+			log_err("Unknown operation for fragment mode: %u.", args.op);
+			return -EINVAL;
+		}
+		break;
+
 	case MODE_EAMT:
 		if (xlat_is_nat64()) {
 			log_err("Stateful NAT64 doesn't have EAMTs.");
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <arpa/inet.h>
+#include <ctype.h>
 
 
 #define MAX_PORT 0xFFFF
@@ -227,6 +228,41 @@ int str_to_u16_array(const char *str, __u16 **array_out, size_t *array_len_out)
 	return 0;
 }
 
+int str_to_hex_array(const char *str, __u8 *out, size_t len)
+{
+	const char *cursor = str;
+	char *endptr;
+	unsigned long byte;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (i != 0) {
+			if (*cursor != ':')
+				goto fail;
+			cursor++;
+		}
+
+		if (!isxdigit(cursor[0]))
+			goto fail;
+		errno = 0;
+		byte = strtoul(cursor, &endptr, 16);
+		if (errno || byte > 0xFF || endptr - cursor > 2)
+			goto fail;
+
+		out[i] = byte;
+		cursor = endptr;
+	}
+
+	if (*cursor == '\0')
+		return 0;
+	/* Fall through. */
+
+fail:
+	log_err("'%s' is not a list of %zu colon-separated hexadecimal bytes.",
+			str, len);
+	return -EINVAL;
+}
+
 int str_to_addr4(const char *str, struct in_addr *result)
 {
 	if (!inet_pton(AF_INET, str, result)) {
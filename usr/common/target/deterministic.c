@@ -0,0 +1,191 @@
+#include "nat64/usr/deterministic.h"
+#include "nat64/common/config.h"
+#include "nat64/common/str_utils.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include <errno.h>
+
+
+#define HDR_LEN sizeof(struct request_hdr)
+#define PAYLOAD_LEN sizeof(union request_deterministic)
+
+struct display_params {
+	bool csv_format;
+	unsigned int row_count;
+	union request_deterministic *req_payload;
+};
+
+static void print_entry(struct deterministic_entry *entry, char *separator)
+{
+	char ipv6_str[INET6_ADDRSTRLEN];
+
+	inet_ntop(AF_INET6, &entry->prefix6.address, ipv6_str, sizeof(ipv6_str));
+	printf("%u", entry->mark);
+	printf("%s", separator);
+	printf("%s/%u", ipv6_str, entry->prefix6.len);
+	printf("%s", separator);
+	printf("%u", entry->subscriber_len);
+	printf("\n");
+}
+
+static int display_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr;
+	struct deterministic_entry *entries;
+	struct display_params *params = arg;
+	__u16 entry_count, i;
+
+	hdr = nlmsg_hdr(msg);
+	entries = nlmsg_data(hdr);
+	entry_count = nlmsg_datalen(hdr) / sizeof(*entries);
+
+	for (i = 0; i < entry_count; i++)
+		print_entry(&entries[i], params->csv_format ? "," : "\t");
+
+	params->row_count += entry_count;
+	params->req_payload->display.mark_set = hdr->nlmsg_flags & NLM_F_MULTI;
+	if (entry_count > 0)
+		params->req_payload->display.mark = entries[entry_count - 1].mark;
+	return 0;
+}
+
+int deterministic_display(bool csv_format)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	union request_deterministic *payload = (union request_deterministic *)
+			(request + HDR_LEN);
+	struct display_params params;
+	int error;
+
+	init_request_hdr(hdr, sizeof(request), MODE_DETERMINISTIC, OP_DISPLAY);
+	payload->display.mark_set = false;
+	payload->display.mark = 0;
+	params.csv_format = csv_format;
+	params.row_count = 0;
+	params.req_payload = payload;
+
+	if (csv_format)
+		printf("Mark,IPv6 Prefix,Subscriber Length\n");
+	else
+		printf("Mark\tIPv6 Prefix\tSubscriber Length\n");
+
+	do {
+		error = netlink_request(request, hdr->length, display_response,
+				&params);
+	} while (!error && payload->display.mark_set);
+
+	if (!csv_format && !error) {
+		if (params.row_count > 0)
+			printf("  (Fetched %u entries.)\n", params.row_count);
+		else
+			printf("  (empty)\n");
+	}
+
+	return error;
+}
+
+static int test_response(struct nl_msg *msg, void *arg)
+{
+	struct response_deterministic *response;
+	char prefix_str[INET6_ADDRSTRLEN];
+	l4_protocol *proto = arg;
+
+	response = nlmsg_data(nlmsg_hdr(msg));
+	inet_ntop(AF_INET6, &response->prefix6.address, prefix_str,
+			sizeof(prefix_str));
+
+	printf("%s: %s/%u - %s#%u (%u transport addresses)\n",
+			l4proto_to_string(*proto),
+			prefix_str, response->prefix6.len,
+			inet_ntoa(response->first.l3), response->first.l4,
+			response->count);
+	return 0;
+}
+
+static int test_proto(union request_deterministic *payload,
+		unsigned char *request, l4_protocol proto)
+{
+	struct request_hdr *hdr = (struct request_hdr *) request;
+
+	payload->test.proto = proto;
+	return netlink_request(request, hdr->length, test_response, &proto);
+}
+
+int deterministic_test(__u32 mark, bool tcp, bool udp, bool icmp,
+		bool addr6_set, struct in6_addr *addr6,
+		bool addr4_set, struct ipv4_transport_addr *addr4)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	union request_deterministic *payload = (union request_deterministic *)
+			(request + HDR_LEN);
+	int tcp_error = 0;
+	int udp_error = 0;
+	int icmp_error = 0;
+
+	init_request_hdr(hdr, sizeof(request), MODE_DETERMINISTIC, OP_TEST);
+	payload->test.mark = mark;
+
+	if (addr4_set && addr6_set) {
+		log_err("You gave me too many addresses.");
+		return -EINVAL;
+
+	} else if (addr6_set) {
+		payload->test.addr_is_ipv6 = true;
+		payload->test.addr.addr6 = *addr6;
+
+	} else if (addr4_set) {
+		payload->test.addr_is_ipv6 = false;
+		payload->test.addr.addr4 = *addr4;
+
+	} else {
+		log_err("I need an IPv6 address or an IPv4 transport address as argument.");
+		return -EINVAL;
+	}
+
+	if (tcp)
+		tcp_error = test_proto(payload, request, L4PROTO_TCP);
+	if (udp)
+		udp_error = test_proto(payload, request, L4PROTO_UDP);
+	if (icmp)
+		icmp_error = test_proto(payload, request, L4PROTO_ICMP);
+
+	return (tcp_error || udp_error || icmp_error) ? -EINVAL : 0;
+}
+
+int deterministic_add(__u32 mark, struct ipv6_prefix *prefix6,
+		__u8 subscriber_len)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	union request_deterministic *payload = (union request_deterministic *)
+			(request + HDR_LEN);
+
+	init_request_hdr(hdr, sizeof(request), MODE_DETERMINISTIC, OP_ADD);
+	payload->add.mark = mark;
+	payload->add.prefix6 = *prefix6;
+	payload->add.subscriber_len = subscriber_len;
+
+	return netlink_request(request, hdr->length, NULL, NULL);
+}
+
+int deterministic_remove(__u32 mark)
+{
+	unsigned char request[HDR_LEN + PAYLOAD_LEN];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	union request_deterministic *payload = (union request_deterministic *)
+			(request + HDR_LEN);
+
+	init_request_hdr(hdr, sizeof(request), MODE_DETERMINISTIC, OP_REMOVE);
+	payload->rm.mark = mark;
+
+	return netlink_request(request, hdr->length, NULL, NULL);
+}
+
+int deterministic_flush(void)
+{
+	struct request_hdr request;
+	init_request_hdr(&request, sizeof(request), MODE_DETERMINISTIC, OP_FLUSH);
+	return netlink_request(&request, request.length, NULL, NULL);
+}
@@ -0,0 +1,27 @@
+#include "nat64/usr/fragment.h"
+#include "nat64/common/config.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include <stdio.h>
+
+
+static int fragment_count_response(struct nl_msg *msg, void *arg)
+{
+	struct response_fragment *stats = nlmsg_data(nlmsg_hdr(msg));
+
+	printf("Incomplete packets: %llu\n", stats->buffers);
+	printf("  Memory: %llu bytes\n", stats->mem);
+	printf("Reassembled packets: %llu\n", stats->reassemblies);
+	printf("Dropped packets:\n");
+	printf("  Timed out: %llu\n", stats->timeouts);
+	printf("  Evicted: %llu\n", stats->evictions);
+	return 0;
+}
+
+int fragment_count(void)
+{
+	struct request_hdr request;
+	init_request_hdr(&request, sizeof(request), MODE_FRAGMENT, OP_COUNT);
+	return netlink_request(&request, request.length,
+			fragment_count_response, NULL);
+}
@@ -28,6 +28,30 @@ static void print_plateaus(struct global_config *conf, char *separator)
 	}
 }
 
+static void print_rss_key(struct rss_config *rss)
+{
+	unsigned int i;
+
+	for (i = 0; i < RSS_KEY_LEN; i++)
+		printf("%s%02x", i ? ":" : "", rss->key[i]);
+}
+
+static void print_rss_indir(struct rss_config *rss, char *separator)
+{
+	unsigned int i;
+
+	if (!rss->indir_len) {
+		printf("(one queue per CPU)");
+		return;
+	}
+
+	for (i = 0; i < rss->indir_len; i++) {
+		printf("%u", rss->indir[i]);
+		if (i != rss->indir_len - 1)
+			printf("%s", separator);
+	}
+}
+
 static char *int_to_hairpin_mode(enum eam_hairpinning_mode mode)
 {
 	switch (mode) {
@@ -84,6 +108,8 @@ static int handle_display_response(struct nl_msg *msg, void *arg)
 	if (xlat_is_nat64()) {
 		printf("  --%s: %llu\n", OPTNAME_MAX_SO,
 				conf->nat64.max_stored_pkts);
+		printf("  --%s: %u\n", OPTNAME_MAX_SO_SRC,
+				conf->nat64.max_stored_pkts_per_src);
 		printf("  --%s: %s\n", OPTNAME_SRC_ICMP6E_BETTER,
 				print_bool(conf->nat64.src_icmp6errs_better));
 	} else {
@@ -126,6 +152,36 @@ static int handle_display_response(struct nl_msg *msg, void *arg)
 				print_bool(conf->nat64.drop_icmp6_info));
 		printf("    --%s: %s\n", OPTNAME_DROP_EXTERNAL_TCP,
 				print_bool(conf->nat64.drop_external_tcp));
+		printf("    --%s: %s\n", OPTNAME_SYN_COOKIES,
+				print_bool(conf->nat64.tcp_syn_cookies));
+		printf("\n");
+
+		printf("  Admission control:\n");
+		printf("    --%s: %llu\n", OPTNAME_MAX_SESSIONS,
+				conf->nat64.limits.max_sessions);
+		printf("    --%s: %u\n", OPTNAME_MAX_SESSIONS_SUB,
+				conf->nat64.limits.max_sessions_per_subscriber);
+		printf("    --%s: %llu\n", OPTNAME_MAX_BIBS,
+				conf->nat64.limits.max_bibs);
+		printf("    --%s: %u\n", OPTNAME_MAX_BIBS_SUB,
+				conf->nat64.limits.max_bibs_per_subscriber);
+		printf("    --%s: %u\n", OPTNAME_SUBSCRIBER_LEN,
+				conf->nat64.limits.subscriber_prefix_len);
+		printf("    --%s: %s\n", OPTNAME_EVICT_ON_LIMIT,
+				print_bool(conf->nat64.limits.evict));
+		printf("    --%s: %u\n", OPTNAME_PORT_BLOCK_SIZE,
+				conf->nat64.port_block_size);
+		printf("\n");
+
+		printf("  Receive Side Scaling:\n");
+		printf("    --%s: %s\n", OPTNAME_RSS_AFFINITY,
+				print_bool(conf->nat64.rss.affinity));
+		printf("    --%s: ", OPTNAME_RSS_KEY);
+		print_rss_key(&conf->nat64.rss);
+		printf("\n");
+		printf("    --%s: ", OPTNAME_RSS_INDIR);
+		print_rss_indir(&conf->nat64.rss, ",");
+		printf("\n");
 		printf("\n");
 
 		printf("  Timeouts:\n");
@@ -140,6 +196,13 @@ static int handle_display_response(struct nl_msg *msg, void *arg)
 		printf("    --%s: ", OPTNAME_FRAG_TIMEOUT);
 		print_time_friendly(conf->nat64.ttl.frag);
 		printf("\n");
+
+		printf("  Fragment memory:\n");
+		printf("    --%s: %u\n", OPTNAME_FRAG_HIGH_THRESH,
+				conf->nat64.frag_high_thresh);
+		printf("    --%s: %u\n", OPTNAME_FRAG_LOW_THRESH,
+				conf->nat64.frag_low_thresh);
+		printf("\n");
 	}
 
 	return 0;
@@ -158,6 +221,7 @@ static int handle_display_response_csv(struct nl_msg *msg, void *arg)
 
 	if (xlat_is_nat64()) {
 		printf(OPTNAME_MAX_SO ",");
+		printf(OPTNAME_MAX_SO_SRC ",");
 		printf(OPTNAME_SRC_ICMP6E_BETTER ",");
 	} else {
 		printf(OPTNAME_AMEND_UDP_CSUM ",");
@@ -180,12 +244,26 @@ static int handle_display_response_csv(struct nl_msg *msg, void *arg)
 		printf(OPTNAME_DROP_BY_ADDR ",");
 		printf(OPTNAME_DROP_ICMP6_INFO ",");
 		printf(OPTNAME_DROP_EXTERNAL_TCP ",");
+		printf(OPTNAME_SYN_COOKIES ",");
+
+		printf(OPTNAME_MAX_SESSIONS ",");
+		printf(OPTNAME_MAX_SESSIONS_SUB ",");
+		printf(OPTNAME_MAX_BIBS ",");
+		printf(OPTNAME_MAX_BIBS_SUB ",");
+		printf(OPTNAME_SUBSCRIBER_LEN ",");
+		printf(OPTNAME_EVICT_ON_LIMIT ",");
+		printf(OPTNAME_PORT_BLOCK_SIZE ",");
+		printf(OPTNAME_RSS_AFFINITY ",");
+		printf(OPTNAME_RSS_KEY ",");
+		printf(OPTNAME_RSS_INDIR ",");
 
 		printf(OPTNAME_UDP_TIMEOUT ",");
 		printf(OPTNAME_TCPEST_TIMEOUT ",");
 		printf(OPTNAME_TCPTRANS_TIMEOUT ",");
 		printf(OPTNAME_ICMP_TIMEOUT ",");
-		printf(OPTNAME_FRAG_TIMEOUT);
+		printf(OPTNAME_FRAG_TIMEOUT ",");
+		printf(OPTNAME_FRAG_HIGH_THRESH ",");
+		printf(OPTNAME_FRAG_LOW_THRESH);
 	}
 
 	printf("\n");
@@ -202,6 +280,7 @@ static int handle_display_response_csv(struct nl_msg *msg, void *arg)
 
 	if (xlat_is_nat64()) {
 		printf("%llu,", conf->nat64.max_stored_pkts);
+		printf("%u,", conf->nat64.max_stored_pkts_per_src);
 		printf("%s,", print_bool(conf->nat64.src_icmp6errs_better));
 	} else {
 		printf("%s,", print_bool(conf->siit.compute_udp_csum_zero));
@@ -224,6 +303,20 @@ static int handle_display_response_csv(struct nl_msg *msg, void *arg)
 		printf("%s,", print_bool(conf->nat64.drop_by_addr));
 		printf("%s,", print_bool(conf->nat64.drop_icmp6_info));
 		printf("%s,", print_bool(conf->nat64.drop_external_tcp));
+		printf("%s,", print_bool(conf->nat64.tcp_syn_cookies));
+
+		printf("%llu,", conf->nat64.limits.max_sessions);
+		printf("%u,", conf->nat64.limits.max_sessions_per_subscriber);
+		printf("%llu,", conf->nat64.limits.max_bibs);
+		printf("%u,", conf->nat64.limits.max_bibs_per_subscriber);
+		printf("%u,", conf->nat64.limits.subscriber_prefix_len);
+		printf("%s,", print_bool(conf->nat64.limits.evict));
+		printf("%u,", conf->nat64.port_block_size);
+		printf("%s,", print_bool(conf->nat64.rss.affinity));
+		print_rss_key(&conf->nat64.rss);
+		printf(",\"");
+		print_rss_indir(&conf->nat64.rss, ",");
+		printf("\",");
 
 		print_time_csv(conf->nat64.ttl.udp);
 		printf(",");
@@ -234,6 +327,8 @@ static int handle_display_response_csv(struct nl_msg *msg, void *arg)
 		print_time_csv(conf->nat64.ttl.icmp);
 		printf(",");
 		print_time_csv(conf->nat64.ttl.frag);
+		printf(",%u,", conf->nat64.frag_high_thresh);
+		printf("%u", conf->nat64.frag_low_thresh);
 	}
 	printf("\n");
 
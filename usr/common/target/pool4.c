@@ -1,12 +1,22 @@
 #include "nat64/usr/pool4.h"
 #include "nat64/common/str_utils.h"
+#include "nat64/usr/str_utils.h"
 #include "nat64/usr/types.h"
 #include "nat64/usr/netlink.h"
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 
 #define HDR_LEN sizeof(struct request_hdr)
 #define PAYLOAD_LEN sizeof(union request_pool4)
+/**
+ * Maximum number of entry bytes per batch request. Has to fit, along with the
+ * headers, in the __u16 netlink_request() takes.
+ */
+#define CHUNK_LEN 60000
 
 
 struct display_args {
@@ -18,7 +28,8 @@ struct display_args {
 static int pool4_display_response(struct nl_msg *response, void *arg)
 {
 	struct nlmsghdr *hdr;
-	struct pool4_sample *samples;
+	struct pool4_sample_usr *samples;
+	struct pool4_sample *sample;
 	unsigned int sample_count, i;
 	struct display_args *args = arg;
 
@@ -27,27 +38,30 @@ static int pool4_display_response(struct nl_msg *response, void *arg)
 	sample_count = nlmsg_datalen(hdr) / sizeof(*samples);
 
 	if (args->row_count == 0 && args->csv)
-		printf("Mark,Protocol,Address,Min port,Max port\n");
+		printf("Mark,Protocol,Address,Min port,Max port,Used\n");
 
 	for (i = 0; i < sample_count; i++) {
+		sample = &samples[i].sample;
 		if (args->csv)
-			printf("%u,%s,%s,%u,%u\n", samples[i].mark,
-					l4proto_to_string(samples[i].proto),
-					inet_ntoa(samples[i].addr),
-					samples[i].range.min,
-					samples[i].range.max);
+			printf("%u,%s,%s,%u,%u,%u\n", sample->mark,
+					l4proto_to_string(sample->proto),
+					inet_ntoa(sample->addr),
+					sample->range.min,
+					sample->range.max,
+					samples[i].used);
 		else
-			printf("%u\t%s\t%s\t%u-%u\n", samples[i].mark,
-					l4proto_to_string(samples[i].proto),
-					inet_ntoa(samples[i].addr),
-					samples[i].range.min,
-					samples[i].range.max);
+			printf("%u\t%s\t%s\t%u-%u\t(%u used)\n", sample->mark,
+					l4proto_to_string(sample->proto),
+					inet_ntoa(sample->addr),
+					sample->range.min,
+					sample->range.max,
+					samples[i].used);
 	}
 
 	args->row_count += sample_count;
 	args->request->display.offset_set = hdr->nlmsg_flags & NLM_F_MULTI;
 	if (sample_count > 0)
-		args->request->display.offset = samples[sample_count - 1];
+		args->request->display.offset = samples[sample_count - 1].sample;
 
 	return 0;
 }
@@ -90,6 +104,7 @@ static int pool4_count_response(struct nl_msg *msg, void *arg)
 	printf("tables: %u\n", response->tables);
 	printf("samples: %llu\n", response->samples);
 	printf("transport addresses: %llu\n", response->taddrs);
+	printf("transport addresses in use: %llu\n", response->used);
 
 	return 0;
 }
@@ -196,3 +211,193 @@ int pool4_flush(bool quick)
 
 	return netlink_request(&request, hdr->length, NULL, NULL);
 }
+
+/*
+ * The batch file has one operation per line:
+ *
+ *	(add | remove) <mark> (tcp | udp | icmp) <IPv4-prefix> [<port-range>]
+ *
+ * The port range defaults to 0-65535. Blank lines and everything after a '#'
+ * are ignored.
+ */
+
+static int parse_proto(char *str, __u8 *proto)
+{
+	if (strcasecmp(str, "tcp") == 0)
+		*proto = L4PROTO_TCP;
+	else if (strcasecmp(str, "udp") == 0)
+		*proto = L4PROTO_UDP;
+	else if (strcasecmp(str, "icmp") == 0)
+		*proto = L4PROTO_ICMP;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * Parses @line into @entry. Returns 1 if @line has no operation.
+ */
+static int parse_batch_line(char *line, struct pool4_batch_entry *entry)
+{
+	char *tokens[6];
+	unsigned int count = 0;
+	char *comment;
+	char *token;
+	int error;
+
+	comment = strchr(line, '#');
+	if (comment)
+		*comment = '\0';
+
+	for (token = strtok(line, " \t\r\n"); token && count < 6;
+			token = strtok(NULL, " \t\r\n"))
+		tokens[count++] = token;
+
+	if (count == 0)
+		return 1;
+	if (count < 4 || count > 5) {
+		log_err("Expected '(add|remove) <mark> (tcp|udp|icmp) <prefix> [<ports>]'.");
+		return -EINVAL;
+	}
+
+	if (strcasecmp(tokens[0], "add") == 0) {
+		entry->add = true;
+	} else if (strcasecmp(tokens[0], "remove") == 0) {
+		entry->add = false;
+	} else {
+		log_err("Unknown operation: '%s'", tokens[0]);
+		return -EINVAL;
+	}
+
+	error = str_to_u32(tokens[1], &entry->mark, 0, MAX_U32);
+	if (error)
+		return error;
+
+	error = parse_proto(tokens[2], &entry->proto);
+	if (error) {
+		log_err("Unknown protocol: '%s'", tokens[2]);
+		return error;
+	}
+
+	error = str_to_ipv4_prefix(tokens[3], &entry->addrs);
+	if (error)
+		return error;
+
+	if (count == 5)
+		return str_to_port_range(tokens[4], &entry->ports);
+
+	entry->ports.min = 0;
+	entry->ports.max = 65535;
+	return 0;
+}
+
+static int read_batch(char *file_name, struct pool4_batch_entry **result,
+		__u32 *result_count)
+{
+	FILE *file;
+	char line[512];
+	struct pool4_batch_entry *entries = NULL;
+	struct pool4_batch_entry *tmp;
+	__u32 count = 0;
+	__u32 capacity = 0;
+	unsigned int line_number = 0;
+	int error = 0;
+
+	file = fopen(file_name, "r");
+	if (!file) {
+		perror(file_name);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+
+		if (count == capacity) {
+			capacity = capacity ? (2 * capacity) : 64;
+			tmp = realloc(entries, capacity * sizeof(*entries));
+			if (!tmp) {
+				log_err("Could not allocate the batch entries.");
+				error = -ENOMEM;
+				break;
+			}
+			entries = tmp;
+		}
+
+		error = parse_batch_line(line, &entries[count]);
+		if (error < 0) {
+			log_err("(%s, line %u)", file_name, line_number);
+			break;
+		}
+		if (!error)
+			count++;
+		error = 0;
+	}
+
+	fclose(file);
+
+	if (error) {
+		free(entries);
+		return error;
+	}
+
+	*result = entries;
+	*result_count = count;
+	return 0;
+}
+
+int pool4_batch(char *file_name, bool replace)
+{
+	struct pool4_batch_entry *entries;
+	unsigned char *request;
+	struct request_hdr *hdr;
+	union request_pool4 *payload;
+	__u32 count;
+	__u32 sent = 0;
+	__u32 chunk;
+	__u32 max = CHUNK_LEN / sizeof(*entries);
+	int error;
+
+	error = read_batch(file_name, &entries, &count);
+	if (error)
+		return error;
+
+	request = malloc(HDR_LEN + PAYLOAD_LEN + CHUNK_LEN);
+	if (!request) {
+		log_err("Could not allocate the request buffer.");
+		free(entries);
+		return -ENOMEM;
+	}
+	/* The default is one page, which is way too small for our chunks. */
+	nlmsg_set_default_size(NLMSG_SPACE(HDR_LEN + PAYLOAD_LEN + CHUNK_LEN));
+
+	hdr = (struct request_hdr *) request;
+	payload = (union request_pool4 *) (request + HDR_LEN);
+
+	/* Always send at least one request, so empty replacements work. */
+	do {
+		chunk = (count - sent > max) ? max : (count - sent);
+		memcpy(payload + 1, &entries[sent], chunk * sizeof(*entries));
+
+		init_request_hdr(hdr, HDR_LEN + PAYLOAD_LEN
+				+ chunk * sizeof(*entries),
+				MODE_POOL4, OP_UPDATE);
+		payload->batch.begin = (sent == 0);
+		payload->batch.commit = (sent + chunk == count);
+		payload->batch.replace = replace;
+		payload->batch.count = chunk;
+
+		error = netlink_request(request, hdr->length, NULL, NULL);
+		if (error)
+			break;
+
+		sent += chunk;
+	} while (sent < count);
+
+	if (!error)
+		printf("Applied %u pool4 operations.\n", count);
+
+	free(request);
+	free(entries);
+	return error;
+}
@@ -0,0 +1,601 @@
+#include "nat64/usr/replication.h"
+#include "nat64/common/config.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+
+#define HDR_LEN sizeof(struct request_hdr)
+#define EVENT_LEN sizeof(struct replication_event)
+
+/*
+ * The events travel between the instances in datagrams that look like this
+ * (multi-byte fields in network byte order):
+ *
+ *	version (1 byte), zeroes (3 bytes), sequence number (8 bytes),
+ *	events (WIRE_EVENT_LEN bytes each), tag (8 bytes).
+ *
+ * The tag is the SipHash-2-4 of everything that precedes it, keyed with the
+ * --key file both instances share. The sequence number only grows, so the
+ * receiver can refuse replays.
+ */
+#define WIRE_VERSION 1
+#define WIRE_HDR_LEN 12
+#define WIRE_EVENT_LEN 56
+#define WIRE_TAG_LEN 8
+#define KEY_LEN 16
+
+/**
+ * Maximum number of events per UDP datagram. Keeps the datagrams below the
+ * usual MTUs so they don't need to be fragmented.
+ */
+#define DGRAM_EVENTS ((1400 - WIRE_HDR_LEN - WIRE_TAG_LEN) / WIRE_EVENT_LEN)
+#define DGRAM_LEN (WIRE_HDR_LEN + DGRAM_EVENTS * WIRE_EVENT_LEN + WIRE_TAG_LEN)
+/**
+ * Maximum number of events the receiver hands over to the kernel in a single
+ * request. Has to fit, along with the header, in a __u16.
+ */
+#define CHUNK_EVENTS (60000 / EVENT_LEN)
+/** Socket buffers; big, so bursts don't get lost. */
+#define SOCKET_BUFFER (8 * 1024 * 1024)
+
+static int replication_count_response(struct nl_msg *msg, void *arg)
+{
+	struct response_replication *stats = nlmsg_data(nlmsg_hdr(msg));
+
+	printf("Published events: %llu\n", stats->events);
+	printf("  Dropped: %llu\n", stats->drops);
+	printf("  Batches: %llu\n", stats->batches);
+	printf("Received events: %llu\n", stats->applied + stats->rejected);
+	printf("  Rejected: %llu\n", stats->rejected);
+	return 0;
+}
+
+int replication_count(void)
+{
+	struct request_hdr request;
+	init_request_hdr(&request, sizeof(request), MODE_REPLICATION, OP_COUNT);
+	return netlink_request(&request, request.length,
+			replication_count_response, NULL);
+}
+
+static void addr4_to_sockaddr(struct ipv4_transport_addr *addr,
+		struct sockaddr_in *sockaddr)
+{
+	memset(sockaddr, 0, sizeof(*sockaddr));
+	sockaddr->sin_family = AF_INET;
+	sockaddr->sin_addr = addr->l3;
+	sockaddr->sin_port = htons(addr->l4);
+}
+
+static int read_key(char *file_name, unsigned char *key)
+{
+	FILE *file;
+	size_t read;
+
+	file = fopen(file_name, "rb");
+	if (!file) {
+		perror("Could not open the key file");
+		return -errno;
+	}
+
+	read = fread(key, 1, KEY_LEN, file);
+	fclose(file);
+
+	if (read != KEY_LEN) {
+		log_err("The key file has to contain at least %u bytes.",
+				KEY_LEN);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do {							\
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;			\
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;			\
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+static __u64 get_le64(const unsigned char *bytes)
+{
+	__u64 result = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		result = (result << 8) | bytes[i];
+	return result;
+}
+
+/**
+ * Returns the SipHash-2-4 of the "len" bytes of "in".
+ */
+static __u64 siphash(const unsigned char *key, const unsigned char *in,
+		size_t len)
+{
+	__u64 k0 = get_le64(key);
+	__u64 k1 = get_le64(key + 8);
+	__u64 v0 = 0x736f6d6570736575ULL ^ k0;
+	__u64 v1 = 0x646f72616e646f6dULL ^ k1;
+	__u64 v2 = 0x6c7967656e657261ULL ^ k0;
+	__u64 v3 = 0x7465646279746573ULL ^ k1;
+	__u64 last = ((__u64) len) << 56;
+	const unsigned char *end = in + len - (len % 8);
+	__u64 m;
+	size_t i;
+
+	for (; in != end; in += 8) {
+		m = get_le64(in);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	for (i = 0; i < len % 8; i++)
+		last |= ((__u64) in[i]) << (8 * i);
+	v3 ^= last;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= last;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static unsigned char *put_bytes(unsigned char *out, const void *in, size_t len)
+{
+	memcpy(out, in, len);
+	return out + len;
+}
+
+static unsigned char *put_u16(unsigned char *out, __u16 value)
+{
+	value = htons(value);
+	return put_bytes(out, &value, sizeof(value));
+}
+
+static unsigned char *put_u32(unsigned char *out, __u32 value)
+{
+	value = htonl(value);
+	return put_bytes(out, &value, sizeof(value));
+}
+
+static unsigned char *put_u64(unsigned char *out, __u64 value)
+{
+	out = put_u32(out, value >> 32);
+	return put_u32(out, value & 0xFFFFFFFFU);
+}
+
+static const unsigned char *get_bytes(const unsigned char *in, void *out,
+		size_t len)
+{
+	memcpy(out, in, len);
+	return in + len;
+}
+
+static const unsigned char *get_u16(const unsigned char *in, __u16 *value)
+{
+	in = get_bytes(in, value, sizeof(*value));
+	*value = ntohs(*value);
+	return in;
+}
+
+static const unsigned char *get_u32(const unsigned char *in, __u32 *value)
+{
+	in = get_bytes(in, value, sizeof(*value));
+	*value = ntohl(*value);
+	return in;
+}
+
+static const unsigned char *get_u64(const unsigned char *in, __u64 *value)
+{
+	__u32 high, low;
+
+	in = get_u32(in, &high);
+	in = get_u32(in, &low);
+	*value = (((__u64) high) << 32) | low;
+	return in;
+}
+
+static unsigned char *put_event(unsigned char *out,
+		struct replication_event *event)
+{
+	out = put_bytes(out, &event->remote6.l3, sizeof(event->remote6.l3));
+	out = put_u16(out, event->remote6.l4);
+	out = put_bytes(out, &event->local6.l3, sizeof(event->local6.l3));
+	out = put_u16(out, event->local6.l4);
+	out = put_bytes(out, &event->local4.l3, sizeof(event->local4.l3));
+	out = put_u16(out, event->local4.l4);
+	out = put_bytes(out, &event->remote4.l3, sizeof(event->remote4.l3));
+	out = put_u16(out, event->remote4.l4);
+	out = put_u32(out, event->lifetime);
+	*out++ = event->type;
+	*out++ = event->l4_proto;
+	*out++ = event->state;
+	*out++ = event->is_est;
+	return out;
+}
+
+static const unsigned char *get_event(const unsigned char *in,
+		struct replication_event *event)
+{
+	memset(event, 0, sizeof(*event));
+	in = get_bytes(in, &event->remote6.l3, sizeof(event->remote6.l3));
+	in = get_u16(in, &event->remote6.l4);
+	in = get_bytes(in, &event->local6.l3, sizeof(event->local6.l3));
+	in = get_u16(in, &event->local6.l4);
+	in = get_bytes(in, &event->local4.l3, sizeof(event->local4.l3));
+	in = get_u16(in, &event->local4.l4);
+	in = get_bytes(in, &event->remote4.l3, sizeof(event->remote4.l3));
+	in = get_u16(in, &event->remote4.l4);
+	in = get_u32(in, &event->lifetime);
+	event->type = *in++;
+	event->l4_proto = *in++;
+	event->state = *in++;
+	event->is_est = *in++;
+	return in;
+}
+
+static int open_udp_socket(void)
+{
+	int sk;
+	int size = SOCKET_BUFFER;
+
+	sk = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sk < 0) {
+		perror("Could not create the UDP socket");
+		return -errno;
+	}
+
+	/* Not fatal; the default buffers just drop more under pressure. */
+	if (setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))
+			|| setsockopt(sk, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)))
+		perror("Could not enlarge the UDP socket's buffers");
+
+	return sk;
+}
+
+struct send_params {
+	int sk;
+	struct sockaddr_in peer;
+	unsigned char key[KEY_LEN];
+	__u64 seq;
+};
+
+/**
+ * Sends the "count" "events" to the peer, as a single datagram.
+ */
+static void send_dgram(struct send_params *params,
+		struct replication_event *events, size_t count)
+{
+	unsigned char dgram[DGRAM_LEN];
+	unsigned char *cursor;
+	size_t i;
+
+	memset(dgram, 0, WIRE_HDR_LEN);
+	dgram[0] = WIRE_VERSION;
+	put_u64(&dgram[4], params->seq++);
+
+	cursor = &dgram[WIRE_HDR_LEN];
+	for (i = 0; i < count; i++)
+		cursor = put_event(cursor, &events[i]);
+	cursor = put_u64(cursor, siphash(params->key, dgram, cursor - dgram));
+
+	if (sendto(params->sk, dgram, cursor - dgram, 0,
+			(struct sockaddr *) &params->peer,
+			sizeof(params->peer)) < 0)
+		perror("Could not send events to the peer");
+}
+
+/**
+ * Forwards one of the kernel's batches to the peer.
+ */
+static int forward_batch(struct nl_msg *msg, void *arg)
+{
+	struct send_params *params = arg;
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct replication_event *events = nlmsg_data(hdr);
+	size_t remaining = nlmsg_datalen(hdr) / EVENT_LEN;
+	size_t count;
+
+	/* Anyone can write to a NETLINK_USERSOCK socket; only trust Jool. */
+	if (nlmsg_get_src(msg)->nl_pid != 0)
+		return NL_SKIP;
+
+	while (remaining > 0) {
+		count = (remaining > DGRAM_EVENTS) ? DGRAM_EVENTS : remaining;
+		send_dgram(params, events, count);
+		events += count;
+		remaining -= count;
+	}
+
+	return NL_OK;
+}
+
+int replication_send(struct ipv4_transport_addr *peer, char *key_file)
+{
+	struct nl_sock *nl_sk;
+	struct request_hdr request;
+	struct send_params params;
+	struct timeval now;
+	int error;
+
+	error = read_key(key_file, params.key);
+	if (error)
+		return error;
+
+	/*
+	 * The receiver refuses sequence numbers it has already seen, so a
+	 * restarted sender has to start above the ones it used before.
+	 */
+	gettimeofday(&now, NULL);
+	params.seq = ((__u64) now.tv_sec) * 1000000 + now.tv_usec;
+
+	params.sk = open_udp_socket();
+	if (params.sk < 0)
+		return params.sk;
+	addr4_to_sockaddr(peer, &params.peer);
+
+	nl_sk = nl_socket_alloc();
+	if (!nl_sk) {
+		log_err("Could not allocate a socket; cannot speak to the NAT64.");
+		error = -ENOMEM;
+		goto fail_udp;
+	}
+
+	/* The batches are not sequenced. */
+	nl_socket_disable_seq_check(nl_sk);
+	error = nl_socket_modify_cb(nl_sk, NL_CB_VALID, NL_CB_CUSTOM,
+			forward_batch, &params);
+	if (error < 0)
+		goto fail_nl;
+
+	error = nl_connect(nl_sk, NETLINK_USERSOCK);
+	if (error < 0)
+		goto fail_nl;
+	error = nl_socket_set_buffer_size(nl_sk, SOCKET_BUFFER, 0);
+	if (error < 0)
+		goto fail_close;
+
+	/* Ask Jool to send the batches to this socket. */
+	init_request_hdr(&request, sizeof(request), MODE_REPLICATION,
+			OP_DISPLAY);
+	error = nl_send_simple(nl_sk, MSG_TYPE_JOOL, 0, &request,
+			request.length);
+	if (error < 0)
+		goto fail_close;
+	error = nl_wait_for_ack(nl_sk);
+	if (error < 0)
+		goto fail_close;
+
+	log_info("Forwarding session events to %s#%u.",
+			inet_ntoa(peer->l3), peer->l4);
+
+	while (1) {
+		error = nl_recvmsgs_default(nl_sk);
+		if (error == -NLE_NOMEM) {
+			/* The socket's buffer overflowed; some events are gone. */
+			log_err("Lost session events; the peer will catch up "
+					"on the next update of each session.");
+			continue;
+		}
+		if (error < 0)
+			goto fail_close;
+	}
+
+	/* Unreachable. */
+
+fail_close:
+	nl_close(nl_sk);
+fail_nl:
+	log_err("Netlink error message: %s (Code %d)", nl_geterror(error),
+			error);
+	nl_socket_free(nl_sk);
+fail_udp:
+	close(params.sk);
+	return error;
+}
+
+/**
+ * Hands "count" events (which come after the "request" header) over to the
+ * kernel.
+ */
+static int apply_events(struct nl_sock *nl_sk, struct request_hdr *request,
+		size_t count)
+{
+	int error;
+
+	init_request_hdr(request, HDR_LEN + count * EVENT_LEN,
+			MODE_REPLICATION, OP_ADD);
+
+	error = nl_send_simple(nl_sk, MSG_TYPE_JOOL, 0, request,
+			request->length);
+	if (error < 0)
+		return error;
+	return nl_wait_for_ack(nl_sk);
+}
+
+struct receive_params {
+	struct in_addr peer;
+	unsigned char key[KEY_LEN];
+	/** Sequence number of the last datagram accepted. */
+	__u64 seq;
+	/** Datagrams refused so far. */
+	unsigned long long refused;
+};
+
+/**
+ * Validates the "len"-byte "dgram", which came from "src", and decodes its
+ * events into "events".
+ *
+ * Returns the number of events decoded. Zero means the datagram was refused.
+ */
+static size_t read_dgram(struct receive_params *params,
+		struct sockaddr_in *src, unsigned char *dgram, size_t len,
+		struct replication_event *events)
+{
+	const unsigned char *cursor;
+	size_t count;
+	size_t i;
+	__u64 seq;
+	__u64 tag;
+
+	if (src->sin_addr.s_addr != params->peer.s_addr)
+		goto refuse;
+	if (len < WIRE_HDR_LEN + WIRE_TAG_LEN)
+		goto refuse;
+	count = (len - WIRE_HDR_LEN - WIRE_TAG_LEN) / WIRE_EVENT_LEN;
+	if (len != WIRE_HDR_LEN + count * WIRE_EVENT_LEN + WIRE_TAG_LEN)
+		goto refuse;
+	if (dgram[0] != WIRE_VERSION)
+		goto refuse;
+
+	get_u64(&dgram[len - WIRE_TAG_LEN], &tag);
+	if (tag != siphash(params->key, dgram, len - WIRE_TAG_LEN))
+		goto refuse;
+
+	/* Replayed or reordered; the newer events supersede it anyway. */
+	get_u64(&dgram[4], &seq);
+	if (seq <= params->seq)
+		goto refuse;
+	params->seq = seq;
+
+	cursor = &dgram[WIRE_HDR_LEN];
+	for (i = 0; i < count; i++)
+		cursor = get_event(cursor, &events[i]);
+	return count;
+
+refuse:
+	/* Don't let a flood of garbage flood the logs as well. */
+	if ((params->refused++ & 0x3FF) == 0) {
+		log_err("Refused a datagram from %s. (%llu so far.)",
+				inet_ntoa(src->sin_addr), params->refused);
+	}
+	return 0;
+}
+
+int replication_receive(struct ipv4_transport_addr *local,
+		struct in_addr *peer, char *key_file)
+{
+	struct nl_sock *nl_sk;
+	struct receive_params params;
+	struct sockaddr_in sockaddr;
+	struct sockaddr_in src;
+	socklen_t src_len;
+	unsigned char dgram[DGRAM_LEN];
+	unsigned char *request;
+	struct replication_event *events;
+	size_t count;
+	ssize_t received;
+	int sk;
+	int flags;
+	int error;
+
+	error = read_key(key_file, params.key);
+	if (error)
+		return error;
+	params.peer = *peer;
+	params.seq = 0;
+	params.refused = 0;
+
+	sk = open_udp_socket();
+	if (sk < 0)
+		return sk;
+	addr4_to_sockaddr(local, &sockaddr);
+	if (bind(sk, (struct sockaddr *) &sockaddr, sizeof(sockaddr))) {
+		error = -errno;
+		perror("Could not bind the UDP socket");
+		goto fail_udp;
+	}
+
+	request = malloc(HDR_LEN + CHUNK_EVENTS * EVENT_LEN);
+	if (!request) {
+		log_err("Could not allocate the request buffer.");
+		error = -ENOMEM;
+		goto fail_udp;
+	}
+	events = (struct replication_event *) (request + HDR_LEN);
+
+	nl_sk = nl_socket_alloc();
+	if (!nl_sk) {
+		log_err("Could not allocate a socket; cannot speak to the NAT64.");
+		error = -ENOMEM;
+		goto fail_request;
+	}
+	error = nl_connect(nl_sk, NETLINK_USERSOCK);
+	if (error < 0) {
+		log_err("Could not bind the socket to Jool.\n"
+				"Netlink error message: %s (Code %d)",
+				nl_geterror(error), error);
+		goto fail_nl;
+	}
+	nlmsg_set_default_size(NLMSG_SPACE(HDR_LEN + CHUNK_EVENTS * EVENT_LEN));
+
+	log_info("Applying the session events %s sends to %s#%u.",
+			inet_ntoa(*peer), inet_ntoa(local->l3), local->l4);
+
+	while (1) {
+		/*
+		 * Wait for the first datagram, then grab whatever else is
+		 * already queued, so the kernel sees large batches.
+		 */
+		count = 0;
+		flags = 0;
+		while (CHUNK_EVENTS - count >= DGRAM_EVENTS) {
+			src_len = sizeof(src);
+			received = recvfrom(sk, dgram, sizeof(dgram), flags,
+					(struct sockaddr *) &src, &src_len);
+			if (received < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				if (errno == EINTR)
+					continue;
+				error = -errno;
+				perror("Could not receive events");
+				goto fail_close;
+			}
+			count += read_dgram(&params, &src, dgram, received,
+					events + count);
+			flags = MSG_DONTWAIT;
+		}
+
+		if (count == 0)
+			continue;
+
+		error = apply_events(nl_sk, (struct request_hdr *) request,
+				count);
+		if (error < 0) {
+			log_err("Jool rejected the events: %s (Code %d)",
+					nl_geterror(error), error);
+			goto fail_close;
+		}
+	}
+
+	/* Unreachable. */
+
+fail_close:
+	nl_close(nl_sk);
+fail_nl:
+	nl_socket_free(nl_sk);
+fail_request:
+	free(request);
+fail_udp:
+	close(sk);
+	return error;
+}
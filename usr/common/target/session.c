@@ -179,8 +179,19 @@ int session_display(bool use_tcp, bool use_udp, bool use_icmp, bool numeric_host
 
 static int session_count_response(struct nl_msg *msg, void *arg)
 {
-	__u64 *conf = nlmsg_data(nlmsg_hdr(msg));
-	printf("%llu\n", *conf);
+	struct response_session_count *counters = nlmsg_data(nlmsg_hdr(msg));
+
+	printf("%llu\n", counters->sessions);
+	printf("  Expiration backlog: %llu\n", counters->expiry_backlog);
+	printf("  Expiration batches: %llu (up to %u sessions each)\n",
+			counters->expiry_batches, counters->expiry_batch_size);
+	printf("  Subscribers (all protocols): %llu (%llu sessions, %llu BIB entries)\n",
+			counters->subscribers, counters->subscriber_sessions,
+			counters->subscriber_bibs);
+	printf("  Admission drops (all protocols): %llu\n",
+			counters->admission_drops);
+	printf("  Admission evictions (all protocols): %llu\n",
+			counters->admission_evictions);
 	return 0;
 }
 
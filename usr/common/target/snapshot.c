@@ -0,0 +1,511 @@
+#include "nat64/usr/snapshot.h"
+#include "nat64/common/config.h"
+#include "nat64/common/str_utils.h"
+#include "nat64/usr/types.h"
+#include "nat64/usr/netlink.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define HDR_LEN sizeof(struct request_hdr)
+#define PAYLOAD_LEN sizeof(struct request_snapshot)
+/**
+ * Maximum number of record bytes per restoration request. Has to fit, along
+ * with the headers, in the __u16 netlink_request() takes.
+ */
+#define CHUNK_LEN 60000
+
+#define SNAPSHOT_MAGIC "JOOLSNAP"
+#define SNAPSHOT_VERSION 1
+
+/*
+ * The snapshot file is a file_hdr followed by two sections (BIB, then
+ * sessions) per protocol. Each section is a section_hdr followed by "count"
+ * bib_entry_usrs or session_entry_usrs.
+ *
+ * Numbers are stored in host byte order; the snapshot is meant to be restored
+ * by the same machine (or a twin of it).
+ */
+struct file_hdr {
+	char magic[8];
+	__u32 version;
+	__u32 reserved;
+	/** When the snapshot was taken. (Seconds since the epoch.) */
+	__u64 timestamp;
+};
+
+struct section_hdr {
+	__u8 l4_proto;
+	__u8 section;
+	__u8 reserved[6];
+	__u64 count;
+};
+
+struct dump_params {
+	FILE *file;
+	__u64 count;
+	bool failed;
+	union {
+		struct request_bib *bib;
+		struct request_session *session;
+	} req_payload;
+};
+
+static int write_records(struct dump_params *params, void *records,
+		size_t size, __u16 count)
+{
+	if (fwrite(records, size, count, params->file) != count) {
+		perror("fwrite");
+		params->failed = true;
+		return -EIO;
+	}
+
+	params->count += count;
+	return 0;
+}
+
+static int bib_dump_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct bib_entry_usr *entries = nlmsg_data(hdr);
+	struct dump_params *params = arg;
+	__u16 entry_count = nlmsg_datalen(hdr) / sizeof(*entries);
+	int error;
+
+	error = write_records(params, entries, sizeof(*entries), entry_count);
+	if (error)
+		return error;
+
+	params->req_payload.bib->display.addr4_set = hdr->nlmsg_flags & NLM_F_MULTI;
+	if (entry_count > 0)
+		params->req_payload.bib->display.addr4 = entries[entry_count - 1].addr4;
+	return 0;
+}
+
+static int session_dump_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct session_entry_usr *entries = nlmsg_data(hdr);
+	struct dump_params *params = arg;
+	__u16 entry_count = nlmsg_datalen(hdr) / sizeof(*entries);
+	int error;
+
+	error = write_records(params, entries, sizeof(*entries), entry_count);
+	if (error)
+		return error;
+
+	params->req_payload.session->display.connection_set =
+			hdr->nlmsg_flags == NLM_F_MULTI;
+	if (entry_count > 0) {
+		params->req_payload.session->display.remote4 =
+				entries[entry_count - 1].remote4;
+		params->req_payload.session->display.local4 =
+				entries[entry_count - 1].local4;
+	}
+	return 0;
+}
+
+/**
+ * Writes the header of a section whose records are about to be appended, and
+ * returns its position so it can be patched once the count is known.
+ */
+static int begin_section(FILE *file, l4_protocol proto,
+		enum snapshot_section section, long *position)
+{
+	struct section_hdr hdr;
+
+	*position = ftell(file);
+	if (*position < 0) {
+		perror("ftell");
+		return -EIO;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.l4_proto = proto;
+	hdr.section = section;
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
+		perror("fwrite");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int end_section(FILE *file, l4_protocol proto,
+		enum snapshot_section section, long position, __u64 count)
+{
+	struct section_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.l4_proto = proto;
+	hdr.section = section;
+	hdr.count = count;
+
+	if (fseek(file, position, SEEK_SET)
+			|| fwrite(&hdr, sizeof(hdr), 1, file) != 1
+			|| fseek(file, 0, SEEK_END)) {
+		perror("Could not patch the section header");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int dump_bib(FILE *file, l4_protocol proto, __u64 *count)
+{
+	unsigned char request[HDR_LEN + sizeof(struct request_bib)];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	struct request_bib *payload = (struct request_bib *) (request + HDR_LEN);
+	struct dump_params params;
+	long position;
+	int error;
+
+	error = begin_section(file, proto, SNAPSHOT_BIB, &position);
+	if (error)
+		return error;
+
+	init_request_hdr(hdr, sizeof(request), MODE_BIB, OP_DISPLAY);
+	payload->l4_proto = proto;
+	payload->display.addr4_set = false;
+	memset(&payload->display.addr4, 0, sizeof(payload->display.addr4));
+
+	params.file = file;
+	params.count = 0;
+	params.failed = false;
+	params.req_payload.bib = payload;
+
+	do {
+		error = netlink_request(request, hdr->length, bib_dump_response, &params);
+	} while (!error && !params.failed && payload->display.addr4_set);
+
+	if (error || params.failed)
+		return -EINVAL;
+
+	*count = params.count;
+	return end_section(file, proto, SNAPSHOT_BIB, position, params.count);
+}
+
+static int dump_sessions(FILE *file, l4_protocol proto, __u64 *count)
+{
+	unsigned char request[HDR_LEN + sizeof(struct request_session)];
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	struct request_session *payload = (struct request_session *) (request + HDR_LEN);
+	struct dump_params params;
+	long position;
+	int error;
+
+	error = begin_section(file, proto, SNAPSHOT_SESSION, &position);
+	if (error)
+		return error;
+
+	init_request_hdr(hdr, sizeof(request), MODE_SESSION, OP_DISPLAY);
+	payload->l4_proto = proto;
+	payload->display.connection_set = false;
+	memset(&payload->display.remote4, 0, sizeof(payload->display.remote4));
+	memset(&payload->display.local4, 0, sizeof(payload->display.local4));
+
+	params.file = file;
+	params.count = 0;
+	params.failed = false;
+	params.req_payload.session = payload;
+
+	do {
+		error = netlink_request(request, hdr->length, session_dump_response, &params);
+	} while (!error && !params.failed && payload->display.connection_set);
+
+	if (error || params.failed)
+		return -EINVAL;
+
+	*count = params.count;
+	return end_section(file, proto, SNAPSHOT_SESSION, position, params.count);
+}
+
+static int dump_single_table(FILE *file, l4_protocol proto)
+{
+	__u64 bibs, sessions;
+	int error;
+
+	/*
+	 * The tables keep moving while we read them, so the snapshot is not
+	 * atomic. Sessions whose BIB entry did not make it are simply dropped
+	 * on restore.
+	 */
+	error = dump_bib(file, proto, &bibs);
+	if (error)
+		return error;
+	error = dump_sessions(file, proto, &sessions);
+	if (error)
+		return error;
+
+	printf("%s: %llu BIB entries, %llu sessions.\n", l4proto_to_string(proto),
+			bibs, sessions);
+	return 0;
+}
+
+int snapshot_dump(char *file_name, bool use_tcp, bool use_udp, bool use_icmp)
+{
+	FILE *file;
+	struct file_hdr hdr;
+	int error = 0;
+
+	file = fopen(file_name, "wb");
+	if (!file) {
+		perror(file_name);
+		return -errno;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.timestamp = time(NULL);
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
+		perror("fwrite");
+		error = -EIO;
+	}
+
+	if (!error && use_tcp)
+		error = dump_single_table(file, L4PROTO_TCP);
+	if (!error && use_udp)
+		error = dump_single_table(file, L4PROTO_UDP);
+	if (!error && use_icmp)
+		error = dump_single_table(file, L4PROTO_ICMP);
+
+	if (fclose(file)) {
+		perror("fclose");
+		if (!error)
+			error = -EIO;
+	}
+
+	return error;
+}
+
+struct restore_params {
+	/** Has the response of the last request arrived? */
+	bool committed;
+	struct response_snapshot response;
+};
+
+static int restore_response(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct restore_params *params = arg;
+
+	/* The requests that don't commit are just ACK'd. */
+	if (hdr->nlmsg_type != MSG_SETCFG
+			|| nlmsg_datalen(hdr) < sizeof(params->response))
+		return 0;
+
+	memcpy(&params->response, nlmsg_data(hdr), sizeof(params->response));
+	params->committed = true;
+	return 0;
+}
+
+static int read_section_hdr(FILE *file, l4_protocol proto,
+		enum snapshot_section section, __u64 *count)
+{
+	struct section_hdr hdr;
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1) {
+		log_err("The snapshot file is truncated.");
+		return -EINVAL;
+	}
+	if (hdr.l4_proto != proto || hdr.section != section) {
+		log_err("The snapshot file is corrupted. (Unexpected section.)");
+		return -EINVAL;
+	}
+
+	*count = hdr.count;
+	return 0;
+}
+
+/**
+ * Ages the sessions by the time that went by since the snapshot was taken.
+ */
+static void age_sessions(struct session_entry_usr *sessions, __u32 count,
+		__u64 elapsed)
+{
+	__u32 i;
+
+	for (i = 0; i < count; i++) {
+		if (sessions[i].dying_time > elapsed)
+			sessions[i].dying_time -= elapsed;
+		else
+			sessions[i].dying_time = 0;
+	}
+}
+
+/**
+ * Sends the "count" records that follow in "file" to the kernel, in as many
+ * requests as necessary. Always sends at least one request.
+ */
+static int restore_section(FILE *file, unsigned char *request,
+		enum snapshot_section section, __u64 count, bool begin,
+		bool commit, __u64 elapsed, struct restore_params *params)
+{
+	struct request_hdr *hdr = (struct request_hdr *) request;
+	struct request_snapshot *payload = (struct request_snapshot *) (request + HDR_LEN);
+	void *records = payload + 1;
+	size_t size;
+	__u32 max;
+	__u32 chunk;
+	int error;
+
+	size = (section == SNAPSHOT_BIB)
+			? sizeof(struct bib_entry_usr)
+			: sizeof(struct session_entry_usr);
+	max = CHUNK_LEN / size;
+
+	do {
+		chunk = (count > max) ? max : count;
+		if (fread(records, size, chunk, file) != chunk) {
+			log_err("The snapshot file is truncated.");
+			return -EINVAL;
+		}
+		if (section == SNAPSHOT_SESSION)
+			age_sessions(records, chunk, elapsed);
+		count -= chunk;
+
+		init_request_hdr(hdr, HDR_LEN + PAYLOAD_LEN + chunk * size,
+				MODE_SNAPSHOT, OP_ADD);
+		payload->begin = begin;
+		payload->commit = commit && !count;
+		payload->section = section;
+		payload->count = chunk;
+
+		error = netlink_request(request, hdr->length, restore_response, params);
+		if (error)
+			return error;
+
+		begin = false;
+	} while (count);
+
+	return 0;
+}
+
+static int skip_section(FILE *file, enum snapshot_section section, __u64 count)
+{
+	size_t size = (section == SNAPSHOT_BIB)
+			? sizeof(struct bib_entry_usr)
+			: sizeof(struct session_entry_usr);
+
+	if (fseek(file, count * size, SEEK_CUR)) {
+		perror("fseek");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int restore_single_table(FILE *file, unsigned char *request,
+		l4_protocol proto, bool selected, __u64 elapsed)
+{
+	struct request_snapshot *payload = (struct request_snapshot *) (request + HDR_LEN);
+	struct restore_params params;
+	__u64 bibs, sessions;
+	int error;
+
+	error = read_section_hdr(file, proto, SNAPSHOT_BIB, &bibs);
+	if (error)
+		return error;
+	if (!selected) {
+		error = skip_section(file, SNAPSHOT_BIB, bibs);
+		if (error)
+			return error;
+		error = read_section_hdr(file, proto, SNAPSHOT_SESSION, &sessions);
+		return error ? : skip_section(file, SNAPSHOT_SESSION, sessions);
+	}
+
+	memset(&params, 0, sizeof(params));
+	payload->l4_proto = proto;
+
+	error = restore_section(file, request, SNAPSHOT_BIB, bibs, true, false,
+			elapsed, &params);
+	if (error)
+		return error;
+	error = read_section_hdr(file, proto, SNAPSHOT_SESSION, &sessions);
+	if (error)
+		return error;
+	error = restore_section(file, request, SNAPSHOT_SESSION, sessions,
+			false, true, elapsed, &params);
+	if (error)
+		return error;
+
+	if (!params.committed) {
+		log_err("The %s tables could not be restored.", l4proto_to_string(proto));
+		return -EINVAL;
+	}
+
+	printf("%s: %llu BIB entries, %llu sessions restored", l4proto_to_string(proto),
+			params.response.bibs, params.response.sessions);
+	printf(" (%llu BIB entries, %llu sessions dropped).\n",
+			params.response.bib_drops, params.response.session_drops);
+	return 0;
+}
+
+int snapshot_restore(char *file_name, bool use_tcp, bool use_udp, bool use_icmp)
+{
+	FILE *file;
+	struct file_hdr hdr;
+	unsigned char *request;
+	l4_protocol protos[] = { L4PROTO_TCP, L4PROTO_UDP, L4PROTO_ICMP };
+	bool selected[] = { use_tcp, use_udp, use_icmp };
+	time_t now;
+	__u64 elapsed;
+	struct section_hdr peek;
+	unsigned int i;
+	int error = 0;
+
+	file = fopen(file_name, "rb");
+	if (!file) {
+		perror(file_name);
+		return -errno;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1
+			|| memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic))) {
+		log_err("%s is not a Jool snapshot.", file_name);
+		fclose(file);
+		return -EINVAL;
+	}
+	if (hdr.version != SNAPSHOT_VERSION) {
+		log_err("Unsupported snapshot version: %u", hdr.version);
+		fclose(file);
+		return -EINVAL;
+	}
+
+	/* dying_time is in milliseconds. */
+	now = time(NULL);
+	elapsed = (now > hdr.timestamp) ? (now - hdr.timestamp) * 1000 : 0;
+
+	request = malloc(HDR_LEN + PAYLOAD_LEN + CHUNK_LEN);
+	if (!request) {
+		log_err("Could not allocate the request buffer.");
+		fclose(file);
+		return -ENOMEM;
+	}
+	/* The default is one page, which is way too small for our chunks. */
+	nlmsg_set_default_size(NLMSG_SPACE(HDR_LEN + PAYLOAD_LEN + CHUNK_LEN));
+
+	/* The dump only includes the protocols that were requested back then. */
+	for (i = 0; i < sizeof(protos) / sizeof(protos[0]) && !error; i++) {
+		if (fread(&peek, sizeof(peek), 1, file) != 1)
+			break;
+		if (fseek(file, -(long)sizeof(peek), SEEK_CUR)) {
+			perror("fseek");
+			error = -EIO;
+			break;
+		}
+		if (peek.l4_proto != protos[i])
+			continue;
+
+		error = restore_single_table(file, request, protos[i],
+				selected[i], elapsed);
+	}
+
+	free(request);
+	fclose(file);
+	return error;
+}